@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ivm_vm.h>
+#include <ivm_image.h>
+#include <ivm_instance.h>
+#include <ivm_pool.h>
+#include <ivm_bytecode.h>
+
+
+/*
+ * Instructions executed after each eviction of the CPU caches.
+ */
+#define BURST_LENGTH    20
+
+
+
+/*
+ * Size of the buffer written to evict the CPU caches.
+ */
+#define EVICT_SIZE      (32UL << 20)
+
+
+
+/*
+ * Fields the VM touches on every instruction.
+ */
+static const struct
+{
+    const char* name;
+    size_t      offset;
+} hot_fields[] = {
+    { "ftable", offsetof(struct ivm_data, ftable) },
+    { "steps", offsetof(struct ivm_data, steps) },
+    { "tlb", offsetof(struct ivm_data, tlb) },
+    { "regs.ip", offsetof(struct ivm_data, regs) + offsetof(struct ivm_registers, ip) },
+    { "regs.sp", offsetof(struct ivm_data, regs) + offsetof(struct ivm_registers, sp) },
+    { "regs.bp", offsetof(struct ivm_data, regs) + offsetof(struct ivm_registers, bp) },
+    { "regs.intr", offsetof(struct ivm_data, regs) + offsetof(struct ivm_registers, intr) },
+};
+
+
+
+static size_t emit(unsigned char* code, size_t pos, uint8_t opcode, uint8_t a, uint8_t b, uint8_t c, uint32_t word)
+{
+    const uint8_t regs[3] = { a, b, c };
+
+    code[pos++] = opcode;
+    for (int i = 0; i < IVM_NUM_REGS(opcode); ++i) {
+        code[pos++] = regs[i];
+    }
+
+    if (IVM_HAS_WORD(opcode)) {
+        memcpy(&code[pos], &word, sizeof(word));
+        pos += sizeof(word);
+    }
+
+    return pos;
+}
+
+
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+
+/*
+ * Measure short runs of the VM that start with cold CPU caches, where the
+ * number of cache lines the VM data spreads its hot fields over shows up
+ * as misses on every entry. A long warm run is measured for comparison.
+ */
+int main(int argc, char** argv)
+{
+    unsigned long bursts = argc > 1 ? strtoul(argv[1], NULL, 0) : 1000;
+    unsigned char code[0x1000];
+    size_t pos = 0;
+    size_t max_line = 0;
+
+    for (size_t i = 0; i < sizeof(hot_fields) / sizeof(hot_fields[0]); ++i) {
+        printf("%-10s offset %3zu, cache line %zu\n", hot_fields[i].name, hot_fields[i].offset, hot_fields[i].offset / 64);
+        max_line = hot_fields[i].offset / 64 > max_line ? hot_fields[i].offset / 64 : max_line;
+    }
+    printf("hot fields span %zu cache line(s)\n", max_line + 1);
+
+    // Endless loop that loads, adds, stores and branches
+    memset(code, 0, sizeof(code));
+    pos = emit(code, pos, SET, 3, 0, 0, 1);
+    pos = emit(code, pos, SET, 5, 0, 0, 0);
+    pos = emit(code, pos, SET, 6, 0, 0, 0);
+
+    uint32_t loop = pos;
+    pos = emit(code, pos, LOADWORD, 4, 5, 0, 0x800);
+    pos = emit(code, pos, ADD, 4, 4, 3, 0);
+    pos = emit(code, pos, STOREWORD, 4, 5, 0, 0x800);
+    pos = emit(code, pos, ADD, 1, 1, 3, 0);
+    pos = emit(code, pos, JUMP, 6, 0, 0, loop);
+
+    struct ivm_image* image;
+    struct ivm_instance* instance;
+    struct ivm_pool* pool;
+    struct ivm_context* context;
+
+    if (ivm_image_create(&image, 32, 0x1000, 64) != 0
+            || ivm_image_load_vm_from_object(image, IVM_VM_OBJECT, 0x400000) != 0
+            || ivm_image_reserve_vm_data(image, IVM_ENTRY, sizeof(code)) != 0) {
+        fprintf(stderr, "Failed to create image\n");
+        return 1;
+    }
+
+    // The instance maps the VM code, contexts run it on this thread
+    if (ivm_instance_create(&instance, image, code) != 0
+            || ivm_pool_create(&pool, image, code, 1) != 0
+            || ivm_pool_acquire(&context, pool) != 0) {
+        fprintf(stderr, "Failed to create VM\n");
+        return 1;
+    }
+
+    unsigned char* evict = malloc(EVICT_SIZE);
+    if (evict == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    int64_t status;
+    uint64_t steps = 50000000;
+
+    double start = now();
+    ivm_context_execute(context, instance, steps, &status);
+    double warm = (now() - start) / steps;
+
+    double cold = 0;
+    for (unsigned long i = 0; i < bursts && status == IVM_EXIT_BUDGET; ++i) {
+        memset(evict, (int) i, EVICT_SIZE);
+
+        start = now();
+        ivm_context_execute(context, instance, BURST_LENGTH, &status);
+        cold += now() - start;
+    }
+
+    if (status != IVM_EXIT_BUDGET) {
+        fprintf(stderr, "VM stopped with status %lld\n", (long long) status);
+        return 1;
+    }
+
+    printf("warm: %.2f ns per instruction\n", warm * 1e9);
+    printf("cold: %.2f ns per run of %d instructions, %.2f ns per instruction\n",
+            cold * 1e9 / bursts, BURST_LENGTH, cold * 1e9 / bursts / BURST_LENGTH);
+
+    free(evict);
+    ivm_pool_release(context);
+    ivm_pool_remove(pool);
+    ivm_instance_remove(instance);
+    ivm_image_remove(image);
+    return 0;
+}
@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ivm_vm.h>
+#include <ivm_image.h>
+#include <ivm_instance.h>
+#include <ivm_bytecode.h>
+
+
+/*
+ * Number of times each VM build runs the loop.
+ */
+#define NUM_RUNS        5
+
+
+
+/*
+ * Append an instruction to the bytecode.
+ */
+static size_t emit(unsigned char* code, size_t pos, uint8_t opcode, uint8_t a, uint8_t b, uint8_t c, uint32_t word)
+{
+    const uint8_t regs[3] = { a, b, c };
+
+    code[pos++] = opcode;
+    for (int i = 0; i < IVM_NUM_REGS(opcode); ++i) {
+        code[pos++] = regs[i];
+    }
+
+    if (IVM_HAS_WORD(opcode)) {
+        memcpy(&code[pos], &word, sizeof(word));
+        pos += sizeof(word);
+    }
+
+    return pos;
+}
+
+
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+
+/*
+ * Run the loop with the VM code from an object file.
+ * Returns the shortest time of the runs, or a negative value on failure.
+ */
+static double run(const char* object, const unsigned char* code, size_t size, uint32_t iterations)
+{
+    struct ivm_image* image;
+    struct ivm_instance* instance;
+    double best = -1;
+
+    if (ivm_image_create(&image, IVM_STATE_DEPTH, IVM_FRAME_SIZE, IVM_FRAME_COUNT) != 0) {
+        return -1;
+    }
+
+    if (ivm_image_load_vm_from_object(image, object, 0x400000) != 0
+            || ivm_image_reserve_vm_data(image, IVM_ENTRY, size) != 0
+            || ivm_instance_create(&instance, image, code) != 0) {
+        ivm_image_remove(image);
+        return -1;
+    }
+
+    for (int i = 0; i < NUM_RUNS; ++i) {
+        struct ivm_registers regs;
+        int64_t status;
+
+        instance->data->registers->ip = 0;
+
+        double start = now();
+        ivm_instance_run(instance);
+        ivm_instance_wait(instance, &status, &regs);
+        double time = now() - start;
+
+        if (status != IVM_EXIT_HALT || regs.r[regs.wb + 1] != iterations) {
+            best = -1;
+            break;
+        }
+
+        if (best < 0 || time < best) {
+            best = time;
+        }
+    }
+
+    ivm_instance_remove(instance);
+    ivm_image_remove(image);
+    return best;
+}
+
+
+
+/*
+ * Compare the generic VM with the VM specialized for the frame geometry,
+ * on a loop that loads, adds, stores and branches.
+ */
+int main(int argc, char** argv)
+{
+    uint32_t iterations = argc > 1 ? strtoul(argv[1], NULL, 0) : 20000000;
+    unsigned char code[IVM_FRAME_SIZE];
+    size_t pos = 0;
+
+    memset(code, 0, sizeof(code));
+    pos = emit(code, pos, SET, 1, 0, 0, 0);
+    pos = emit(code, pos, SET, 2, 0, 0, iterations);
+    pos = emit(code, pos, SET, 3, 0, 0, 1);
+    pos = emit(code, pos, SET, 5, 0, 0, 0);
+    pos = emit(code, pos, SET, 6, 0, 0, 0);
+
+    uint32_t loop = pos;
+    pos = emit(code, pos, LOADWORD, 4, 5, 0, 0x100);
+    pos = emit(code, pos, ADD, 4, 4, 3, 0);
+    pos = emit(code, pos, STOREWORD, 4, 5, 0, 0x100);
+    pos = emit(code, pos, ADD, 1, 1, 3, 0);
+    pos = emit(code, pos, JUMPNE, 1, 2, 6, loop);
+    pos = emit(code, pos, HALT, 0, 0, 0, 0);
+
+    double generic = run(IVM_VM_OBJECT, code, sizeof(code), iterations);
+    double fixed = run(IVM_VM_OBJECT_FIXED, code, sizeof(code), iterations);
+    if (generic < 0 || fixed < 0) {
+        fprintf(stderr, "Failed to run the VM\n");
+        return 1;
+    }
+
+    printf("%u iterations, best of %d runs\n", iterations, NUM_RUNS);
+    printf("generic:     %.3f s (%.2f ns per instruction)\n", generic, generic * 1e9 / (iterations * 5.0));
+    printf("specialized: %.3f s (%.2f ns per instruction)\n", fixed, fixed * 1e9 / (iterations * 5.0));
+    return 0;
+}
@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ivm_vm.h>
+#include <ivm_image.h>
+#include <ivm_bytecode.h>
+
+
+/*
+ * Number of times each image is written.
+ */
+#define NUM_RUNS        3
+
+
+
+/*
+ * Number of small segments in the second image.
+ */
+#define NUM_SEGMENTS    20000
+
+
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+
+/*
+ * Write an image to a temporary file a few times.
+ * Returns the shortest time, or a negative value on failure.
+ */
+static double write_image(const struct ivm_image* image, const void* bytecode)
+{
+    double best = -1;
+
+    for (int i = 0; i < NUM_RUNS; ++i) {
+        FILE* fp = tmpfile();
+        if (fp == NULL) {
+            return -1;
+        }
+
+        double start = now();
+        int err = ivm_image_write(fp, image, bytecode);
+        double time = now() - start;
+        fclose(fp);
+
+        if (err != 0) {
+            return -1;
+        }
+
+        if (best < 0 || time < best) {
+            best = time;
+        }
+    }
+
+    return best;
+}
+
+
+
+/*
+ * Time writing an image with a large bytecode section, which is dominated
+ * by copying the bytecode, and an image with many small segments, which is
+ * dominated by headers and padding.
+ */
+int main(int argc, char** argv)
+{
+    size_t size = (argc > 1 ? strtoul(argv[1], NULL, 0) : 1024) << 20;
+    struct ivm_image* image;
+    static unsigned char data[100];
+
+    unsigned char* bytecode = malloc(size);
+    if (bytecode == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    memset(bytecode, 0x5a, size);
+    bytecode[0] = HALT;
+
+    if (ivm_image_create(&image, 32, 0x100000, 1024) != 0
+            || ivm_image_load_vm_from_object(image, IVM_VM_OBJECT, 0x400000) != 0
+            || ivm_image_reserve_vm_data(image, IVM_ENTRY, size - 100) != 0) {
+        fprintf(stderr, "Failed to create image\n");
+        return 1;
+    }
+
+    double time = write_image(image, bytecode);
+    ivm_image_remove(image);
+    free(bytecode);
+    if (time < 0) {
+        fprintf(stderr, "Failed to write image\n");
+        return 1;
+    }
+    printf("%zu MiB bytecode:    %.3f s\n", size >> 20, time);
+
+    int err = ivm_image_create(&image, 32, 0x1000, 16);
+    if (err == 0) {
+        err = ivm_image_load_vm_from_object(image, IVM_VM_OBJECT, 0x400000);
+    }
+    if (err == 0) {
+        err = ivm_image_reserve_vm_data(image, IVM_ENTRY, sizeof(data));
+    }
+
+    for (size_t i = 0; i < NUM_SEGMENTS && err == 0; ++i) {
+        struct ivm_segment* segment;
+
+        err = ivm_image_add_segment(&segment, image, IVM_SEG_DATA, 0x1000, 0x100000000ULL + i * 0x2000, 0x1000, 0x1000);
+        if (err == 0) {
+            err = ivm_image_add_section(NULL, segment, IVM_SECT_DATA, 8, data, sizeof(data));
+        }
+    }
+
+    if (err != 0) {
+        fprintf(stderr, "Failed to create image\n");
+        return 1;
+    }
+
+    time = write_image(image, data);
+    ivm_image_remove(image);
+    if (time < 0) {
+        fprintf(stderr, "Failed to write image\n");
+        return 1;
+    }
+    printf("%d small segments: %.3f s\n", NUM_SEGMENTS, time);
+
+    return 0;
+}
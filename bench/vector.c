@@ -0,0 +1,227 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ivm_vm.h>
+#include <ivm_image.h>
+#include <ivm_instance.h>
+#include <ivm_bytecode.h>
+
+
+/*
+ * Frame geometry of the guest.
+ */
+#define FRAME_SIZE      0x1000
+#define NUM_FRAMES      64
+
+
+
+/*
+ * Guest address and size of the buffer that is summed.
+ */
+#define BUFFER          0x8000
+#define BUFFER_SIZE     0x20000
+
+
+
+/*
+ * Number of times each loop runs, and how many fewer passes the scalar
+ * loop makes over the buffer.
+ */
+#define NUM_RUNS        5
+#define SCALAR_DIVISOR  50
+
+
+
+static struct ivm_instance* instance;
+
+
+
+/*
+ * Append an instruction to the bytecode.
+ */
+static size_t emit(unsigned char* code, size_t pos, uint8_t opcode, uint8_t a, uint8_t b, uint8_t c, uint32_t word)
+{
+    const uint8_t regs[3] = { a, b, c };
+
+    code[pos++] = opcode;
+    for (int i = 0; i < IVM_NUM_REGS(opcode); ++i) {
+        code[pos++] = regs[i];
+    }
+
+    if (IVM_HAS_WORD(opcode)) {
+        memcpy(&code[pos], &word, sizeof(word));
+        pos += sizeof(word);
+    }
+
+    return pos;
+}
+
+
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+
+static unsigned char* guest(uint32_t addr)
+{
+    const struct ivm_data* data = instance->data;
+    return (unsigned char*) data->ftable[addr / FRAME_SIZE].addr + addr % FRAME_SIZE;
+}
+
+
+
+/*
+ * Sum the buffer the given number of times with MSUM.
+ */
+static size_t emit_vector(unsigned char* code, uint32_t passes)
+{
+    size_t pos = 0;
+
+    pos = emit(code, pos, SET, 1, 0, 0, BUFFER);
+    pos = emit(code, pos, SET, 3, 0, 0, BUFFER_SIZE);
+    pos = emit(code, pos, SET, 5, 0, 0, 0);
+    pos = emit(code, pos, SET, 6, 0, 0, passes);
+    pos = emit(code, pos, SET, 7, 0, 0, 1);
+    pos = emit(code, pos, SET, 8, 0, 0, 0);
+    pos = emit(code, pos, SET, 9, 0, 0, 0);
+
+    uint32_t loop = pos;
+    pos = emit(code, pos, MSUM, 4, 1, 3, 0);
+    pos = emit(code, pos, ADD, 9, 9, 4, 0);
+    pos = emit(code, pos, SUB, 6, 6, 7, 0);
+    pos = emit(code, pos, JUMPNE, 6, 8, 5, loop);
+    pos = emit(code, pos, HALT, 0, 0, 0, 0);
+
+    return pos;
+}
+
+
+
+/*
+ * Sum the buffer the given number of times, one byte at a time.
+ */
+static size_t emit_scalar(unsigned char* code, uint32_t passes)
+{
+    size_t pos = 0;
+
+    pos = emit(code, pos, SET, 1, 0, 0, BUFFER);
+    pos = emit(code, pos, SET, 3, 0, 0, BUFFER_SIZE);
+    pos = emit(code, pos, SET, 5, 0, 0, 0);
+    pos = emit(code, pos, SET, 6, 0, 0, passes);
+    pos = emit(code, pos, SET, 7, 0, 0, 1);
+    pos = emit(code, pos, SET, 8, 0, 0, 0);
+    pos = emit(code, pos, SET, 9, 0, 0, 0);
+
+    uint32_t outer = pos;
+    pos = emit(code, pos, MOVE, 10, 1, 0, 0);
+    pos = emit(code, pos, MOVE, 11, 3, 0, 0);
+
+    uint32_t inner = pos;
+    pos = emit(code, pos, LOAD, 12, 10, 0, 0);
+    pos = emit(code, pos, ADD, 9, 9, 12, 0);
+    pos = emit(code, pos, ADD, 10, 10, 7, 0);
+    pos = emit(code, pos, SUB, 11, 11, 7, 0);
+    pos = emit(code, pos, JUMPNE, 11, 8, 5, inner);
+    pos = emit(code, pos, SUB, 6, 6, 7, 0);
+    pos = emit(code, pos, JUMPNE, 6, 8, 5, outer);
+    pos = emit(code, pos, HALT, 0, 0, 0, 0);
+
+    return pos;
+}
+
+
+
+/*
+ * Run the guest code with the given CPU features.
+ * Returns the shortest time of the runs, or a negative value on failure.
+ */
+static double run(const unsigned char* code, size_t size, uint64_t cpu, uint32_t expected)
+{
+    double best = -1;
+
+    memcpy(guest(0), code, size);
+
+    for (int i = 0; i < NUM_RUNS; ++i) {
+        struct ivm_registers regs;
+        int64_t status;
+
+        instance->data->cpu = cpu;
+        instance->data->registers->ip = 0;
+
+        double start = now();
+        ivm_instance_run(instance);
+        ivm_instance_wait(instance, &status, &regs);
+        double time = now() - start;
+
+        if (status != IVM_EXIT_HALT || regs.r[regs.wb + 9] != expected) {
+            return -1;
+        }
+
+        if (best < 0 || time < best) {
+            best = time;
+        }
+    }
+
+    return best;
+}
+
+
+
+/*
+ * Compare the throughput of MSUM with the kernels the VM picks for this
+ * CPU, with its 128-bit kernels and with a bytecode loop that sums one
+ * byte at a time.
+ */
+int main(int argc, char** argv)
+{
+    uint32_t passes = argc > 1 ? strtoul(argv[1], NULL, 0) : 2000;
+    uint32_t scalar_passes = passes / SCALAR_DIVISOR > 0 ? passes / SCALAR_DIVISOR : 1;
+    unsigned char code[FRAME_SIZE];
+    struct ivm_image* image;
+
+    memset(code, 0, sizeof(code));
+    if (ivm_image_create(&image, 32, FRAME_SIZE, NUM_FRAMES) != 0
+            || ivm_image_load_vm_from_object(image, IVM_VM_OBJECT, 0x400000) != 0
+            || ivm_image_reserve_vm_data(image, IVM_ENTRY, sizeof(code)) != 0
+            || ivm_instance_create(&instance, image, code) != 0) {
+        fprintf(stderr, "Failed to create VM\n");
+        return 1;
+    }
+
+    uint32_t sum = 0;
+    srand(1);
+    for (uint32_t i = 0; i < BUFFER_SIZE; ++i) {
+        *guest(BUFFER + i) = rand();
+        sum += *guest(BUFFER + i);
+    }
+
+    memset(code, 0, sizeof(code));
+    double dispatch = run(code, emit_vector(code, passes), 0, sum * passes);
+    double narrow = run(code, emit_vector(code, passes), IVM_CPU_DETECTED, sum * passes);
+
+    memset(code, 0, sizeof(code));
+    double scalar = run(code, emit_scalar(code, scalar_passes), 0, sum * scalar_passes);
+
+    ivm_instance_remove(instance);
+    ivm_image_remove(image);
+
+    if (dispatch < 0 || narrow < 0 || scalar < 0) {
+        fprintf(stderr, "Failed to run the VM\n");
+        return 1;
+    }
+
+    double bytes = (double) BUFFER_SIZE * passes;
+    printf("%u passes over %d KiB, best of %d runs\n", passes, BUFFER_SIZE >> 10, NUM_RUNS);
+    printf("MSUM, detected:  %.2f GB/s\n", bytes / dispatch / 1e9);
+    printf("MSUM, 128-bit:   %.2f GB/s\n", bytes / narrow / 1e9);
+    printf("scalar bytecode: %.2f GB/s (%u passes)\n", (double) BUFFER_SIZE * scalar_passes / scalar / 1e9, scalar_passes);
+    return 0;
+}
@@ -0,0 +1,251 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <ivm_vm.h>
+#include <ivm_image.h>
+#include <ivm_bytecode.h>
+#include <ivm_interrupt.h>
+#include <ivm_syscall.h>
+#include <ivm_zygote.h>
+
+
+/*
+ * Frame geometry of the guest images.
+ */
+#define FRAME_SIZE      0x400
+#define NUM_FRAMES      256
+
+
+
+/*
+ * Guest address of the byte the guest writes to standard output.
+ */
+#define MESSAGE         0x100
+
+
+
+/*
+ * Append an instruction to the bytecode.
+ */
+static size_t emit(unsigned char* code, size_t pos, uint8_t opcode, uint8_t a, uint8_t b, uint8_t c, uint32_t word)
+{
+    const uint8_t regs[3] = { a, b, c };
+
+    code[pos++] = opcode;
+    for (int i = 0; i < IVM_NUM_REGS(opcode); ++i) {
+        code[pos++] = regs[i];
+    }
+
+    if (IVM_HAS_WORD(opcode)) {
+        memcpy(&code[pos], &word, sizeof(word));
+        pos += sizeof(word);
+    }
+
+    return pos;
+}
+
+
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+
+/*
+ * Write an executable image to a temporary file.
+ * Returns 0 on success, or an error code.
+ */
+static int write_image(char* path, uint64_t flags, const unsigned char* code, size_t size)
+{
+    struct ivm_image* image;
+
+    int fd = mkstemp(path);
+    if (fd < 0 || fchmod(fd, 0700) != 0) {
+        return 1;
+    }
+
+    FILE* fp = fdopen(fd, "w");
+    if (fp == NULL) {
+        close(fd);
+        return 1;
+    }
+
+    int err = ivm_image_create(&image, 32, FRAME_SIZE, NUM_FRAMES);
+    if (err == 0) {
+        image->data->flags = flags;
+        err = ivm_image_load_vm_from_object(image, IVM_VM_OBJECT, 0x400000);
+        if (err == 0) {
+            err = ivm_image_reserve_vm_data(image, IVM_ENTRY, size);
+        }
+        if (err == 0) {
+            err = ivm_image_write(fp, image, code);
+        }
+        ivm_image_remove(image);
+    }
+
+    if (fclose(fp) != 0 && err == 0) {
+        err = 1;
+    }
+
+    return err;
+}
+
+
+
+/*
+ * Wait for the first byte the guest writes, which it does with its first
+ * system call, and then for the guest to close the pipe when it exits.
+ * Returns the time until the first byte, or a negative value on failure.
+ */
+static double wait_guest(int pipe_fd, double start)
+{
+    char buf[16];
+
+    if (read(pipe_fd, buf, 1) != 1) {
+        return -1;
+    }
+    double time = now() - start;
+
+    while (read(pipe_fd, buf, sizeof(buf)) > 0);
+    return time;
+}
+
+
+
+/*
+ * Launch the image with fork and exec.
+ */
+static double launch_exec(const char* path)
+{
+    int fds[2];
+    int status;
+
+    if (pipe(fds) != 0) {
+        return -1;
+    }
+
+    double start = now();
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(fds[1], 1);
+        execl(path, path, (char*) NULL);
+        _exit(127);
+    }
+    close(fds[1]);
+
+    double time = pid > 0 ? wait_guest(fds[0], start) : -1;
+    close(fds[0]);
+
+    if (pid > 0 && (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)) {
+        time = -1;
+    }
+
+    return time;
+}
+
+
+
+/*
+ * Launch the initialized VM from the fork-server.
+ * Children of the fork-server are reaped by the fork-server.
+ */
+static double launch_zygote(int control)
+{
+    int fds[2];
+    pid_t child;
+
+    if (pipe(fds) != 0) {
+        return -1;
+    }
+
+    const int stdio[3] = { 0, fds[1], 2 };
+
+    double start = now();
+    int err = ivm_zygote_spawn(&child, control, stdio, NULL, 0);
+    close(fds[1]);
+
+    double time = err == 0 ? wait_guest(fds[0], start) : -1;
+    close(fds[0]);
+    return time;
+}
+
+
+
+/*
+ * Compare the latency from a launch request until the guest runs, for a
+ * fork-server that clones an initialized VM and for fork and exec of the
+ * same image.
+ */
+int main(int argc, char** argv)
+{
+    unsigned long launches = argc > 1 ? strtoul(argv[1], NULL, 0) : 1000;
+    unsigned char code[FRAME_SIZE];
+    size_t pos = 0;
+
+    // Write one byte to standard output and exit with status 0
+    memset(code, 0, sizeof(code));
+    pos = emit(code, pos, SET, 2, 0, 0, 1);
+    pos = emit(code, pos, SET, 3, 0, 0, MESSAGE);
+    pos = emit(code, pos, SET, 4, 0, 0, 1);
+    pos = emit(code, pos, SET, 1, 0, 0, IVM_SYSCALL_WRITE);
+    pos = emit(code, pos, TRAP, 5, 0, 0, IVM_INTR_SYSCALL);
+    pos = emit(code, pos, SET, 0, 0, 0, 0);
+    pos = emit(code, pos, HALT, 0, 0, 0, 0);
+    code[MESSAGE] = '.';
+
+    char plain_path[] = "/tmp/ivm_bench_plainXXXXXX";
+    char zygote_path[] = "/tmp/ivm_bench_zygoteXXXXXX";
+
+    if (write_image(plain_path, 0, code, sizeof(code)) != 0
+            || write_image(zygote_path, IVM_FLAG_ZYGOTE, code, sizeof(code)) != 0) {
+        fprintf(stderr, "Failed to write images\n");
+        return 1;
+    }
+
+    pid_t server;
+    int control;
+    if (ivm_zygote_start(&server, &control, zygote_path) != 0) {
+        fprintf(stderr, "Failed to start the fork-server\n");
+        return 1;
+    }
+
+    double exec_total = 0;
+    double zygote_total = 0;
+    int failed = 0;
+
+    // Alternate, so that both see the same system load
+    for (unsigned long i = 0; i < launches && !failed; ++i) {
+        double exec_time = launch_exec(plain_path);
+        double zygote_time = launch_zygote(control);
+
+        failed = exec_time < 0 || zygote_time < 0;
+        exec_total += exec_time;
+        zygote_total += zygote_time;
+    }
+
+    close(control);
+    waitpid(server, NULL, 0);
+    unlink(plain_path);
+    unlink(zygote_path);
+
+    if (failed) {
+        fprintf(stderr, "Failed to launch the guest\n");
+        return 1;
+    }
+
+    printf("%lu launches, time until the guest runs\n", launches);
+    printf("fork and exec: %.1f us\n", exec_total * 1e6 / launches);
+    printf("fork-server:   %.1f us\n", zygote_total * 1e6 / launches);
+    return 0;
+}
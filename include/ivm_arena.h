@@ -0,0 +1,63 @@
+#ifndef __IBSENVM_ARENA_H__
+#define __IBSENVM_ARENA_H__
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+
+
+/*
+ * Block of memory that objects are carved out of.
+ */
+struct ivm_arena_block
+{
+    struct ivm_arena_block*     next;               // Previously filled block
+    size_t                      size;               // Size of data
+    size_t                      used;               // Bytes handed out
+    unsigned char               data[];
+};
+
+
+
+/*
+ * Bump allocator.
+ * Objects are placed back to back in blocks that double in size, so
+ * objects allocated one after the other are next to each other in memory.
+ * Objects can not be freed one at a time, only the whole arena at once.
+ */
+struct ivm_arena
+{
+    struct ivm_arena_block*     block;              // Block currently being filled
+    size_t                      block_size;         // Size of the first block
+};
+
+
+
+/*
+ * Initialize an empty arena. No memory is allocated until the first object.
+ */
+void ivm_arena_init(struct ivm_arena* arena, size_t block_size);
+
+
+
+/*
+ * Allocate an object from the arena, with the given alignment.
+ * Alignment must be a power of two. Returns NULL if out of memory.
+ */
+void* ivm_arena_alloc(struct ivm_arena* arena, size_t size, size_t align);
+
+
+
+/*
+ * Free every object allocated from the arena.
+ */
+void ivm_arena_release(struct ivm_arena* arena);
+
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* __IBSENVM_ARENA_H__ */
@@ -1,6 +1,8 @@
 #ifndef __IBSENVM_BYTECODE_H__
 #define __IBSENVM_BYTECODE_H__
 
+#include <stdint.h>
+
 /*
  * The byte code language used by the Ibsen virtual machine.
  * 
@@ -13,6 +15,16 @@
  *  101x = 0xa-b = Register operand and word operand
  *  110x = 0xc-d = Two register operands and word operand
  *  111x = 0xe-f = Three register operands and word operand
+ *
+ * Vector instructions (V*) operate on ranges of registers, R[n] being
+ * register n of the current window. A range that does not fit in R00-RFF
+ * raises IVM_INTR_INVALID_OPCODE. Memory instructions (M*) operate on spans
+ * of bytes in guest memory. Ranges and spans must either be the same or not
+ * overlap at all, except for MCOPY.
+ *
+ * Atomic instructions (LOADACQ, STOREREL, ATOM*) operate on 4-byte aligned
+ * words, which makes them usable on frames shared with other VMs. An
+ * unaligned address raises IVM_INTR_PROTECTION_FAULT.
  */
 enum 
 {
@@ -22,26 +34,50 @@ enum
     JUMPGT      =   0xe3,   // if [r0] > [r1] then IP = [r2] + [word]
     JUMPNE      =   0xe4,   // if [r0] != [r1] then IP = [r2] + [word]
     CALL        =   0x20,   // *(SP) = IP, SP += 1, IP = [r0] 
-    RETURN      =   0x00,   // SP -= 1, IP = *(SP)
-    LOAD        =   0xc7,   // [r0] = *(BP + [r1] + [word])
+    RETURN      =   0x01,   // SP -= 1, IP = *(SP)
+    CALLW       =   0xa1,   // Save IP and slide register window up, IP = [r0] + [word]
+    RETW        =   0x02,   // Slide register window down and restore IP
+    SETWS       =   0xb7,   // WS = [r0] + [word]
+    NCALL       =   0xa2,   // Call native function in slot [r0] + [word]
+    LOAD        =   0xc7,   // [r0] = *(BP + [r1] + [word]) (byte)
     LOADWORD    =   0xd7,   // [r0] = *(BP + [r1] + [word])
-    STORE       =   0xc6,   // *(BP + [r1] + [word]) = [r0]
+    STORE       =   0xc6,   // *(BP + [r1] + [word]) = [r0] (byte)
     STOREWORD   =   0xd6,   // *(BP + [r1] + [word]) = [r0]
-    POP         =   0x27,   // *(SP) = [r0], SP += 1
-    PUSH        =   0x26,   // SP -= 1, [r0] = *(SP)
+    LOADACQ     =   0xd8,   // [r0] = *(BP + [r1] + [word]) (aligned word, acquire)
+    STOREREL    =   0xd9,   // *(BP + [r1] + [word]) = [r0] (aligned word, release)
+    ATOMCAS     =   0x7a,   // if *(BP + [r1]) == [r0] then *(BP + [r1]) = [r2], [r0] = old value (atomic)
+    ATOMADD     =   0x7b,   // [r0] = *(BP + [r1]), *(BP + [r1]) += [r2] (atomic)
+    POP         =   0x27,   // SP -= 1, [r0] = *(SP)
+    PUSH        =   0x26,   // *(SP) = [r0], SP += 1
     MOVE        =   0x47,   // [r0] = [r1]
     SET         =   0xa7,   // [r0] = [word]
-    ZERO        =   0x17,   // [r0] = 0
+    ZERO        =   0x21,   // [r0] = 0
     INVERT      =   0x28,   // [r0] = ~[r0]
     XOR         =   0x48,   // [r0] = [r0] ^ [r1]
     AND         =   0x4c,   // [r0] = [r0] & [r1]
     OR          =   0x4d,   // [r0] = [r0] | [r1]
     SHIFTUP     =   0x44,   // [r0] = [r0] << [r1]
     SHIFTDOWN   =   0x45,   // [r0] = [r0] >> [r1]
-    SUB         =   0x6c,   // [r0] = [r1] + [r2]
+    SUB         =   0x6c,   // [r0] = [r1] - [r2]
     ADD         =   0x6d,   // [r0] = [r1] + [r2]
     MUL         =   0x64,   // [r0] = [r1] * [r2]
     DIVMOD      =   0x65,   // [r2] = [r0] % [r1], [r0] = [r0] / [r1]
+    VADD        =   0xe8,   // R[r0 + i] = R[r1 + i] + R[r2 + i] for i < [word]
+    VXOR        =   0xe9,   // R[r0 + i] = R[r1 + i] ^ R[r2 + i] for i < [word]
+    VCMPEQ      =   0xea,   // R[r0 + i] = R[r1 + i] == R[r2 + i] ? ~0 : 0 for i < [word]
+    VMIN        =   0xeb,   // R[r0 + i] = min(R[r1 + i], R[r2 + i]) for i < [word]
+    VMAX        =   0xec,   // R[r0 + i] = max(R[r1 + i], R[r2 + i]) for i < [word]
+    VSUM        =   0xc8,   // [r0] = R[r1] + ... + R[r1 + [word] - 1]
+    MADD        =   0x70,   // *(BP + [r0] + i) += *(BP + [r1] + i) for i < [r2] (bytes)
+    MXOR        =   0x71,   // *(BP + [r0] + i) ^= *(BP + [r1] + i) for i < [r2] (bytes)
+    MCMPEQ      =   0x72,   // *(BP + [r0] + i) = *(BP + [r0] + i) == *(BP + [r1] + i) ? 0xff : 0 for i < [r2]
+    MMIN        =   0x73,   // *(BP + [r0] + i) = min(*(BP + [r0] + i), *(BP + [r1] + i)) for i < [r2] (bytes)
+    MMAX        =   0x74,   // *(BP + [r0] + i) = max(*(BP + [r0] + i), *(BP + [r1] + i)) for i < [r2] (bytes)
+    MSUM        =   0x75,   // [r0] = *(BP + [r1]) + ... + *(BP + [r1] + [r2] - 1) (bytes)
+    MCOPY       =   0x76,   // Copy [r2] bytes from BP + [r1] to BP + [r0], spans may overlap
+    MFILL       =   0x77,   // Fill [r2] bytes at BP + [r0] with the byte [r1]
+    MCMP        =   0x78,   // [r0] = offset of first difference of [r2] bytes at BP + [r0] and BP + [r1], or [r2]
+    MFIND       =   0x79,   // [r0] = offset of first byte [r1] in [r2] bytes at BP + [r0], or [r2]
     SETBP       =   0xb3,   // BP = [r0] + [word]
     SETSB       =   0xb5,   // SB = [r0] + [word]
     SETSP       =   0xbf,   // SP = [r0] + [word]
@@ -57,9 +93,9 @@ enum
     NOOP        =   0x1f,   // do nothing
     DISABLE     =   0xae,   // IMASK &= ~(1 << [r0])
     ENABLE      =   0x2f,   // IMASK |= 1 << [r0]
-    VECTOR      =   0xde,   // IV = [r0] + [word]
-    TRAP        =   0xaf,   // R00 = IP + 2, IP = (IV + (1 << ([r0] + [word])))
-    RESTORE     =   0x10,   // IP = R00
+    VECTOR      =   0xde,   // IV[[r0]] = [r1] + [word]
+    TRAP        =   0xaf,   // Raise interrupt [r0] + [word], push IP and R00, R00 = IP, IP = IV[[r0] + [word]]
+    RESTORE     =   0x10,   // Pop IP and R00 from the state stack, enable the interrupt again
 };
 
 
@@ -70,5 +106,59 @@ enum
 #define IVM_PREFIX(opcode) ((opcode) >> 5)
 
 
+
+/*
+ * Get number of register operands from opcode.
+ */
+#define IVM_NUM_REGS(opcode) (IVM_PREFIX(opcode) & 0x3)
+
+
+
+/*
+ * Check if the opcode takes a word operand.
+ */
+#define IVM_HAS_WORD(opcode) (IVM_PREFIX(opcode) >= 0x4)
+
+
+
+/*
+ * Get the encoded length of an instruction.
+ * Instructions are encoded as the opcode, followed by one byte per register
+ * operand and an unaligned little-endian 32-bit word.
+ */
+#define IVM_INSTR_LEN(opcode) (1 + IVM_NUM_REGS(opcode) + (IVM_HAS_WORD(opcode) ? 4 : 0))
+
+
+
+/*
+ * Length of the longest instruction.
+ */
+#define IVM_MAX_INSTR_LEN   8
+
+
+
+/*
+ * Fixed-width encoding (version 1), used by images with IVM_FLAG_WIDE.
+ * Every instruction is a naturally aligned little-endian 64-bit word, with
+ * the opcode in bits 0-7, register operands in bits 8-15, 16-23 and 24-31
+ * and the word operand in bits 32-63. Unused fields are zero.
+ * Addresses are the same as in the variable-length encoding, the
+ * instruction at bytecode offset n is entry n of the fixed-width code, so
+ * jump targets and data addresses do not change.
+ */
+#define IVM_WIDE_VERSION    1
+
+#define IVM_WIDE_ENCODE(opcode, r0, r1, r2, word) \
+    ((uint64_t) (uint8_t) (opcode) \
+     | ((uint64_t) (uint8_t) (r0) << 8) \
+     | ((uint64_t) (uint8_t) (r1) << 16) \
+     | ((uint64_t) (uint8_t) (r2) << 24) \
+     | ((uint64_t) (uint32_t) (word) << 32))
+
+#define IVM_WIDE_OPCODE(insn)   ((uint8_t) (insn))
+#define IVM_WIDE_REG(insn, i)   ((uint8_t) ((insn) >> (8 + 8 * (i))))
+#define IVM_WIDE_WORD(insn)     ((uint32_t) ((insn) >> 32))
+
+
 #endif /* __IBSENVM_BYTECODE_H__ */
 
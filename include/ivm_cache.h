@@ -0,0 +1,84 @@
+#ifndef __IBSENVM_CACHE_H__
+#define __IBSENVM_CACHE_H__
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <ivm_entry.h>
+
+
+
+/*
+ * Cache file format version.
+ */
+#define IVM_CACHE_VERSION   2
+
+
+
+/*
+ * Fixed-width code mapped from a cache file.
+ */
+struct ivm_cache_entry
+{
+    void*                   map;            // Mapping of the whole file
+    size_t                  map_size;       // Size of the mapping
+    const uint64_t*         wide;           // Fixed-width instructions
+    size_t                  count;          // Number of fixed-width instructions
+};
+
+
+
+/*
+ * Map the cached fixed-width code of bytecode from a cache directory.
+ *
+ * Files are named by a 128-bit hash of the bytecode, IVM_ID_STRING,
+ * IVM_WIDE_VERSION and the ID and frame geometry of the VM code that runs
+ * it, so neither a library that encodes differently nor another VM build
+ * finds the files of another. A file holds a header with the magic
+ * "IVMWIDE", the versions, the ID strings, the geometry, the size and hash
+ * of the bytecode and a checksum of the instructions, followed by the
+ * instructions as made by ivm_bytecode_widen and a copy of the bytecode.
+ * Instructions only refer to guest addresses, so the code can be placed
+ * anywhere.
+ *
+ * Returns ENOENT if the bytecode is not cached, and EINVAL if the file
+ * does not match the VM code or the bytecode, or fails the checksum.
+ */
+int ivm_cache_load(struct ivm_cache_entry* entry,
+                   const char* dir,
+                   const char* vm_id,
+                   const struct ivm_vm_geometry* geometry,
+                   const void* bytecode,
+                   size_t size);
+
+
+
+/*
+ * Unmap fixed-width code mapped by ivm_cache_load.
+ */
+void ivm_cache_release(struct ivm_cache_entry* entry);
+
+
+
+/*
+ * Add the fixed-width code of bytecode to a cache directory, creating the
+ * directory if it does not exist. The file is written under a temporary
+ * name and renamed into place, so processes that look up the same
+ * bytecode at the same time never map a partial file.
+ */
+int ivm_cache_store(const char* dir,
+                    const char* vm_id,
+                    const struct ivm_vm_geometry* geometry,
+                    const void* bytecode,
+                    size_t size,
+                    const uint64_t* wide,
+                    size_t count);
+
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* __IBSENVM_CACHE_H__ */
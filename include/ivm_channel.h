@@ -0,0 +1,128 @@
+#ifndef __IBSENVM_CHANNEL_H__
+#define __IBSENVM_CHANNEL_H__
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <ivm_vm.h>
+#include <ivm_memory.h>
+#include <ivm_list.h>
+
+
+
+/*
+ * Shared-memory channel between VMs hosted in the same process.
+ *
+ * A channel is a ring of fixed-size message slots in frames that are
+ * mapped into the frame table of every attached VM, so guests exchange
+ * messages without syscalls or copies. The ring can be used with one
+ * producer (SPSC) or several (MPSC).
+ *
+ * Layout, as seen by the guest at the attach address:
+ *  +0      head, the next position producers reserve (own cache line)
+ *  +64     tail, the next position the consumer reads (own cache line)
+ *  +128    number of slots (power of two) and slot size in bytes
+ *  +256    slots, each starting with a 32-bit sequence number
+ *
+ * Slot i initially has sequence number i. A producer at position p waits
+ * for slot p % n to have sequence p, reserves p with ATOMCAS on head
+ * (or STOREREL when it is the only producer), writes the message after the
+ * sequence number, and publishes it with STOREREL of p + 1. The consumer
+ * at position p waits for sequence p + 1 with LOADACQ, reads the message in
+ * place, and frees the slot with STOREREL of p + n.
+ *
+ * A producer can ring the doorbell with NCALL IVM_NATIVE_CHANNEL_RING,
+ * which raises IVM_INTR_DOORBELL in the other attached VMs that asked
+ * for it. The doorbell is disabled while its handler runs, and a ring in
+ * the meantime is delivered after the handler returns with RESTORE.
+ */
+struct ivm_channel
+{
+    struct ivm_list             list;               // Linked list node
+    unsigned char*              memory;             // Shared frames
+    size_t                      size;               // Size of shared memory
+    size_t                      frame_size;         // Frame size of attached VMs
+    uint32_t                    num_slots;          // Number of message slots
+    uint32_t                    slot_size;          // Size of each slot
+    size_t                      num_ports;          // Number of attached VMs
+    struct ivm_channel_port*    ports;              // Attached VMs
+};
+
+
+
+/*
+ * A VM attached to a channel.
+ */
+struct ivm_channel_port
+{
+    struct ivm_data*            data;               // VM data
+    uint32_t                    addr;               // Guest address of the channel
+    bool                        doorbell;           // Raise IVM_INTR_DOORBELL on ring
+    struct ivm_frame*           saved;              // Frames replaced by the channel
+};
+
+
+
+/*
+ * Offsets into the channel memory.
+ */
+#define IVM_CHANNEL_HEAD        0
+#define IVM_CHANNEL_TAIL        64
+#define IVM_CHANNEL_NUM_SLOTS   128
+#define IVM_CHANNEL_SLOT_SIZE   132
+#define IVM_CHANNEL_SLOTS       256
+
+
+
+/*
+ * Create a channel for VMs with the given frame size.
+ * The number of slots must be a power of two, and the slot size a multiple
+ * of 8 that holds the sequence number and the message.
+ */
+int ivm_channel_create(struct ivm_channel** channel, size_t frame_size, uint32_t num_slots, uint32_t slot_size);
+
+
+
+/*
+ * Destroy a channel. It must be detached from all VMs.
+ */
+void ivm_channel_remove(struct ivm_channel* channel);
+
+
+
+/*
+ * Map the channel into a VM at a frame-aligned guest address.
+ * The frames previously at that address are put aside until the channel is
+ * detached. Channel frames are marked IVM_FRAME_ATTR_SHARED, which makes pool
+ * resets and snapshots leave them alone. The VM must not be running.
+ * Returns EINVAL if the frame size differs or the frames are out of range,
+ * and EEXIST if a channel is already attached there.
+ */
+int ivm_channel_attach(struct ivm_channel* channel, struct ivm_data* data, uint32_t addr, bool doorbell);
+
+
+
+/*
+ * Unmap the channel from a VM and restore the frames it replaced.
+ * The VM must not be running.
+ */
+void ivm_channel_detach(struct ivm_channel* channel, struct ivm_data* data);
+
+
+
+/*
+ * Native function that rings the doorbell of the channel at guest address
+ * R01 (relative to BP). R00 is set to IVM_NATIVE_OK, or to
+ * IVM_NATIVE_NOT_FOUND if no channel is attached at that address.
+ */
+void ivm_channel_ring(uint32_t* r, struct ivm_frame* ftable, struct ivm_data* vm);
+
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* __IBSENVM_CHANNEL_H__ */
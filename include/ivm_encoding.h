@@ -0,0 +1,55 @@
+#ifndef __IBSENVM_ENCODING_H__
+#define __IBSENVM_ENCODING_H__
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <ivm_image.h>
+
+
+
+/*
+ * Convert bytecode to the fixed-width encoding, see IVM_WIDE_VERSION in
+ * ivm_bytecode.h.
+ *
+ * An instruction is decoded at every offset, so that computed jumps land
+ * on the same instruction in both encodings. The conversion stops at the
+ * first offset where an instruction would run past the end of the
+ * bytecode, and the VM falls back to the variable-length encoding from
+ * there. The array is allocated with malloc and must be freed by the
+ * caller.
+ */
+int ivm_bytecode_widen(uint64_t** wide, size_t* count, const void* bytecode, size_t size);
+
+
+
+/*
+ * Convert the bytecode of an image to the fixed-width encoding, place it
+ * at the given address and set IVM_FLAG_WIDE.
+ *
+ * The VM then fetches every instruction with a single aligned load,
+ * without translating the IP through the frame table. The fixed-width code
+ * is read-only, so guests that rewrite their own instructions must not use
+ * it. Reads and writes of the bytecode as data are not affected.
+ * VM data must be reserved first.
+ */
+int ivm_image_load_wide_code(struct ivm_image* image, const void* bytecode, size_t size, uint64_t addr);
+
+
+
+/*
+ * Same as ivm_image_load_wide_code, but map the fixed-width code from a
+ * cache directory if the same bytecode has been converted before, see
+ * ivm_cache.h. Otherwise the bytecode is converted and added to the
+ * cache. Failing to add it is not an error.
+ */
+int ivm_image_load_cached_wide_code(struct ivm_image* image, const char* dir, const void* bytecode, size_t size, uint64_t addr);
+
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* __IBSENVM_ENCODING_H__ */
@@ -20,12 +20,27 @@ struct ivm_function
 
 
 
+/*
+ * Frame geometry a VM build is specialized for.
+ * A field set to zero means that the value is read from the VM data at run
+ * time, so the build works with any value.
+ */
+struct ivm_vm_geometry
+{
+    uint64_t            frame_size; // Frame size
+    uint64_t            num_frames; // Number of frames
+    uint64_t            num_states; // Depth of the internal state stack
+};
+
+
+
 /*
  *  Functions used by the Ibsen virtual machine.
  */
 struct ivm_vm_functions
 {
     char                id[16];     // Identifier string
+    struct ivm_vm_geometry geometry;// Specialized frame geometry
     struct ivm_function interrupt;  // Interrupt routine
     struct ivm_function vm;         // Virtual machine code
     struct ivm_function loader;     // Address to the loader
@@ -10,6 +10,7 @@ extern "C" {
 #include <ivm_vm.h>
 #include <ivm_entry.h>
 #include <ivm_list.h>
+#include <ivm_arena.h>
 
 
 
@@ -37,12 +38,22 @@ struct ivm_image
     size_t                      data_offset_to_ct;  // Offset to call table
     size_t                      vm_file_offset;     // Offset in image file to entry point
     void*                       vm_code;            // Code of the VM
+    char*                       vm_interp;          // Path to shared VM code (NULL if VM code is in image)
+    struct ivm_vm_geometry      vm_geometry;        // Frame geometry the VM code is specialized for
+    void*                       frame_data;         // Saved frame contents (snapshots)
+    void*                       wide_code;          // Fixed-width bytecode, see ivm_encoding.h
+    void*                       wide_code_map;      // Cache file mapping of wide_code (NULL if allocated)
+    size_t                      wide_code_map_size; // Size of the cache file mapping
     uint64_t                    vm_entry_point;     // Address of the entry point
     size_t                      file_size;          // Total file size of image
     size_t                      num_segments;       // Number of segments in image
+    struct ivm_segment**        segment_index;      // Segments sorted by address
+    size_t                      segment_index_size; // Capacity of segment_index
     size_t                      num_sections;       // Number of sections in image
     size_t                      page_size;          // System page size
     struct ivm_list             segments;           // List of segments
+    struct ivm_arena            segment_arena;      // Memory for segments
+    struct ivm_arena            section_arena;      // Memory for sections
 };
 
 
@@ -70,7 +81,6 @@ struct ivm_segment
     size_t                      vm_align;           // VM alignment
     uint64_t                    vm_start;           // Virtual memory address of the segment
     size_t                      vm_size;            // Size of segment in virtual memory
-    size_t                      file_start;         // Absolute position in file
     size_t                      file_align;         // File alignment
     size_t                      file_size;          // File size
     struct ivm_list             sections;           // List of sections
@@ -86,7 +96,7 @@ enum ivm_section_type
     IVM_SECT_TEXT,
     IVM_SECT_CODE,
     IVM_SECT_BYTECODE,
-    IVM_SECT_BSS,
+    IVM_SECT_BSS,       // Zero-initialised, takes no file space
     IVM_SECT_CONST
 };
 
@@ -122,7 +132,8 @@ int ivm_image_create(struct ivm_image** image,
 
 /*
  * Delete image and free resources.
- * This will also recursively destroy any associated segments and sections.
+ * This will also destroy any associated segments and sections, which are
+ * allocated from arenas owned by the image.
  */
 void ivm_image_remove(struct ivm_image* image);
 
@@ -130,6 +141,8 @@ void ivm_image_remove(struct ivm_image* image);
 
 /*
  * Create a memory segment and add it to the image.
+ * Segments are placed in the file in the order they are added. Returns
+ * EFAULT if the memory range overlaps another segment.
  */
 int ivm_image_add_segment(struct ivm_segment** segment, 
                           struct ivm_image* image, 
@@ -141,8 +154,41 @@ int ivm_image_add_segment(struct ivm_segment** segment,
 
 
 
+/*
+ * Segment to create with ivm_image_add_segments, with the same meaning as
+ * the arguments of ivm_image_add_segment.
+ */
+struct ivm_segment_info
+{
+    enum ivm_segment_type       type;               // Segment type
+    size_t                      vm_align;           // VM alignment
+    uint64_t                    vm_start;           // Virtual memory address of the segment
+    size_t                      vm_size;            // Size of segment in virtual memory
+    size_t                      file_align;         // File alignment
+};
+
+
+
+/*
+ * Create many memory segments at once and add them to the image, in the
+ * given order. The new segments are sorted once and merged into the index
+ * of existing segments, instead of inserting them one at a time. If
+ * segments is not NULL, it receives the segment created for each entry.
+ * Returns EFAULT and adds nothing if any memory ranges overlap.
+ */
+int ivm_image_add_segments(struct ivm_segment** segments,
+                           struct ivm_image* image,
+                           const struct ivm_segment_info* info,
+                           size_t count);
+
+
+
 /*
  * Create a section and add it to a segment.
+ * Sections of type IVM_SECT_BSS have no contents and take no space in the
+ * image file, the data pointer is ignored and the memory is zero when the
+ * image is loaded. They must come after any sections with contents in the
+ * segment, adding another kind of section after them returns EINVAL.
  */
 int ivm_image_add_section(struct ivm_section** section,
                           struct ivm_segment* segment,
@@ -154,6 +200,8 @@ int ivm_image_add_section(struct ivm_section** section,
 
 /*
  * Load the code of the Ibsen virtual machine in to memory.
+ * Returns EINVAL if the VM is specialized for a different frame geometry
+ * than the image, which also applies to the other functions loading VM code.
  */
 int ivm_image_load_vm(struct ivm_image* image,
                       const struct ivm_vm_functions* funcs,
@@ -161,6 +209,60 @@ int ivm_image_load_vm(struct ivm_image* image,
 
 
 
+/*
+ * Load the code of the Ibsen virtual machine from a static library or
+ * relocatable object file.
+ * The VM functions are found through the symbol table, and all code and
+ * read-only data they refer to is copied and relocated to the code segment.
+ */
+int ivm_image_load_vm_from_object(struct ivm_image* image, const char* filename, uint64_t code_addr);
+
+
+
+/*
+ * Reference the code of the Ibsen virtual machine from a shared file instead
+ * of copying it into the image.
+ * The file must be written with ivm_image_write_shared_vm using the same VM
+ * functions and address. It is mapped by the kernel as the program
+ * interpreter of the image, so all images share one copy of the VM code in
+ * the page cache.
+ */
+int ivm_image_load_shared_vm(struct ivm_image* image,
+                             const struct ivm_vm_functions* funcs,
+                             uint64_t code_addr,
+                             const char* filename);
+
+
+
+/*
+ * Write the code of the Ibsen virtual machine to a file that can be shared
+ * by images created with ivm_image_load_shared_vm.
+ * The VM code finds its data at IVM_ENTRY, so all images using the shared
+ * file must reserve VM data at that address.
+ */
+int ivm_image_write_shared_vm(FILE* fp, const struct ivm_vm_functions* funcs, uint64_t code_addr);
+
+
+
+/*
+ * Same as ivm_image_load_shared_vm, with the VM code extracted from a static
+ * library or relocatable object file.
+ */
+int ivm_image_load_shared_vm_from_object(struct ivm_image* image,
+                                         const char* object,
+                                         uint64_t code_addr,
+                                         const char* filename);
+
+
+
+/*
+ * Same as ivm_image_write_shared_vm, with the VM code extracted from a static
+ * library or relocatable object file.
+ */
+int ivm_image_write_shared_vm_from_object(FILE* fp, const char* object, uint64_t code_addr);
+
+
+
 /*
  * Load the code of the Ibsen virtual machine in to memory from file.
  */
@@ -177,6 +279,16 @@ int ivm_image_reserve_vm_data(struct ivm_image* image,
 
 
 
+/*
+ * Get the position of the data of a segment in the image file, relative to
+ * the end of the file headers. Segment data is placed in the order the
+ * segments were added, so sections can be added to any segment at any
+ * time without moving the others.
+ */
+size_t ivm_image_segment_offset(const struct ivm_image* image, const struct ivm_segment* segment);
+
+
+
 /*
  * Write image to file.
  */
@@ -184,6 +296,25 @@ int ivm_image_write(FILE* fp, const struct ivm_image* image, const void* bytecod
 
 
 
+/*
+ * Same as ivm_image_write, but write the section data of a regular file
+ * from several threads. Every section already has its place in the file,
+ * so the data is split into chunks of a few megabytes that the threads
+ * write with pwritev in any order. A thread count of 0 uses one thread per
+ * online CPU. Files that can not seek are written by the calling thread.
+ */
+int ivm_image_write_parallel(FILE* fp, const struct ivm_image* image, const void* bytecode, size_t num_threads);
+
+
+
+/*
+ * Get the size of the file headers preceding the segment data when the
+ * image is written to file.
+ */
+size_t ivm_image_header_size(const struct ivm_image* image);
+
+
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,95 @@
+#ifndef __IBSENVM_INSTANCE_H__
+#define __IBSENVM_INSTANCE_H__
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <ivm_vm.h>
+#include <ivm_image.h>
+
+
+
+/*
+ * Virtual machine hosted in the calling process.
+ *
+ * The segments of the image are mapped directly at their addresses in the
+ * calling process, and the VM runs on a thread of its own. Since segments
+ * are mapped at fixed addresses, only one instance of an image can exist at
+ * a time. Shared VM code is mapped from its file.
+ */
+struct ivm_instance
+{
+    struct ivm_data*            data;               // Mapped VM data
+    int64_t                     (*vm)(struct ivm_data*); // Mapped VM entry
+    size_t                      num_mappings;       // Number of mapped segments
+    void**                      mappings;           // Addresses of mapped segments
+    size_t*                     mapping_sizes;      // Sizes of mapped segments
+    pthread_t                   thread;             // Thread running the VM
+    pthread_mutex_t             lock;               // Protects the fields below
+    pthread_cond_t              cond;               // Signals changes of state
+    bool                        running;            // VM is running
+    bool                        quit;               // Thread should terminate
+    uint64_t                    steps;              // Pending run request (0 = run until stopped)
+    bool                        pending;            // A run request is pending
+    int64_t                     status;             // Reason the VM last returned
+};
+
+
+
+/*
+ * Map an image into the calling process and start the VM thread.
+ * The VM does not execute any instructions before it is told to run or step.
+ * Returns EEXIST if the image addresses are already in use.
+ */
+int ivm_instance_create(struct ivm_instance** instance, const struct ivm_image* image, const void* bytecode);
+
+
+
+/*
+ * Stop the VM thread and unmap the image.
+ */
+void ivm_instance_remove(struct ivm_instance* instance);
+
+
+
+/*
+ * Run the VM until it halts, aborts, is paused or the guest requests a
+ * snapshot. Returns immediately, use ivm_instance_wait to wait for the VM.
+ */
+int ivm_instance_run(struct ivm_instance* instance);
+
+
+
+/*
+ * Execute the given number of instructions.
+ * Returns immediately, use ivm_instance_wait to wait for the VM.
+ */
+int ivm_instance_step(struct ivm_instance* instance, uint64_t steps);
+
+
+
+/*
+ * Ask a running VM to stop after the current instruction.
+ */
+int ivm_instance_pause(struct ivm_instance* instance);
+
+
+
+/*
+ * Wait for the VM to stop.
+ * The reason the VM stopped (IVM_EXIT_*) is stored in status, and the
+ * registers are copied so that the exit status of a halted guest is in R00,
+ * which is r[wb] in the register file.
+ */
+int ivm_instance_wait(struct ivm_instance* instance, int64_t* status, struct ivm_registers* registers);
+
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* __IBSENVM_INSTANCE_H__ */
@@ -19,7 +19,7 @@ enum
 {
     IVM_INTR_DEBUG                  = 0x0,  // Reserved for future use
     IVM_INTR_USER_DEFINED           = 0x1,  // User defined interrupt vector
-    IVM_INTR_RESERVED0              = 0x2,  // Reserved for future use
+    IVM_INTR_DOORBELL               = 0x2,  // Another VM rang the doorbell of a shared channel
     IVM_INTR_RESERVED1              = 0x3,  // Reserved for future use
     IVM_INTR_RESERVED2              = 0x4,  // Reserved for future use
     IVM_INTR_RESERVED3              = 0x5,  // Reserved for future use
@@ -42,7 +42,7 @@ enum
  * Non-maskable interrupts, except syscalls, will cause the virtual machine to abort.
  */
 #define IVM_INTR_NONMASKABLE \
-    ((1 << IVM_INTR_ILLEGAL_STATE) | (1 << IVM_INTR_EXTERNAL_EVENT) | (1 << IVM_INTR_EXCEPTION_OVERFLOW) | (1 << IVM_INTR_PROTECTION_FAULT) | (1 << IVM_INTR_CALL_SYSCALL))
+    ((1 << IVM_INTR_ILLEGAL_STATE) | (1 << IVM_INTR_EXTERNAL_EVENT) | (1 << IVM_INTR_EXCEPTION_OVERFLOW) | (1 << IVM_INTR_PROTECTION_FAULT) | (1 << IVM_INTR_SYSCALL))
 
 
 #define IVM_INTR_IS_MASKABLE(i) !(IVM_INTR_NONMASKABLE & (1 << (i)))
@@ -35,6 +35,7 @@ enum
     IVM_FRAME_ATTR_ALLOC_ON_FAULT   = 0x0010, // Frame should be loaded if not present
     IVM_FRAME_ATTR_ZERO_ON_ALLOC    = 0x0020, // Frame should be zeroed out on load
     IVM_FRAME_ATTR_STALE            = 0x0040, // Frame contains data that must be saved on free
+    IVM_FRAME_ATTR_SHARED           = 0x0080, // Frame is host memory shared with other VMs
 };
 
 
@@ -0,0 +1,149 @@
+#ifndef __IBSENVM_NATIVE_H__
+#define __IBSENVM_NATIVE_H__
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <ivm_vm.h>
+#include <ivm_memory.h>
+#include <ivm_image.h>
+
+
+
+/*
+ * Native host function.
+ *
+ * Guests call native functions with NCALL, which calls the function in the
+ * given slot of the call table directly from the VM loop, without raising an
+ * interrupt or pushing VM state. The function gets the registers of the
+ * current window (R00-RFF), the frame table and the VM data, and returns its
+ * results in the registers. It can raise an interrupt by setting its bit in
+ * vm->regs.intr.
+ *
+ * Native functions run on the thread and stack of the VM, so they are only
+ * usable when the VM is hosted in the calling process, with ivm_instance or
+ * ivm_pool.
+ */
+typedef void (*ivm_native_t)(uint32_t* r, struct ivm_frame* ftable, struct ivm_data* vm);
+
+
+
+/*
+ * Put a native function in a slot of the call table of an image.
+ * Slots are chosen by the host, so bytecode can refer to them by number.
+ * Instances and pools created from the image afterwards inherit the
+ * function. Snapshots and image files do not, since function addresses are
+ * only valid in the process that registered them. Passing NULL clears the slot.
+ * Returns EINVAL if the slot is out of range.
+ */
+int ivm_image_set_native(struct ivm_image* image, uint32_t slot, ivm_native_t func);
+
+
+
+/*
+ * Get a host pointer to guest memory from a native function.
+ * Every frame of the span must be loaded and allow the given access, and
+ * frames must follow each other in host memory, which they do for instances
+ * and pools. Writing marks the frames as stale. The address is not relative
+ * to BP.
+ * Returns NULL if the span can not be accessed.
+ */
+static inline void* ivm_native_memory(const struct ivm_data* vm, uint32_t addr, uint32_t len, uint16_t access)
+{
+    if ((uint64_t) addr + len > UINT32_MAX + 1ULL) {
+        return NULL;
+    }
+
+    uint64_t idx = IVM_FNUM(addr, vm->fshift);
+    uint64_t end = IVM_FNUM(addr + (len > 0 ? len - 1 : 0), vm->fshift);
+
+    if (end >= vm->fnum) {
+        return NULL;
+    }
+
+    uint64_t start = vm->ftable[idx].addr;
+
+    for (uint64_t i = idx; i <= end; ++i) {
+        struct ivm_frame* frame = &vm->ftable[i];
+
+        if (!(frame->attr & IVM_FRAME_ATTR_ALLOC) || (frame->attr & access) != access) {
+            return NULL;
+        }
+
+        if (frame->addr != start + (i - idx) * vm->fsize) {
+            return NULL;
+        }
+
+        if (access & IVM_FRAME_ATTR_WRITE) {
+            frame->attr |= IVM_FRAME_ATTR_STALE;
+        }
+    }
+
+    return ((unsigned char*) start) + IVM_FOFF(addr, vm->fshift);
+}
+
+
+
+/*
+ * Call table slots of the intrinsics added by ivm_image_add_intrinsics.
+ * Arguments are passed in R01-R03 and the status is returned in R00.
+ * Addresses are relative to BP, like for LOAD and STORE.
+ *
+ * The hash map maps 32-bit keys to 32-bit values with open addressing and
+ * linear probing. It lives in guest memory at an 8-byte aligned address, and
+ * takes IVM_MAP_SIZE(capacity) bytes: a header, one control byte per slot
+ * and the key/value slots. Control bytes are probed before slots are
+ * touched, so a lookup usually reads one cache line of control bytes and one
+ * slot. The map does not grow, INSERT returns IVM_NATIVE_FULL when it is
+ * seven-eighths full and the guest must move the entries to a larger map.
+ *
+ * SORT sorts an array of records in place by the unsigned 32-bit word at the
+ * start of each record. The sort is stable.
+ */
+enum
+{
+    IVM_NATIVE_MAP_INIT     = 0,    // Init map at R01 with R02 slots (power of two, at least 8)
+    IVM_NATIVE_MAP_INSERT   = 1,    // Insert or update key R02 with value R03 in map at R01
+    IVM_NATIVE_MAP_LOOKUP   = 2,    // Look up key R02 in map at R01, value is returned in R03
+    IVM_NATIVE_MAP_ERASE    = 3,    // Erase key R02 from map at R01
+    IVM_NATIVE_SORT         = 4,    // Sort R02 records of R03 bytes (multiple of 4) at R01
+    IVM_NATIVE_CHANNEL_RING = 5,    // Ring the doorbell of the channel at R01, see ivm_channel.h
+};
+
+
+
+/*
+ * Status returned by intrinsics in R00.
+ */
+enum
+{
+    IVM_NATIVE_OK           = 0,    // Operation succeeded
+    IVM_NATIVE_NOT_FOUND    = 1,    // Key is not in the map
+    IVM_NATIVE_FULL         = 2,    // Map is full
+    IVM_NATIVE_INVALID      = 3,    // Invalid arguments or map header
+    IVM_NATIVE_NO_MEMORY    = 4,    // Host could not allocate memory
+};
+
+
+
+/*
+ * Size in bytes of a hash map with the given number of slots.
+ */
+#define IVM_MAP_SIZE(capacity) (16 + (capacity) + 8 * (capacity))
+
+
+
+/*
+ * Register the hash map, sort and channel intrinsics in their call table
+ * slots.
+ */
+int ivm_image_add_intrinsics(struct ivm_image* image);
+
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* __IBSENVM_NATIVE_H__ */
@@ -0,0 +1,55 @@
+#ifndef __IBSENVM_OBJECT_H__
+#define __IBSENVM_OBJECT_H__
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <ivm_entry.h>
+
+
+
+/*
+ * Code of the Ibsen virtual machine extracted from an object file.
+ *
+ * The code starts with a jump to the loader, followed by every code and
+ * read-only data section the VM functions refer to. All relocations are
+ * applied, so the code can only run at the address it was extracted for.
+ */
+struct ivm_vm_code
+{
+    char                id[16];     // Identifier string
+    struct ivm_vm_geometry geometry;// Specialized frame geometry
+    uint64_t            addr;       // Address the code is relocated to
+    size_t              size;       // Size of the code
+    void*               code;       // Relocated code and read-only data
+    struct ivm_function interrupt;  // Interrupt routine
+    struct ivm_function vm;         // Virtual machine code
+    struct ivm_function loader;     // Loader
+};
+
+
+
+/*
+ * Extract the VM functions from a static library or relocatable object file.
+ * The functions are found through the symbol table, so the VM can be built
+ * with any optimization level.
+ * Returns ENOENT if a symbol can not be resolved, and ENOTSUP if the VM code
+ * needs writable data or uses an unsupported relocation.
+ */
+int ivm_vm_code_extract(struct ivm_vm_code** code, const char* filename, uint64_t addr);
+
+
+
+/*
+ * Release extracted VM code.
+ */
+void ivm_vm_code_remove(struct ivm_vm_code* code);
+
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* __IBSENVM_OBJECT_H__ */
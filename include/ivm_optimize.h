@@ -0,0 +1,119 @@
+#ifndef __IBSENVM_OPTIMIZE_H__
+#define __IBSENVM_OPTIMIZE_H__
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <ivm_profile.h>
+
+
+
+/*
+ * Optimization passes, in the order they are run.
+ */
+enum ivm_optimize_pass
+{
+    IVM_PASS_JUMPS,         // Jump threading and removal of jumps to the next instruction
+    IVM_PASS_CONSTANTS,     // Constant propagation through SET, MOVE and arithmetic
+    IVM_PASS_STRENGTH,      // Multiplication and division by constants
+    IVM_PASS_LOADS,         // Loads of values that are already in a register
+    IVM_PASS_DEAD_CODE,     // Register writes that are overwritten before they are read
+    IVM_PASS_COUNT
+};
+
+
+
+/*
+ * Outcome of an optimization.
+ */
+struct ivm_optimize_report
+{
+    bool                    applied;                    // False if the bytecode has computed jumps
+    size_t                  removed[IVM_PASS_COUNT];    // Instructions removed by each pass
+    size_t                  rewritten[IVM_PASS_COUNT];  // Instructions replaced by cheaper ones
+    size_t                  padding;                    // Instructions added to keep jump targets in place
+    size_t                  num_regions;                // Straight-line regions between jump targets
+    size_t                  num_changed;                // Regions that were rewritten
+};
+
+
+
+/*
+ * Optimize bytecode loaded at guest address 0, in place.
+ *
+ * Bytecode addresses data and jump targets by absolute address, so the
+ * optimizer never moves them. Instructions are only removed and rewritten
+ * within straight-line regions between jump targets, and the space freed
+ * at the end of a region is either unreachable or skipped with a jump.
+ * A region is only changed if fewer instructions are executed.
+ *
+ * This requires every jump target to be known, see ivm_bytecode_map, and
+ * constants that equal the address of an instruction are treated as jump
+ * targets as well. Bytecode with computed jumps is left alone. Registers
+ * are assumed to be visible to the host when the guest halts, but not when
+ * it is aborted or paused in the middle of a region. If the guest sets
+ * interrupt vectors, handlers may run between any two instructions and
+ * observe or change any register or memory, so no register values are
+ * known and only rewrites that do not depend on them are made. Code that
+ * reads or modifies its own instructions is not supported.
+ *
+ * Returns 0 on success, and EINVAL if the bytecode does not pass
+ * verification.
+ */
+int ivm_bytecode_optimize(struct ivm_optimize_report* report, void* bytecode, size_t size);
+
+
+
+/*
+ * Outcome of a code layout.
+ */
+struct ivm_layout_report
+{
+    bool                    applied;                    // False if the code can not be moved
+    size_t                  num_units;                  // Runs of code that fall through into each other
+    size_t                  num_moved;                  // Units placed at another address
+    size_t                  hot_bytes;                  // Size of the units that were executed
+    size_t                  frames_before;              // Frames with executed instructions before
+    size_t                  frames_after;               // Frames with executed instructions after
+};
+
+
+
+/*
+ * Reorder the code of bytecode loaded at guest address 0 by a profile of
+ * the same bytecode, in place, so that executed code is packed into as few
+ * frames as possible.
+ *
+ * Code is moved in units of basic blocks that fall through into each
+ * other, which keeps the size of the bytecode. The unit at the entry point
+ * stays first, followed by executed units in order of executed
+ * instructions per byte, the rest in their original order and then the
+ * unreachable bytes between them. Jumps,
+ * interrupt vectors and calls with a word operand are updated to their
+ * moved targets. The target of CALL is updated in the SET that loads it,
+ * which must be in the same region as the call, and such a constant is
+ * assumed to be a code address wherever it is used. Return addresses must
+ * be pushed by CALL, and data must follow the code.
+ *
+ * Bytecode is left alone if it has computed jumps, uses MOVEIP, or any
+ * target can not be updated. Returns 0 on success, and EINVAL if the
+ * bytecode does not pass verification or the profile does not match it.
+ */
+int ivm_bytecode_layout(struct ivm_layout_report* report, void* bytecode, size_t size, const struct ivm_profile* profile, size_t frame_size);
+
+
+
+/*
+ * Get the name of an optimization pass.
+ */
+const char* ivm_optimize_pass_name(enum ivm_optimize_pass pass);
+
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* __IBSENVM_OPTIMIZE_H__ */
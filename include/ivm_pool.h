@@ -0,0 +1,136 @@
+#ifndef __IBSENVM_POOL_H__
+#define __IBSENVM_POOL_H__
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <ivm_vm.h>
+#include <ivm_list.h>
+#include <ivm_image.h>
+#include <ivm_instance.h>
+
+
+
+/*
+ * Pre-initialized virtual machine context.
+ * A context holds a private copy of the VM data (registers, state stack and
+ * frame table) and of the guest memory, with all pointers rebased to the
+ * context's own memory.
+ *
+ * The virtual machine sets IVM_FRAME_ATTR_STALE on every frame it writes to,
+ * which allows a context to be reset by restoring only the dirty frames.
+ */
+struct ivm_context
+{
+    struct ivm_pool*            pool;               // Parent reference
+    struct ivm_list             list;               // Linked list node
+    struct ivm_data*            data;               // VM data of this context
+    unsigned char*              memory;             // Guest memory backing the frames
+    uint64_t*                   saved;              // Frames written before the last snapshot
+};
+
+
+
+/*
+ * Pool of virtual machine contexts.
+ * The pool keeps a pristine template of the VM data and guest memory that
+ * is used to reset contexts when they are released.
+ */
+struct ivm_pool
+{
+    struct ivm_data*            data;               // Pristine VM data
+    size_t                      data_size;          // Size of VM data
+    size_t                      data_offset_to_regs;  // Offset to registers
+    size_t                      data_offset_to_states; // Offset to states
+    size_t                      data_offset_to_ft;  // Offset to frame table
+    size_t                      data_offset_to_ct;  // Offset to call table
+    unsigned char*              memory;             // Pristine guest memory
+    size_t                      memory_size;        // Size of guest memory
+    uint64_t                    memory_start;       // Address of guest memory in the image
+    uint64_t*                   wide_code;          // Fixed-width code shared by all contexts
+    size_t                      num_contexts;       // Number of contexts in pool
+    size_t                      num_free;           // Number of contexts not in use
+    struct ivm_context*         contexts;           // Context descriptors
+    struct ivm_list             free;               // List of free contexts
+};
+
+
+
+/*
+ * Create a pool of VM contexts from an image.
+ * The image must have VM data reserved, and the bytecode is used as the
+ * initial content of the bytecode section.
+ */
+int ivm_pool_create(struct ivm_pool** pool,
+                    const struct ivm_image* image,
+                    const void* bytecode,
+                    size_t num_contexts);
+
+
+
+/*
+ * Delete pool and free resources.
+ * All contexts must be released before the pool is removed.
+ */
+void ivm_pool_remove(struct ivm_pool* pool);
+
+
+
+/*
+ * Take a pre-initialized context from the pool.
+ * Returns EAGAIN if all contexts are in use.
+ */
+int ivm_pool_acquire(struct ivm_context** context, struct ivm_pool* pool);
+
+
+
+/*
+ * Reset a context and return it to the pool.
+ */
+void ivm_pool_release(struct ivm_context* context);
+
+
+
+/*
+ * Reset a context to the pristine state.
+ * Only frames marked as stale, or written before a snapshot was taken, are
+ * restored, along with the registers and the rest of the VM data before the
+ * state stack.
+ */
+void ivm_context_reset(struct ivm_context* context);
+
+
+
+/*
+ * Run a context on the calling thread until the guest halts, aborts, is
+ * paused or has executed the given number of instructions (0 = no limit).
+ * The VM code is taken from an instance of the image the pool was created
+ * from, which has it mapped at the address it was linked for. Contexts can
+ * be executed on several threads at once, and independently of the
+ * instance itself.
+ * The reason the VM stopped (IVM_EXIT_*) is stored in status.
+ */
+int ivm_context_execute(struct ivm_context* context, const struct ivm_instance* instance, uint64_t steps, int64_t* status);
+
+
+
+/*
+ * Write data to the guest memory of a context and mark the frames as stale.
+ */
+int ivm_context_write(struct ivm_context* context, uint64_t addr, const void* data, size_t size);
+
+
+
+/*
+ * Read data from the guest memory of a context.
+ */
+int ivm_context_read(const struct ivm_context* context, uint64_t addr, void* data, size_t size);
+
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* __IBSENVM_POOL_H__ */
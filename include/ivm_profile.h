@@ -0,0 +1,143 @@
+#ifndef __IBSENVM_PROFILE_H__
+#define __IBSENVM_PROFILE_H__
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <ivm_vm.h>
+
+
+
+/*
+ * Profile file format version.
+ */
+#define IVM_PROFILE_VERSION     1
+
+
+
+/*
+ * Function entered by CALL or CALLW.
+ */
+struct ivm_profile_function
+{
+    uint32_t                addr;           // Entry point
+    uint32_t                reserved;
+    uint64_t                calls;          // Number of calls
+};
+
+
+
+/*
+ * Basic block, a run of instructions that is only entered at its first
+ * instruction and only left after its last.
+ */
+struct ivm_profile_block
+{
+    uint32_t                addr;           // Address of the first instruction
+    uint32_t                size;           // Size in bytes
+    uint64_t                count;          // Number of times the block was executed
+};
+
+
+
+/*
+ * Control transfer from one instruction to another that does not follow it,
+ * by a taken jump, call, return or interrupt. Transfers from the host have
+ * IVM_PROFILE_HOST as source.
+ */
+struct ivm_profile_edge
+{
+    uint32_t                from;           // Address of the instruction that transferred control
+    uint32_t                to;             // Address of the next instruction executed
+    uint64_t                count;          // Number of transfers
+};
+
+
+
+/*
+ * Execution profile of guest bytecode, sorted by address.
+ *
+ * Profiles are written as a header with the magic "IVMPROF", the version
+ * and the number of each record, followed by the functions, blocks and
+ * edges in host byte order.
+ */
+struct ivm_profile
+{
+    size_t                  num_functions;
+    struct ivm_profile_function* functions;
+    size_t                  num_blocks;
+    struct ivm_profile_block* blocks;
+    size_t                  num_edges;
+    struct ivm_profile_edge* edges;
+    uint64_t                lost;           // Transfers that were not recorded
+};
+
+
+
+/*
+ * Start recording control transfers of a VM that is not running.
+ * Only taken transfers are recorded, not every instruction. The table holds
+ * at least the given number of distinct transfers, transfers that do not
+ * fit are counted as lost. It must be released with ivm_profile_stop
+ * before the VM is removed. Returns EEXIST if the VM is already profiled.
+ */
+int ivm_profile_start(struct ivm_data* data, size_t capacity);
+
+
+
+/*
+ * Stop recording and discard the recorded transfers.
+ * The VM must not be running.
+ */
+void ivm_profile_stop(struct ivm_data* data);
+
+
+
+/*
+ * Build a profile from the transfers recorded by a VM that is not running,
+ * and the bytecode it ran. Block counts are derived from the transfers
+ * into and out of each block, by following the verified instructions
+ * between them. Returns EINVAL if the VM is not profiled or the bytecode
+ * does not pass verification.
+ */
+int ivm_profile_collect(struct ivm_profile** profile, const struct ivm_data* data, const void* bytecode, size_t size);
+
+
+
+/*
+ * Release a profile.
+ */
+void ivm_profile_remove(struct ivm_profile* profile);
+
+
+
+/*
+ * Write a profile to file.
+ */
+int ivm_profile_write(FILE* fp, const struct ivm_profile* profile);
+
+
+
+/*
+ * Read a profile from file.
+ * Returns EINVAL if the file is not a profile of this version.
+ */
+int ivm_profile_read(struct ivm_profile** profile, FILE* fp);
+
+
+
+/*
+ * Find the block that contains an address.
+ * Returns NULL if no executed or verified instruction is there.
+ */
+const struct ivm_profile_block* ivm_profile_find_block(const struct ivm_profile* profile, uint32_t addr);
+
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* __IBSENVM_PROFILE_H__ */
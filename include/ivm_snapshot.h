@@ -0,0 +1,54 @@
+#ifndef __IBSENVM_SNAPSHOT_H__
+#define __IBSENVM_SNAPSHOT_H__
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <ivm_image.h>
+#include <ivm_pool.h>
+
+
+
+/*
+ * Snapshot types.
+ *
+ * A full snapshot contains every allocated frame of the context.
+ *
+ * An incremental snapshot contains only the frames marked as stale since the
+ * previous snapshot. The remaining frames are marked to be loaded on fault
+ * from the parent image, which must be opened on the given file descriptor
+ * when the snapshot is started.
+ */
+enum ivm_snapshot_type
+{
+    IVM_SNAPSHOT_FULL,
+    IVM_SNAPSHOT_INCREMENTAL
+};
+
+
+
+/*
+ * Create an image from a running VM context.
+ *
+ * The new image contains the VM data, registers, state stack and frames of
+ * the context, and resumes execution where the snapshot was taken once it
+ * is written with ivm_image_write and started. The VM code is taken from the
+ * parent image, which is either the image the pool was created from or the
+ * previous snapshot of the same context.
+ *
+ * Taking a snapshot clears the stale attribute of the context's frames.
+ */
+int ivm_image_snapshot(struct ivm_image** snapshot,
+                       const struct ivm_image* parent,
+                       struct ivm_context* context,
+                       enum ivm_snapshot_type type,
+                       int parent_fd);
+
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* __IBSENVM_SNAPSHOT_H__ */
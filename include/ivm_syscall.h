@@ -16,6 +16,7 @@ enum
 {
     IVM_SYSCALL_WRITE               = 0x0000,   // Write to specified file descriptor
     IVM_SYSCALL_READ                = 0x0001,   // Read from specified file descriptor
+    IVM_SYSCALL_SNAPSHOT            = 0x0002,   // Request the host to take a snapshot of the VM
     // TODO: Open and close fd
     // TODO: mmap and munmap for allocating memory
 };
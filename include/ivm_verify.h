@@ -0,0 +1,103 @@
+#ifndef __IBSENVM_VERIFY_H__
+#define __IBSENVM_VERIFY_H__
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <ivm_image.h>
+
+
+
+/*
+ * Reasons for rejecting bytecode.
+ */
+enum ivm_verify_error
+{
+    IVM_VERIFY_OK,                  // Bytecode is well-formed
+    IVM_VERIFY_INVALID_OPCODE,      // Undefined opcode
+    IVM_VERIFY_TRUNCATED,           // Instruction or execution runs past the end of the bytecode
+    IVM_VERIFY_INVALID_OPERAND,     // Register range or native function slot out of bounds
+    IVM_VERIFY_INVALID_TARGET,      // Jump target outside the bytecode
+    IVM_VERIFY_OVERLAP,             // Jump target or instruction inside another instruction
+};
+
+
+
+/*
+ * Outcome of a verification pass.
+ */
+struct ivm_verify_result
+{
+    enum ivm_verify_error   error;              // First error found
+    uint32_t                offset;             // Offset of the offending instruction
+    size_t                  num_instructions;   // Number of reachable instructions
+    size_t                  num_dynamic;        // Jumps and calls with computed targets
+};
+
+
+
+/*
+ * Verify bytecode loaded at guest address 0.
+ *
+ * Every instruction reachable from the entry point is decoded, by following
+ * fall-through paths and jump targets that are known at link time. A target
+ * is known when its base register was set from constants (SET, ZERO, MOVE,
+ * MOVEIP, ADD, SUB) earlier in the same basic block, or on every path into
+ * it. Since asynchronous interrupts can run a handler between any two
+ * instructions, and the handler may change any register, no values are
+ * tracked at all if the bytecode contains a VECTOR instruction; every jump
+ * through a register then counts as computed. Code that is only reached through
+ * computed targets, such as function pointers, is not decoded, and these
+ * jumps are counted instead.
+ *
+ * Returns 0 if the bytecode is well-formed, EINVAL if it is rejected and
+ * another error code if verification could not be done.
+ */
+int ivm_bytecode_verify(struct ivm_verify_result* result, const void* bytecode, size_t size);
+
+
+
+/*
+ * Flags of each bytecode offset in the map of verified bytecode.
+ */
+enum
+{
+    IVM_MAP_START           = 0x01,     // A reachable instruction starts here
+    IVM_MAP_TARGET          = 0x02,     // Entry point, or target of a jump, call or interrupt vector
+};
+
+
+
+/*
+ * Verify bytecode and map its reachable instructions, with one entry per
+ * byte of bytecode. The map is only filled in if the bytecode is
+ * well-formed. Tools that rewrite bytecode must keep every target in place,
+ * and can only do so safely if the result counts no computed jumps.
+ */
+int ivm_bytecode_map(struct ivm_verify_result* result, const void* bytecode, size_t size, unsigned char* map);
+
+
+
+/*
+ * Verify the bytecode section of an image.
+ * The VM checks every instruction it executes regardless, since the guest
+ * can compute its IP and write its own code, so this only rejects bytecode
+ * that is known to be broken before it is shipped. The result may be NULL.
+ */
+int ivm_image_verify(struct ivm_image* image, const void* bytecode, struct ivm_verify_result* result);
+
+
+
+/*
+ * Get a description of a verification error.
+ */
+const char* ivm_verify_strerror(enum ivm_verify_error error);
+
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* __IBSENVM_VERIFY_H__ */
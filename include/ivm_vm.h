@@ -8,19 +8,113 @@
 #include <ivm_syscall.h>
 
 
+/*
+ * Register windows.
+ * CALLW slides the 256 visible registers up by IVM_WINDOW_SHIFT, so that the
+ * callee sees the caller's R10-RFF as R00-REF, and the caller's R00-R0F are
+ * preserved without being copied. Up to IVM_WINDOW_REGS / IVM_WINDOW_SHIFT
+ * windows are kept in the register file. On overflow, the oldest window and
+ * its return address are spilled to guest memory at the window spill
+ * pointer, and filled again by RETW.
+ */
+#define IVM_WINDOW_SHIFT    16
+#define IVM_WINDOW_REGS     128
+#define IVM_WINDOW_NUM      (IVM_WINDOW_REGS / IVM_WINDOW_SHIFT)
+
+
+
+/*
+ * Size in bytes of a window spilled to guest memory.
+ */
+#define IVM_WINDOW_SPILL_SIZE   (4 * (IVM_WINDOW_SHIFT + 1))
+
+
+
 /*
  * Registers used by the Ibsen virtual machine.
+ * The registers used by every instruction come first, so that they fit in
+ * the first cache line of struct ivm_data.
+ * The visible registers R00-RFF are r[wb] to r[wb + 255].
  */
-struct __attribute__((aligned(16))) ivm_registers
+struct __attribute__((aligned(8))) ivm_registers
 {
     uint32_t ip;        // Current instruction pointer/program counter
-    uint32_t sb;        // Stack base pointer
-    uint16_t sp;        // Current stack pointer
+    uint32_t sp;        // Current stack pointer
     uint32_t bp;        // Memory base offset
-    uint16_t imask;     // Masked interrupts
     uint16_t intr;      // Interrupts
+    uint16_t imask;     // Masked interrupts
+    uint32_t sb;        // Stack base pointer
+    uint32_t wb;        // Register window base
+    uint32_t ws;        // Window spill pointer
+    uint32_t wn;        // Number of spilled windows
+    uint32_t r[256 + IVM_WINDOW_REGS];  // General purpose registers
+    uint32_t wret[IVM_WINDOW_NUM];      // Return addresses of windows
     uint32_t iv[16];    // Interrupt vectors
-    uint32_t r[256];    // General purpose registers
+};
+
+
+
+/*
+ * Number of cached frame translations.
+ * One entry is used for instruction fetches and one for data accesses.
+ */
+#define IVM_TLB_SIZE    2
+
+
+
+/*
+ * Cached translation of a guest frame to a host address.
+ * Write access is only cached for frames that are already marked stale.
+ */
+struct ivm_tlb_entry
+{
+    uint32_t    tag;    // Frame number plus one, zero if the entry is empty
+    uint16_t    attr;   // Frame attributes
+    uint16_t    reserved;
+    uint64_t    addr;   // Host address of the frame
+};
+
+
+
+/*
+ * Number of cached branch targets, must be a power of two.
+ */
+#define IVM_BTC_SIZE    64
+
+
+
+/*
+ * Cached location of the target of a taken branch.
+ * Entries are indexed by the address of the branch and only hit if both
+ * the branch and its target match, so computed jumps and calls that go to
+ * the same place as last time skip the frame table lookup. Only targets
+ * where the longest instruction fits in the rest of the frame are cached.
+ */
+struct ivm_btc_entry
+{
+    uint64_t                key;    // Target address shifted up 32 bits, ored with the branch address plus one
+    uint64_t                addr;   // Host address of the target instruction
+    struct ivm_tlb_entry    tlb;    // Translation of the target frame
+};
+
+
+
+/*
+ * Source address of transfers from the host, when the VM starts running.
+ */
+#define IVM_PROFILE_HOST    0xffffffff
+
+
+
+/*
+ * Number of times control went from one instruction to another that does
+ * not follow it, recorded by the VM while profiling, see ivm_profile.h.
+ * Entries are found by hashing the key, and are empty if the count is 0.
+ */
+struct ivm_profile_entry
+{
+    uint64_t    key;    // Target address shifted up 32 bits, ored with the source address
+    uint64_t    count;  // Number of transfers
 };
 
 
@@ -34,7 +128,10 @@ struct __attribute__((aligned (16))) ivm_state
     uint8_t  opcode;        // Instruction opcode
     uint8_t  num_operands;  // Operand count
     uint8_t  operands[4];   // Operands
+    uint8_t  intr;          // Interrupt being handled
     uint32_t word;          // Constant
+    uint32_t ip;            // Interrupted instruction pointer
+    uint32_t ret;           // R00 of the interrupted code
 };
 
 
@@ -53,24 +150,103 @@ enum
 
 
 
+/*
+ * Reasons for the virtual machine to return to its caller.
+ */
+enum
+{
+    IVM_EXIT_HALT           = 0x00,     // Guest executed HALT, exit status is in R00
+    IVM_EXIT_BUDGET         = 0x01,     // Instruction budget is exhausted
+    IVM_EXIT_PAUSE          = 0x02,     // Host raised IVM_INTR_EXTERNAL_EVENT
+    IVM_EXIT_SNAPSHOT       = 0x03,     // Guest requested a snapshot with IVM_SYSCALL_SNAPSHOT
+    IVM_EXIT_ABORT          = 0x04,     // Unhandled interrupt, the cause is left in the interrupt bits
+};
+
+
+
+/*
+ * Image flags.
+ */
+enum
+{
+    IVM_FLAG_ZYGOTE         = 0x0001,   // Run as fork-server, see ivm_zygote.h
+    IVM_FLAG_WIDE           = 0x0004,   // Fetch from fixed-width code, see ivm_encoding.h
+};
+
+
+
+/*
+ * Number of slots in the native function table, see ivm_native.h.
+ */
+#define IVM_CTABLE_SIZE     64
+
+
+
+/*
+ * Host CPU features, detected by the VM the first time it runs.
+ */
+enum
+{
+    IVM_CPU_DETECTED        = 0x0001,   // Features have been detected
+    IVM_CPU_AVX2            = 0x0002,   // AVX2 can be used
+};
+
+
+
 /*
  * Main data structure for the Ibsen virtual machine.
+ *
+ * The first cache line holds everything the VM touches on every
+ * instruction: the frame table pointer, the instruction budget, the
+ * translation cache and the IP, SP, BP and interrupt registers. The rest of
+ * the registers follow, and data that is only used by the host or on slow
+ * paths is placed after them.
  */
-struct __attribute__((aligned (16))) ivm_data
+struct __attribute__((aligned (64))) ivm_data
 {
+    struct ivm_frame*       ftable;     // Frame table pointer
+    uint64_t                steps;      // Instructions to execute before returning (0 = no limit)
+    struct ivm_tlb_entry    tlb[IVM_TLB_SIZE]; // Cached frame translations
+    struct ivm_registers    regs;       // Virtual machine registers
     char                    id[16];     // Identifier string
     uint64_t                vm_addr;    // Address to the virtual machine
-    struct ivm_registers*   registers;  // Virtual machine registers
+    uint64_t                flags;      // Image flags
+    uint64_t                cpu;        // Host CPU features
+    struct ivm_registers*   registers;  // Address of regs where the VM runs
     ivm_interrupt_t         interrupt;  // Interrupt routine
     size_t                  state_size; // Maximum size of the internal state stack
     size_t                  state_pos;  // Internal state stack position
     size_t                  fshift;     // Frame shift
     size_t                  fsize;      // Frame size
     size_t                  fnum;       // Number of frames
-    struct ivm_frame*       ftable;     // Frame table pointer
     struct ivm_state*       states;     // Internal state stack
-    uint64_t*               ctable;     // System call table
+    uint64_t*               ctable;     // Native function table
+    const uint64_t*         wcode;      // Fixed-width code (IVM_FLAG_WIDE)
+    uint64_t                wsize;      // Number of fixed-width instructions
+    struct ivm_btc_entry    btc[IVM_BTC_SIZE]; // Cached branch targets
+    struct ivm_profile_entry* ptable;   // Recorded control transfers (NULL = not profiling)
+    uint64_t                psize;      // Number of entries in ptable, a power of two
+    uint64_t                plost;      // Transfers not recorded because ptable was full
 };
 
 
+
+
+/*
+ * Invalidate cached frame translations and branch targets.
+ * The host must do this after changing the frame table or clearing stale
+ * frames of a VM that is not running.
+ */
+static inline void ivm_flush_tlb(struct ivm_data* data)
+{
+    for (int i = 0; i < IVM_TLB_SIZE; ++i) {
+        data->tlb[i].tag = 0;
+    }
+
+    for (int i = 0; i < IVM_BTC_SIZE; ++i) {
+        data->btc[i].key = 0;
+    }
+}
+
+
 #endif /* __IBSENVM_VIRTUAL_MACHINE_H__ */
@@ -0,0 +1,75 @@
+#ifndef __IBSENVM_ZYGOTE_H__
+#define __IBSENVM_ZYGOTE_H__
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+
+
+/*
+ * File descriptor of the control socket in a fork-server.
+ */
+#define IVM_ZYGOTE_FD           3
+
+
+
+/*
+ * Maximum number of arguments passed in a launch request.
+ */
+#define IVM_ZYGOTE_MAX_ARGS     16
+
+
+
+/*
+ * Launch request sent over the control socket.
+ *
+ * The request must be accompanied by three file descriptors (SCM_RIGHTS)
+ * that replace standard input, output and error in the child. The arguments
+ * are copied to the general purpose registers R00 to R(num_args - 1).
+ *
+ * The fork-server replies with the process identifier of the child.
+ */
+struct ivm_zygote_request
+{
+    uint32_t    num_args;                       // Number of arguments
+    uint32_t    args[IVM_ZYGOTE_MAX_ARGS];      // Argument values
+};
+
+
+
+/*
+ * Reply sent by the fork-server for every launch request.
+ */
+struct ivm_zygote_reply
+{
+    int32_t     pid;        // Process identifier of the child, or negative error code
+};
+
+
+
+/*
+ * Start an image built with IVM_FLAG_ZYGOTE as a fork-server.
+ * The fork-server initializes the VM once and then waits for launch requests
+ * on the control socket.
+ */
+int ivm_zygote_start(pid_t* pid, int* control, const char* filename);
+
+
+
+/*
+ * Ask a fork-server to clone the initialized VM.
+ * The child resumes with the given file descriptors as standard input,
+ * output and error, and with the arguments in its registers.
+ */
+int ivm_zygote_spawn(pid_t* child, int control, const int fds[3], const uint32_t* args, size_t num_args);
+
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* __IBSENVM_ZYGOTE_H__ */
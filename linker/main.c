@@ -2,65 +2,376 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <getopt.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
 #include <ivm_vm.h>
 #include <ivm_image.h>
+#include <ivm_verify.h>
+#include <ivm_optimize.h>
+#include <ivm_encoding.h>
+#include <ivm_profile.h>
+#include <ivm_instance.h>
+
+
+/*
+ * Frame geometry of the image.
+ */
+#define STATE_DEPTH     32
+#define FRAME_SIZE      0x400
+#define FRAME_COUNT     256
+
+
+
+/*
+ * Address of the fixed-width code, below the VM data.
+ */
+#define WIDE_CODE_ADDR  0x70000000
+
+
+
+/*
+ * Number of distinct control transfers recorded by a profiling run.
+ */
+#define PROFILE_SIZE    4096
+
+
+
+/*
+ * Pick the VM build specialized for the frame geometry of the image, if
+ * there is one.
+ */
+static const char* select_vm_object(size_t num_states, size_t frame_size, size_t num_frames)
+{
+    if (num_states == IVM_STATE_DEPTH && frame_size == IVM_FRAME_SIZE && num_frames == IVM_FRAME_COUNT) {
+        return IVM_VM_OBJECT_FIXED;
+    }
+
+    return IVM_VM_OBJECT;
+}
+
 
 
 int print_usage(char** argv) {
-    fprintf(stderr, "Usage: %s output\n", argv[0]);
+    fprintf(stderr, "Usage: %s [-z] [-s] [-n] [-O] [-w] [-c path] [-p path] [-P path] [-j threads] [-i path] [-m path] output\n", argv[0]);
+    fprintf(stderr, "       %s [-m path] -V output\n", argv[0]);
+    fprintf(stderr, "  -z         run image as fork-server\n");
+    fprintf(stderr, "  -s         use shared VM code instead of copying it into the image\n");
+    fprintf(stderr, "  -n         do not verify the bytecode\n");
+    fprintf(stderr, "  -O         optimize the bytecode\n");
+    fprintf(stderr, "  -w         convert the bytecode to the fixed-width encoding\n");
+    fprintf(stderr, "  -c path    cache fixed-width code in directory path (implies -w)\n");
+    fprintf(stderr, "  -p path    lay out the bytecode by the profile in path\n");
+    fprintf(stderr, "  -P path    run the image once and write its profile to path\n");
+    fprintf(stderr, "  -j threads write the image with threads threads (0 = one per CPU, default 1)\n");
+    fprintf(stderr, "  -i path    location of shared VM code (default %s)\n", IVM_VM_PATH);
+    fprintf(stderr, "  -m path    library or object file to extract VM code from (default %s)\n", select_vm_object(STATE_DEPTH, FRAME_SIZE, FRAME_COUNT));
+    fprintf(stderr, "  -V         write shared VM code to output\n");
     return 1;
 }
 
+
+
+static int write_shared_vm(const char* output, const char* vm_object)
+{
+    FILE* fp = fopen(output, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "%s\n", strerror(errno));
+        return errno;
+    }
+
+    int result = ivm_image_write_shared_vm_from_object(fp, vm_object, 0x400000);
+    if (result != 0) {
+        fprintf(stderr, "Failed to write shared VM code: %s\n", strerror(result));
+    }
+
+    fclose(fp);
+    return result;
+}
+
+
+static int layout_bytecode(const char* path, void* bytecode, size_t size)
+{
+    struct ivm_profile* profile;
+    struct ivm_layout_report report;
+
+    FILE* fp = fopen(path, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return errno;
+    }
+
+    int result = ivm_profile_read(&profile, fp);
+    fclose(fp);
+    if (result != 0) {
+        fprintf(stderr, "Failed to read profile: %s\n", strerror(result));
+        return result;
+    }
+
+    result = ivm_bytecode_layout(&report, bytecode, size, profile, FRAME_SIZE);
+    ivm_profile_remove(profile);
+    if (result != 0) {
+        fprintf(stderr, "Failed to lay out bytecode: %s\n", strerror(result));
+        return result;
+    }
+    else if (!report.applied) {
+        fprintf(stderr, "Bytecode can not be moved, layout not changed\n");
+    }
+    else {
+        fprintf(stderr, "%zu of %zu units moved, %zu hot bytes in %zu frames (was %zu)\n",
+                report.num_moved, report.num_units, report.hot_bytes, report.frames_after, report.frames_before);
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Run the image once and write the profile of its bytecode.
+ */
+static int write_profile(const char* path, const struct ivm_image* image, const void* bytecode, size_t size)
+{
+    struct ivm_instance* instance;
+    struct ivm_profile* profile;
+    int64_t status;
+
+    int result = ivm_instance_create(&instance, image, bytecode);
+    if (result != 0) {
+        fprintf(stderr, "Failed to run image: %s\n", strerror(result));
+        return result;
+    }
+
+    result = ivm_profile_start(instance->data, PROFILE_SIZE);
+    if (result == 0) {
+        ivm_instance_run(instance);
+        ivm_instance_wait(instance, &status, NULL);
+        result = ivm_profile_collect(&profile, instance->data, bytecode, size);
+        ivm_profile_stop(instance->data);
+    }
+    ivm_instance_remove(instance);
+
+    if (result != 0) {
+        fprintf(stderr, "Failed to profile bytecode: %s\n", strerror(result));
+        return result;
+    }
+
+    if (profile->lost > 0) {
+        fprintf(stderr, "Profile table is full, %llu transfers lost\n", (unsigned long long) profile->lost);
+    }
+
+    FILE* fp = fopen(path, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        ivm_profile_remove(profile);
+        return errno;
+    }
+
+    result = ivm_profile_write(fp, profile);
+    fclose(fp);
+    ivm_profile_remove(profile);
+    if (result != 0) {
+        fprintf(stderr, "Failed to write profile: %s\n", strerror(result));
+    }
+
+    return result;
+}
+
+
+
 int main(int argc, char** argv)
 {
     int result;
+    int opt;
+    uint64_t flags = 0;
+    bool shared = false;
+    bool write_vm = false;
+    bool verify = true;
+    bool optimize = false;
+    bool wide = false;
+    long num_threads = 1;
+    const char* cache_dir = NULL;
+    const char* profile_path = NULL;
+    const char* record_path = NULL;
+    const char* vm_path = IVM_VM_PATH;
+    const char* vm_object = select_vm_object(STATE_DEPTH, FRAME_SIZE, FRAME_COUNT);
 
-    if (argc != 2) {
-        return print_usage(argv);
-    } else {
-        if ( strcmp(argv[1], "-h") == 0) {
-            return print_usage(argv);
-        }
-        if ( strcmp(argv[1], "-u") == 0) {
-            return print_usage(argv);
+    while ((opt = getopt(argc, argv, "hzsnOwc:p:P:j:i:m:V")) != -1) {
+        switch (opt) {
+            case 'z':
+                flags |= IVM_FLAG_ZYGOTE;
+                break;
+
+            case 's':
+                shared = true;
+                break;
+
+            case 'n':
+                verify = false;
+                break;
+
+            case 'O':
+                optimize = true;
+                break;
+
+            case 'w':
+                wide = true;
+                break;
+
+            case 'c':
+                cache_dir = optarg;
+                wide = true;
+                break;
+
+            case 'p':
+                profile_path = optarg;
+                break;
+
+            case 'P':
+                record_path = optarg;
+                break;
+
+            case 'j':
+                num_threads = strtol(optarg, NULL, 0);
+                if (num_threads < 0) {
+                    return print_usage(argv);
+                }
+                break;
+
+            case 'i':
+                vm_path = optarg;
+                break;
+
+            case 'm':
+                vm_object = optarg;
+                break;
+
+            case 'V':
+                write_vm = true;
+                break;
+
+            default:
+                return print_usage(argv);
         }
     }
 
-    struct ivm_vm_functions funcs;
-    ivm_get_vm_functions(&funcs);
-    const char* string = "\x0eHello, world!\n";
+    // A fork-server does not return from a profiling run
+    if (optind + 1 != argc || (record_path != NULL && (flags & IVM_FLAG_ZYGOTE))) {
+        return print_usage(argv);
+    }
+    const char* output = argv[optind];
+
+    if (write_vm) {
+        return write_shared_vm(output, vm_object);
+    }
+
+    // Write "Hello, world!" to stdout and exit with status 0
+    char bytecode[] = 
+        "\xa7\x02\x01\x00\x00\x00"     // SET R02, 1       (stdout)
+        "\xa7\x03\x25\x00\x00\x00"     // SET R03, 0x25    (message)
+        "\xa7\x04\x0e\x00\x00\x00"     // SET R04, 14      (length)
+        "\xa7\x01\x00\x00\x00\x00"     // SET R01, IVM_SYSCALL_WRITE
+        "\xaf\x05\x0b\x00\x00\x00"     // TRAP R05, IVM_INTR_SYSCALL
+        "\xa7\x00\x00\x00\x00\x00"     // SET R00, 0
+        "\x00"                         // HALT
+        "Hello, world!\n";
 
     struct ivm_image* image;
-    result = ivm_image_create(&image, 32, 0x400, 256);
+    result = ivm_image_create(&image, STATE_DEPTH, FRAME_SIZE, FRAME_COUNT);
     if (result != 0) {
         fprintf(stderr, "Failed to create image: %s\n", strerror(result));
         return result;
     }
+    image->data->flags = flags;
 
-    result = ivm_image_load_vm(image, &funcs, 0x400000);
+    if (shared) {
+        result = ivm_image_load_shared_vm_from_object(image, vm_object, 0x400000, vm_path);
+    }
+    else {
+        result = ivm_image_load_vm_from_object(image, vm_object, 0x400000);
+    }
     if (result != 0) {
         fprintf(stderr, "Failed to load VM code: %s\n", strerror(result));
         return result;
     }
 
-    result = ivm_image_reserve_vm_data(image, IVM_ENTRY, 16);
+    result = ivm_image_reserve_vm_data(image, IVM_ENTRY, sizeof(bytecode));
     if (result != 0) {
         fprintf(stderr, "Failed to reserve VM memory for data: %s\n", strerror(result));
         return result;
     }
 
+    if (optimize) {
+        struct ivm_optimize_report report;
+
+        result = ivm_bytecode_optimize(&report, bytecode, sizeof(bytecode));
+        if (result != 0) {
+            fprintf(stderr, "Failed to optimize bytecode: %s\n", strerror(result));
+            return result;
+        }
+        else if (!report.applied) {
+            fprintf(stderr, "Bytecode has computed jumps, not optimized\n");
+        }
+        else {
+            for (int pass = 0; pass < IVM_PASS_COUNT; ++pass) {
+                fprintf(stderr, "%-24s %zu removed, %zu rewritten\n", ivm_optimize_pass_name(pass), report.removed[pass], report.rewritten[pass]);
+            }
+            fprintf(stderr, "%zu of %zu regions changed, %zu padding instructions\n", report.num_changed, report.num_regions, report.padding);
+        }
+    }
+
+    if (profile_path != NULL) {
+        result = layout_bytecode(profile_path, bytecode, sizeof(bytecode));
+        if (result != 0) {
+            return result;
+        }
+    }
+
+    if (verify) {
+        struct ivm_verify_result verified;
+
+        result = ivm_image_verify(image, bytecode, &verified);
+        if (result == EINVAL && verified.error != IVM_VERIFY_OK) {
+            fprintf(stderr, "Invalid bytecode at offset 0x%x: %s\n", verified.offset, ivm_verify_strerror(verified.error));
+            return result;
+        }
+        else if (result != 0) {
+            fprintf(stderr, "Failed to verify bytecode: %s\n", strerror(result));
+            return result;
+        }
+    }
+
+    if (wide && cache_dir != NULL) {
+        result = ivm_image_load_cached_wide_code(image, cache_dir, bytecode, sizeof(bytecode), WIDE_CODE_ADDR);
+        if (result != 0) {
+            fprintf(stderr, "Failed to convert bytecode: %s\n", strerror(result));
+            return result;
+        }
+    }
+    else if (wide) {
+        result = ivm_image_load_wide_code(image, bytecode, sizeof(bytecode), WIDE_CODE_ADDR);
+        if (result != 0) {
+            fprintf(stderr, "Failed to convert bytecode: %s\n", strerror(result));
+            return result;
+        }
+    }
+
+    if (record_path != NULL) {
+        result = write_profile(record_path, image, bytecode, sizeof(bytecode));
+        if (result != 0) {
+            return result;
+        }
+    }
 
-    FILE* fp = fopen(argv[1], "w");
+    FILE* fp = fopen(output, "w");
     if (fp == NULL) {
         fprintf(stderr, "%s\n", strerror(errno));
         return errno;
     }
 
-    result = ivm_image_write(fp, image, string);
+    result = ivm_image_write_parallel(fp, image, bytecode, num_threads);
     if (result != 0) {
         fprintf(stderr, "Failed to write to output file: %s\n", strerror(result));
         return result;
@@ -0,0 +1,62 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <ivm_image.h>
+#include <ivm_arena.h>
+
+
+
+void ivm_arena_init(struct ivm_arena* arena, size_t block_size)
+{
+    arena->block = NULL;
+    arena->block_size = block_size > 0 ? block_size : 1;
+}
+
+
+
+void* ivm_arena_alloc(struct ivm_arena* arena, size_t size, size_t align)
+{
+    struct ivm_arena_block* block = arena->block;
+
+    if (block != NULL) {
+        uint64_t start = IVM_ALIGN_ADDR(block->data + block->used, align) - (uint64_t) block->data;
+        if (start + size <= block->size) {
+            block->used = start + size;
+            return block->data + start;
+        }
+    }
+
+    size_t block_size = block != NULL ? block->size * 2 : arena->block_size;
+    while (block_size < size + align) {
+        block_size *= 2;
+    }
+
+    struct ivm_arena_block* next = malloc(sizeof(struct ivm_arena_block) + block_size);
+    if (next == NULL) {
+        return NULL;
+    }
+
+    next->next = block;
+    next->size = block_size;
+    next->used = 0;
+    arena->block = next;
+
+    uint64_t start = IVM_ALIGN_ADDR(next->data, align) - (uint64_t) next->data;
+    next->used = start + size;
+    return next->data + start;
+}
+
+
+
+void ivm_arena_release(struct ivm_arena* arena)
+{
+    struct ivm_arena_block* block = arena->block;
+
+    while (block != NULL) {
+        struct ivm_arena_block* next = block->next;
+        free(block);
+        block = next;
+    }
+
+    arena->block = NULL;
+}
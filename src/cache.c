@@ -0,0 +1,290 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <ivm_entry.h>
+#include <ivm_bytecode.h>
+#include <ivm_cache.h>
+
+
+
+/*
+ * Cache file header.
+ * The header is followed by the instructions and a copy of the bytecode.
+ */
+struct header
+{
+    char        magic[8];
+    uint32_t    version;
+    uint32_t    wide_version;
+    char        id[32];         // ID string of the library
+    char        vm_id[32];      // ID string of the VM code
+    struct ivm_vm_geometry geometry; // Frame geometry of the VM code
+    uint64_t    size;           // Size of the bytecode
+    uint64_t    key[2];         // Hash of the fields above and the bytecode
+    uint64_t    count;          // Number of fixed-width instructions
+    uint64_t    checksum;       // Hash of the instructions
+};
+
+
+
+static const char magic[8] = "IVMWIDE";
+
+
+
+/*
+ * Seeds of the two halves of the key, and of the checksum.
+ */
+static const uint64_t seeds[3] = { 0x243f6a8885a308d3, 0x13198a2e03707344, 0xa4093822299f31d0 };
+
+
+
+/*
+ * Length of a file name: the key in hex, ".wide" and the terminator.
+ */
+#define NAME_LENGTH     (32 + 5 + 1)
+
+
+
+static inline uint64_t mix(uint64_t x)
+{
+    x ^= x >> 32;
+    x *= 0xd6e8feb86659fd93;
+    x ^= x >> 32;
+    return x;
+}
+
+
+
+/*
+ * Hash a buffer a word at a time.
+ */
+static uint64_t hash_bytes(uint64_t seed, const void* data, size_t size)
+{
+    const unsigned char* ptr = data;
+    uint64_t hash = mix(seed ^ size);
+    uint64_t word;
+
+    while (size >= sizeof(word)) {
+        memcpy(&word, ptr, sizeof(word));
+        hash = mix(hash ^ word) + seed;
+        ptr += sizeof(word);
+        size -= sizeof(word);
+    }
+
+    word = 0;
+    memcpy(&word, ptr, size);
+    return mix(mix(hash ^ word) ^ seed);
+}
+
+
+
+/*
+ * Fill in the header fields that identify the bytecode and the VM code that
+ * runs it, and the key they hash to. Everything before the key is compared
+ * when a file is loaded.
+ */
+static void make_header(struct header* header, const char* vm_id, const struct ivm_vm_geometry* geometry, const void* bytecode, size_t size)
+{
+    memset(header, 0, sizeof(struct header));
+    memcpy(header->magic, magic, sizeof(magic));
+    header->version = IVM_CACHE_VERSION;
+    header->wide_version = IVM_WIDE_VERSION;
+    snprintf(header->id, sizeof(header->id), "%s", IVM_ID_STRING);
+    snprintf(header->vm_id, sizeof(header->vm_id), "%s", vm_id);
+    header->geometry = *geometry;
+    header->size = size;
+
+    for (int i = 0; i < 2; ++i) {
+        uint64_t seed = hash_bytes(seeds[i], header, offsetof(struct header, key));
+        header->key[i] = hash_bytes(seed, bytecode, size);
+    }
+}
+
+
+
+static char* make_path(const char* dir, const uint64_t* key, const char* suffix)
+{
+    size_t length = strlen(dir) + 1 + NAME_LENGTH + strlen(suffix);
+
+    char* path = malloc(length);
+    if (path != NULL) {
+        snprintf(path, length, "%s/%016llx%016llx.wide%s", dir, (unsigned long long) key[0], (unsigned long long) key[1], suffix);
+    }
+
+    return path;
+}
+
+
+
+static bool check_header(const struct header* header, const struct header* expected, size_t file_size)
+{
+    if (memcmp(header, expected, offsetof(struct header, count)) != 0) {
+        return false;
+    }
+
+    // Do not trust the count of a corrupt file with the mapping size
+    size_t size = header->size;
+    return header->count <= size && file_size == sizeof(struct header) + sizeof(uint64_t) * header->count + size;
+}
+
+
+
+int ivm_cache_load(struct ivm_cache_entry* entry, const char* dir, const char* vm_id, const struct ivm_vm_geometry* geometry, const void* bytecode, size_t size)
+{
+    struct header expected;
+    struct stat st;
+
+    if (entry == NULL || dir == NULL || vm_id == NULL || geometry == NULL || (bytecode == NULL && size > 0)) {
+        return EINVAL;
+    }
+
+    make_header(&expected, vm_id, geometry, bytecode, size);
+
+    char* path = make_path(dir, expected.key, "");
+    if (path == NULL) {
+        return errno;
+    }
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    int err = errno;
+    free(path);
+    if (fd < 0) {
+        return err;
+    }
+
+    if (fstat(fd, &st) != 0) {
+        err = errno;
+        close(fd);
+        return err;
+    }
+
+    if ((size_t) st.st_size < sizeof(struct header)) {
+        close(fd);
+        return EINVAL;
+    }
+
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    err = errno;
+    close(fd);
+    if (map == MAP_FAILED) {
+        return err;
+    }
+
+    const struct header* header = map;
+    const uint64_t* wide = (const uint64_t*) (header + 1);
+
+    // A matching key is not proof of the same bytecode, so compare it as well
+    if (!check_header(header, &expected, st.st_size)
+            || hash_bytes(seeds[2], wide, sizeof(uint64_t) * header->count) != header->checksum
+            || (size > 0 && memcmp(wide + header->count, bytecode, size) != 0)) {
+        munmap(map, st.st_size);
+        return EINVAL;
+    }
+
+    entry->map = map;
+    entry->map_size = st.st_size;
+    entry->wide = wide;
+    entry->count = header->count;
+    return 0;
+}
+
+
+
+void ivm_cache_release(struct ivm_cache_entry* entry)
+{
+    if (entry->map != NULL) {
+        munmap(entry->map, entry->map_size);
+        entry->map = NULL;
+    }
+}
+
+
+
+static int write_all(int fd, const void* data, size_t size)
+{
+    const unsigned char* ptr = data;
+
+    while (size > 0) {
+        ssize_t n = write(fd, ptr, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        else if (n < 0) {
+            return errno;
+        }
+
+        ptr += n;
+        size -= n;
+    }
+
+    return 0;
+}
+
+
+
+int ivm_cache_store(const char* dir, const char* vm_id, const struct ivm_vm_geometry* geometry, const void* bytecode, size_t size, const uint64_t* wide, size_t count)
+{
+    struct header header;
+    char suffix[32];
+
+    if (dir == NULL || vm_id == NULL || geometry == NULL || (bytecode == NULL && size > 0) || (wide == NULL && count > 0)) {
+        return EINVAL;
+    }
+
+    if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+        return errno;
+    }
+
+    make_header(&header, vm_id, geometry, bytecode, size);
+    header.count = count;
+    header.checksum = hash_bytes(seeds[2], wide, sizeof(uint64_t) * count);
+
+    snprintf(suffix, sizeof(suffix), ".%ld", (long) getpid());
+
+    char* path = make_path(dir, header.key, "");
+    char* temp = make_path(dir, header.key, suffix);
+    if (path == NULL || temp == NULL) {
+        free(temp);
+        free(path);
+        return ENOMEM;
+    }
+
+    int err = 0;
+    int fd = open(temp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        err = errno;
+    }
+    else {
+        err = write_all(fd, &header, sizeof(header));
+        if (err == 0) {
+            err = write_all(fd, wide, sizeof(uint64_t) * count);
+        }
+        if (err == 0) {
+            err = write_all(fd, bytecode, size);
+        }
+
+        if (close(fd) != 0 && err == 0) {
+            err = errno;
+        }
+
+        if (err == 0 && rename(temp, path) != 0) {
+            err = errno;
+        }
+
+        if (err != 0) {
+            unlink(temp);
+        }
+    }
+
+    free(temp);
+    free(path);
+    return err;
+}
@@ -0,0 +1,200 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <ivm_list.h>
+#include <ivm_vm.h>
+#include <ivm_memory.h>
+#include <ivm_interrupt.h>
+#include <ivm_native.h>
+#include <ivm_channel.h>
+
+
+/*
+ * Channels are looked up by native functions, which only know the VM.
+ */
+static pthread_mutex_t channels_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ivm_list channels = { &channels, &channels };
+
+
+
+int ivm_channel_create(struct ivm_channel** handle, size_t frame_size, uint32_t num_slots, uint32_t slot_size)
+{
+    if (handle == NULL || frame_size < 16 || (frame_size & (frame_size - 1)) != 0) {
+        return EINVAL;
+    }
+
+    if (num_slots == 0 || (num_slots & (num_slots - 1)) != 0 || slot_size < 8 || (slot_size & 7) != 0) {
+        return EINVAL;
+    }
+
+    struct ivm_channel* channel = malloc(sizeof(struct ivm_channel));
+    if (channel == NULL) {
+        return errno;
+    }
+
+    channel->size = IVM_ALIGN_ADDR(IVM_CHANNEL_SLOTS + (uint64_t) num_slots * slot_size, frame_size);
+    channel->frame_size = frame_size;
+    channel->num_slots = num_slots;
+    channel->slot_size = slot_size;
+    channel->num_ports = 0;
+    channel->ports = NULL;
+
+    size_t align = frame_size > 64 ? frame_size : 64;
+    int err = posix_memalign((void**) &channel->memory, align, channel->size);
+    if (err != 0) {
+        free(channel);
+        return err;
+    }
+    memset(channel->memory, 0, channel->size);
+
+    memcpy(channel->memory + IVM_CHANNEL_NUM_SLOTS, &num_slots, sizeof(uint32_t));
+    memcpy(channel->memory + IVM_CHANNEL_SLOT_SIZE, &slot_size, sizeof(uint32_t));
+
+    for (uint32_t i = 0; i < num_slots; ++i) {
+        memcpy(channel->memory + IVM_CHANNEL_SLOTS + (size_t) i * slot_size, &i, sizeof(uint32_t));
+    }
+
+    pthread_mutex_lock(&channels_lock);
+    ivm_list_insert(&channels, channel);
+    pthread_mutex_unlock(&channels_lock);
+
+    *handle = channel;
+    return 0;
+}
+
+
+
+void ivm_channel_remove(struct ivm_channel* channel)
+{
+    pthread_mutex_lock(&channels_lock);
+    ivm_list_remove(channel);
+    pthread_mutex_unlock(&channels_lock);
+
+    free(channel->ports);
+    free(channel->memory);
+    free(channel);
+}
+
+
+
+int ivm_channel_attach(struct ivm_channel* channel, struct ivm_data* data, uint32_t addr, bool doorbell)
+{
+    if (channel == NULL || data == NULL || data->fsize != channel->frame_size || (addr & (data->fsize - 1)) != 0) {
+        return EINVAL;
+    }
+
+    size_t first = addr >> data->fshift;
+    size_t count = channel->size >> data->fshift;
+    if (first + count > data->fnum) {
+        return EINVAL;
+    }
+
+    for (size_t i = first; i < first + count; ++i) {
+        if (data->ftable[i].attr & IVM_FRAME_ATTR_SHARED) {
+            return EEXIST;
+        }
+    }
+
+    struct ivm_frame* saved = malloc(sizeof(struct ivm_frame) * count);
+    if (saved == NULL) {
+        return errno;
+    }
+    memcpy(saved, &data->ftable[first], sizeof(struct ivm_frame) * count);
+
+    pthread_mutex_lock(&channels_lock);
+
+    struct ivm_channel_port* ports = realloc(channel->ports, sizeof(struct ivm_channel_port) * (channel->num_ports + 1));
+    if (ports == NULL) {
+        int err = errno;
+        pthread_mutex_unlock(&channels_lock);
+        free(saved);
+        return err;
+    }
+
+    channel->ports = ports;
+    ports[channel->num_ports].data = data;
+    ports[channel->num_ports].addr = addr;
+    ports[channel->num_ports].doorbell = doorbell;
+    ports[channel->num_ports].saved = saved;
+    channel->num_ports++;
+
+    pthread_mutex_unlock(&channels_lock);
+
+    for (size_t i = 0; i < count; ++i) {
+        struct ivm_frame* frame = &data->ftable[first + i];
+        frame->addr = (uint64_t) (channel->memory + (i << data->fshift));
+        frame->attr = IVM_FRAME_ATTR_READ | IVM_FRAME_ATTR_WRITE | IVM_FRAME_ATTR_ALLOC | IVM_FRAME_ATTR_SHARED;
+        frame->file = -1;
+        frame->offs = 0;
+    }
+
+    ivm_flush_tlb(data);
+    return 0;
+}
+
+
+
+void ivm_channel_detach(struct ivm_channel* channel, struct ivm_data* data)
+{
+    pthread_mutex_lock(&channels_lock);
+
+    for (size_t i = 0; i < channel->num_ports; ++i) {
+        struct ivm_channel_port* port = &channel->ports[i];
+        if (port->data != data) {
+            continue;
+        }
+
+        size_t first = port->addr >> data->fshift;
+        size_t count = channel->size >> data->fshift;
+        memcpy(&data->ftable[first], port->saved, sizeof(struct ivm_frame) * count);
+        free(port->saved);
+
+        *port = channel->ports[--channel->num_ports];
+        break;
+    }
+
+    pthread_mutex_unlock(&channels_lock);
+    ivm_flush_tlb(data);
+}
+
+
+
+void ivm_channel_ring(uint32_t* r, struct ivm_frame* ftable, struct ivm_data* vm)
+{
+    (void) ftable;
+    uint32_t addr = vm->regs.bp + r[1];
+    struct ivm_channel* found = NULL;
+
+    pthread_mutex_lock(&channels_lock);
+
+    ivm_list_foreach(struct ivm_channel, channel, &channels) {
+        for (size_t i = 0; i < channel->num_ports; ++i) {
+            const struct ivm_channel_port* port = &channel->ports[i];
+            if (port->data == vm && addr >= port->addr && addr - port->addr < channel->size) {
+                found = channel;
+                break;
+            }
+        }
+
+        if (found != NULL) {
+            break;
+        }
+    }
+
+    if (found != NULL) {
+        for (size_t i = 0; i < found->num_ports; ++i) {
+            struct ivm_channel_port* port = &found->ports[i];
+            if (port->data != vm && port->doorbell) {
+                __atomic_fetch_or(&port->data->regs.intr, (uint16_t) (1 << IVM_INTR_DOORBELL), __ATOMIC_SEQ_CST);
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&channels_lock);
+
+    r[0] = found != NULL ? IVM_NATIVE_OK : IVM_NATIVE_NOT_FOUND;
+}
@@ -0,0 +1,135 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <ivm_list.h>
+#include <ivm_vm.h>
+#include <ivm_image.h>
+#include <ivm_bytecode.h>
+#include <ivm_encoding.h>
+#include <ivm_cache.h>
+
+
+
+int ivm_bytecode_widen(uint64_t** wide, size_t* count, const void* bytecode, size_t size)
+{
+    const unsigned char* code = bytecode;
+
+    if (wide == NULL || count == NULL || (bytecode == NULL && size > 0)) {
+        return EINVAL;
+    }
+
+    // Stop where the variable-length decoder would read past the end
+    size_t num = 0;
+    while (num < size && num + IVM_INSTR_LEN(code[num]) <= size) {
+        ++num;
+    }
+
+    uint64_t* insns = malloc(sizeof(uint64_t) * (num > 0 ? num : 1));
+    if (insns == NULL) {
+        return errno;
+    }
+
+    for (size_t pos = 0; pos < num; ++pos) {
+        uint8_t opcode = code[pos];
+        uint8_t r[3] = { 0, 0, 0 };
+        uint32_t word = 0;
+
+        for (int i = 0; i < IVM_NUM_REGS(opcode); ++i) {
+            r[i] = code[pos + 1 + i];
+        }
+
+        if (IVM_HAS_WORD(opcode)) {
+            const unsigned char* w = &code[pos + 1 + IVM_NUM_REGS(opcode)];
+            word = w[0] | (w[1] << 8) | (w[2] << 16) | ((uint32_t) w[3] << 24);
+        }
+
+        insns[pos] = IVM_WIDE_ENCODE(opcode, r[0], r[1], r[2], word);
+    }
+
+    *wide = insns;
+    *count = num;
+    return 0;
+}
+
+
+
+/*
+ * Place fixed-width code owned by the image at the given address.
+ */
+static int add_wide_code(struct ivm_image* image, const uint64_t* wide, size_t count, uint64_t addr)
+{
+    struct ivm_segment* segment = NULL;
+    int err = ivm_image_add_segment(&segment, image, IVM_SEG_DATA, image->page_size, addr, sizeof(uint64_t) * count, image->page_size);
+    if (err != 0) {
+        return err;
+    }
+
+    if (segment->vm_start != addr) {
+        return EFAULT;
+    }
+
+    err = ivm_image_add_section(NULL, segment, IVM_SECT_CONST, sizeof(uint64_t), wide, sizeof(uint64_t) * count);
+    if (err != 0) {
+        return err;
+    }
+
+    image->data->wcode = (const uint64_t*) addr;
+    image->data->wsize = count;
+    image->data->flags |= IVM_FLAG_WIDE;
+    return 0;
+}
+
+
+
+int ivm_image_load_wide_code(struct ivm_image* image, const void* bytecode, size_t size, uint64_t addr)
+{
+    uint64_t* wide;
+    size_t count;
+
+    if (image == NULL || image->data->registers == NULL) {
+        return EINVAL;
+    }
+
+    if (image->wide_code != NULL) {
+        return EEXIST;
+    }
+
+    int err = ivm_bytecode_widen(&wide, &count, bytecode, size);
+    if (err != 0) {
+        return err;
+    }
+
+    image->wide_code = wide;
+    return add_wide_code(image, wide, count, addr);
+}
+
+
+
+int ivm_image_load_cached_wide_code(struct ivm_image* image, const char* dir, const void* bytecode, size_t size, uint64_t addr)
+{
+    struct ivm_cache_entry entry;
+
+    if (image == NULL || image->data->registers == NULL || dir == NULL) {
+        return EINVAL;
+    }
+
+    if (image->wide_code != NULL) {
+        return EEXIST;
+    }
+
+    if (ivm_cache_load(&entry, dir, image->data->id, &image->vm_geometry, bytecode, size) != 0) {
+        int err = ivm_image_load_wide_code(image, bytecode, size, addr);
+        if (err == 0) {
+            // The cache only saves time, the code is usable without it
+            ivm_cache_store(dir, image->data->id, &image->vm_geometry, bytecode, size, image->wide_code, image->data->wsize);
+        }
+        return err;
+    }
+
+    image->wide_code = (void*) entry.wide;
+    image->wide_code_map = entry.map;
+    image->wide_code_map_size = entry.map_size;
+    return add_wide_code(image, entry.wide, entry.count, addr);
+}
@@ -6,78 +6,175 @@
 #include <errno.h>
 #include <unistd.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <ivm_list.h>
 #include <ivm_vm.h>
 #include <ivm_image.h>
+#include <ivm_object.h>
 #include <dlfcn.h>
 
 
 
-static bool overlaps(struct ivm_image* image, uint64_t addr, size_t size)
+/*
+ * Size of the first block of the segment and section arenas.
+ */
+#define SEGMENT_BLOCK_SIZE  (sizeof(struct ivm_segment) * 32)
+#define SECTION_BLOCK_SIZE  (sizeof(struct ivm_section) * 32)
+
+
+
+/*
+ * Find the first segment in the index that starts at or after an address.
+ */
+static size_t find_segment(const struct ivm_image* image, uint64_t addr)
+{
+    size_t lo = 0;
+    size_t hi = image->num_segments;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (image->segment_index[mid]->vm_start < addr) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+
+
+/*
+ * Check if a memory range overlaps a segment.
+ * Segments in the index never overlap, so only the segments on either
+ * side of where the range starts need to be checked.
+ */
+static bool overlaps(const struct ivm_image* image, uint64_t addr, size_t size)
 {
-    ivm_list_foreach(struct ivm_segment, seg, &image->segments) {
-        uint64_t start = seg->vm_start;
-        uint64_t end = seg->vm_start + seg->vm_size;
+    if (addr + size < addr) {
+        return true;
+    }
 
-        if ((start <= addr && addr < end) || (start <= addr + size && addr + size < end)) {
+    size_t pos = find_segment(image, addr);
+
+    if (pos > 0) {
+        const struct ivm_segment* prev = image->segment_index[pos - 1];
+        if (prev->vm_start + prev->vm_size > addr) {
             return true;
         }
     }
 
-    return false;
+    return pos < image->num_segments && image->segment_index[pos]->vm_start < addr + size;
 }
 
 
 
-static void remove_segment(struct ivm_segment* segment)
+/*
+ * Make room for more segments in the index.
+ */
+static int reserve_segments(struct ivm_image* image, size_t count)
 {
-    ivm_list_foreach(struct ivm_section, sect, &segment->sections) {
-        segment->image->num_sections--;
-        ivm_list_remove(sect);
-        free(sect);
+    size_t needed = image->num_segments + count;
+    if (needed <= image->segment_index_size) {
+        return 0;
+    }
+
+    size_t size = image->segment_index_size > 0 ? image->segment_index_size * 2 : 16;
+    if (size < needed) {
+        size = needed;
     }
 
-    segment->image->num_segments--;
-    segment->image->file_size -= segment->file_size;
+    struct ivm_segment** index = realloc(image->segment_index, sizeof(struct ivm_segment*) * size);
+    if (index == NULL) {
+        return errno;
+    }
+
+    image->segment_index = index;
+    image->segment_index_size = size;
+    return 0;
+}
+
+
+
+static void init_segment(struct ivm_segment* segment, struct ivm_image* image, enum ivm_segment_type type, size_t align, uint64_t addr, size_t size, size_t file_align)
+{
+    segment->type = type;
+    segment->image = image;
+    segment->vm_align = align;
+    segment->vm_start = IVM_ALIGN_ADDR(addr, align);
+    segment->vm_size = IVM_ALIGN_ADDR(size, align);
+    segment->file_align = file_align;
+    segment->file_size = 0;
+}
+
+
+
+/*
+ * Place a segment after the others in the file.
+ */
+static void append_segment(struct ivm_image* image, struct ivm_segment* segment)
+{
+    ivm_list_init(&segment->sections);
+    ivm_list_insert(&image->segments, segment);
+}
+
 
-    struct ivm_segment* next = ivm_list_next(&segment->image->segments, segment);
 
-    while (next != NULL) {
-        next->file_start -= segment->file_start;
-        next = ivm_list_next(&segment->image->segments, next);
+static int compare_segments(const void* a, const void* b)
+{
+    const struct ivm_segment* x = *(const struct ivm_segment* const*) a;
+    const struct ivm_segment* y = *(const struct ivm_segment* const*) b;
+
+    if (x->vm_start != y->vm_start) {
+        return x->vm_start < y->vm_start ? -1 : 1;
     }
 
-    ivm_list_remove(segment);
-    free(segment);
+    return 0;
 }
 
 
 
 static int create_vm_data(struct ivm_image* image, size_t num_states, size_t frame_size, size_t num_frames)
 {
+    // Frame size must be a power of two so addresses can be split with shifts
+    if (frame_size < 16 || (frame_size & (frame_size - 1)) != 0) {
+        return EINVAL;
+    }
+
+    size_t fshift = 0;
+    while ((1UL << fshift) < frame_size) {
+        ++fshift;
+    }
+
+    // Registers are part of struct ivm_data, so that the hot ones share its first cache line
     size_t data_size = sizeof(struct ivm_data) 
-        + sizeof(struct ivm_registers)
         + sizeof(struct ivm_state) * num_states
-        + sizeof(struct ivm_frame) * num_frames;
+        + sizeof(struct ivm_frame) * num_frames
+        + sizeof(uint64_t) * IVM_CTABLE_SIZE;
 
-    struct ivm_data* data = malloc(data_size);
-    if (data == NULL) {
-        return errno;
+    struct ivm_data* data = NULL;
+    int err = posix_memalign((void**) &data, __alignof__(struct ivm_data), data_size);
+    if (err != 0) {
+        return err;
     }
     memset(data, 0, data_size);
 
     data->state_size = num_states;
-    data->fshift = 9; // FIXME: calculate from frame size
+    data->fshift = fshift;
     data->fsize = frame_size;
     data->fnum = num_frames;
 
     image->data = data;
     image->data_size = data_size;
-    image->data_offset_to_regs = sizeof(struct ivm_data);
-    image->data_offset_to_states = image->data_offset_to_regs + sizeof(struct ivm_registers);
+    image->data_offset_to_regs = offsetof(struct ivm_data, regs);
+    image->data_offset_to_states = sizeof(struct ivm_data);
     image->data_offset_to_ft = image->data_offset_to_states + sizeof(struct ivm_state) * num_states;
     image->data_offset_to_ct = image->data_offset_to_ft + sizeof(struct ivm_frame) * num_frames;
 
+    data->regs.imask = IVM_INTR_DEFAULT_MASK;
+
     return 0;
 }
 
@@ -108,11 +205,21 @@ int ivm_image_create(struct ivm_image** handle, size_t stack_size, size_t frame_
     image->file_size = 0;
     image->vm_file_offset = 0;
     image->vm_code = NULL;
+    image->vm_interp = NULL;
+    memset(&image->vm_geometry, 0, sizeof(image->vm_geometry));
+    image->frame_data = NULL;
+    image->wide_code = NULL;
+    image->wide_code_map = NULL;
+    image->wide_code_map_size = 0;
     image->vm_entry_point = 0;
     image->num_segments = 0;
+    image->segment_index = NULL;
+    image->segment_index_size = 0;
     image->num_sections = 0;
     image->page_size = pagesize;
     ivm_list_init(&image->segments);
+    ivm_arena_init(&image->segment_arena, SEGMENT_BLOCK_SIZE);
+    ivm_arena_init(&image->section_arena, SECTION_BLOCK_SIZE);
 
     *handle = image;
     return 0;
@@ -122,12 +229,19 @@ int ivm_image_create(struct ivm_image** handle, size_t stack_size, size_t frame_
 
 void ivm_image_remove(struct ivm_image* image)
 {
-    ivm_list_foreach(struct ivm_segment, seg, &image->segments) {
-        remove_segment(seg);
-    }
-
+    ivm_arena_release(&image->section_arena);
+    ivm_arena_release(&image->segment_arena);
+    free(image->segment_index);
     free(image->data);
     free(image->vm_code);
+    free(image->vm_interp);
+    free(image->frame_data);
+    if (image->wide_code_map != NULL) {
+        munmap(image->wide_code_map, image->wide_code_map_size);
+    }
+    else {
+        free(image->wide_code);
+    }
     free(image);
 }
 
@@ -148,24 +262,24 @@ int ivm_image_add_segment(struct ivm_segment** handle,
         return EFAULT;
     }
 
-    struct ivm_segment* segment = malloc(sizeof(struct ivm_segment));
+    int err = reserve_segments(image, 1);
+    if (err != 0) {
+        return err;
+    }
+
+    struct ivm_segment* segment = ivm_arena_alloc(&image->segment_arena, sizeof(struct ivm_segment), __alignof__(struct ivm_segment));
     if (segment == NULL) {
-        return errno;
+        return ENOMEM;
     }
+    init_segment(segment, image, type, align, addr, size, file_align);
 
-    segment->type = type;
-    segment->image = image;
-    ivm_list_insert(&image->segments, segment);
-    segment->vm_align = align;
-    segment->vm_start = addr;
-    segment->vm_size = size;
-    segment->file_start = image->file_size;
-    segment->file_align = file_align;
-    segment->file_size = 0;
-    ivm_list_init(&segment->sections);
-    
+    size_t pos = find_segment(image, addr);
+    memmove(&image->segment_index[pos + 1], &image->segment_index[pos], sizeof(struct ivm_segment*) * (image->num_segments - pos));
+    image->segment_index[pos] = segment;
     image->num_segments++;
 
+    append_segment(image, segment);
+
     if (handle != NULL) {
         *handle = segment;
     }
@@ -174,6 +288,101 @@ int ivm_image_add_segment(struct ivm_segment** handle,
 
 
 
+int ivm_image_add_segments(struct ivm_segment** handles,
+                           struct ivm_image* image,
+                           const struct ivm_segment_info* info,
+                           size_t count)
+{
+    if (image == NULL || (info == NULL && count > 0)) {
+        return EINVAL;
+    }
+
+    if (count == 0) {
+        return 0;
+    }
+
+    int err = reserve_segments(image, count);
+    if (err != 0) {
+        return err;
+    }
+
+    // Nothing is taken from the arena until the segments are known to fit
+    struct ivm_segment* added = malloc(sizeof(struct ivm_segment) * count);
+    struct ivm_segment** sorted = malloc(sizeof(struct ivm_segment*) * count);
+    struct ivm_segment** index = malloc(sizeof(struct ivm_segment*) * image->segment_index_size);
+    if (added == NULL || sorted == NULL || index == NULL) {
+        free(index);
+        free(sorted);
+        free(added);
+        return ENOMEM;
+    }
+
+    // The file is laid out in the given order, but the index needs the new
+    // segments sorted to merge them with the existing ones
+    for (size_t i = 0; i < count; ++i) {
+        init_segment(&added[i], image, info[i].type, info[i].vm_align, info[i].vm_start, info[i].vm_size, info[i].file_align);
+        sorted[i] = &added[i];
+    }
+    qsort(sorted, count, sizeof(struct ivm_segment*), compare_segments);
+
+    size_t num = 0;
+    size_t i = 0;
+    size_t j = 0;
+    while (i < image->num_segments || j < count) {
+        if (j == count || (i < image->num_segments && image->segment_index[i]->vm_start <= sorted[j]->vm_start)) {
+            index[num++] = image->segment_index[i++];
+        }
+        else {
+            index[num++] = sorted[j++];
+        }
+
+        const struct ivm_segment* prev = num > 1 ? index[num - 2] : NULL;
+        const struct ivm_segment* next = index[num - 1];
+        if (next->vm_start + next->vm_size < next->vm_start || (prev != NULL && prev->vm_start + prev->vm_size > next->vm_start)) {
+            err = EFAULT;
+            break;
+        }
+    }
+    free(sorted);
+
+    struct ivm_segment* segments = NULL;
+    if (err == 0) {
+        segments = ivm_arena_alloc(&image->segment_arena, sizeof(struct ivm_segment) * count, __alignof__(struct ivm_segment));
+        if (segments == NULL) {
+            err = ENOMEM;
+        }
+    }
+
+    if (err != 0) {
+        free(index);
+        free(added);
+        return err;
+    }
+
+    memcpy(segments, added, sizeof(struct ivm_segment) * count);
+    for (size_t k = 0; k < num; ++k) {
+        if (index[k] >= added && index[k] < added + count) {
+            index[k] = &segments[index[k] - added];
+        }
+    }
+    free(added);
+
+    free(image->segment_index);
+    image->segment_index = index;
+    image->num_segments = num;
+
+    for (size_t k = 0; k < count; ++k) {
+        append_segment(image, &segments[k]);
+        if (handles != NULL) {
+            handles[k] = &segments[k];
+        }
+    }
+
+    return 0;
+}
+
+
+
 int ivm_image_add_section(struct ivm_section** handle,
                           struct ivm_segment* segment,
                           enum ivm_section_type type,
@@ -181,41 +390,46 @@ int ivm_image_add_section(struct ivm_section** handle,
                           const void* data,
                           size_t size)
 {
-    struct ivm_section* section = malloc(sizeof(struct ivm_section));
-    if (section == NULL) {
-        return errno;
+    const struct ivm_section* prev = ivm_list_last(struct ivm_section, &segment->sections);
+
+    // The file holds the start of the segment, so contents can not follow
+    // zero-initialised sections
+    bool bss = type == IVM_SECT_BSS;
+    if (!bss && prev != NULL && prev->type == IVM_SECT_BSS) {
+        return EINVAL;
     }
 
-    const struct ivm_section* prev = ivm_list_last(struct ivm_section, &segment->sections);
+    uint64_t vm_offset = IVM_ALIGN_ADDR(prev != NULL ? prev->vm_offset_to_seg + prev->vm_size : 0, align);
+    if (vm_offset + IVM_ALIGN_ADDR(size, align) > segment->vm_size) {
+        return ENOSPC;
+    }
+
+    struct ivm_image* image = segment->image;
+    struct ivm_section* section = ivm_arena_alloc(&image->section_arena, sizeof(struct ivm_section), __alignof__(struct ivm_section));
+    if (section == NULL) {
+        return ENOMEM;
+    }
 
     section->type = type;
     section->segment = segment;
     ivm_list_insert(&segment->sections, section);
-    section->data = data;
-    section->size = size;
     section->vm_align = align;
     section->vm_size = IVM_ALIGN_ADDR(size, align);
-    section->vm_offset_to_seg = IVM_ALIGN_ADDR(prev != NULL ? prev->vm_offset_to_seg + prev->vm_size : 0, align);
+    section->vm_offset_to_seg = vm_offset;
     uint64_t prev_offset = prev != NULL ? IVM_ALIGN_ADDR(prev->vm_offset_to_seg + prev->vm_size, prev->vm_align) : 0;
     section->vm_offset_to_prev = section->vm_offset_to_seg - prev_offset;
     section->size = size;
-    section->data = data;
+    section->data = bss ? NULL : data;
 
-    if (segment->vm_start + section->vm_offset_to_seg + section->vm_size > segment->vm_start + segment->vm_size) {
-        ivm_list_remove(section);
-        free(section);
-        return ENOSPC;
-    }
-
-    // Adjust file pointers
-    section->file_offset_to_seg = prev != NULL ? prev->file_offset_to_seg + prev->size + prev->file_padding : 0;
+    // Adjust file pointers, zero-initialised sections take no file space
+    size_t file_size = bss ? 0 : size;
+    section->file_offset_to_seg = prev != NULL ? prev->file_offset_to_seg + (prev->type == IVM_SECT_BSS ? 0 : prev->size) + prev->file_padding : 0;
     section->file_offset_to_prev = 0;
-    section->file_padding = IVM_ALIGN_ADDR(size, segment->file_align) - size;
-    segment->file_size += section->size + section->file_padding;
+    section->file_padding = IVM_ALIGN_ADDR(file_size, segment->file_align) - file_size;
+    segment->file_size += file_size + section->file_padding;
 
-    struct ivm_image* image = segment->image;
     image->num_sections++;
-    image->file_size += section->size + section->file_padding;
+    image->file_size += file_size + section->file_padding;
 
     if (handle != NULL) {
         *handle = section;
@@ -226,35 +440,84 @@ int ivm_image_add_section(struct ivm_section** handle,
 
 
 
-int ivm_image_load_vm(struct ivm_image* image, const struct ivm_vm_functions* funcs, uint64_t addr)
+size_t ivm_image_segment_offset(const struct ivm_image* image, const struct ivm_segment* segment)
 {
-    int err;
+    size_t offset = 0;
 
-    size_t code_align = 8;
+    ivm_list_foreach(const struct ivm_segment, seg, &image->segments) {
+        if (seg == segment) {
+            break;
+        }
+        offset += seg->file_size;
+    }
 
-    size_t size = image->page_size // offset with one page
-        + IVM_ALIGN_ADDR(funcs->loader.size, code_align)
-        + IVM_ALIGN_ADDR(funcs->vm.size, code_align)
-        + IVM_ALIGN_ADDR(funcs->interrupt.size, code_align);
+    return offset;
+}
 
-    size = IVM_ALIGN_ADDR(size, image->page_size);
 
-    image->vm_code = malloc(size);
-    if (image->vm_code == NULL) {
-        return errno;
-    }
 
+/*
+ * Alignment of VM functions in the code segment.
+ */
+#define VM_CODE_ALIGN 8
 
-    // Load VM code (offset by one page)
-    unsigned char* ldptr = (unsigned char*) IVM_ALIGN_ADDR(image->vm_code, code_align) + image->page_size;
-    memcpy(ldptr, (void*) funcs->loader.addr, funcs->loader.size);
-    unsigned char* vmptr = ldptr + IVM_ALIGN_ADDR(funcs->loader.size, code_align);
-    memcpy(vmptr, (void*) funcs->vm.addr, funcs->vm.size);
-    unsigned char* intrptr = vmptr + IVM_ALIGN_ADDR(funcs->vm.size, code_align);
-    memcpy(intrptr, (void*) funcs->interrupt.addr, funcs->interrupt.size);
 
-    // TODO: create syscall table
-    
+
+/*
+ * Get the size of the VM code segment.
+ * The code is offset with one page, where the file headers are mapped.
+ */
+static size_t vm_code_size(const struct ivm_image* image, const struct ivm_vm_functions* funcs)
+{
+    size_t size = image->page_size
+        + IVM_ALIGN_ADDR(funcs->loader.size, VM_CODE_ALIGN)
+        + IVM_ALIGN_ADDR(funcs->vm.size, VM_CODE_ALIGN)
+        + IVM_ALIGN_ADDR(funcs->interrupt.size, VM_CODE_ALIGN);
+
+    return IVM_ALIGN_ADDR(size, image->page_size);
+}
+
+
+
+/*
+ * Check that VM code specialized for a frame geometry can run the image.
+ */
+static bool geometry_matches(const struct ivm_image* image, const struct ivm_vm_geometry* geometry)
+{
+    return (geometry->frame_size == 0 || geometry->frame_size == image->data->fsize)
+        && (geometry->num_frames == 0 || geometry->num_frames == image->data->fnum)
+        && (geometry->num_states == 0 || geometry->num_states == image->data->state_size);
+}
+
+
+
+/*
+ * Set the identifier string and frame geometry of the VM.
+ * The ID of VM functions fills its array when it is as long as possible, so
+ * it is not necessarily terminated.
+ */
+static void set_vm_id(struct ivm_image* image, const char* id, const struct ivm_vm_geometry* geometry)
+{
+    size_t length = strnlen(id, sizeof(image->data->id) - 1);
+
+    memcpy(image->data->id, id, length);
+    image->data->id[length] = '\0';
+    image->vm_geometry = *geometry;
+}
+
+
+
+/*
+ * Create the code segment from VM code starting with the loader.
+ * The code buffer is offset by one page, where the file headers are mapped,
+ * and is owned by the image afterwards.
+ */
+static int add_vm_code(struct ivm_image* image, uint64_t addr, void* code, size_t size, uint64_t vm_addr, uint64_t intr_addr, const char* id, const struct ivm_vm_geometry* geometry)
+{
+    int err;
+
+    image->vm_code = code;
+
     // Create code segment
     struct ivm_segment* segment = NULL;
     err = ivm_image_add_segment(&segment, image, IVM_SEG_CODE, image->page_size, addr, size, image->page_size);
@@ -274,16 +537,211 @@ int ivm_image_load_vm(struct ivm_image* image, const struct ivm_vm_functions* fu
     }
 
     image->vm_entry_point = segment->vm_start;
-    image->vm_file_offset = segment->file_start;
-    image->data->vm_addr = segment->vm_start + image->page_size + (vmptr - ldptr);
-    image->data->interrupt = (ivm_interrupt_t) (segment->vm_start + image->page_size + (intrptr - ldptr));
+    image->vm_file_offset = ivm_image_segment_offset(image, segment);
+    image->data->vm_addr = vm_addr;
+    image->data->interrupt = (ivm_interrupt_t) intr_addr;
 
-    strcpy(image->data->id, funcs->id);
+    set_vm_id(image, id, geometry);
     return 0;
 }
 
 
 
+int ivm_image_load_vm(struct ivm_image* image, const struct ivm_vm_functions* funcs, uint64_t addr)
+{
+    if (!geometry_matches(image, &funcs->geometry)) {
+        return EINVAL;
+    }
+
+    size_t code_align = VM_CODE_ALIGN;
+    size_t size = vm_code_size(image, funcs);
+
+    unsigned char* code = malloc(size);
+    if (code == NULL) {
+        return errno;
+    }
+
+
+    // Load VM code (offset by one page)
+    unsigned char* ldptr = (unsigned char*) IVM_ALIGN_ADDR(code, code_align) + image->page_size;
+    memcpy(ldptr, (void*) funcs->loader.addr, funcs->loader.size);
+    unsigned char* vmptr = ldptr + IVM_ALIGN_ADDR(funcs->loader.size, code_align);
+    memcpy(vmptr, (void*) funcs->vm.addr, funcs->vm.size);
+    unsigned char* intrptr = vmptr + IVM_ALIGN_ADDR(funcs->vm.size, code_align);
+    memcpy(intrptr, (void*) funcs->interrupt.addr, funcs->interrupt.size);
+
+    // TODO: create syscall table
+
+    return add_vm_code(image, addr, code, size,
+            addr + image->page_size + (vmptr - ldptr),
+            addr + image->page_size + (intrptr - ldptr),
+            funcs->id, &funcs->geometry);
+}
+
+
+
+int ivm_image_load_vm_from_object(struct ivm_image* image, const char* filename, uint64_t addr)
+{
+    struct ivm_vm_code* vm_code = NULL;
+
+    int err = ivm_vm_code_extract(&vm_code, filename, addr + image->page_size);
+    if (err != 0) {
+        return err;
+    }
+
+    if (!geometry_matches(image, &vm_code->geometry)) {
+        ivm_vm_code_remove(vm_code);
+        return EINVAL;
+    }
+
+    size_t size = IVM_ALIGN_ADDR(image->page_size + vm_code->size, image->page_size);
+
+    unsigned char* code = calloc(1, size);
+    if (code == NULL) {
+        err = errno;
+        ivm_vm_code_remove(vm_code);
+        return err;
+    }
+    memcpy(code + image->page_size, vm_code->code, vm_code->size);
+
+    err = add_vm_code(image, addr, code, size, vm_code->vm.addr, vm_code->interrupt.addr, vm_code->id, &vm_code->geometry);
+
+    ivm_vm_code_remove(vm_code);
+    return err;
+}
+
+
+
+/*
+ * Reference the shared VM code file as the program interpreter.
+ */
+static int set_shared_vm(struct ivm_image* image, uint64_t addr, size_t size, uint64_t vm_addr, uint64_t intr_addr, const char* id, const struct ivm_vm_geometry* geometry, const char* filename)
+{
+    if (image->vm_code != NULL || image->vm_interp != NULL) {
+        return EINVAL;
+    }
+
+    if (overlaps(image, addr, size)) {
+        return EFAULT;
+    }
+
+    image->vm_interp = strdup(filename);
+    if (image->vm_interp == NULL) {
+        return errno;
+    }
+
+    image->vm_entry_point = addr;
+    image->vm_file_offset = 0;
+    image->data->vm_addr = vm_addr;
+    image->data->interrupt = (ivm_interrupt_t) intr_addr;
+
+    set_vm_id(image, id, geometry);
+    return 0;
+}
+
+
+
+int ivm_image_load_shared_vm(struct ivm_image* image, const struct ivm_vm_functions* funcs, uint64_t addr, const char* filename)
+{
+    if (!geometry_matches(image, &funcs->geometry)) {
+        return EINVAL;
+    }
+
+    // Same layout as the code segment created by ivm_image_load_vm
+    uint64_t ldaddr = addr + image->page_size;
+    uint64_t vmaddr = ldaddr + IVM_ALIGN_ADDR(funcs->loader.size, VM_CODE_ALIGN);
+    uint64_t intraddr = vmaddr + IVM_ALIGN_ADDR(funcs->vm.size, VM_CODE_ALIGN);
+
+    return set_shared_vm(image, addr, vm_code_size(image, funcs), vmaddr, intraddr, funcs->id, &funcs->geometry, filename);
+}
+
+
+
+int ivm_image_load_shared_vm_from_object(struct ivm_image* image, const char* object, uint64_t addr, const char* filename)
+{
+    struct ivm_vm_code* vm_code = NULL;
+
+    // Extracting again yields the same layout as in the shared file
+    int err = ivm_vm_code_extract(&vm_code, object, addr + image->page_size);
+    if (err != 0) {
+        return err;
+    }
+
+    if (!geometry_matches(image, &vm_code->geometry)) {
+        ivm_vm_code_remove(vm_code);
+        return EINVAL;
+    }
+
+    size_t size = IVM_ALIGN_ADDR(image->page_size + vm_code->size, image->page_size);
+    err = set_shared_vm(image, addr, size, vm_code->vm.addr, vm_code->interrupt.addr, vm_code->id, &vm_code->geometry, filename);
+
+    ivm_vm_code_remove(vm_code);
+    return err;
+}
+
+
+
+/*
+ * Write an image containing only VM code.
+ */
+static int write_vm_only(FILE* fp, const struct ivm_vm_functions* funcs, const char* object, uint64_t addr)
+{
+    int err;
+    struct ivm_image* image = NULL;
+    struct ivm_vm_geometry geometry;
+
+    if (object != NULL) {
+        struct ivm_vm_code* vm_code = NULL;
+
+        err = ivm_vm_code_extract(&vm_code, object, addr);
+        if (err != 0) {
+            return err;
+        }
+
+        geometry = vm_code->geometry;
+        ivm_vm_code_remove(vm_code);
+    }
+    else {
+        geometry = funcs->geometry;
+    }
+
+    // The file holds no VM data, but specialized code still checks the geometry
+    err = ivm_image_create(&image, geometry.num_states, geometry.frame_size != 0 ? geometry.frame_size : 16, geometry.num_frames);
+    if (err != 0) {
+        return err;
+    }
+
+    if (object != NULL) {
+        err = ivm_image_load_vm_from_object(image, object, addr);
+    }
+    else {
+        err = ivm_image_load_vm(image, funcs, addr);
+    }
+
+    if (err == 0) {
+        err = ivm_image_write(fp, image, NULL);
+    }
+
+    ivm_image_remove(image);
+    return err;
+}
+
+
+
+int ivm_image_write_shared_vm(FILE* fp, const struct ivm_vm_functions* funcs, uint64_t addr)
+{
+    return write_vm_only(fp, funcs, NULL, addr);
+}
+
+
+
+int ivm_image_write_shared_vm_from_object(FILE* fp, const char* object, uint64_t addr)
+{
+    return write_vm_only(fp, NULL, object, addr);
+}
+
+
+
 int ivm_image_load_vm_from_file(struct ivm_image* image, const char* filename, uint64_t addr)
 {
     void* handle = dlopen(filename, RTLD_NOW | RTLD_LOCAL);
@@ -314,10 +772,11 @@ static void initialize_frame_table(struct ivm_image* image, uint64_t addr, size_
 
     for (size_t i = 0; i < image->data->fnum; ++i) {
         frames[i].addr = 0;
-        if (image->data->fsize * i <= size) {
+        frames[i].attr = 0;
+        if (image->data->fsize * i < size) {
             frames[i].addr = addr + image->data->fsize * i;
+            frames[i].attr = IVM_FRAME_ATTR_READ | IVM_FRAME_ATTR_WRITE | IVM_FRAME_ATTR_EXEC | IVM_FRAME_ATTR_ALLOC;
         }
-        frames[i].attr = 0;
         frames[i].file = -1;
         frames[i].offs = 0;
     }
@@ -348,15 +807,20 @@ int ivm_image_reserve_vm_data(struct ivm_image* image, uint64_t data_addr, size_
     image->data->ftable = (void*) (data_segment->vm_start + image->data_offset_to_ft);
     image->data->ctable = (void*) (data_segment->vm_start + image->data_offset_to_ct);
 
+    // The call table holds host pointers, so it is left out of the file
+    // and reads as zero when the image is loaded; it comes last
     struct ivm_section* data_section = NULL;
-    err = ivm_image_add_section(&data_section, data_segment, IVM_SECT_DATA, image->page_size, image->data, image->data_size);
+    err = ivm_image_add_section(&data_section, data_segment, IVM_SECT_DATA, image->page_size, image->data, image->data_offset_to_ct);
     if (err != 0) {
         return err;
     }
 
     
+    // Reserve memory for all frames, only the bytecode takes up file space
+    size_t memory_size = image->data->fsize * image->data->fnum;
+
     struct ivm_segment* code_segment = NULL;
-    err = ivm_image_add_segment(&code_segment, image, IVM_SEG_DATA, image->page_size, data_addr + data_segment->vm_size, bytecode_size, image->page_size);
+    err = ivm_image_add_segment(&code_segment, image, IVM_SEG_DATA, image->page_size, data_addr + data_segment->vm_size, memory_size, image->page_size);
     if (err != 0) {
         return err;
     }
@@ -367,6 +831,6 @@ int ivm_image_reserve_vm_data(struct ivm_image* image, uint64_t data_addr, size_
         return err;
     }
 
-    initialize_frame_table(image, code_segment->vm_start, bytecode_size);
+    initialize_frame_table(image, code_segment->vm_start, memory_size);
     return 0;
 }
@@ -0,0 +1,338 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <ivm_list.h>
+#include <ivm_vm.h>
+#include <ivm_interrupt.h>
+#include <ivm_image.h>
+#include <ivm_instance.h>
+
+
+
+static void* map_fixed(uint64_t addr, size_t size, int prot, int fd)
+{
+    int flags = MAP_PRIVATE | (fd < 0 ? MAP_ANONYMOUS : 0);
+#ifdef MAP_FIXED_NOREPLACE
+    flags |= MAP_FIXED_NOREPLACE;
+#endif
+
+    void* ptr = mmap((void*) addr, size, prot, flags, fd, 0);
+    if (ptr == MAP_FAILED) {
+        return NULL;
+    }
+
+    // Older kernels treat the address as a hint
+    if ((uint64_t) ptr != addr) {
+        munmap(ptr, size);
+        errno = EEXIST;
+        return NULL;
+    }
+
+    return ptr;
+}
+
+
+
+static void unmap_segments(struct ivm_instance* instance)
+{
+    for (size_t i = 0; i < instance->num_mappings; ++i) {
+        munmap(instance->mappings[i], instance->mapping_sizes[i]);
+    }
+
+    instance->num_mappings = 0;
+}
+
+
+
+/*
+ * Map segments the way the kernel would map the image file.
+ * The code segment includes the file headers, so its sections are placed
+ * at their offset in the file.
+ */
+static int map_segments(struct ivm_instance* instance, const struct ivm_image* image, const void* bytecode)
+{
+    size_t header_size = ivm_image_header_size(image);
+
+    ivm_list_foreach(const struct ivm_segment, segment, &image->segments) {
+        size_t size = segment->vm_size;
+        size_t offset = 0;
+
+        if (segment->type == IVM_SEG_CODE) {
+            offset = header_size + ivm_image_segment_offset(image, segment);
+            if (offset + segment->file_size > size) {
+                size = offset + segment->file_size;
+            }
+        }
+
+        size = IVM_ALIGN_ADDR(size, image->page_size);
+
+        unsigned char* ptr = map_fixed(segment->vm_start, size, PROT_READ | PROT_WRITE, -1);
+        if (ptr == NULL) {
+            int err = errno;
+            unmap_segments(instance);
+            return err;
+        }
+
+        instance->mappings[instance->num_mappings] = ptr;
+        instance->mapping_sizes[instance->num_mappings] = size;
+        instance->num_mappings++;
+
+        ivm_list_foreach(const struct ivm_section, section, &segment->sections) {
+            const void* data = section->type == IVM_SECT_BYTECODE ? bytecode : section->data;
+
+            if (data != NULL) {
+                size_t pos = segment->type == IVM_SEG_CODE ? offset + section->file_offset_to_seg : section->vm_offset_to_seg;
+                memcpy(ptr + pos, data, section->size);
+            }
+        }
+
+        if (segment->type == IVM_SEG_CODE && mprotect(ptr, size, PROT_READ | PROT_EXEC) != 0) {
+            int err = errno;
+            unmap_segments(instance);
+            return err;
+        }
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Map the shared VM code the way the kernel maps the program interpreter.
+ */
+static int map_shared_vm(struct ivm_instance* instance, const struct ivm_image* image)
+{
+    struct stat st;
+
+    int fd = open(image->vm_interp, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return errno;
+    }
+
+    if (fstat(fd, &st) != 0) {
+        int err = errno;
+        close(fd);
+        return err;
+    }
+
+    size_t size = IVM_ALIGN_ADDR(st.st_size, image->page_size);
+    void* ptr = map_fixed(image->vm_entry_point, size, PROT_READ | PROT_EXEC, fd);
+    int err = errno;
+    close(fd);
+
+    if (ptr == NULL) {
+        return err;
+    }
+
+    instance->mappings[instance->num_mappings] = ptr;
+    instance->mapping_sizes[instance->num_mappings] = size;
+    instance->num_mappings++;
+    return 0;
+}
+
+
+
+static void* run_vm(void* arg)
+{
+    struct ivm_instance* instance = arg;
+
+    pthread_mutex_lock(&instance->lock);
+
+    while (!instance->quit) {
+        if (!instance->pending) {
+            pthread_cond_wait(&instance->cond, &instance->lock);
+            continue;
+        }
+
+        instance->pending = false;
+        instance->running = true;
+        instance->data->steps = instance->steps;
+        pthread_mutex_unlock(&instance->lock);
+
+        int64_t status = instance->vm(instance->data);
+
+        pthread_mutex_lock(&instance->lock);
+        instance->status = status;
+        instance->running = false;
+        pthread_cond_broadcast(&instance->cond);
+    }
+
+    pthread_mutex_unlock(&instance->lock);
+    return NULL;
+}
+
+
+
+int ivm_instance_create(struct ivm_instance** handle, const struct ivm_image* image, const void* bytecode)
+{
+    int err;
+
+    if (handle == NULL || image == NULL || image->data->registers == NULL || image->data->vm_addr == 0) {
+        return EINVAL;
+    }
+
+    struct ivm_instance* instance = malloc(sizeof(struct ivm_instance));
+    if (instance == NULL) {
+        return errno;
+    }
+
+    instance->num_mappings = 0;
+    instance->mappings = calloc(image->num_segments + 1, sizeof(void*));
+    instance->mapping_sizes = calloc(image->num_segments + 1, sizeof(size_t));
+    if (instance->mappings == NULL || instance->mapping_sizes == NULL) {
+        err = errno;
+        goto free_instance;
+    }
+
+    err = map_segments(instance, image, bytecode);
+    if (err != 0) {
+        goto free_instance;
+    }
+
+    if (image->vm_interp != NULL) {
+        err = map_shared_vm(instance, image);
+        if (err != 0) {
+            unmap_segments(instance);
+            goto free_instance;
+        }
+    }
+
+    instance->data = (struct ivm_data*) ((uint64_t) image->data->registers - image->data_offset_to_regs);
+
+    // The call table is not part of the data section, see ivm_image_reserve_vm_data
+    memcpy(instance->data->ctable, ((const unsigned char*) image->data) + image->data_offset_to_ct, sizeof(uint64_t) * IVM_CTABLE_SIZE);
+    instance->vm = (int64_t (*)(struct ivm_data*)) instance->data->vm_addr;
+    instance->running = false;
+    instance->quit = false;
+    instance->pending = false;
+    instance->steps = 0;
+    instance->status = IVM_EXIT_PAUSE;
+
+    pthread_mutex_init(&instance->lock, NULL);
+    pthread_cond_init(&instance->cond, NULL);
+
+    err = pthread_create(&instance->thread, NULL, run_vm, instance);
+    if (err != 0) {
+        pthread_cond_destroy(&instance->cond);
+        pthread_mutex_destroy(&instance->lock);
+        unmap_segments(instance);
+        goto free_instance;
+    }
+
+    *handle = instance;
+    return 0;
+
+free_instance:
+    free(instance->mappings);
+    free(instance->mapping_sizes);
+    free(instance);
+    return err;
+}
+
+
+
+void ivm_instance_remove(struct ivm_instance* instance)
+{
+    pthread_mutex_lock(&instance->lock);
+    instance->quit = true;
+    if (instance->running) {
+        __atomic_fetch_or(&instance->data->registers->intr, (uint16_t) (1 << IVM_INTR_EXTERNAL_EVENT), __ATOMIC_SEQ_CST);
+    }
+    pthread_cond_broadcast(&instance->cond);
+    pthread_mutex_unlock(&instance->lock);
+
+    pthread_join(instance->thread, NULL);
+
+    pthread_cond_destroy(&instance->cond);
+    pthread_mutex_destroy(&instance->lock);
+    unmap_segments(instance);
+
+    free(instance->mappings);
+    free(instance->mapping_sizes);
+    free(instance);
+}
+
+
+
+static int request_run(struct ivm_instance* instance, uint64_t steps)
+{
+    int err = 0;
+
+    pthread_mutex_lock(&instance->lock);
+
+    if (instance->running || instance->pending) {
+        err = EBUSY;
+    }
+    else {
+        instance->steps = steps;
+        instance->pending = true;
+        pthread_cond_broadcast(&instance->cond);
+    }
+
+    pthread_mutex_unlock(&instance->lock);
+    return err;
+}
+
+
+
+int ivm_instance_run(struct ivm_instance* instance)
+{
+    return request_run(instance, 0);
+}
+
+
+
+int ivm_instance_step(struct ivm_instance* instance, uint64_t steps)
+{
+    if (steps == 0) {
+        return EINVAL;
+    }
+
+    return request_run(instance, steps);
+}
+
+
+
+int ivm_instance_pause(struct ivm_instance* instance)
+{
+    pthread_mutex_lock(&instance->lock);
+
+    if (instance->running || instance->pending) {
+        __atomic_fetch_or(&instance->data->registers->intr, (uint16_t) (1 << IVM_INTR_EXTERNAL_EVENT), __ATOMIC_SEQ_CST);
+    }
+
+    pthread_mutex_unlock(&instance->lock);
+    return 0;
+}
+
+
+
+int ivm_instance_wait(struct ivm_instance* instance, int64_t* status, struct ivm_registers* registers)
+{
+    pthread_mutex_lock(&instance->lock);
+
+    while (instance->running || instance->pending) {
+        pthread_cond_wait(&instance->cond, &instance->lock);
+    }
+
+    if (status != NULL) {
+        *status = instance->status;
+    }
+
+    if (registers != NULL) {
+        memcpy(registers, instance->data->registers, sizeof(struct ivm_registers));
+    }
+
+    pthread_mutex_unlock(&instance->lock);
+    return 0;
+}
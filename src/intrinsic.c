@@ -0,0 +1,662 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <ivm_vm.h>
+#include <ivm_memory.h>
+#include <ivm_interrupt.h>
+#include <ivm_image.h>
+#include <ivm_native.h>
+#include <ivm_channel.h>
+
+
+/*
+ * Identifies an initialized map ("IVMM").
+ */
+#define MAP_MAGIC 0x4d4d5649
+
+
+/*
+ * Control bytes.
+ * Full slots hold the top seven bits of the hash, so most mismatching keys
+ * are rejected without reading their slot.
+ */
+#define CTRL_EMPTY      0x00
+#define CTRL_DELETED    0x01
+#define CTRL_FULL       0x80
+
+
+/*
+ * Use insertion sort below this many records.
+ */
+#define SORT_THRESHOLD  32
+
+
+struct map_header
+{
+    uint32_t    capacity;   // Number of slots, a power of two
+    uint32_t    count;      // Number of keys
+    uint32_t    deleted;    // Number of deleted slots
+    uint32_t    magic;      // MAP_MAGIC
+};
+
+
+struct map_slot
+{
+    uint32_t    key;
+    uint32_t    value;
+};
+
+
+/*
+ * Hash map in guest memory.
+ * Control bytes and slots are translated one at a time, so an operation only
+ * checks the frames it touches. A failed translation returns scratch memory
+ * that reads as empty, and the fault is reported when the operation ends.
+ */
+struct map
+{
+    struct ivm_data*    vm;
+    uint32_t            addr;       // Address of the header, including BP
+    uint16_t            access;     // Access needed by the operation
+    bool                fault;      // A translation failed
+    uint32_t            mask;       // Capacity - 1
+    struct map_header*  header;
+    struct map_slot     scratch;    // Returned for failed translations
+};
+
+
+
+static uint32_t hash_key(uint32_t key)
+{
+    key ^= key >> 16;
+    key *= 0x85ebca6b;
+    key ^= key >> 13;
+    key *= 0xc2b2ae35;
+    key ^= key >> 16;
+    return key;
+}
+
+
+
+/*
+ * Get a host pointer to a guest span, or raise a frame fault.
+ */
+static void* guest_span(struct ivm_data* vm, uint32_t addr, uint64_t len, uint16_t access)
+{
+    void* ptr = NULL;
+
+    if (len <= UINT32_MAX) {
+        ptr = ivm_native_memory(vm, vm->regs.bp + addr, len, access);
+    }
+
+    if (ptr == NULL) {
+        vm->regs.intr |= 1 << IVM_INTR_FRAME_FAULT;
+    }
+
+    return ptr;
+}
+
+
+
+static void* map_access(struct map* map, uint32_t offset, uint32_t len)
+{
+    void* ptr = ivm_native_memory(map->vm, map->addr + offset, len, map->access);
+
+    if (ptr == NULL) {
+        map->fault = true;
+        map->scratch.key = 0;
+        map->scratch.value = 0;
+        return &map->scratch;
+    }
+
+    return ptr;
+}
+
+
+
+static uint8_t* map_ctrl(struct map* map, uint32_t idx)
+{
+    return map_access(map, sizeof(struct map_header) + idx, 1);
+}
+
+
+
+static struct map_slot* map_slot(struct map* map, uint32_t idx)
+{
+    return map_access(map, sizeof(struct map_header) + map->mask + 1 + sizeof(struct map_slot) * idx, sizeof(struct map_slot));
+}
+
+
+
+/*
+ * Open the hash map at the given guest address.
+ * Returns false and sets the status in R00 if the map can not be used.
+ */
+static bool open_map(struct map* map, uint32_t* r, struct ivm_data* vm, uint16_t access)
+{
+    map->vm = vm;
+    map->addr = vm->regs.bp + r[1];
+    map->access = access;
+    map->fault = false;
+
+    if ((map->addr & 7) != 0) {
+        r[0] = IVM_NATIVE_INVALID;
+        return false;
+    }
+
+    map->header = guest_span(vm, r[1], sizeof(struct map_header), access);
+    if (map->header == NULL) {
+        return false;
+    }
+
+    uint32_t capacity = map->header->capacity;
+    if (map->header->magic != MAP_MAGIC || capacity < 8 || (capacity & (capacity - 1)) != 0
+            || (uint64_t) map->addr + IVM_MAP_SIZE((uint64_t) capacity) > UINT32_MAX + 1ULL) {
+        r[0] = IVM_NATIVE_INVALID;
+        return false;
+    }
+
+    map->mask = capacity - 1;
+    return true;
+}
+
+
+
+/*
+ * Finish an operation, raising a frame fault if guest memory could not be
+ * accessed. Returns false if the operation failed.
+ */
+static bool close_map(struct map* map)
+{
+    if (map->fault) {
+        map->vm->regs.intr |= 1 << IVM_INTR_FRAME_FAULT;
+        return false;
+    }
+
+    return true;
+}
+
+
+
+/*
+ * Read the group of eight control bytes that holds the given slot.
+ * Groups are 8-byte aligned in guest memory and never cross a frame.
+ */
+static uint64_t map_group(struct map* map, uint32_t idx)
+{
+    uint64_t group;
+    memcpy(&group, map_access(map, sizeof(struct map_header) + (idx & ~7U), 8), sizeof(group));
+    return group;
+}
+
+
+
+/*
+ * Mask with the high bit set in every byte at or after the given offset in
+ * its group.
+ */
+static inline uint64_t group_from(uint32_t idx)
+{
+    return (0x8080808080808080ULL << (8 * (idx & 7)));
+}
+
+
+
+/*
+ * Find the slot of a key.
+ * Eight control bytes are compared at a time. A byte is empty if both its
+ * high and low bits are clear, and candidate tags are confirmed byte by byte
+ * since the zero byte test can flag the byte after a real match.
+ * Returns the slot index, or the capacity if the key is not in the map.
+ */
+static uint32_t find_key(struct map* map, uint32_t key)
+{
+    uint32_t hash = hash_key(key);
+    uint8_t tag = CTRL_FULL | (hash >> 25);
+    uint64_t pattern = 0x0101010101010101ULL * tag;
+    uint32_t idx = hash & map->mask;
+
+    for (uint32_t probed = 0; probed <= map->mask; ) {
+        uint64_t group = map_group(map, idx);
+        uint64_t from = group_from(idx);
+        uint64_t empty = ~group & ~(group << 7) & from;
+        uint64_t diff = group ^ pattern;
+        uint64_t match = (diff - 0x0101010101010101ULL) & ~diff & from;
+
+        // Only candidates before the first empty byte belong to the probe sequence
+        if (empty != 0) {
+            match &= (empty & -empty) - 1;
+        }
+
+        while (match != 0) {
+            uint32_t byte = __builtin_ctzll(match) / 8;
+            uint32_t slot = (idx & ~7U) + byte;
+
+            if (((group >> (8 * byte)) & 0xff) == tag && map_slot(map, slot)->key == key) {
+                return slot;
+            }
+
+            match &= match - 1;
+        }
+
+        if (empty != 0) {
+            break;
+        }
+
+        probed += 8 - (idx & 7);
+        idx = ((idx & ~7U) + 8) & map->mask;
+    }
+
+    return map->mask + 1;
+}
+
+
+
+/*
+ * Put a key that is not in the map into the first free slot of its probe
+ * sequence. Free slots are the empty and deleted ones, which have the high
+ * bit of their control byte clear.
+ * The control bytes and counts are in guest memory, so the probe is bounded
+ * by the capacity as in find_key. Returns false if there is no free slot.
+ */
+static bool place_key(struct map* map, uint32_t key, uint32_t value)
+{
+    uint32_t hash = hash_key(key);
+    uint32_t idx = hash & map->mask;
+    uint64_t free = 0;
+
+    for (uint32_t probed = 0; probed <= map->mask; ) {
+        free = ~map_group(map, idx) & group_from(idx);
+        if (free != 0) {
+            break;
+        }
+
+        probed += 8 - (idx & 7);
+        idx = ((idx & ~7U) + 8) & map->mask;
+    }
+
+    if (free == 0) {
+        return false;
+    }
+
+    idx = (idx & ~7U) + __builtin_ctzll(free) / 8;
+
+    uint8_t* ctrl = map_ctrl(map, idx);
+    if (*ctrl == CTRL_DELETED) {
+        map->header->deleted--;
+    }
+
+    *ctrl = CTRL_FULL | (hash >> 25);
+    struct map_slot* slot = map_slot(map, idx);
+    slot->key = key;
+    slot->value = value;
+    map->header->count++;
+    return true;
+}
+
+
+
+/*
+ * Remove deleted slots by inserting every key again.
+ * Returns EINVAL if a key could not be placed, which only happens if the
+ * guest changed the map behind our back.
+ */
+static int purge_deleted(struct map* map)
+{
+    uint32_t count = map->header->count;
+    struct map_slot* saved = malloc(sizeof(struct map_slot) * (count > 0 ? count : 1));
+    if (saved == NULL) {
+        return errno;
+    }
+
+    uint32_t n = 0;
+    for (uint32_t i = 0; i <= map->mask && n < count; ++i) {
+        if (*map_ctrl(map, i) & CTRL_FULL) {
+            saved[n++] = *map_slot(map, i);
+        }
+    }
+
+    for (uint32_t i = 0; i <= map->mask; ++i) {
+        *map_ctrl(map, i) = CTRL_EMPTY;
+    }
+
+    map->header->count = 0;
+    map->header->deleted = 0;
+
+    int err = 0;
+    for (uint32_t i = 0; i < n && err == 0; ++i) {
+        if (!place_key(map, saved[i].key, saved[i].value)) {
+            err = EINVAL;
+        }
+    }
+
+    free(saved);
+    return err;
+}
+
+
+
+static void map_init(uint32_t* r, struct ivm_frame* ftable, struct ivm_data* vm)
+{
+    (void) ftable;
+    uint32_t addr = r[1];
+    uint32_t capacity = r[2];
+
+    if (((vm->regs.bp + addr) & 7) != 0 || capacity < 8 || (capacity & (capacity - 1)) != 0) {
+        r[0] = IVM_NATIVE_INVALID;
+        return;
+    }
+
+    struct map_header* header = guest_span(vm, addr, IVM_MAP_SIZE((uint64_t) capacity), IVM_FRAME_ATTR_READ | IVM_FRAME_ATTR_WRITE);
+    if (header == NULL) {
+        return;
+    }
+
+    header->capacity = capacity;
+    header->count = 0;
+    header->deleted = 0;
+    header->magic = MAP_MAGIC;
+    memset(header + 1, CTRL_EMPTY, capacity);
+
+    r[0] = IVM_NATIVE_OK;
+}
+
+
+
+static void map_insert(uint32_t* r, struct ivm_frame* ftable, struct ivm_data* vm)
+{
+    (void) ftable;
+    struct map map;
+
+    if (!open_map(&map, r, vm, IVM_FRAME_ATTR_READ | IVM_FRAME_ATTR_WRITE)) {
+        return;
+    }
+
+    uint32_t idx = find_key(&map, r[2]);
+    if (idx <= map.mask) {
+        map_slot(&map, idx)->value = r[3];
+        if (close_map(&map)) {
+            r[0] = IVM_NATIVE_OK;
+        }
+        return;
+    }
+
+    uint32_t limit = map.mask + 1 - (map.mask + 1) / 8;
+    if (map.header->count + 1 > limit) {
+        if (close_map(&map)) {
+            r[0] = IVM_NATIVE_FULL;
+        }
+        return;
+    }
+
+    if (map.header->count + map.header->deleted + 1 > limit) {
+        int err = purge_deleted(&map);
+        if (err != 0) {
+            if (close_map(&map)) {
+                r[0] = err == ENOMEM ? IVM_NATIVE_NO_MEMORY : IVM_NATIVE_INVALID;
+            }
+            return;
+        }
+    }
+
+    if (!place_key(&map, r[2], r[3])) {
+        if (close_map(&map)) {
+            r[0] = IVM_NATIVE_INVALID;
+        }
+        return;
+    }
+
+    if (close_map(&map)) {
+        r[0] = IVM_NATIVE_OK;
+    }
+}
+
+
+
+static void map_lookup(uint32_t* r, struct ivm_frame* ftable, struct ivm_data* vm)
+{
+    (void) ftable;
+    struct map map;
+
+    if (!open_map(&map, r, vm, IVM_FRAME_ATTR_READ)) {
+        return;
+    }
+
+    uint32_t idx = find_key(&map, r[2]);
+    uint32_t value = idx <= map.mask ? map_slot(&map, idx)->value : 0;
+
+    if (!close_map(&map)) {
+        return;
+    }
+
+    if (idx > map.mask) {
+        r[0] = IVM_NATIVE_NOT_FOUND;
+        return;
+    }
+
+    r[3] = value;
+    r[0] = IVM_NATIVE_OK;
+}
+
+
+
+static void map_erase(uint32_t* r, struct ivm_frame* ftable, struct ivm_data* vm)
+{
+    (void) ftable;
+    struct map map;
+
+    if (!open_map(&map, r, vm, IVM_FRAME_ATTR_READ | IVM_FRAME_ATTR_WRITE)) {
+        return;
+    }
+
+    uint32_t idx = find_key(&map, r[2]);
+    if (idx > map.mask) {
+        if (close_map(&map)) {
+            r[0] = IVM_NATIVE_NOT_FOUND;
+        }
+        return;
+    }
+
+    // A slot followed by an empty slot ends no probe sequence
+    uint8_t* ctrl = map_ctrl(&map, idx);
+    if (*map_ctrl(&map, (idx + 1) & map.mask) == CTRL_EMPTY) {
+        *ctrl = CTRL_EMPTY;
+    }
+    else {
+        *ctrl = CTRL_DELETED;
+        map.header->deleted++;
+    }
+
+    map.header->count--;
+    if (close_map(&map)) {
+        r[0] = IVM_NATIVE_OK;
+    }
+}
+
+
+
+static inline uint32_t record_key(const unsigned char* record)
+{
+    uint32_t key;
+    memcpy(&key, record, sizeof(key));
+    return key;
+}
+
+
+
+static void insertion_sort(unsigned char* base, size_t n, size_t size, unsigned char* tmp)
+{
+    for (size_t i = 1; i < n; ++i) {
+        uint32_t key = record_key(base + i * size);
+        size_t j = i;
+
+        while (j > 0 && record_key(base + (j - 1) * size) > key) {
+            --j;
+        }
+
+        if (j != i) {
+            memcpy(tmp, base + i * size, size);
+            memmove(base + (j + 1) * size, base + j * size, (i - j) * size);
+            memcpy(base + j * size, tmp, size);
+        }
+    }
+}
+
+
+
+/*
+ * Move records into buckets by one byte of the key.
+ * The record size is a constant in the common cases, so the copies become
+ * plain loads and stores.
+ */
+static inline __attribute__((always_inline))
+void radix_pass(const unsigned char* src, unsigned char* dst, size_t n, size_t size, int shift, size_t* offsets)
+{
+    for (size_t i = 0; i < n; ++i) {
+        const unsigned char* record = src + i * size;
+        size_t bucket = (record_key(record) >> shift) & 0xff;
+        memcpy(dst + offsets[bucket] * size, record, size);
+        offsets[bucket]++;
+    }
+}
+
+
+
+/*
+ * Stable LSD radix sort on the 32-bit key, one byte per pass. Passes where
+ * every key has the same byte are skipped.
+ */
+static void radix_sort(unsigned char* base, size_t n, size_t size, unsigned char* tmp)
+{
+    size_t counts[4][256];
+    memset(counts, 0, sizeof(counts));
+
+    for (size_t i = 0; i < n; ++i) {
+        uint32_t key = record_key(base + i * size);
+        counts[0][key & 0xff]++;
+        counts[1][(key >> 8) & 0xff]++;
+        counts[2][(key >> 16) & 0xff]++;
+        counts[3][key >> 24]++;
+    }
+
+    unsigned char* src = base;
+    unsigned char* dst = tmp;
+
+    for (int pass = 0; pass < 4; ++pass) {
+        size_t offsets[256];
+        size_t total = 0;
+        bool skip = false;
+
+        for (int b = 0; b < 256; ++b) {
+            if (counts[pass][b] == n) {
+                skip = true;
+                break;
+            }
+            offsets[b] = total;
+            total += counts[pass][b];
+        }
+
+        if (skip) {
+            continue;
+        }
+
+        switch (size) {
+            case 4:
+                radix_pass(src, dst, n, 4, pass * 8, offsets);
+                break;
+
+            case 8:
+                radix_pass(src, dst, n, 8, pass * 8, offsets);
+                break;
+
+            default:
+                radix_pass(src, dst, n, size, pass * 8, offsets);
+                break;
+        }
+
+        unsigned char* swap = src;
+        src = dst;
+        dst = swap;
+    }
+
+    if (src != base) {
+        memcpy(base, src, n * size);
+    }
+}
+
+
+
+static void sort_records(uint32_t* r, struct ivm_frame* ftable, struct ivm_data* vm)
+{
+    (void) ftable;
+    uint32_t n = r[2];
+    uint32_t size = r[3];
+
+    if (size == 0 || (size & 3) != 0) {
+        r[0] = IVM_NATIVE_INVALID;
+        return;
+    }
+
+    unsigned char* base = guest_span(vm, r[1], (uint64_t) n * size, IVM_FRAME_ATTR_READ | IVM_FRAME_ATTR_WRITE);
+    if (base == NULL) {
+        return;
+    }
+
+    if (n < 2) {
+        r[0] = IVM_NATIVE_OK;
+        return;
+    }
+
+    unsigned char* tmp = malloc(n < SORT_THRESHOLD ? size : (size_t) n * size);
+    if (tmp == NULL) {
+        r[0] = IVM_NATIVE_NO_MEMORY;
+        return;
+    }
+
+    if (n < SORT_THRESHOLD) {
+        insertion_sort(base, n, size, tmp);
+    }
+    else {
+        radix_sort(base, n, size, tmp);
+    }
+
+    free(tmp);
+    r[0] = IVM_NATIVE_OK;
+}
+
+
+
+int ivm_image_add_intrinsics(struct ivm_image* image)
+{
+    int err;
+
+    err = ivm_image_set_native(image, IVM_NATIVE_MAP_INIT, map_init);
+    if (err != 0) {
+        return err;
+    }
+
+    err = ivm_image_set_native(image, IVM_NATIVE_MAP_INSERT, map_insert);
+    if (err != 0) {
+        return err;
+    }
+
+    err = ivm_image_set_native(image, IVM_NATIVE_MAP_LOOKUP, map_lookup);
+    if (err != 0) {
+        return err;
+    }
+
+    err = ivm_image_set_native(image, IVM_NATIVE_MAP_ERASE, map_erase);
+    if (err != 0) {
+        return err;
+    }
+
+    err = ivm_image_set_native(image, IVM_NATIVE_SORT, sort_records);
+    if (err != 0) {
+        return err;
+    }
+
+    return ivm_image_set_native(image, IVM_NATIVE_CHANNEL_RING, ivm_channel_ring);
+}
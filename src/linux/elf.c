@@ -1,6 +1,12 @@
 #include <elf.h>
 #include <string.h>
 #include <errno.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <ivm_list.h>
 #include <ivm_image.h>
 #include <stdlib.h>
@@ -11,14 +17,378 @@
 
 
 
-int ivm_image_write(FILE* fp, const struct ivm_image* image, const void* bytecode)
+/*
+ * Get the number of program headers and size of the interpreter path.
+ */
+static size_t num_phdrs(const struct ivm_image* image, size_t* interp_size)
+{
+    *interp_size = image->vm_interp != NULL ? strlen(image->vm_interp) + 1 : 0;
+    return image->num_segments + (image->vm_interp != NULL ? 1 : 0);
+}
+
+
+
+/*
+ * Output file.
+ * Regular files are written at fixed offsets with pwritev, and padding
+ * between sections is left as holes. Other files are written in order,
+ * with padding written from a buffer of zeros.
+ */
+struct output
+{
+    FILE*       fp;
+    int         fd;
+    off_t       base;       // File offset of the image, -1 if written in order
+    size_t      pos;        // Bytes written so far when written in order
+};
+
+
+
+static const unsigned char zeros[4096];
+
+
+
+/*
+ * Number of buffers written by one call, the limit of pwritev on Linux.
+ */
+#define MAX_VECTORS     1024
+
+
+
+/*
+ * Largest number of threads writing section data.
+ */
+#define MAX_THREADS     64
+
+
+
+static int open_output(struct output* out, FILE* fp)
+{
+    struct stat st;
+
+    out->fp = fp;
+    out->fd = fileno(fp);
+    out->base = -1;
+    out->pos = 0;
+
+    if (fflush(fp) != 0) {
+        return errno;
+    }
+
+    if (fstat(out->fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        out->base = ftello(fp);
+
+        // Drop old contents, so that holes read as zeros
+        if (out->base >= 0 && ftruncate(out->fd, out->base) != 0) {
+            return errno;
+        }
+    }
+
+    return 0;
+}
+
+
+
+static int write_zeros(struct output* out, size_t size)
+{
+    while (size > 0) {
+        size_t n = size < sizeof(zeros) ? size : sizeof(zeros);
+        if (fwrite(zeros, n, 1, out->fp) != 1) {
+            return EIO;
+        }
+        out->pos += n;
+        size -= n;
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Write buffers back to back at an offset in the image.
+ */
+static int write_vectors(struct output* out, size_t offset, struct iovec* iov, int count)
+{
+    if (out->base < 0) {
+        if (offset < out->pos) {
+            return EINVAL;
+        }
+
+        int err = write_zeros(out, offset - out->pos);
+        for (int i = 0; i < count && err == 0; ++i) {
+            if (fwrite(iov[i].iov_base, iov[i].iov_len, 1, out->fp) != 1) {
+                err = EIO;
+            }
+            out->pos += iov[i].iov_len;
+        }
+        return err;
+    }
+
+    off_t pos = out->base + offset;
+    while (count > 0) {
+        ssize_t n = pwritev(out->fd, iov, count, pos);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        else if (n <= 0) {
+            return n < 0 ? errno : EIO;
+        }
+        pos += n;
+
+        // Skip what was written after a short write
+        while (count > 0 && (size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if (count > 0) {
+            iov->iov_base = ((unsigned char*) iov->iov_base) + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Set the size of the image and move the file position to its end.
+ */
+static int close_output(struct output* out, size_t size)
+{
+    if (out->base < 0) {
+        int err = write_zeros(out, size - out->pos);
+        return err != 0 || ferror(out->fp) ? EIO : 0;
+    }
+
+    if (ftruncate(out->fd, out->base + size) != 0) {
+        return errno;
+    }
+
+    if (fseeko(out->fp, out->base + size, SEEK_SET) != 0) {
+        return errno;
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Largest amount of section data written by one call, so that large
+ * sections are split between threads.
+ */
+#define CHUNK_SIZE      (4UL << 20)
+
+
+
+/*
+ * Run of adjacent section data written by one call.
+ */
+struct chunk
+{
+    size_t      offset;     // Offset in the image
+    size_t      first;      // First buffer
+    int         count;      // Number of buffers
+};
+
+
+
+/*
+ * Section data to write, split into chunks.
+ */
+struct writer
+{
+    struct output*      out;
+    struct iovec*       iov;
+    size_t              num_iov;
+    struct chunk*       chunks;
+    size_t              num_chunks;
+    size_t              next;       // Next chunk to write
+    int                 err;        // First error
+    pthread_mutex_t     lock;
+};
+
+
+
+/*
+ * Split the contents of all sections into chunks of adjacent data.
+ */
+static int find_chunks(struct writer* writer, const struct ivm_image* image, const void* bytecode, size_t data_start)
+{
+    size_t max_iov = 0;
+
+    ivm_list_foreach(const struct ivm_segment, segment, &image->segments) {
+        ivm_list_foreach(const struct ivm_section, section, &segment->sections) {
+            max_iov += 1 + section->size / CHUNK_SIZE;
+        }
+    }
+
+    writer->num_iov = 0;
+    writer->num_chunks = 0;
+    writer->iov = malloc(sizeof(struct iovec) * (max_iov > 0 ? max_iov : 1));
+    writer->chunks = malloc(sizeof(struct chunk) * (max_iov > 0 ? max_iov : 1));
+    if (writer->iov == NULL || writer->chunks == NULL) {
+        free(writer->chunks);
+        free(writer->iov);
+        return ENOMEM;
+    }
+
+    struct chunk* chunk = NULL;
+    size_t chunk_size = 0;
+    size_t file_start = data_start;
+
+    ivm_list_foreach(const struct ivm_segment, segment, &image->segments) {
+        size_t segment_start = file_start;
+        file_start += segment->file_size;
+
+        ivm_list_foreach(const struct ivm_section, section, &segment->sections) {
+            const unsigned char* ptr = section->type == IVM_SECT_BYTECODE ? bytecode : section->data;
+            size_t offset = segment_start + section->file_offset_to_seg;
+            size_t size = section->size;
+
+            // Sections without contents are left as zeros
+            if (ptr == NULL) {
+                continue;
+            }
+
+            while (size > 0) {
+                size_t n = size < CHUNK_SIZE ? size : CHUNK_SIZE;
+
+                if (chunk == NULL || offset != chunk->offset + chunk_size || chunk->count == MAX_VECTORS || chunk_size + n > CHUNK_SIZE) {
+                    chunk = &writer->chunks[writer->num_chunks++];
+                    chunk->offset = offset;
+                    chunk->first = writer->num_iov;
+                    chunk->count = 0;
+                    chunk_size = 0;
+                }
+
+                writer->iov[writer->num_iov].iov_base = (void*) ptr;
+                writer->iov[writer->num_iov].iov_len = n;
+                writer->num_iov++;
+                chunk->count++;
+                chunk_size += n;
+
+                ptr += n;
+                offset += n;
+                size -= n;
+            }
+        }
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Write chunks until there are none left or a write fails.
+ */
+static void* write_chunks(void* arg)
+{
+    struct writer* writer = arg;
+
+    while (true) {
+        pthread_mutex_lock(&writer->lock);
+        size_t idx = writer->next++;
+        bool done = idx >= writer->num_chunks || writer->err != 0;
+        pthread_mutex_unlock(&writer->lock);
+
+        if (done) {
+            break;
+        }
+
+        const struct chunk* chunk = &writer->chunks[idx];
+        int err = write_vectors(writer->out, chunk->offset, &writer->iov[chunk->first], chunk->count);
+        if (err != 0) {
+            pthread_mutex_lock(&writer->lock);
+            if (writer->err == 0) {
+                writer->err = err;
+            }
+            pthread_mutex_unlock(&writer->lock);
+        }
+    }
+
+    return NULL;
+}
+
+
+
+/*
+ * Write the contents of all sections, as few runs of adjacent sections as
+ * possible. Files written in order are written by the calling thread only.
+ */
+static int write_sections(struct output* out, const struct ivm_image* image, const void* bytecode, size_t data_start, size_t num_threads)
+{
+    struct writer writer;
+    pthread_t threads[MAX_THREADS];
+    size_t num_started = 0;
+
+    int err = find_chunks(&writer, image, bytecode, data_start);
+    if (err != 0) {
+        return err;
+    }
+
+    writer.out = out;
+    writer.next = 0;
+    writer.err = 0;
+    pthread_mutex_init(&writer.lock, NULL);
+
+    if (out->base < 0 || num_threads > writer.num_chunks) {
+        num_threads = out->base < 0 ? 1 : writer.num_chunks;
+    }
+
+    // The calling thread writes too, and carries on alone if no threads
+    // can be started
+    for (size_t i = 1; i < num_threads && i < MAX_THREADS; ++i) {
+        if (pthread_create(&threads[num_started], NULL, write_chunks, &writer) != 0) {
+            break;
+        }
+        num_started++;
+    }
+
+    write_chunks(&writer);
+
+    for (size_t i = 0; i < num_started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&writer.lock);
+    free(writer.chunks);
+    free(writer.iov);
+    return writer.err;
+}
+
+
+
+static void put(unsigned char** ptr, const void* data, size_t size)
+{
+    memcpy(*ptr, data, size);
+    *ptr += size;
+}
+
+
+
+size_t ivm_image_header_size(const struct ivm_image* image)
+{
+    size_t interp_size;
+    size_t ph_off = sizeof(Elf64_Ehdr) + sizeof(Elf64_Phdr) * num_phdrs(image, &interp_size);
+    return IVM_ALIGN_ADDR(ph_off + interp_size, image->page_size);
+}
+
+
+
+static int write_image(FILE* fp, const struct ivm_image* image, const void* bytecode, size_t num_threads)
 {
     if (image->vm_entry_point != LINUX_ENTRY) {
         return EINVAL;
     }
 
-    size_t ph_off = sizeof(Elf64_Ehdr) + sizeof(Elf64_Phdr) * image->num_segments;
-    size_t data_start = IVM_ALIGN_ADDR(ph_off, image->page_size);
+    size_t interp_size;
+    size_t ph_off = sizeof(Elf64_Ehdr) + sizeof(Elf64_Phdr) * num_phdrs(image, &interp_size);
+    size_t data_start = ivm_image_header_size(image);
     
     size_t data_end = data_start + image->file_size;
 
@@ -29,6 +399,18 @@ int ivm_image_write(FILE* fp, const struct ivm_image* image, const void* bytecod
     };
 
     size_t sh_start = data_end + sizeof(strs);
+    size_t sh_size = sizeof(Elf64_Shdr) * (2 + image->num_sections);
+
+    // Headers go to one buffer before the data, string and section header
+    // tables to one buffer after it
+    unsigned char* headers = malloc(ph_off + interp_size);
+    unsigned char* trailer = malloc(sizeof(strs) + sh_size);
+    if (headers == NULL || trailer == NULL) {
+        free(trailer);
+        free(headers);
+        return ENOMEM;
+    }
+    unsigned char* ptr = headers;
 
     Elf64_Ehdr ehdr;
     ehdr.e_ident[EI_MAG0] = ELFMAG0;
@@ -55,14 +437,31 @@ int ivm_image_write(FILE* fp, const struct ivm_image* image, const void* bytecod
     ehdr.e_shnum = 2 + image->num_sections;
     ehdr.e_shstrndx = 1 + image->num_sections;
 
-    fwrite(&ehdr, sizeof(ehdr), 1, fp);
+    put(&ptr, &ehdr, sizeof(ehdr));
+
+    // Let the kernel map the shared VM code as program interpreter
+    if (image->vm_interp != NULL) {
+        Elf64_Phdr phdr;
+        phdr.p_type = PT_INTERP;
+        phdr.p_flags = PF_R;
+        phdr.p_offset = ph_off;
+        phdr.p_filesz = interp_size;
+        phdr.p_vaddr = 0;
+        phdr.p_paddr = 0;
+        phdr.p_memsz = interp_size;
+        phdr.p_align = 1;
+
+        put(&ptr, &phdr, sizeof(phdr));
+    }
 
-    // Write program headers to file
+    // Write program headers to file, segment data follows the headers in
+    // the order the segments were added
+    size_t file_start = data_start;
     ivm_list_foreach(const struct ivm_segment, segment, &image->segments) {
         Elf64_Phdr phdr;
         phdr.p_type = PT_LOAD;
         phdr.p_flags = 0;
-        phdr.p_offset = data_start + segment->file_start;
+        phdr.p_offset = file_start;
         phdr.p_filesz = segment->file_size;
         phdr.p_vaddr = segment->vm_start;
         phdr.p_paddr = phdr.p_vaddr;
@@ -76,8 +475,8 @@ int ivm_image_write(FILE* fp, const struct ivm_image* image, const void* bytecod
             case IVM_SEG_CODE:
                 // Include ELF header and program headers
                 phdr.p_offset = 0;
-                phdr.p_filesz = data_start + segment->file_start + segment->file_size;
-                phdr.p_memsz = data_start + segment->file_start + segment->file_size;
+                phdr.p_filesz = file_start + segment->file_size;
+                phdr.p_memsz = file_start + segment->file_size;
                 phdr.p_flags = PF_R | PF_X;
                 break;
 
@@ -86,40 +485,18 @@ int ivm_image_write(FILE* fp, const struct ivm_image* image, const void* bytecod
                 break;
         }
 
-        fwrite(&phdr, sizeof(phdr), 1, fp);
-    }
-
-    // Write padding to file
-    for (size_t i = 0; i < data_start - ph_off; ++i) {
-        fputc('\x00', fp);
+        put(&ptr, &phdr, sizeof(phdr));
+        file_start += segment->file_size;
     }
 
-    // Write data to file
-    ivm_list_foreach(const struct ivm_segment, segment, &image->segments) {
-
-        ivm_list_foreach(const struct ivm_section, section, &segment->sections) {
-            const void* ptr = NULL;
-
-            switch (section->type) {
-                case IVM_SECT_BYTECODE:
-                    ptr = bytecode;
-                    break;
-
-                default:
-                    ptr = section->data;
-                    break;
-            }
-
-            fwrite(ptr, section->size, 1, fp);
-
-            for (size_t i = 0; i < section->file_padding; ++i) {
-                fputc('\x00', fp);
-            }
-        }
+    // Write interpreter path to file
+    if (image->vm_interp != NULL) {
+        put(&ptr, image->vm_interp, interp_size);
     }
 
     // Write string table contents
-    fwrite(strs, sizeof(strs), 1, fp);
+    ptr = trailer;
+    put(&ptr, strs, sizeof(strs));
 
     // Write NULL section header
     Elf64_Shdr nshdr;
@@ -133,17 +510,20 @@ int ivm_image_write(FILE* fp, const struct ivm_image* image, const void* bytecod
     nshdr.sh_info = 0;
     nshdr.sh_addralign = 0;
     nshdr.sh_entsize = 0;
-    fwrite(&nshdr, sizeof(nshdr), 1, fp);
+    put(&ptr, &nshdr, sizeof(nshdr));
 
     // Write section headers
+    file_start = data_start;
     ivm_list_foreach(const struct ivm_segment, segment, &image->segments) {
+        size_t segment_start = file_start;
+        file_start += segment->file_size;
 
         ivm_list_foreach(const struct ivm_section, section, &segment->sections) {
             Elf64_Shdr shdr;
             shdr.sh_name = idxs[section->type];
             shdr.sh_type = 0;
             shdr.sh_flags = 0;
-            shdr.sh_offset = data_start + segment->file_start + section->file_offset_to_seg;
+            shdr.sh_offset = segment_start + section->file_offset_to_seg;
             shdr.sh_size = section->size + section->file_padding;
             shdr.sh_link = 0;
             shdr.sh_info = 0;
@@ -180,7 +560,7 @@ int ivm_image_write(FILE* fp, const struct ivm_image* image, const void* bytecod
                     break;
             }
 
-            fwrite(&shdr, sizeof(shdr), 1, fp);
+            put(&ptr, &shdr, sizeof(shdr));
         }
     }
 
@@ -197,7 +577,53 @@ int ivm_image_write(FILE* fp, const struct ivm_image* image, const void* bytecod
     strtab.sh_addralign = 1;
     strtab.sh_entsize = 0;// sizeof(strs);
     
-    fwrite(&strtab, sizeof(strtab), 1, fp);
+    put(&ptr, &strtab, sizeof(strtab));
 
-    return 0;
+    // Padding after the headers and between sections is not written
+    struct output out;
+    struct iovec iov;
+    int err = open_output(&out, fp);
+
+    if (err == 0) {
+        iov.iov_base = headers;
+        iov.iov_len = ph_off + interp_size;
+        err = write_vectors(&out, 0, &iov, 1);
+    }
+
+    if (err == 0) {
+        err = write_sections(&out, image, bytecode, data_start, num_threads);
+    }
+
+    if (err == 0) {
+        iov.iov_base = trailer;
+        iov.iov_len = sizeof(strs) + sh_size;
+        err = write_vectors(&out, data_end, &iov, 1);
+    }
+
+    if (err == 0) {
+        err = close_output(&out, sh_start + sh_size);
+    }
+
+    free(trailer);
+    free(headers);
+    return err;
+}
+
+
+
+int ivm_image_write(FILE* fp, const struct ivm_image* image, const void* bytecode)
+{
+    return write_image(fp, image, bytecode, 1);
+}
+
+
+
+int ivm_image_write_parallel(FILE* fp, const struct ivm_image* image, const void* bytecode, size_t num_threads)
+{
+    if (num_threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = cpus > 0 ? cpus : 1;
+    }
+
+    return write_image(fp, image, bytecode, num_threads);
 }
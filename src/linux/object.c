@@ -0,0 +1,729 @@
+#include <elf.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <ivm_entry.h>
+#include <ivm_object.h>
+
+
+#define AR_MAGIC        "!<arch>\n"
+#define AR_MAGIC_SIZE   8
+#define AR_HDR_SIZE     60
+
+/*
+ * Size of the jump to the loader at the start of the code.
+ */
+#define LOADER_JUMP_SIZE 8
+
+
+
+/*
+ * Relocatable object file, possibly a member of an archive.
+ */
+struct object
+{
+    const unsigned char*    data;       // Contents of the object file
+    size_t                  size;       // Size of the object file
+    const Elf64_Shdr*       shdrs;      // Section headers
+    size_t                  num_shdrs;  // Number of section headers
+    const Elf64_Sym*        syms;       // Symbol table
+    size_t                  num_syms;   // Number of symbols
+    size_t                  symtab;     // Index of symbol table section
+    const char*             strtab;     // Symbol names
+    size_t                  strtab_size;// Size of symbol names
+    bool*                   used;       // Section is copied
+    uint64_t*               addrs;      // Address of copied sections
+};
+
+
+
+/*
+ * Symbol resolved to the object that defines it.
+ */
+struct symbol
+{
+    const struct object*    object;
+    const Elf64_Sym*        sym;
+};
+
+
+
+static int read_file(const char* filename, unsigned char** data, size_t* size)
+{
+    FILE* fp = fopen(filename, "rb");
+    if (fp == NULL) {
+        return errno;
+    }
+
+    if (fseek(fp, 0, SEEK_END) != 0) {
+        int err = errno;
+        fclose(fp);
+        return err;
+    }
+
+    long length = ftell(fp);
+    rewind(fp);
+
+    if (length <= 0) {
+        fclose(fp);
+        return ENOEXEC;
+    }
+
+    *data = malloc(length);
+    if (*data == NULL) {
+        int err = errno;
+        fclose(fp);
+        return err;
+    }
+
+    if (fread(*data, length, 1, fp) != 1) {
+        free(*data);
+        fclose(fp);
+        return EIO;
+    }
+
+    fclose(fp);
+    *size = length;
+    return 0;
+}
+
+
+
+static bool is_elf(const unsigned char* data, size_t size)
+{
+    return size >= sizeof(Elf64_Ehdr) && memcmp(data, ELFMAG, SELFMAG) == 0;
+}
+
+
+
+static int parse_object(struct object* obj, const unsigned char* data, size_t size)
+{
+    const Elf64_Ehdr* ehdr = (const Elf64_Ehdr*) data;
+
+    if (!is_elf(data, size)
+            || ehdr->e_ident[EI_CLASS] != ELFCLASS64
+            || ehdr->e_ident[EI_DATA] != ELFDATA2LSB
+            || ehdr->e_type != ET_REL
+            || ehdr->e_machine != EM_X86_64
+            || ehdr->e_shentsize != sizeof(Elf64_Shdr)
+            || ehdr->e_shoff > size
+            || ehdr->e_shnum > (size - ehdr->e_shoff) / sizeof(Elf64_Shdr)) {
+        return ENOEXEC;
+    }
+
+    obj->data = data;
+    obj->size = size;
+    obj->shdrs = (const Elf64_Shdr*) (data + ehdr->e_shoff);
+    obj->num_shdrs = ehdr->e_shnum;
+    obj->syms = NULL;
+    obj->num_syms = 0;
+    obj->strtab = NULL;
+    obj->strtab_size = 0;
+
+    for (size_t i = 0; i < obj->num_shdrs; ++i) {
+        const Elf64_Shdr* shdr = &obj->shdrs[i];
+
+        if (shdr->sh_type != SHT_NOBITS && (shdr->sh_offset > size || shdr->sh_size > size - shdr->sh_offset)) {
+            return ENOEXEC;
+        }
+
+        if (shdr->sh_type == SHT_SYMTAB) {
+            if (shdr->sh_link >= obj->num_shdrs) {
+                return ENOEXEC;
+            }
+
+            const Elf64_Shdr* strs = &obj->shdrs[shdr->sh_link];
+            obj->symtab = i;
+            obj->syms = (const Elf64_Sym*) (data + shdr->sh_offset);
+            obj->num_syms = shdr->sh_size / sizeof(Elf64_Sym);
+            obj->strtab = (const char*) (data + strs->sh_offset);
+            obj->strtab_size = strs->sh_size;
+        }
+    }
+
+    obj->used = calloc(obj->num_shdrs, sizeof(bool));
+    obj->addrs = calloc(obj->num_shdrs, sizeof(uint64_t));
+    if (obj->used == NULL || obj->addrs == NULL) {
+        free(obj->used);
+        free(obj->addrs);
+        return ENOMEM;
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Find the next member of an archive.
+ */
+static bool next_member(const unsigned char* data, size_t size, size_t* pos, const unsigned char** member, size_t* member_size)
+{
+    while (*pos + AR_HDR_SIZE <= size) {
+        const char* hdr = (const char*) data + *pos;
+        char field[11];
+
+        memcpy(field, hdr + 48, 10);
+        field[10] = '\0';
+
+        size_t length = strtoul(field, NULL, 10);
+        size_t start = *pos + AR_HDR_SIZE;
+        if (length > size - start) {
+            return false;
+        }
+
+        *pos = start + length + (length & 1);
+
+        // Skip symbol index and long name table
+        if (hdr[0] == '/' && (hdr[1] == ' ' || hdr[1] == '/' || hdr[1] == 'S')) {
+            continue;
+        }
+
+        *member = data + start;
+        *member_size = length;
+        return true;
+    }
+
+    return false;
+}
+
+
+
+static void free_objects(struct object* objects, size_t num_objects)
+{
+    for (size_t i = 0; i < num_objects; ++i) {
+        free(objects[i].used);
+        free(objects[i].addrs);
+    }
+
+    free(objects);
+}
+
+
+
+/*
+ * Parse all relocatable objects in a file, which is either an object file or
+ * an archive of object files.
+ */
+static int parse_objects(struct object** handle, size_t* num_objects, const unsigned char* data, size_t size)
+{
+    int err;
+    size_t pos;
+    const unsigned char* member;
+    size_t member_size;
+
+    if (is_elf(data, size)) {
+        struct object* obj = malloc(sizeof(struct object));
+        if (obj == NULL) {
+            return errno;
+        }
+
+        err = parse_object(obj, data, size);
+        if (err != 0) {
+            free(obj);
+            return err;
+        }
+
+        *handle = obj;
+        *num_objects = 1;
+        return 0;
+    }
+
+    if (size < AR_MAGIC_SIZE || memcmp(data, AR_MAGIC, AR_MAGIC_SIZE) != 0) {
+        return ENOEXEC;
+    }
+
+    size_t n = 0;
+    pos = AR_MAGIC_SIZE;
+    while (next_member(data, size, &pos, &member, &member_size)) {
+        n += is_elf(member, member_size) ? 1 : 0;
+    }
+
+    struct object* objects = calloc(n > 0 ? n : 1, sizeof(struct object));
+    if (objects == NULL) {
+        return errno;
+    }
+
+    size_t i = 0;
+    pos = AR_MAGIC_SIZE;
+    while (i < n && next_member(data, size, &pos, &member, &member_size)) {
+        if (!is_elf(member, member_size)) {
+            continue;
+        }
+
+        err = parse_object(&objects[i], member, member_size);
+        if (err != 0) {
+            free_objects(objects, i);
+            return err;
+        }
+        ++i;
+    }
+
+    *handle = objects;
+    *num_objects = n;
+    return 0;
+}
+
+
+
+static const char* symbol_name(const struct object* obj, const Elf64_Sym* sym)
+{
+    if (sym->st_name >= obj->strtab_size) {
+        return "";
+    }
+
+    return obj->strtab + sym->st_name;
+}
+
+
+
+/*
+ * Find a global symbol defined in any of the objects.
+ */
+static bool find_symbol(struct symbol* symbol, const struct object* objects, size_t num_objects, const char* name)
+{
+    bool found = false;
+
+    for (size_t i = 0; i < num_objects; ++i) {
+        const struct object* obj = &objects[i];
+
+        for (size_t j = 1; j < obj->num_syms; ++j) {
+            const Elf64_Sym* sym = &obj->syms[j];
+            int bind = ELF64_ST_BIND(sym->st_info);
+
+            if (sym->st_shndx == SHN_UNDEF || (bind != STB_GLOBAL && bind != STB_WEAK)) {
+                continue;
+            }
+
+            if (strcmp(symbol_name(obj, sym), name) != 0) {
+                continue;
+            }
+
+            symbol->object = obj;
+            symbol->sym = sym;
+            found = true;
+
+            if (bind == STB_GLOBAL) {
+                return true;
+            }
+        }
+    }
+
+    return found;
+}
+
+
+
+/*
+ * Resolve a symbol referred to by a relocation.
+ */
+static int resolve(struct symbol* symbol, const struct object* objects, size_t num_objects, const struct object* obj, size_t idx)
+{
+    if (idx >= obj->num_syms) {
+        return ENOEXEC;
+    }
+
+    const Elf64_Sym* sym = &obj->syms[idx];
+
+    if (sym->st_shndx == SHN_UNDEF) {
+        if (!find_symbol(symbol, objects, num_objects, symbol_name(obj, sym))) {
+            return ENOENT;
+        }
+    }
+    else {
+        symbol->object = obj;
+        symbol->sym = sym;
+    }
+
+    if (symbol->sym->st_shndx == SHN_COMMON) {
+        return ENOTSUP;
+    }
+
+    if (symbol->sym->st_shndx != SHN_ABS && symbol->sym->st_shndx >= symbol->object->num_shdrs) {
+        return ENOEXEC;
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Mark a section to be copied, along with all sections it refers to.
+ */
+static int use_section(struct object* objects, size_t num_objects, struct object* obj, size_t idx)
+{
+    int err;
+
+    if (obj->used[idx]) {
+        return 0;
+    }
+
+    const Elf64_Shdr* shdr = &obj->shdrs[idx];
+
+    if (!(shdr->sh_flags & SHF_ALLOC)) {
+        return ENOEXEC;
+    }
+
+    // The code is mapped read-only and shared by all guests
+    if ((shdr->sh_flags & SHF_WRITE) && shdr->sh_size > 0) {
+        return ENOTSUP;
+    }
+
+    obj->used[idx] = true;
+
+    for (size_t i = 0; i < obj->num_shdrs; ++i) {
+        const Elf64_Shdr* rel = &obj->shdrs[i];
+
+        if (rel->sh_type != SHT_RELA || rel->sh_info != idx || rel->sh_link != obj->symtab) {
+            continue;
+        }
+
+        const Elf64_Rela* relas = (const Elf64_Rela*) (obj->data + rel->sh_offset);
+        for (size_t j = 0; j < rel->sh_size / sizeof(Elf64_Rela); ++j) {
+            struct symbol symbol;
+
+            if (ELF64_R_TYPE(relas[j].r_info) == R_X86_64_NONE) {
+                continue;
+            }
+
+            err = resolve(&symbol, objects, num_objects, obj, ELF64_R_SYM(relas[j].r_info));
+            if (err != 0) {
+                return err;
+            }
+
+            if (symbol.sym->st_shndx != SHN_ABS) {
+                err = use_section(objects, num_objects, (struct object*) symbol.object, symbol.sym->st_shndx);
+                if (err != 0) {
+                    return err;
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+
+
+static uint64_t symbol_addr(const struct symbol* symbol)
+{
+    if (symbol->sym->st_shndx == SHN_ABS) {
+        return symbol->sym->st_value;
+    }
+
+    return symbol->object->addrs[symbol->sym->st_shndx] + symbol->sym->st_value;
+}
+
+
+
+static int apply_relocation(struct ivm_vm_code* code, unsigned char* place, uint64_t P, uint64_t S, int64_t A, uint32_t type)
+{
+    int64_t value;
+
+    switch (type) {
+        case R_X86_64_64:
+            value = S + A;
+            memcpy(place, &value, 8);
+            return 0;
+
+        case R_X86_64_PC64:
+            value = S + A - P;
+            memcpy(place, &value, 8);
+            return 0;
+
+        case R_X86_64_GOTPCRELX:
+        case R_X86_64_REX_GOTPCRELX:
+            // There is no GOT, so turn mov foo@GOTPCREL(%rip) into lea foo(%rip)
+            if (place < ((unsigned char*) code->code) + 2 || place[-2] != 0x8b) {
+                return ENOTSUP;
+            }
+            place[-2] = 0x8d;
+            /* fall through */
+
+        case R_X86_64_PC32:
+        case R_X86_64_PLT32:
+            value = S + A - P;
+            if (value < INT32_MIN || value > INT32_MAX) {
+                return ERANGE;
+            }
+            memcpy(place, &value, 4);
+            return 0;
+
+        case R_X86_64_32:
+            value = S + A;
+            if (value < 0 || value > UINT32_MAX) {
+                return ERANGE;
+            }
+            memcpy(place, &value, 4);
+            return 0;
+
+        case R_X86_64_32S:
+            value = S + A;
+            if (value < INT32_MIN || value > INT32_MAX) {
+                return ERANGE;
+            }
+            memcpy(place, &value, 4);
+            return 0;
+
+        default:
+            return ENOTSUP;
+    }
+}
+
+
+
+static int relocate(struct ivm_vm_code* code, const struct object* objects, size_t num_objects, const struct object* obj, size_t idx)
+{
+    int err;
+    const Elf64_Shdr* shdr = &obj->shdrs[idx];
+    unsigned char* base = ((unsigned char*) code->code) + (obj->addrs[idx] - code->addr);
+
+    for (size_t i = 0; i < obj->num_shdrs; ++i) {
+        const Elf64_Shdr* rel = &obj->shdrs[i];
+
+        if (rel->sh_type != SHT_RELA || rel->sh_info != idx || rel->sh_link != obj->symtab) {
+            continue;
+        }
+
+        const Elf64_Rela* relas = (const Elf64_Rela*) (obj->data + rel->sh_offset);
+        for (size_t j = 0; j < rel->sh_size / sizeof(Elf64_Rela); ++j) {
+            const Elf64_Rela* rela = &relas[j];
+            struct symbol symbol;
+
+            if (ELF64_R_TYPE(rela->r_info) == R_X86_64_NONE) {
+                continue;
+            }
+
+            if (rela->r_offset > shdr->sh_size || shdr->sh_size - rela->r_offset < 4) {
+                return ENOEXEC;
+            }
+
+            err = resolve(&symbol, objects, num_objects, obj, ELF64_R_SYM(rela->r_info));
+            if (err != 0) {
+                return err;
+            }
+
+            uint32_t type = ELF64_R_TYPE(rela->r_info);
+            if ((type == R_X86_64_64 || type == R_X86_64_PC64) && shdr->sh_size - rela->r_offset < 8) {
+                return ENOEXEC;
+            }
+
+            err = apply_relocation(code, base + rela->r_offset, obj->addrs[idx] + rela->r_offset,
+                    symbol_addr(&symbol), rela->r_addend, type);
+            if (err != 0) {
+                return err;
+            }
+        }
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Place used sections after the jump to the loader, copy them and apply
+ * relocations.
+ */
+static int link_sections(struct ivm_vm_code* code, struct object* objects, size_t num_objects)
+{
+    int err;
+    uint64_t offset = LOADER_JUMP_SIZE;
+
+    for (size_t i = 0; i < num_objects; ++i) {
+        for (size_t j = 0; j < objects[i].num_shdrs; ++j) {
+            if (objects[i].used[j]) {
+                uint64_t align = objects[i].shdrs[j].sh_addralign > 1 ? objects[i].shdrs[j].sh_addralign : 1;
+                offset = (offset + align - 1) & ~(align - 1);
+                objects[i].addrs[j] = code->addr + offset;
+                offset += objects[i].shdrs[j].sh_size;
+            }
+        }
+    }
+
+    code->size = offset;
+    code->code = calloc(1, offset);
+    if (code->code == NULL) {
+        return errno;
+    }
+
+    for (size_t i = 0; i < num_objects; ++i) {
+        const struct object* obj = &objects[i];
+
+        for (size_t j = 0; j < obj->num_shdrs; ++j) {
+            if (obj->used[j] && obj->shdrs[j].sh_type != SHT_NOBITS) {
+                memcpy(((unsigned char*) code->code) + (obj->addrs[j] - code->addr),
+                        obj->data + obj->shdrs[j].sh_offset, obj->shdrs[j].sh_size);
+            }
+        }
+    }
+
+    for (size_t i = 0; i < num_objects; ++i) {
+        for (size_t j = 0; j < objects[i].num_shdrs; ++j) {
+            if (objects[i].used[j]) {
+                err = relocate(code, objects, num_objects, &objects[i], j);
+                if (err != 0) {
+                    return err;
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+
+
+static int find_function(struct ivm_function* func, struct symbol* symbol, struct object* objects, size_t num_objects, const char* name)
+{
+    if (!find_symbol(symbol, objects, num_objects, name) || symbol->sym->st_shndx == SHN_ABS || symbol->sym->st_shndx >= symbol->object->num_shdrs) {
+        return ENOENT;
+    }
+
+    strncpy(func->name, name, sizeof(func->name) - 1);
+    func->name[sizeof(func->name) - 1] = '\0';
+    return use_section(objects, num_objects, (struct object*) symbol->object, symbol->sym->st_shndx);
+}
+
+
+
+/*
+ * Copy the contents of a data symbol.
+ */
+static int read_symbol(void* buf, size_t size, const struct object* objects, size_t num_objects, const char* name)
+{
+    struct symbol symbol;
+
+    if (!find_symbol(&symbol, objects, num_objects, name) || symbol.sym->st_shndx >= symbol.object->num_shdrs) {
+        return ENOENT;
+    }
+
+    const Elf64_Shdr* shdr = &symbol.object->shdrs[symbol.sym->st_shndx];
+    if (shdr->sh_type != SHT_PROGBITS || symbol.sym->st_value > shdr->sh_size) {
+        return ENOEXEC;
+    }
+
+    size_t length = shdr->sh_size - symbol.sym->st_value;
+    if (length > size) {
+        length = size;
+    }
+
+    memset(buf, 0, size);
+    memcpy(buf, symbol.object->data + shdr->sh_offset + symbol.sym->st_value, length);
+    return 0;
+}
+
+
+
+static int extract(struct ivm_vm_code* code, struct object* objects, size_t num_objects)
+{
+    int err;
+    struct symbol interrupt, vm, loader;
+
+    err = read_symbol(code->id, sizeof(code->id) - 1, objects, num_objects, "ivm_vm_id");
+    if (err != 0) {
+        return err;
+    }
+
+    err = read_symbol(&code->geometry, sizeof(code->geometry), objects, num_objects, "ivm_vm_geometry");
+    if (err != 0) {
+        return err;
+    }
+
+    err = find_function(&code->loader, &loader, objects, num_objects, "__loader");
+    if (err != 0) {
+        return err;
+    }
+
+    err = find_function(&code->vm, &vm, objects, num_objects, "__vm");
+    if (err != 0) {
+        return err;
+    }
+
+    err = find_function(&code->interrupt, &interrupt, objects, num_objects, "__interrupt");
+    if (err != 0) {
+        return err;
+    }
+
+    err = link_sections(code, objects, num_objects);
+    if (err != 0) {
+        return err;
+    }
+
+    code->loader.addr = symbol_addr(&loader);
+    code->loader.size = loader.sym->st_size;
+    code->vm.addr = symbol_addr(&vm);
+    code->vm.size = vm.sym->st_size;
+    code->interrupt.addr = symbol_addr(&interrupt);
+    code->interrupt.size = interrupt.sym->st_size;
+
+    // Jump to the loader, so that the entry point is at the start of the code
+    unsigned char* jump = code->code;
+    int32_t rel = code->loader.addr - (code->addr + 5);
+    memset(jump, 0xcc, LOADER_JUMP_SIZE);
+    jump[0] = 0xe9;
+    memcpy(jump + 1, &rel, 4);
+
+    return 0;
+}
+
+
+
+int ivm_vm_code_extract(struct ivm_vm_code** handle, const char* filename, uint64_t addr)
+{
+    int err;
+    unsigned char* data = NULL;
+    size_t size = 0;
+    struct object* objects = NULL;
+    size_t num_objects = 0;
+
+    if (handle == NULL || filename == NULL) {
+        return EINVAL;
+    }
+
+    struct ivm_vm_code* code = malloc(sizeof(struct ivm_vm_code));
+    if (code == NULL) {
+        return errno;
+    }
+    memset(code, 0, sizeof(struct ivm_vm_code));
+    code->addr = addr;
+
+    err = read_file(filename, &data, &size);
+    if (err != 0) {
+        free(code);
+        return err;
+    }
+
+    err = parse_objects(&objects, &num_objects, data, size);
+    if (err != 0) {
+        free(data);
+        free(code);
+        return err;
+    }
+
+    err = extract(code, objects, num_objects);
+
+    free_objects(objects, num_objects);
+    free(data);
+
+    if (err != 0) {
+        ivm_vm_code_remove(code);
+        return err;
+    }
+
+    *handle = code;
+    return 0;
+}
+
+
+
+void ivm_vm_code_remove(struct ivm_vm_code* code)
+{
+    free(code->code);
+    free(code);
+}
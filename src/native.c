@@ -0,0 +1,19 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <errno.h>
+#include <ivm_vm.h>
+#include <ivm_image.h>
+#include <ivm_native.h>
+
+
+
+int ivm_image_set_native(struct ivm_image* image, uint32_t slot, ivm_native_t func)
+{
+    if (image == NULL || slot >= IVM_CTABLE_SIZE) {
+        return EINVAL;
+    }
+
+    uint64_t* ctable = (uint64_t*) (((unsigned char*) image->data) + image->data_offset_to_ct);
+    ctable[slot] = (uint64_t) func;
+    return 0;
+}
@@ -0,0 +1,1886 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <ivm_vm.h>
+#include <ivm_bytecode.h>
+#include <ivm_verify.h>
+#include <ivm_optimize.h>
+
+
+
+/*
+ * Decoded instruction.
+ */
+struct insn
+{
+    uint32_t    pos;        // Offset in the original bytecode
+    uint8_t     opcode;     // Opcode, possibly rewritten
+    uint8_t     r[3];       // Register operands
+    uint32_t    word;       // Word operand
+    uint32_t    target;     // Jump target, if resolved
+    bool        resolved;   // Jump target is known
+    int         removed;    // Pass that removed the instruction, or -1
+    int         rewritten;  // Pass that rewrote the instruction, or -1
+};
+
+
+
+/*
+ * Straight-line code between jump targets.
+ * Only the first instruction of a region can be jumped to, so instructions
+ * can be removed from a region as long as its start and end stay in place.
+ */
+struct region
+{
+    uint32_t    start;      // Offset of the first instruction
+    uint32_t    end;        // Offset after the last instruction
+    size_t      first;      // Index of the first instruction
+    size_t      count;      // Number of instructions
+    bool        fixed;      // Instructions observe their own address
+    uint64_t    live_in[4]; // Registers that are read before they are written
+};
+
+
+
+/*
+ * Registers with values known at this point of a region.
+ */
+struct reg_state
+{
+    uint64_t    known[4];
+    uint32_t    value[256];
+};
+
+
+
+struct optimizer
+{
+    unsigned char*          code;
+    size_t                  size;
+    unsigned char*          map;        // Instruction starts and targets
+    struct insn*            insns;
+    size_t                  num_insns;
+    struct region*          regions;
+    size_t                  num_regions;
+    struct reg_state*       entries;    // Known registers on entry to each region
+    bool*                   reached;    // Region entry state has been computed
+    bool                    handlers;   // Guest sets interrupt vectors
+    struct ivm_optimize_report* report;
+};
+
+
+
+static inline bool is_known(const struct reg_state* s, uint8_t reg)
+{
+    return !!(s->known[reg / 64] & (1ULL << (reg % 64)));
+}
+
+
+
+static inline bool has_value(const struct reg_state* s, uint8_t reg, uint32_t value)
+{
+    return is_known(s, reg) && s->value[reg] == value;
+}
+
+
+
+static inline void set_known(struct reg_state* s, uint8_t reg, uint32_t value)
+{
+    s->known[reg / 64] |= 1ULL << (reg % 64);
+    s->value[reg] = value;
+}
+
+
+
+static inline void set_unknown(struct reg_state* s, uint8_t reg)
+{
+    s->known[reg / 64] &= ~(1ULL << (reg % 64));
+}
+
+
+
+static inline void clear_state(struct reg_state* s)
+{
+    memset(s->known, 0, sizeof(s->known));
+}
+
+
+
+static inline bool is_live(const uint64_t* live, uint8_t reg)
+{
+    return !!(live[reg / 64] & (1ULL << (reg % 64)));
+}
+
+
+
+static inline void set_live(uint64_t* live, uint8_t reg)
+{
+    live[reg / 64] |= 1ULL << (reg % 64);
+}
+
+
+
+static inline void set_dead(uint64_t* live, uint8_t reg)
+{
+    live[reg / 64] &= ~(1ULL << (reg % 64));
+}
+
+
+
+static inline void set_all_live(uint64_t* live)
+{
+    memset(live, 0xff, sizeof(uint64_t) * 4);
+}
+
+
+
+static bool is_terminator(uint8_t opcode)
+{
+    return opcode == JUMP || opcode == HALT || opcode == RETURN || opcode == RETW || opcode == RESTORE;
+}
+
+
+
+static bool is_branch(uint8_t opcode)
+{
+    return opcode == JUMPEQ || opcode == JUMPLT || opcode == JUMPGT || opcode == JUMPNE;
+}
+
+
+
+/*
+ * Check if execution continues after the last remaining instruction of a
+ * region.
+ */
+static bool falls_through(const struct optimizer* o, const struct region* region)
+{
+    for (size_t i = region->first + region->count; i-- > region->first; ) {
+        if (o->insns[i].removed < 0) {
+            return !is_terminator(o->insns[i].opcode);
+        }
+    }
+
+    return true;
+}
+
+
+
+/*
+ * Mark an instruction as removed or rewritten by a pass.
+ */
+static void remove_insn(struct insn* insn, int pass)
+{
+    insn->removed = pass;
+}
+
+
+
+static void rewrite_insn(struct insn* insn, int pass, uint8_t opcode, uint8_t r0, uint8_t r1, uint8_t r2, uint32_t word)
+{
+    insn->opcode = opcode;
+    insn->r[0] = r0;
+    insn->r[1] = r1;
+    insn->r[2] = r2;
+    insn->word = word;
+    if (insn->rewritten < 0) {
+        insn->rewritten = pass;
+    }
+}
+
+
+
+/*
+ * Update the known register values after an instruction.
+ */
+static void step_state(const struct optimizer* o, struct reg_state* s, const struct insn* insn)
+{
+    uint8_t a = insn->r[0];
+    uint8_t b = insn->r[1];
+    uint8_t c = insn->r[2];
+
+    switch (insn->opcode) {
+        case SET:
+            set_known(s, a, insn->word);
+            break;
+
+        case ZERO:
+            set_known(s, a, 0);
+            break;
+
+        case MOVEIP:
+            set_known(s, a, insn->pos + IVM_INSTR_LEN(MOVEIP));
+            break;
+
+        case MOVE:
+            if (is_known(s, b)) {
+                set_known(s, a, s->value[b]);
+            }
+            else {
+                set_unknown(s, a);
+            }
+            break;
+
+        case ADD:
+        case SUB:
+        case MUL:
+            if (is_known(s, b) && is_known(s, c)) {
+                uint32_t x = s->value[b];
+                uint32_t y = s->value[c];
+                set_known(s, a, insn->opcode == ADD ? x + y : insn->opcode == SUB ? x - y : x * y);
+            }
+            else {
+                set_unknown(s, a);
+            }
+            break;
+
+        case CALL:
+        case CALLW:
+        case NCALL:
+        case TRAP:
+        case POPALL:
+        case RETW:
+            clear_state(s);
+            break;
+
+        case VADD:
+        case VXOR:
+        case VCMPEQ:
+        case VMIN:
+        case VMAX:
+            for (uint32_t i = 0; i < insn->word; ++i) {
+                set_unknown(s, a + i);
+            }
+            break;
+
+        case VSUM:
+            set_unknown(s, a);
+            break;
+
+        case JUMP: case JUMPEQ: case JUMPLT: case JUMPGT: case JUMPNE:
+        case STORE: case STOREWORD: case STOREREL: case PUSH:
+        case SETBP: case SETSB: case SETSP: case SETWS:
+        case MADD: case MXOR: case MCMPEQ: case MMIN: case MMAX: case MCOPY: case MFILL:
+        case ENABLE: case DISABLE: case VECTOR: case NOOP:
+            break;
+
+        default:
+            for (int i = 0; i < IVM_NUM_REGS(insn->opcode); ++i) {
+                set_unknown(s, insn->r[i]);
+            }
+            break;
+    }
+
+    // Asynchronous interrupts can run a handler between any two
+    // instructions, and the handler may change any register
+    if (o->handlers) {
+        clear_state(s);
+    }
+}
+
+
+
+/*
+ * Find the instruction at an offset.
+ */
+static struct insn* find_insn(const struct optimizer* o, uint32_t pos)
+{
+    size_t lo = 0;
+    size_t hi = o->num_insns;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (o->insns[mid].pos < pos) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+
+    if (lo < o->num_insns && o->insns[lo].pos == pos) {
+        return &o->insns[lo];
+    }
+
+    return NULL;
+}
+
+
+
+static struct region* find_region(const struct optimizer* o, uint32_t pos)
+{
+    size_t lo = 0;
+    size_t hi = o->num_regions;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (o->regions[mid].start < pos) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+
+    if (lo < o->num_regions && o->regions[lo].start == pos) {
+        return &o->regions[lo];
+    }
+
+    return NULL;
+}
+
+
+
+/*
+ * Target of a jump, if its base register is known.
+ */
+static bool jump_target(const struct reg_state* s, const struct insn* insn, uint32_t* target)
+{
+    uint8_t base = insn->opcode == JUMP ? insn->r[0] : insn->r[2];
+
+    if (!is_known(s, base)) {
+        return false;
+    }
+
+    *target = s->value[base] + insn->word;
+    return true;
+}
+
+
+
+static void entry_state(const struct optimizer* o, const struct region* region, struct reg_state* s)
+{
+    memcpy(s, &o->entries[region - o->regions], sizeof(struct reg_state));
+}
+
+
+
+/*
+ * Merge the registers known on one path into a region.
+ * Returns true if the entry state of the region changed.
+ */
+static bool merge_entry(struct optimizer* o, const struct region* region, const struct reg_state* s)
+{
+    size_t idx = region - o->regions;
+    struct reg_state* entry = &o->entries[idx];
+    bool changed = false;
+
+    if (!o->reached[idx]) {
+        memcpy(entry, s, sizeof(struct reg_state));
+        o->reached[idx] = true;
+        return true;
+    }
+
+    for (int reg = 0; reg < 256; ++reg) {
+        if (is_known(entry, reg) && !has_value(s, reg, entry->value[reg])) {
+            set_unknown(entry, reg);
+            changed = true;
+        }
+    }
+
+    return changed;
+}
+
+
+
+/*
+ * Follow one region and merge its exits into the regions it continues in.
+ * Returns true if the entry state of another region changed.
+ */
+static bool propagate_region(struct optimizer* o, struct region* region, bool* unresolved)
+{
+    struct reg_state s;
+    struct reg_state empty;
+    bool changed = false;
+
+    entry_state(o, region, &s);
+    clear_state(&empty);
+
+    for (size_t i = region->first; i < region->first + region->count; ++i) {
+        struct insn* insn = &o->insns[i];
+        const struct reg_state* state = &s;
+        uint8_t base = insn->r[0];
+        uint32_t offset = insn->word;
+
+        if (insn->removed >= 0) {
+            continue;
+        }
+
+        switch (insn->opcode) {
+            case JUMPEQ:
+                base = insn->r[2];
+                break;
+
+            case JUMPLT:
+            case JUMPGT:
+            case JUMPNE:
+                if (insn->r[0] == insn->r[1]) {
+                    // Padding that is never taken
+                    insn->resolved = false;
+                    continue;
+                }
+                base = insn->r[2];
+                break;
+
+            case CALL:
+                offset = 0;
+                break;
+
+            case CALLW:
+                // The callee sees a different register window
+                state = &empty;
+                break;
+
+            case VECTOR:
+                base = insn->r[1];
+                state = &empty;
+                break;
+
+            case JUMP:
+                break;
+
+            default:
+                step_state(o, &s, insn);
+                continue;
+        }
+
+        insn->resolved = is_known(&s, base);
+        insn->target = s.value[base] + offset;
+
+        const struct region* dest = insn->resolved ? find_region(o, insn->target) : NULL;
+        if (dest != NULL) {
+            changed = merge_entry(o, dest, state) || changed;
+        }
+        else {
+            insn->resolved = false;
+            *unresolved = true;
+        }
+
+        step_state(o, &s, insn);
+    }
+
+    const struct region* next = region + 1;
+    if (falls_through(o, region) && next < o->regions + o->num_regions && next->start == region->end) {
+        changed = merge_entry(o, next, &s) || changed;
+    }
+
+    return changed;
+}
+
+
+
+/*
+ * Find the registers that are known on entry to each region, on every
+ * path into it. If a jump can not be followed, any jump target may be
+ * entered with unknown registers.
+ */
+static void propagate_entries(struct optimizer* o)
+{
+    struct reg_state empty;
+    bool unresolved = false;
+    bool seeded = false;
+
+    clear_state(&empty);
+    memset(o->reached, 0, sizeof(bool) * o->num_regions);
+    merge_entry(o, &o->regions[0], &empty);
+
+    while (true) {
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (size_t r = 0; r < o->num_regions; ++r) {
+                if (o->reached[r]) {
+                    changed = propagate_region(o, &o->regions[r], &unresolved) || changed;
+                }
+            }
+        }
+
+        changed = false;
+        for (size_t r = 0; r < o->num_regions; ++r) {
+            bool target = !!(o->map[o->regions[r].start] & IVM_MAP_TARGET);
+
+            // Regions that are not reached by following jumps, such as
+            // return addresses, are entered with unknown registers
+            if (!o->reached[r] || (unresolved && !seeded && target)) {
+                changed = merge_entry(o, &o->regions[r], &empty) || changed;
+            }
+        }
+        seeded = unresolved;
+
+        if (!changed) {
+            break;
+        }
+    }
+}
+
+
+
+/*
+ * Thread jumps to unconditional jumps, and replace jumps to instructions
+ * that leave the code, such as HALT, with the instruction itself.
+ */
+static void thread_jumps(struct optimizer* o, struct region* region)
+{
+    struct reg_state s;
+    entry_state(o, region, &s);
+
+    for (size_t i = region->first; i < region->first + region->count; ++i) {
+        struct insn* insn = &o->insns[i];
+        uint32_t target;
+
+        if (insn->removed < 0 && (insn->opcode == JUMP || is_branch(insn->opcode)) && jump_target(&s, insn, &target)) {
+            uint8_t base = insn->opcode == JUMP ? insn->r[0] : insn->r[2];
+
+            if (target == insn->pos + IVM_INSTR_LEN(insn->opcode)) {
+                remove_insn(insn, IVM_PASS_JUMPS);
+                continue;
+            }
+
+            uint32_t final = target;
+            for (int hops = 0; hops < 16; ++hops) {
+                const struct insn* next = find_insn(o, final);
+                uint32_t further;
+
+                if (next == NULL || next->removed >= 0 || next->opcode != JUMP || !jump_target(&s, next, &further)) {
+                    break;
+                }
+
+                if (further == target || !(o->map[further] & IVM_MAP_TARGET)) {
+                    break;
+                }
+                final = further;
+            }
+
+            const struct insn* dest = find_insn(o, final);
+
+            if (insn->opcode == JUMP && dest != NULL && dest->removed < 0 && IVM_INSTR_LEN(dest->opcode) == 1 && is_terminator(dest->opcode)) {
+                rewrite_insn(insn, IVM_PASS_JUMPS, dest->opcode, 0, 0, 0, 0);
+            }
+            else if (final != target) {
+                rewrite_insn(insn, IVM_PASS_JUMPS, insn->opcode, insn->r[0], insn->r[1], insn->r[2], final - s.value[base]);
+            }
+        }
+
+        if (insn->removed < 0) {
+            step_state(o, &s, insn);
+        }
+    }
+}
+
+
+
+/*
+ * Evaluate a branch whose operands are known.
+ * Returns 1 if the branch is always taken, 0 if it is never taken and -1 if
+ * it depends on run-time values.
+ */
+static int branch_outcome(const struct reg_state* s, const struct insn* insn)
+{
+    uint8_t a = insn->r[0];
+    uint8_t b = insn->r[1];
+    uint32_t x;
+    uint32_t y;
+
+    if (a == b) {
+        x = y = 0;
+    }
+    else if (is_known(s, a) && is_known(s, b)) {
+        x = s->value[a];
+        y = s->value[b];
+    }
+    else {
+        return -1;
+    }
+
+    switch (insn->opcode) {
+        case JUMPEQ:
+            return x == y;
+        case JUMPLT:
+            return x < y;
+        case JUMPGT:
+            return x > y;
+        case JUMPNE:
+            return x != y;
+    }
+
+    return -1;
+}
+
+
+
+/*
+ * Remove instructions that do not change any register, and fold branches
+ * on known values.
+ */
+static void propagate_constants(struct optimizer* o, struct region* region)
+{
+    struct reg_state s;
+    entry_state(o, region, &s);
+
+    for (size_t i = region->first; i < region->first + region->count; ++i) {
+        struct insn* insn = &o->insns[i];
+        uint8_t a = insn->r[0];
+        uint8_t b = insn->r[1];
+        uint8_t c = insn->r[2];
+        int outcome;
+
+        if (insn->removed >= 0) {
+            continue;
+        }
+
+        switch (insn->opcode) {
+            case SET:
+                if (has_value(&s, a, insn->word)) {
+                    remove_insn(insn, IVM_PASS_CONSTANTS);
+                }
+                break;
+
+            case ZERO:
+                if (has_value(&s, a, 0)) {
+                    remove_insn(insn, IVM_PASS_CONSTANTS);
+                }
+                break;
+
+            case MOVE:
+                if (a == b || (is_known(&s, b) && has_value(&s, a, s.value[b]))) {
+                    remove_insn(insn, IVM_PASS_CONSTANTS);
+                }
+                break;
+
+            case ADD:
+            case SUB:
+                if (has_value(&s, c, 0)) {
+                    if (a == b) {
+                        remove_insn(insn, IVM_PASS_CONSTANTS);
+                    }
+                    else {
+                        rewrite_insn(insn, IVM_PASS_CONSTANTS, MOVE, a, b, 0, 0);
+                    }
+                }
+                else if (insn->opcode == ADD && has_value(&s, b, 0)) {
+                    if (a == c) {
+                        remove_insn(insn, IVM_PASS_CONSTANTS);
+                    }
+                    else {
+                        rewrite_insn(insn, IVM_PASS_CONSTANTS, MOVE, a, c, 0, 0);
+                    }
+                }
+                break;
+
+            case XOR:
+                if (a == b) {
+                    rewrite_insn(insn, IVM_PASS_CONSTANTS, ZERO, a, 0, 0, 0);
+                }
+                else if (has_value(&s, b, 0)) {
+                    remove_insn(insn, IVM_PASS_CONSTANTS);
+                }
+                break;
+
+            case OR:
+            case SHIFTUP:
+            case SHIFTDOWN:
+                if (a == b && insn->opcode == OR) {
+                    remove_insn(insn, IVM_PASS_CONSTANTS);
+                }
+                else if (is_known(&s, b) && (insn->opcode == OR ? s.value[b] : s.value[b] & 31) == 0) {
+                    remove_insn(insn, IVM_PASS_CONSTANTS);
+                }
+                break;
+
+            case AND:
+                if (a == b || has_value(&s, b, 0xffffffff)) {
+                    remove_insn(insn, IVM_PASS_CONSTANTS);
+                }
+                break;
+
+            case JUMPEQ:
+            case JUMPLT:
+            case JUMPGT:
+            case JUMPNE:
+                outcome = branch_outcome(&s, insn);
+                if (outcome == 0) {
+                    remove_insn(insn, IVM_PASS_CONSTANTS);
+                }
+                else if (outcome == 1) {
+                    rewrite_insn(insn, IVM_PASS_CONSTANTS, JUMP, c, 0, 0, insn->word);
+
+                    // The rest of the region can no longer be reached
+                    for (size_t j = i + 1; j < region->first + region->count; ++j) {
+                        if (o->insns[j].removed < 0) {
+                            remove_insn(&o->insns[j], IVM_PASS_CONSTANTS);
+                        }
+                    }
+                }
+                break;
+        }
+
+        if (insn->removed < 0) {
+            step_state(o, &s, insn);
+        }
+    }
+}
+
+
+
+/*
+ * Replace multiplication by 0, 1 and powers of two, and division by 1.
+ * Division by other powers of two would take two instructions, which costs
+ * more than DIVMOD in the VM.
+ */
+static void reduce_strength(struct optimizer* o, struct region* region)
+{
+    struct reg_state s;
+    entry_state(o, region, &s);
+
+    for (size_t i = region->first; i < region->first + region->count; ++i) {
+        struct insn* insn = &o->insns[i];
+        uint8_t a = insn->r[0];
+        uint8_t b = insn->r[1];
+        uint8_t c = insn->r[2];
+
+        if (insn->removed >= 0) {
+            continue;
+        }
+
+        if (insn->opcode == MUL) {
+            // Multiplication is commutative, let c be the known factor
+            if (!is_known(&s, c) && is_known(&s, b)) {
+                uint8_t t = b;
+                b = c;
+                c = t;
+            }
+
+            if (has_value(&s, c, 0)) {
+                rewrite_insn(insn, IVM_PASS_STRENGTH, ZERO, a, 0, 0, 0);
+            }
+            else if (has_value(&s, c, 1)) {
+                if (a == b) {
+                    remove_insn(insn, IVM_PASS_STRENGTH);
+                }
+                else {
+                    rewrite_insn(insn, IVM_PASS_STRENGTH, MOVE, a, b, 0, 0);
+                }
+            }
+            else if (a == b && is_known(&s, c) && (s.value[c] & (s.value[c] - 1)) == 0) {
+                uint32_t shift = __builtin_ctz(s.value[c]);
+
+                for (int reg = 0; reg < 256; ++reg) {
+                    if (reg != a && has_value(&s, reg, shift)) {
+                        rewrite_insn(insn, IVM_PASS_STRENGTH, SHIFTUP, a, reg, 0, 0);
+                        break;
+                    }
+                }
+            }
+        }
+        else if (insn->opcode == DIVMOD && has_value(&s, b, 1)) {
+            // The remainder is written before the quotient
+            if (a == c) {
+                remove_insn(insn, IVM_PASS_STRENGTH);
+            }
+            else {
+                rewrite_insn(insn, IVM_PASS_STRENGTH, ZERO, c, 0, 0, 0);
+            }
+        }
+
+        if (insn->removed < 0) {
+            step_state(o, &s, insn);
+        }
+    }
+}
+
+
+
+/*
+ * Instructions that neither write guest memory nor change BP, and do not
+ * order memory accesses.
+ */
+static bool keeps_memory(uint8_t opcode)
+{
+    switch (opcode) {
+        case SET: case ZERO: case MOVE: case ADD: case SUB: case MUL: case DIVMOD:
+        case XOR: case AND: case OR: case INVERT: case SHIFTUP: case SHIFTDOWN:
+        case VADD: case VXOR: case VCMPEQ: case VMIN: case VMAX: case VSUM:
+        case MSUM: case MCMP: case MFIND:
+        case MOVEBP: case MOVESB: case MOVESP: case MOVEIP:
+        case JUMPEQ: case JUMPLT: case JUMPGT: case JUMPNE:
+        case LOAD: case LOADWORD: case NOOP:
+            return true;
+    }
+
+    return false;
+}
+
+
+
+/*
+ * Replace loads of a value that is already in a register.
+ * Memory shared with other VMs must be read with LOADACQ, which is never
+ * replaced.
+ */
+static void remove_loads(struct optimizer* o, struct region* region)
+{
+    struct
+    {
+        uint8_t     opcode;
+        uint8_t     base;
+        uint8_t     dest;
+        uint32_t    offset;
+    } avail[16];
+    size_t num_avail = 0;
+
+    for (size_t i = region->first; i < region->first + region->count; ++i) {
+        struct insn* insn = &o->insns[i];
+        uint8_t a = insn->r[0];
+        uint8_t b = insn->r[1];
+
+        if (insn->removed >= 0) {
+            continue;
+        }
+
+        if (!keeps_memory(insn->opcode)) {
+            num_avail = 0;
+
+            // A stored word can be loaded again from its register
+            if (insn->opcode == STOREWORD && a != b) {
+                avail[num_avail].opcode = LOADWORD;
+                avail[num_avail].base = b;
+                avail[num_avail].dest = a;
+                avail[num_avail].offset = insn->word;
+                num_avail++;
+            }
+            continue;
+        }
+
+        if (insn->opcode == LOAD || insn->opcode == LOADWORD) {
+            for (size_t j = 0; j < num_avail; ++j) {
+                if (avail[j].opcode == insn->opcode && avail[j].base == b && avail[j].offset == insn->word) {
+                    if (avail[j].dest == a) {
+                        remove_insn(insn, IVM_PASS_LOADS);
+                    }
+                    else {
+                        rewrite_insn(insn, IVM_PASS_LOADS, MOVE, a, avail[j].dest, 0, 0);
+                    }
+                    break;
+                }
+            }
+        }
+
+        // Forget values held in or addressed by registers that are written
+        uint8_t first = insn->r[0];
+        uint32_t count = IVM_NUM_REGS(insn->opcode) > 0 ? 1 : 0;
+        if (insn->opcode >= VADD && insn->opcode <= VMAX) {
+            count = insn->word;
+        }
+        else if (insn->opcode == DIVMOD) {
+            count = 256;
+        }
+
+        for (size_t j = 0; j < num_avail; ) {
+            bool clobbered = count == 256 || (uint32_t) (avail[j].dest - first) < count || (uint32_t) (avail[j].base - first) < count;
+            if (clobbered) {
+                avail[j] = avail[--num_avail];
+            }
+            else {
+                ++j;
+            }
+        }
+
+        bool loaded = insn->removed < 0 && (insn->opcode == LOAD || insn->opcode == LOADWORD);
+        if (loaded && a != b && num_avail < 16) {
+            avail[num_avail].opcode = insn->opcode;
+            avail[num_avail].base = b;
+            avail[num_avail].dest = a;
+            avail[num_avail].offset = insn->word;
+            num_avail++;
+        }
+    }
+}
+
+
+
+/*
+ * Instructions without side effects other than writing R[r0].
+ */
+static bool is_pure(uint8_t opcode)
+{
+    switch (opcode) {
+        case SET: case ZERO: case MOVE: case ADD: case SUB: case MUL:
+        case XOR: case AND: case OR: case INVERT: case SHIFTUP: case SHIFTDOWN:
+        case MOVEBP: case MOVESB: case MOVESP:
+            return true;
+    }
+
+    return false;
+}
+
+
+
+/*
+ * Update live registers backwards over an instruction.
+ */
+static void step_live(const struct optimizer* o, uint64_t* live, const struct insn* insn)
+{
+    uint8_t opcode = insn->opcode;
+    uint8_t a = insn->r[0];
+    const struct region* dest;
+
+    switch (opcode) {
+        case SET: case ZERO: case MOVEBP: case MOVESB: case MOVESP: case MOVEIP:
+        case MOVE: case ADD: case SUB: case MUL:
+        case LOAD: case LOADWORD: case LOADACQ: case POP:
+            set_dead(live, a);
+            for (int i = 1; i < IVM_NUM_REGS(opcode); ++i) {
+                set_live(live, insn->r[i]);
+            }
+            return;
+
+        case JUMP:
+        case JUMPEQ:
+        case JUMPLT:
+        case JUMPGT:
+        case JUMPNE:
+            if (opcode == JUMP) {
+                memset(live, 0, sizeof(uint64_t) * 4);
+            }
+            dest = insn->resolved ? find_region(o, insn->target) : NULL;
+            if (dest != NULL) {
+                for (int i = 0; i < 4; ++i) {
+                    live[i] |= dest->live_in[i];
+                }
+            }
+            else {
+                set_all_live(live);
+            }
+            break;
+
+        case VADD:
+        case VXOR:
+        case VCMPEQ:
+        case VMIN:
+        case VMAX:
+            for (uint32_t i = 0; i < insn->word; ++i) {
+                set_live(live, insn->r[1] + i);
+                set_live(live, insn->r[2] + i);
+            }
+            return;
+
+        case VSUM:
+            for (uint32_t i = 0; i < insn->word; ++i) {
+                set_live(live, insn->r[1] + i);
+            }
+            return;
+
+        case CALL:
+        case CALLW:
+        case RETURN:
+        case RETW:
+        case RESTORE:
+        case NCALL:
+        case TRAP:
+        case PUSHALL:
+        case POPALL:
+        case HALT:
+            // The host can read all registers when the guest halts
+            set_all_live(live);
+            return;
+    }
+
+    for (int i = 0; i < IVM_NUM_REGS(opcode); ++i) {
+        set_live(live, insn->r[i]);
+    }
+}
+
+
+
+/*
+ * Walk a region backwards and compute the registers live at its start.
+ * Dead pure instructions are removed if requested.
+ */
+static bool region_liveness(struct optimizer* o, struct region* region, bool remove)
+{
+    uint64_t live[4] = { 0 };
+
+    const struct region* next = region + 1;
+    if (falls_through(o, region) && next < o->regions + o->num_regions && next->start == region->end) {
+        memcpy(live, next->live_in, sizeof(live));
+    }
+    else if (falls_through(o, region)) {
+        set_all_live(live);
+    }
+
+    for (size_t i = region->count; i-- > 0; ) {
+        struct insn* insn = &o->insns[region->first + i];
+
+        if (insn->removed >= 0) {
+            continue;
+        }
+
+        if (remove && is_pure(insn->opcode) && !is_live(live, insn->r[0])) {
+            remove_insn(insn, IVM_PASS_DEAD_CODE);
+            continue;
+        }
+
+        step_live(o, live, insn);
+    }
+
+    bool changed = memcmp(region->live_in, live, sizeof(live)) != 0;
+    memcpy(region->live_in, live, sizeof(live));
+    return changed;
+}
+
+
+
+/*
+ * Remove register writes that are not read on any path.
+ */
+static void remove_dead_code(struct optimizer* o)
+{
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t r = o->num_regions; r-- > 0; ) {
+            changed = region_liveness(o, &o->regions[r], false) || changed;
+        }
+    }
+
+    for (size_t r = 0; r < o->num_regions; ++r) {
+        if (!o->regions[r].fixed) {
+            region_liveness(o, &o->regions[r], true);
+        }
+    }
+}
+
+
+
+static size_t encode(unsigned char* buf, const struct insn* insn)
+{
+    size_t len = 0;
+
+    buf[len++] = insn->opcode;
+    for (int i = 0; i < IVM_NUM_REGS(insn->opcode); ++i) {
+        buf[len++] = insn->r[i];
+    }
+
+    if (IVM_HAS_WORD(insn->opcode)) {
+        buf[len++] = insn->word & 0xff;
+        buf[len++] = (insn->word >> 8) & 0xff;
+        buf[len++] = (insn->word >> 16) & 0xff;
+        buf[len++] = insn->word >> 24;
+    }
+
+    return len;
+}
+
+
+
+/*
+ * Fill a gap that is executed with as few instructions as possible.
+ * A jump over the gap needs a register with a known value. Otherwise the
+ * gap is filled with branches that are never taken, moves of a register to
+ * itself and NOOPs.
+ * Returns the number of instructions added.
+ */
+static size_t fill_gap(unsigned char* buf, size_t gap, uint32_t end, const struct reg_state* s)
+{
+    struct insn pad = { .removed = -1, .rewritten = -1 };
+    size_t added = 0;
+    size_t len = 0;
+
+    if (gap >= IVM_INSTR_LEN(JUMP)) {
+        for (int reg = 0; reg < 256; ++reg) {
+            if (is_known(s, reg)) {
+                pad.opcode = JUMP;
+                pad.r[0] = reg;
+                pad.word = end - s->value[reg];
+                len = encode(buf, &pad);
+                memset(buf + len, NOOP, gap - len);
+                return 1;
+            }
+        }
+    }
+
+    while (len < gap) {
+        if (gap - len >= IVM_INSTR_LEN(JUMPLT)) {
+            pad.opcode = JUMPLT;
+            pad.word = 0;
+        }
+        else if (gap - len >= IVM_INSTR_LEN(MOVE)) {
+            pad.opcode = MOVE;
+        }
+        else {
+            pad.opcode = NOOP;
+        }
+        len += encode(buf + len, &pad);
+        added++;
+    }
+
+    return added;
+}
+
+
+
+/*
+ * Write a region back if it executes fewer instructions than before.
+ */
+static void write_region(struct optimizer* o, const struct region* region, unsigned char* buf)
+{
+    size_t removed = 0;
+    size_t rewritten = 0;
+    size_t len = 0;
+    const struct insn* last = NULL;
+    struct reg_state s;
+
+    entry_state(o, region, &s);
+
+    for (size_t i = region->first; i < region->first + region->count; ++i) {
+        const struct insn* insn = &o->insns[i];
+        if (insn->removed >= 0) {
+            removed++;
+            continue;
+        }
+
+        if (insn->rewritten >= 0) {
+            rewritten++;
+        }
+        len += encode(buf + len, insn);
+        step_state(o, &s, insn);
+        last = insn;
+    }
+
+    if (removed == 0 && rewritten == 0) {
+        return;
+    }
+
+    size_t gap = region->end - region->start - len;
+    size_t added = 0;
+
+    if (gap > 0) {
+        if (last != NULL && is_terminator(last->opcode)) {
+            memset(buf + len, NOOP, gap);
+        }
+        else {
+            added = fill_gap(buf + len, gap, region->end, &s);
+        }
+    }
+
+    if (added > 0 && added >= removed) {
+        return;
+    }
+
+    memcpy(o->code + region->start, buf, region->end - region->start);
+
+    for (size_t i = region->first; i < region->first + region->count; ++i) {
+        const struct insn* insn = &o->insns[i];
+        if (insn->removed >= 0) {
+            o->report->removed[insn->removed]++;
+        }
+        else if (insn->rewritten >= 0) {
+            o->report->rewritten[insn->rewritten]++;
+        }
+    }
+
+    o->report->padding += added;
+    o->report->num_changed++;
+}
+
+
+
+/*
+ * Split the reachable instructions into regions.
+ */
+static int decode(struct optimizer* o)
+{
+    size_t num_insns = 0;
+    for (size_t i = 0; i < o->size; ++i) {
+        if (o->map[i] & IVM_MAP_START) {
+            num_insns++;
+        }
+    }
+
+    o->insns = malloc(sizeof(struct insn) * num_insns);
+    o->regions = malloc(sizeof(struct region) * num_insns);
+    if (o->insns == NULL || o->regions == NULL) {
+        return ENOMEM;
+    }
+
+    for (size_t i = 0; i < o->size; ++i) {
+        if (!(o->map[i] & IVM_MAP_START)) {
+            continue;
+        }
+
+        struct insn* insn = &o->insns[o->num_insns++];
+        const unsigned char* code = &o->code[i];
+
+        insn->pos = i;
+        insn->opcode = code[0];
+        insn->removed = -1;
+        insn->rewritten = -1;
+        insn->resolved = false;
+        insn->target = 0;
+        for (int j = 0; j < 3; ++j) {
+            insn->r[j] = j < IVM_NUM_REGS(code[0]) ? code[1 + j] : 0;
+        }
+
+        insn->word = 0;
+        if (IVM_HAS_WORD(code[0])) {
+            const unsigned char* w = &code[1 + IVM_NUM_REGS(code[0])];
+            insn->word = w[0] | (w[1] << 8) | (w[2] << 16) | ((uint32_t) w[3] << 24);
+
+            // A constant address of an instruction may be jumped to
+            if (insn->word < o->size && (o->map[insn->word] & IVM_MAP_START)) {
+                o->map[insn->word] |= IVM_MAP_TARGET;
+            }
+        }
+
+        if (insn->opcode == VECTOR) {
+            o->handlers = true;
+        }
+    }
+
+    for (size_t i = 0; i < o->num_insns; ++i) {
+        const struct insn* insn = &o->insns[i];
+        const struct insn* prev = i > 0 ? &o->insns[i - 1] : NULL;
+        struct region* region = o->num_regions > 0 ? &o->regions[o->num_regions - 1] : NULL;
+        uint32_t len = IVM_INSTR_LEN(insn->opcode);
+
+        bool starts = prev == NULL || (o->map[insn->pos] & IVM_MAP_TARGET) || region->end != insn->pos || is_terminator(prev->opcode);
+
+        if (starts) {
+            region = &o->regions[o->num_regions++];
+            region->start = insn->pos;
+            region->end = insn->pos;
+            region->first = i;
+            region->count = 0;
+            region->fixed = false;
+            memset(region->live_in, 0, sizeof(region->live_in));
+        }
+
+        region->end = insn->pos + len;
+        region->count++;
+        if (insn->opcode == MOVEIP) {
+            region->fixed = true;
+        }
+    }
+
+    return 0;
+}
+
+
+
+static int optimize(struct optimizer* o)
+{
+    int err = decode(o);
+    if (err != 0) {
+        return err;
+    }
+
+    o->report->num_regions = o->num_regions;
+
+    o->entries = malloc(sizeof(struct reg_state) * o->num_regions);
+    o->reached = malloc(sizeof(bool) * o->num_regions);
+    if (o->entries == NULL || o->reached == NULL) {
+        return ENOMEM;
+    }
+
+    propagate_entries(o);
+
+    for (size_t r = 0; r < o->num_regions; ++r) {
+        struct region* region = &o->regions[r];
+        if (region->fixed) {
+            continue;
+        }
+
+        thread_jumps(o, region);
+        propagate_constants(o, region);
+        reduce_strength(o, region);
+        if (!o->handlers) {
+            remove_loads(o, region);
+        }
+    }
+
+    if (!o->handlers) {
+        propagate_entries(o);
+        remove_dead_code(o);
+    }
+
+    propagate_entries(o);
+
+    size_t max_len = 0;
+    for (size_t r = 0; r < o->num_regions; ++r) {
+        size_t len = o->regions[r].end - o->regions[r].start;
+        max_len = len > max_len ? len : max_len;
+    }
+
+    unsigned char* buf = malloc(max_len);
+    if (buf == NULL) {
+        return errno;
+    }
+
+    for (size_t r = 0; r < o->num_regions; ++r) {
+        if (!o->regions[r].fixed) {
+            write_region(o, &o->regions[r], buf);
+        }
+    }
+
+    free(buf);
+    return 0;
+}
+
+
+
+int ivm_bytecode_optimize(struct ivm_optimize_report* report, void* bytecode, size_t size)
+{
+    struct ivm_verify_result verified;
+
+    if (report == NULL || bytecode == NULL) {
+        return EINVAL;
+    }
+
+    memset(report, 0, sizeof(struct ivm_optimize_report));
+
+    unsigned char* map = malloc(size > 0 ? size : 1);
+    if (map == NULL) {
+        return errno;
+    }
+
+    int err = ivm_bytecode_map(&verified, bytecode, size, map);
+    if (err != 0 || verified.num_dynamic > 0) {
+        free(map);
+        return err;
+    }
+
+    struct optimizer o = {
+        .code = bytecode,
+        .size = size,
+        .map = map,
+        .insns = NULL,
+        .num_insns = 0,
+        .regions = NULL,
+        .num_regions = 0,
+        .entries = NULL,
+        .reached = NULL,
+        .handlers = false,
+        .report = report,
+    };
+
+    err = optimize(&o);
+    report->applied = err == 0;
+
+    free(o.reached);
+    free(o.entries);
+    free(o.regions);
+    free(o.insns);
+    free(map);
+    return err;
+}
+
+
+
+/*
+ * Basic blocks that fall through into each other, which are moved together.
+ */
+struct unit
+{
+    uint32_t    start;      // Offset in the original bytecode
+    uint32_t    end;        // Offset after the unit
+    uint32_t    dest;       // Offset after layout
+    uint64_t    heat;       // Instructions executed
+    size_t      index;      // Position in the original bytecode
+};
+
+
+
+struct layout
+{
+    struct optimizer*       o;
+    struct unit*            units;
+    size_t                  num_units;
+    uint32_t                code_end;   // Offset after the last unit, data follows
+    uint64_t*               counts;     // Execution count of each instruction
+};
+
+
+
+/*
+ * Decode bytecode and find the targets of its jumps.
+ * Returns EAGAIN if the bytecode has computed jumps.
+ */
+static int analyze(struct optimizer* o, unsigned char* code, size_t size, struct ivm_optimize_report* report)
+{
+    struct ivm_verify_result verified;
+
+    memset(o, 0, sizeof(struct optimizer));
+    o->code = code;
+    o->size = size;
+    o->report = report;
+
+    o->map = malloc(size > 0 ? size : 1);
+    if (o->map == NULL) {
+        return errno;
+    }
+
+    int err = ivm_bytecode_map(&verified, code, size, o->map);
+    if (err != 0) {
+        return err;
+    }
+
+    if (verified.num_dynamic > 0) {
+        return EAGAIN;
+    }
+
+    err = decode(o);
+    if (err != 0) {
+        return err;
+    }
+
+    o->entries = malloc(sizeof(struct reg_state) * o->num_regions);
+    o->reached = malloc(sizeof(bool) * o->num_regions);
+    if (o->entries == NULL || o->reached == NULL) {
+        return ENOMEM;
+    }
+
+    propagate_entries(o);
+    return 0;
+}
+
+
+
+static void release(struct optimizer* o)
+{
+    free(o->reached);
+    free(o->entries);
+    free(o->regions);
+    free(o->insns);
+    free(o->map);
+}
+
+
+
+static bool is_transfer(uint8_t opcode)
+{
+    return opcode == JUMP || is_branch(opcode) || opcode == CALL || opcode == CALLW || opcode == VECTOR;
+}
+
+
+
+/*
+ * Check if the target of a transfer is known, or if it is padding that
+ * never jumps.
+ */
+static bool is_movable(const struct insn* insn)
+{
+    if (insn->resolved || !is_transfer(insn->opcode)) {
+        return true;
+    }
+
+    return insn->opcode != JUMP && insn->opcode != JUMPEQ && is_branch(insn->opcode) && insn->r[0] == insn->r[1];
+}
+
+
+
+/*
+ * Check if an instruction may change a register.
+ */
+static bool writes_register(const struct optimizer* o, const struct insn* insn, uint8_t reg)
+{
+    struct reg_state s;
+
+    // Try two values, since an instruction may write the value the
+    // register already had
+    for (uint32_t value = 0; value < 2; ++value) {
+        clear_state(&s);
+        set_known(&s, reg, value);
+        step_state(o, &s, insn);
+        if (!has_value(&s, reg, value)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+
+/*
+ * Find the SET that loads the target of a CALL, following moves between
+ * registers within the region of the call.
+ */
+static struct insn* call_source(const struct optimizer* o, const struct region* region, size_t idx)
+{
+    uint8_t reg = o->insns[idx].r[0];
+
+    for (size_t i = idx; i-- > region->first; ) {
+        struct insn* insn = &o->insns[i];
+
+        if (!writes_register(o, insn, reg)) {
+            continue;
+        }
+        else if (insn->opcode == SET && insn->r[0] == reg) {
+            return insn;
+        }
+        else if (insn->opcode == MOVE && insn->r[0] == reg) {
+            reg = insn->r[1];
+            continue;
+        }
+
+        return NULL;
+    }
+
+    return NULL;
+}
+
+
+
+/*
+ * Address of code after layout.
+ */
+static uint32_t relocate(const struct layout* l, uint32_t addr)
+{
+    if (addr >= l->code_end) {
+        return addr;
+    }
+
+    size_t lo = 0;
+    size_t hi = l->num_units;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (l->units[mid].start <= addr) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+
+    const struct unit* unit = &l->units[lo - 1];
+    return addr - unit->start + unit->dest;
+}
+
+
+
+static void put_word(unsigned char* code, const struct insn* insn, uint32_t pos, uint32_t word)
+{
+    unsigned char* w = &code[pos + 1 + IVM_NUM_REGS(insn->opcode)];
+
+    w[0] = word & 0xff;
+    w[1] = (word >> 8) & 0xff;
+    w[2] = (word >> 16) & 0xff;
+    w[3] = word >> 24;
+}
+
+
+
+/*
+ * Executed units first, by executed instructions per byte, and the rest in
+ * their original order.
+ */
+static int compare_units(const void* a, const void* b)
+{
+    const struct unit* x = a;
+    const struct unit* y = b;
+
+    if ((x->heat > 0) != (y->heat > 0)) {
+        return x->heat > 0 ? -1 : 1;
+    }
+
+    if (x->heat > 0) {
+        double dx = (double) x->heat / (x->end - x->start);
+        double dy = (double) y->heat / (y->end - y->start);
+        if (dx != dy) {
+            return dx > dy ? -1 : 1;
+        }
+    }
+
+    return x->index < y->index ? -1 : (x->index > y->index);
+}
+
+
+
+/*
+ * Split the code into units and weigh them by the profile.
+ */
+static int find_units(struct layout* l, const struct ivm_profile* profile)
+{
+    const struct optimizer* o = l->o;
+
+    for (size_t i = 0; i < profile->num_blocks; ++i) {
+        uint32_t addr = profile->blocks[i].addr;
+        if (addr >= o->size || !(o->map[addr] & IVM_MAP_START)) {
+            return EINVAL;
+        }
+    }
+
+    l->units = malloc(sizeof(struct unit) * o->num_regions);
+    l->counts = malloc(sizeof(uint64_t) * o->num_insns);
+    if (l->units == NULL || l->counts == NULL) {
+        return ENOMEM;
+    }
+
+    for (size_t r = 0; r < o->num_regions; ++r) {
+        const struct region* region = &o->regions[r];
+        const struct region* prev = r > 0 ? &o->regions[r - 1] : NULL;
+
+        if (prev == NULL || !falls_through(o, prev) || prev->end != region->start) {
+            struct unit* unit = &l->units[l->num_units];
+            unit->start = region->start;
+            unit->heat = 0;
+            unit->index = l->num_units++;
+        }
+
+        struct unit* unit = &l->units[l->num_units - 1];
+        unit->end = region->end;
+
+        for (size_t i = region->first; i < region->first + region->count; ++i) {
+            const struct ivm_profile_block* block = ivm_profile_find_block(profile, o->insns[i].pos);
+
+            l->counts[i] = block != NULL ? block->count : 0;
+            unit->heat += l->counts[i];
+        }
+    }
+
+    l->code_end = l->units[l->num_units - 1].end;
+
+    return 0;
+}
+
+
+
+/*
+ * Place the units and update the targets of the moved code.
+ * Returns EAGAIN if a target can not be updated.
+ */
+static int place_units(struct layout* l, unsigned char* buf)
+{
+    struct optimizer* o = l->o;
+
+    struct unit* order = malloc(sizeof(struct unit) * l->num_units);
+    if (order == NULL) {
+        return ENOMEM;
+    }
+
+    // The entry point stays in place
+    memcpy(order, l->units, sizeof(struct unit) * l->num_units);
+    qsort(order + 1, l->num_units - 1, sizeof(struct unit), compare_units);
+
+    uint32_t dest = 0;
+    for (size_t u = 0; u < l->num_units; ++u) {
+        l->units[order[u].index].dest = dest;
+        dest += order[u].end - order[u].start;
+    }
+    free(order);
+
+    for (size_t u = 0; u < l->num_units; ++u) {
+        const struct unit* unit = &l->units[u];
+        memcpy(buf + unit->dest, o->code + unit->start, unit->end - unit->start);
+    }
+
+    // Unreachable bytes between units are moved after them
+    for (size_t u = 0; u + 1 < l->num_units; ++u) {
+        uint32_t gap = l->units[u + 1].start - l->units[u].end;
+        memcpy(buf + dest, o->code + l->units[u].end, gap);
+        dest += gap;
+    }
+
+    for (size_t r = 0; r < o->num_regions; ++r) {
+        const struct region* region = &o->regions[r];
+
+        for (size_t i = region->first; i < region->first + region->count; ++i) {
+            const struct insn* insn = &o->insns[i];
+
+            if (!is_transfer(insn->opcode) || !insn->resolved) {
+                continue;
+            }
+
+            if (insn->opcode != CALL) {
+                put_word(buf, insn, relocate(l, insn->pos), insn->word + relocate(l, insn->target) - insn->target);
+                continue;
+            }
+
+            const struct insn* source = call_source(o, region, i);
+            if (source == NULL) {
+                return EAGAIN;
+            }
+            put_word(buf, source, relocate(l, source->pos), relocate(l, insn->target));
+        }
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Check that every transfer of the moved code goes to the moved target.
+ */
+static bool check_layout(const struct layout* l, unsigned char* buf)
+{
+    const struct optimizer* o = l->o;
+    struct ivm_optimize_report report;
+    struct optimizer moved;
+    bool ok = true;
+
+    if (analyze(&moved, buf, o->size, &report) != 0 || moved.num_insns != o->num_insns) {
+        release(&moved);
+        return false;
+    }
+
+    for (size_t i = 0; i < o->num_insns && ok; ++i) {
+        const struct insn* insn = &o->insns[i];
+        const struct insn* after = find_insn(&moved, relocate(l, insn->pos));
+
+        ok = after != NULL && after->opcode == insn->opcode && after->resolved == insn->resolved;
+        if (ok && insn->resolved) {
+            ok = after->target == relocate(l, insn->target);
+        }
+    }
+
+    release(&moved);
+    return ok;
+}
+
+
+
+/*
+ * Count the frames that hold executed instructions.
+ */
+static size_t count_frames(const struct layout* l, size_t frame_size, bool moved)
+{
+    const struct optimizer* o = l->o;
+    size_t num_frames = o->size / frame_size + 1;
+    size_t count = 0;
+
+    bool* used = calloc(num_frames, sizeof(bool));
+    if (used == NULL) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < o->num_insns; ++i) {
+        if (l->counts[i] > 0) {
+            size_t frame = (moved ? relocate(l, o->insns[i].pos) : o->insns[i].pos) / frame_size;
+            count += !used[frame];
+            used[frame] = true;
+        }
+    }
+
+    free(used);
+    return count;
+}
+
+
+
+static int layout(struct layout* l, const struct ivm_profile* profile, struct ivm_layout_report* report, size_t frame_size)
+{
+    const struct optimizer* o = l->o;
+
+    for (size_t r = 0; r < o->num_regions; ++r) {
+        if (o->regions[r].fixed) {
+            return EAGAIN;
+        }
+    }
+
+    for (size_t i = 0; i < o->num_insns; ++i) {
+        if (!is_movable(&o->insns[i])) {
+            return EAGAIN;
+        }
+    }
+
+    int err = find_units(l, profile);
+    if (err != 0) {
+        return err;
+    }
+
+    unsigned char* buf = malloc(o->size);
+    if (buf == NULL) {
+        return errno;
+    }
+    memcpy(buf, o->code, o->size);
+
+    err = place_units(l, buf);
+    if (err == 0 && !check_layout(l, buf)) {
+        err = EAGAIN;
+    }
+
+    if (err == 0) {
+        report->num_units = l->num_units;
+        for (size_t u = 0; u < l->num_units; ++u) {
+            report->num_moved += l->units[u].dest != l->units[u].start;
+            report->hot_bytes += l->units[u].heat > 0 ? l->units[u].end - l->units[u].start : 0;
+        }
+
+        if (frame_size > 0) {
+            report->frames_before = count_frames(l, frame_size, false);
+            report->frames_after = count_frames(l, frame_size, true);
+        }
+
+        memcpy(o->code, buf, o->size);
+    }
+
+    free(buf);
+    return err;
+}
+
+
+
+int ivm_bytecode_layout(struct ivm_layout_report* report, void* bytecode, size_t size, const struct ivm_profile* profile, size_t frame_size)
+{
+    struct ivm_optimize_report unused;
+    struct optimizer o;
+
+    if (report == NULL || bytecode == NULL || profile == NULL) {
+        return EINVAL;
+    }
+
+    memset(report, 0, sizeof(struct ivm_layout_report));
+
+    int err = analyze(&o, bytecode, size, &unused);
+    if (err != 0) {
+        release(&o);
+        return err == EAGAIN ? 0 : err;
+    }
+
+    struct layout l = {
+        .o = &o,
+        .units = NULL,
+        .num_units = 0,
+        .code_end = 0,
+        .counts = NULL,
+    };
+
+    err = layout(&l, profile, report, frame_size);
+    report->applied = err == 0;
+
+    free(l.counts);
+    free(l.units);
+    release(&o);
+    return err == EAGAIN ? 0 : err;
+}
+
+
+
+const char* ivm_optimize_pass_name(enum ivm_optimize_pass pass)
+{
+    switch (pass) {
+        case IVM_PASS_JUMPS:
+            return "jump threading";
+
+        case IVM_PASS_CONSTANTS:
+            return "constant propagation";
+
+        case IVM_PASS_STRENGTH:
+            return "strength reduction";
+
+        case IVM_PASS_LOADS:
+            return "redundant loads";
+
+        case IVM_PASS_DEAD_CODE:
+            return "dead code";
+
+        case IVM_PASS_COUNT:
+            break;
+    }
+
+    return "unknown";
+}
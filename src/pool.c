@@ -0,0 +1,382 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <ivm_list.h>
+#include <ivm_vm.h>
+#include <ivm_memory.h>
+#include <ivm_image.h>
+#include <ivm_instance.h>
+#include <ivm_pool.h>
+
+
+
+static const struct ivm_section* find_bytecode(const struct ivm_image* image)
+{
+    ivm_list_foreach(const struct ivm_segment, seg, &image->segments) {
+        ivm_list_foreach(const struct ivm_section, sect, &seg->sections) {
+            if (sect->type == IVM_SECT_BYTECODE) {
+                return sect;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+
+
+static struct ivm_frame* frame_table(const struct ivm_pool* pool, struct ivm_data* data)
+{
+    return (struct ivm_frame*) (((unsigned char*) data) + pool->data_offset_to_ft);
+}
+
+
+
+static void restore_frame(struct ivm_context* context, size_t idx)
+{
+    const struct ivm_pool* pool = context->pool;
+    const struct ivm_frame* orig = &frame_table(pool, pool->data)[idx];
+    struct ivm_frame* frame = &frame_table(pool, context->data)[idx];
+
+    if (orig->addr == 0) {
+        *frame = *orig;
+        return;
+    }
+
+    uint64_t offset = orig->addr - pool->memory_start;
+    memcpy(context->memory + offset, pool->memory + offset, pool->data->fsize);
+
+    frame->addr = (uint64_t) (context->memory + offset);
+    frame->attr = orig->attr;
+    frame->file = orig->file;
+    frame->offs = orig->offs;
+}
+
+
+
+/*
+ * Point the VM data of a context at its own registers, state stack and
+ * tables, which follow it in the same allocation.
+ */
+static void rebase_data(struct ivm_context* context)
+{
+    const struct ivm_pool* pool = context->pool;
+    struct ivm_data* data = context->data;
+    unsigned char* base = (unsigned char*) data;
+
+    data->registers = (void*) (base + pool->data_offset_to_regs);
+    data->states = (void*) (base + pool->data_offset_to_states);
+    data->ftable = (void*) (base + pool->data_offset_to_ft);
+    data->ctable = (void*) (base + pool->data_offset_to_ct);
+    data->wcode = pool->wide_code;
+}
+
+
+
+static void initialize_context(struct ivm_context* context)
+{
+    const struct ivm_pool* pool = context->pool;
+    struct ivm_data* data = context->data;
+
+    memcpy(data, pool->data, pool->data_size);
+    memcpy(context->memory, pool->memory, pool->memory_size);
+    rebase_data(context);
+
+    struct ivm_frame* frames = data->ftable;
+    for (size_t i = 0; i < data->fnum; ++i) {
+        if (frames[i].addr != 0) {
+            frames[i].addr = (uint64_t) (context->memory + (frames[i].addr - pool->memory_start));
+        }
+    }
+}
+
+
+
+static int create_template(struct ivm_pool* pool, const struct ivm_image* image, const void* bytecode)
+{
+    const struct ivm_section* section = find_bytecode(image);
+    if (section == NULL || image->data->registers == NULL) {
+        return EINVAL;
+    }
+
+    const struct ivm_segment* segment = section->segment;
+    const struct ivm_frame* frames = (const struct ivm_frame*) (((const unsigned char*) image->data) + image->data_offset_to_ft);
+
+    uint64_t start = segment->vm_start + section->vm_offset_to_seg;
+    size_t size = section->size;
+
+    for (size_t i = 0; i < image->data->fnum; ++i) {
+        if (frames[i].addr == 0) {
+            continue;
+        }
+
+        if (frames[i].addr < start) {
+            return EINVAL;
+        }
+
+        if (frames[i].addr - start + image->data->fsize > size) {
+            size = frames[i].addr - start + image->data->fsize;
+        }
+    }
+
+    int err = posix_memalign((void**) &pool->data, __alignof__(struct ivm_data), image->data_size);
+    if (err != 0) {
+        pool->data = NULL;
+        return err;
+    }
+    memcpy(pool->data, image->data, image->data_size);
+
+    pool->memory = calloc(1, size);
+    if (pool->memory == NULL) {
+        free(pool->data);
+        return errno;
+    }
+
+    if (bytecode != NULL) {
+        memcpy(pool->memory, bytecode, section->size);
+    }
+
+    pool->wide_code = NULL;
+    if (image->data->flags & IVM_FLAG_WIDE) {
+        pool->wide_code = malloc(sizeof(uint64_t) * (image->data->wsize > 0 ? image->data->wsize : 1));
+        if (pool->wide_code == NULL) {
+            free(pool->memory);
+            free(pool->data);
+            return errno;
+        }
+        memcpy(pool->wide_code, image->wide_code, sizeof(uint64_t) * image->data->wsize);
+    }
+
+    pool->data_size = image->data_size;
+    pool->data_offset_to_regs = image->data_offset_to_regs;
+    pool->data_offset_to_states = image->data_offset_to_states;
+    pool->data_offset_to_ft = image->data_offset_to_ft;
+    pool->data_offset_to_ct = image->data_offset_to_ct;
+    pool->memory_size = size;
+    pool->memory_start = start;
+
+    return 0;
+}
+
+
+
+int ivm_pool_create(struct ivm_pool** handle, const struct ivm_image* image, const void* bytecode, size_t num_contexts)
+{
+    if (handle == NULL || image == NULL || num_contexts == 0) {
+        return EINVAL;
+    }
+
+    struct ivm_pool* pool = malloc(sizeof(struct ivm_pool));
+    if (pool == NULL) {
+        return errno;
+    }
+
+    int err = create_template(pool, image, bytecode);
+    if (err != 0) {
+        free(pool);
+        return err;
+    }
+
+    pool->contexts = calloc(num_contexts, sizeof(struct ivm_context));
+    if (pool->contexts == NULL) {
+        err = errno;
+        ivm_pool_remove(pool);
+        return err;
+    }
+
+    pool->num_contexts = 0;
+    pool->num_free = 0;
+    ivm_list_init(&pool->free);
+
+    for (size_t i = 0; i < num_contexts; ++i) {
+        struct ivm_context* context = &pool->contexts[i];
+
+        context->pool = pool;
+        if (posix_memalign((void**) &context->data, __alignof__(struct ivm_data), pool->data_size) != 0) {
+            context->data = NULL;
+        }
+        context->memory = malloc(pool->memory_size);
+        context->saved = calloc((pool->data->fnum + 63) / 64, sizeof(uint64_t));
+        if (context->data == NULL || context->memory == NULL || context->saved == NULL) {
+            err = context->data == NULL ? ENOMEM : errno;
+            free(context->data);
+            free(context->memory);
+            free(context->saved);
+            ivm_pool_remove(pool);
+            return err;
+        }
+
+        initialize_context(context);
+
+        ivm_list_insert(&pool->free, context);
+        pool->num_contexts++;
+        pool->num_free++;
+    }
+
+    *handle = pool;
+    return 0;
+}
+
+
+
+void ivm_pool_remove(struct ivm_pool* pool)
+{
+    if (pool->contexts != NULL) {
+        for (size_t i = 0; i < pool->num_contexts; ++i) {
+            free(pool->contexts[i].data);
+            free(pool->contexts[i].memory);
+            free(pool->contexts[i].saved);
+        }
+        free(pool->contexts);
+    }
+
+    free(pool->wide_code);
+    free(pool->memory);
+    free(pool->data);
+    free(pool);
+}
+
+
+
+int ivm_pool_acquire(struct ivm_context** handle, struct ivm_pool* pool)
+{
+    struct ivm_context* context = ivm_list_first(struct ivm_context, &pool->free);
+    if (context == NULL) {
+        return EAGAIN;
+    }
+
+    ivm_list_remove(context);
+    pool->num_free--;
+
+    *handle = context;
+    return 0;
+}
+
+
+
+void ivm_pool_release(struct ivm_context* context)
+{
+    ivm_context_reset(context);
+
+    ivm_list_insert(&context->pool->free, context);
+    context->pool->num_free++;
+}
+
+
+
+void ivm_context_reset(struct ivm_context* context)
+{
+    const struct ivm_pool* pool = context->pool;
+    struct ivm_data* data = context->data;
+    struct ivm_frame* frames = data->ftable;
+
+    for (size_t i = 0; i < data->fnum; ++i) {
+        if (frames[i].attr & IVM_FRAME_ATTR_SHARED) {
+            continue;
+        }
+
+        if ((frames[i].attr & IVM_FRAME_ATTR_STALE) || (context->saved[i / 64] & (1ULL << (i % 64)))) {
+            restore_frame(context, i);
+        }
+    }
+
+    memset(context->saved, 0, sizeof(uint64_t) * ((data->fnum + 63) / 64));
+
+    // Restore the registers along with the budget, translation caches, CPU
+    // features and profiling state of the last run
+    memcpy(data, pool->data, sizeof(struct ivm_data));
+    rebase_data(context);
+    ivm_flush_tlb(data);
+}
+
+
+
+int ivm_context_execute(struct ivm_context* context, const struct ivm_instance* instance, uint64_t steps, int64_t* status)
+{
+    if (context == NULL || instance == NULL || context->data->vm_addr != instance->data->vm_addr) {
+        return EINVAL;
+    }
+
+    context->data->steps = steps;
+
+    int64_t result = instance->vm(context->data);
+    if (status != NULL) {
+        *status = result;
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Translate a guest address to a frame in the context.
+ */
+static struct ivm_frame* lookup_frame(const struct ivm_context* context, uint64_t addr)
+{
+    const struct ivm_data* data = context->data;
+
+    uint64_t idx = addr >> data->fshift;
+    if (idx >= data->fnum || data->ftable[idx].addr == 0) {
+        return NULL;
+    }
+
+    return &data->ftable[idx];
+}
+
+
+
+int ivm_context_write(struct ivm_context* context, uint64_t addr, const void* data, size_t size)
+{
+    const unsigned char* ptr = data;
+    uint64_t fsize = 1ULL << context->data->fshift;
+
+    while (size > 0) {
+        struct ivm_frame* frame = lookup_frame(context, addr);
+        if (frame == NULL) {
+            return EFAULT;
+        }
+
+        uint64_t offset = addr & (fsize - 1);
+        size_t n = fsize - offset < size ? fsize - offset : size;
+
+        memcpy((void*) (frame->addr + offset), ptr, n);
+        frame->attr |= IVM_FRAME_ATTR_STALE;
+
+        ptr += n;
+        addr += n;
+        size -= n;
+    }
+
+    return 0;
+}
+
+
+
+int ivm_context_read(const struct ivm_context* context, uint64_t addr, void* data, size_t size)
+{
+    unsigned char* ptr = data;
+    uint64_t fsize = 1ULL << context->data->fshift;
+
+    while (size > 0) {
+        const struct ivm_frame* frame = lookup_frame(context, addr);
+        if (frame == NULL) {
+            return EFAULT;
+        }
+
+        uint64_t offset = addr & (fsize - 1);
+        size_t n = fsize - offset < size ? fsize - offset : size;
+
+        memcpy(ptr, (const void*) (frame->addr + offset), n);
+
+        ptr += n;
+        addr += n;
+        size -= n;
+    }
+
+    return 0;
+}
@@ -0,0 +1,407 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <ivm_vm.h>
+#include <ivm_bytecode.h>
+#include <ivm_verify.h>
+#include <ivm_profile.h>
+
+
+
+/*
+ * Profile file header.
+ */
+struct header
+{
+    char        magic[8];
+    uint32_t    version;
+    uint32_t    reserved;
+    uint64_t    num_functions;
+    uint64_t    num_blocks;
+    uint64_t    num_edges;
+    uint64_t    lost;
+};
+
+
+
+static const char magic[8] = "IVMPROF";
+
+
+
+/*
+ * Flag added to the bytecode map where a block starts.
+ */
+#define MAP_LEADER  0x80
+
+
+
+int ivm_profile_start(struct ivm_data* data, size_t capacity)
+{
+    if (data == NULL || capacity == 0) {
+        return EINVAL;
+    }
+
+    if (data->ptable != NULL) {
+        return EEXIST;
+    }
+
+    size_t size = 1;
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    struct ivm_profile_entry* table = calloc(size, sizeof(struct ivm_profile_entry));
+    if (table == NULL) {
+        return errno;
+    }
+
+    data->psize = size;
+    data->plost = 0;
+    data->ptable = table;
+    return 0;
+}
+
+
+
+void ivm_profile_stop(struct ivm_data* data)
+{
+    free(data->ptable);
+    data->ptable = NULL;
+    data->psize = 0;
+    data->plost = 0;
+}
+
+
+
+void ivm_profile_remove(struct ivm_profile* profile)
+{
+    if (profile != NULL) {
+        free(profile->functions);
+        free(profile->blocks);
+        free(profile->edges);
+        free(profile);
+    }
+}
+
+
+
+static int compare_edges(const void* a, const void* b)
+{
+    const struct ivm_profile_edge* x = a;
+    const struct ivm_profile_edge* y = b;
+
+    if (x->from != y->from) {
+        return x->from < y->from ? -1 : 1;
+    }
+
+    if (x->to != y->to) {
+        return x->to < y->to ? -1 : 1;
+    }
+
+    return 0;
+}
+
+
+
+static int compare_functions(const void* a, const void* b)
+{
+    const struct ivm_profile_function* x = a;
+    const struct ivm_profile_function* y = b;
+
+    if (x->addr != y->addr) {
+        return x->addr < y->addr ? -1 : 1;
+    }
+
+    return 0;
+}
+
+
+
+static bool is_terminator(uint8_t opcode)
+{
+    return opcode == JUMP || opcode == HALT || opcode == RETURN || opcode == RETW || opcode == RESTORE;
+}
+
+
+
+static struct ivm_profile* create_profile(size_t num_functions, size_t num_blocks, size_t num_edges)
+{
+    struct ivm_profile* profile = malloc(sizeof(struct ivm_profile));
+    if (profile == NULL) {
+        return NULL;
+    }
+
+    profile->num_functions = num_functions;
+    profile->functions = malloc(sizeof(struct ivm_profile_function) * (num_functions > 0 ? num_functions : 1));
+    profile->num_blocks = num_blocks;
+    profile->blocks = malloc(sizeof(struct ivm_profile_block) * (num_blocks > 0 ? num_blocks : 1));
+    profile->num_edges = num_edges;
+    profile->edges = malloc(sizeof(struct ivm_profile_edge) * (num_edges > 0 ? num_edges : 1));
+    profile->lost = 0;
+
+    if (profile->functions == NULL || profile->blocks == NULL || profile->edges == NULL) {
+        ivm_profile_remove(profile);
+        return NULL;
+    }
+
+    return profile;
+}
+
+
+
+/*
+ * Split the verified instructions into blocks at every jump target, every
+ * instruction that was entered by a transfer and after every instruction
+ * that transferred control. The count of a block is the number of
+ * transfers into it, plus the number of times the block before it ran
+ * without transferring control elsewhere.
+ */
+static void find_blocks(struct ivm_profile* profile, const unsigned char* code, size_t size, unsigned char* map, const uint64_t* in, const uint64_t* out)
+{
+    struct ivm_profile_block* block = NULL;
+    uint64_t left = 0;
+    bool ended = true;
+
+    profile->num_blocks = 0;
+
+    for (size_t pos = 0; pos < size; ++pos) {
+        if (!(map[pos] & IVM_MAP_START)) {
+            continue;
+        }
+
+        uint8_t opcode = code[pos];
+        uint32_t len = IVM_INSTR_LEN(opcode);
+        bool adjacent = block != NULL && block->addr + block->size == pos;
+
+        if (ended || !adjacent || (map[pos] & (MAP_LEADER | IVM_MAP_TARGET))) {
+            uint64_t fall = adjacent && !ended ? left : 0;
+
+            block = &profile->blocks[profile->num_blocks++];
+            block->addr = pos;
+            block->size = 0;
+            block->count = in[pos] + fall;
+        }
+
+        block->size += len;
+
+        // Execution continues after the block as often as it did not leave
+        // it through a transfer
+        left = block->count > out[pos] ? block->count - out[pos] : 0;
+        ended = is_terminator(opcode);
+    }
+}
+
+
+
+/*
+ * Sum the calls into each function.
+ */
+static void find_functions(struct ivm_profile* profile, const unsigned char* code, size_t size, const unsigned char* map)
+{
+    profile->num_functions = 0;
+
+    for (size_t i = 0; i < profile->num_edges; ++i) {
+        const struct ivm_profile_edge* edge = &profile->edges[i];
+
+        if (edge->from < size && (map[edge->from] & IVM_MAP_START) && (code[edge->from] == CALL || code[edge->from] == CALLW)) {
+            struct ivm_profile_function* func = &profile->functions[profile->num_functions++];
+            func->addr = edge->to;
+            func->reserved = 0;
+            func->calls = edge->count;
+        }
+    }
+
+    qsort(profile->functions, profile->num_functions, sizeof(struct ivm_profile_function), compare_functions);
+
+    size_t n = 0;
+    for (size_t i = 0; i < profile->num_functions; ++i) {
+        if (n > 0 && profile->functions[n - 1].addr == profile->functions[i].addr) {
+            profile->functions[n - 1].calls += profile->functions[i].calls;
+        }
+        else {
+            profile->functions[n++] = profile->functions[i];
+        }
+    }
+    profile->num_functions = n;
+}
+
+
+
+int ivm_profile_collect(struct ivm_profile** profile, const struct ivm_data* data, const void* bytecode, size_t size)
+{
+    struct ivm_verify_result verified;
+
+    if (profile == NULL || data == NULL || data->ptable == NULL || bytecode == NULL || size == 0) {
+        return EINVAL;
+    }
+
+    size_t num_edges = 0;
+    for (uint64_t i = 0; i < data->psize; ++i) {
+        if (data->ptable[i].count > 0) {
+            num_edges++;
+        }
+    }
+
+    unsigned char* map = malloc(size);
+    uint64_t* in = calloc(size, sizeof(uint64_t));
+    uint64_t* out = calloc(size, sizeof(uint64_t));
+    if (map == NULL || in == NULL || out == NULL) {
+        free(out);
+        free(in);
+        free(map);
+        return ENOMEM;
+    }
+
+    int err = ivm_bytecode_map(&verified, bytecode, size, map);
+    if (err != 0) {
+        free(out);
+        free(in);
+        free(map);
+        return err;
+    }
+
+    struct ivm_profile* p = create_profile(num_edges, verified.num_instructions, num_edges);
+    if (p == NULL) {
+        free(out);
+        free(in);
+        free(map);
+        return ENOMEM;
+    }
+
+    p->num_edges = 0;
+    for (uint64_t i = 0; i < data->psize; ++i) {
+        const struct ivm_profile_entry* entry = &data->ptable[i];
+
+        if (entry->count > 0) {
+            struct ivm_profile_edge* edge = &p->edges[p->num_edges++];
+            edge->from = entry->key & 0xffffffff;
+            edge->to = entry->key >> 32;
+            edge->count = entry->count;
+
+            if (edge->to < size && (map[edge->to] & IVM_MAP_START)) {
+                map[edge->to] |= MAP_LEADER;
+                in[edge->to] += edge->count;
+            }
+
+            if (edge->from < size && (map[edge->from] & IVM_MAP_START)) {
+                uint32_t next = edge->from + IVM_INSTR_LEN(((const unsigned char*) bytecode)[edge->from]);
+                if (next < size) {
+                    map[next] |= MAP_LEADER;
+                }
+                out[edge->from] += edge->count;
+            }
+        }
+    }
+    p->lost = data->plost;
+
+    qsort(p->edges, p->num_edges, sizeof(struct ivm_profile_edge), compare_edges);
+
+    find_functions(p, bytecode, size, map);
+    find_blocks(p, bytecode, size, map, in, out);
+
+    free(out);
+    free(in);
+    free(map);
+
+    *profile = p;
+    return 0;
+}
+
+
+
+int ivm_profile_write(FILE* fp, const struct ivm_profile* profile)
+{
+    struct header header;
+
+    if (fp == NULL || profile == NULL) {
+        return EINVAL;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, magic, sizeof(magic));
+    header.version = IVM_PROFILE_VERSION;
+    header.num_functions = profile->num_functions;
+    header.num_blocks = profile->num_blocks;
+    header.num_edges = profile->num_edges;
+    header.lost = profile->lost;
+
+    fwrite(&header, sizeof(header), 1, fp);
+    fwrite(profile->functions, sizeof(struct ivm_profile_function), profile->num_functions, fp);
+    fwrite(profile->blocks, sizeof(struct ivm_profile_block), profile->num_blocks, fp);
+    fwrite(profile->edges, sizeof(struct ivm_profile_edge), profile->num_edges, fp);
+
+    if (ferror(fp)) {
+        return EIO;
+    }
+
+    return 0;
+}
+
+
+
+int ivm_profile_read(struct ivm_profile** profile, FILE* fp)
+{
+    struct header header;
+
+    if (profile == NULL || fp == NULL) {
+        return EINVAL;
+    }
+
+    if (fread(&header, sizeof(header), 1, fp) != 1) {
+        return ferror(fp) ? EIO : EINVAL;
+    }
+
+    if (memcmp(header.magic, magic, sizeof(magic)) != 0 || header.version != IVM_PROFILE_VERSION) {
+        return EINVAL;
+    }
+
+    // Do not trust the counts of a corrupt file with the allocation sizes
+    if (header.num_functions > SIZE_MAX / 16 || header.num_blocks > SIZE_MAX / 16 || header.num_edges > SIZE_MAX / 16) {
+        return EINVAL;
+    }
+
+    struct ivm_profile* p = create_profile(header.num_functions, header.num_blocks, header.num_edges);
+    if (p == NULL) {
+        return ENOMEM;
+    }
+    p->lost = header.lost;
+
+    if (fread(p->functions, sizeof(struct ivm_profile_function), p->num_functions, fp) != p->num_functions
+            || fread(p->blocks, sizeof(struct ivm_profile_block), p->num_blocks, fp) != p->num_blocks
+            || fread(p->edges, sizeof(struct ivm_profile_edge), p->num_edges, fp) != p->num_edges) {
+        int err = ferror(fp) ? EIO : EINVAL;
+        ivm_profile_remove(p);
+        return err;
+    }
+
+    *profile = p;
+    return 0;
+}
+
+
+
+const struct ivm_profile_block* ivm_profile_find_block(const struct ivm_profile* profile, uint32_t addr)
+{
+    size_t lo = 0;
+    size_t hi = profile->num_blocks;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (profile->blocks[mid].addr <= addr) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+
+    if (lo > 0 && addr - profile->blocks[lo - 1].addr < profile->blocks[lo - 1].size) {
+        return &profile->blocks[lo - 1];
+    }
+
+    return NULL;
+}
@@ -0,0 +1,367 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <ivm_list.h>
+#include <ivm_vm.h>
+#include <ivm_memory.h>
+#include <ivm_image.h>
+#include <ivm_pool.h>
+#include <ivm_snapshot.h>
+
+
+
+/*
+ * Copy the code segment of the parent image, or reference the same shared
+ * VM code.
+ */
+static int copy_code(struct ivm_image* image, const struct ivm_image* parent)
+{
+    int err;
+
+    if (parent->vm_interp != NULL) {
+        image->vm_interp = strdup(parent->vm_interp);
+        if (image->vm_interp == NULL) {
+            return errno;
+        }
+
+        image->vm_entry_point = parent->vm_entry_point;
+        image->vm_file_offset = 0;
+        return 0;
+    }
+
+    ivm_list_foreach(const struct ivm_segment, seg, &parent->segments) {
+        if (seg->type != IVM_SEG_CODE) {
+            continue;
+        }
+
+        const struct ivm_section* sect = ivm_list_first(const struct ivm_section, &seg->sections);
+        if (sect == NULL) {
+            return EINVAL;
+        }
+
+        image->vm_code = malloc(sect->size);
+        if (image->vm_code == NULL) {
+            return errno;
+        }
+        memcpy(image->vm_code, sect->data, sect->size);
+
+        struct ivm_segment* segment = NULL;
+        err = ivm_image_add_segment(&segment, image, IVM_SEG_CODE, seg->vm_align, seg->vm_start, seg->vm_size, seg->file_align);
+        if (err != 0) {
+            return err;
+        }
+
+        err = ivm_image_add_section(NULL, segment, IVM_SECT_CODE, sect->vm_align, image->vm_code, sect->size);
+        if (err != 0) {
+            return err;
+        }
+
+        image->vm_entry_point = segment->vm_start;
+        image->vm_file_offset = ivm_image_segment_offset(image, segment);
+        return 0;
+    }
+
+    return EINVAL;
+}
+
+
+
+/*
+ * Copy the fixed-width code of the parent image to the same address.
+ */
+static int copy_wide_code(struct ivm_image* image, const struct ivm_image* parent)
+{
+    size_t size = sizeof(uint64_t) * parent->data->wsize;
+
+    image->data->wcode = parent->data->wcode;
+    if (!(parent->data->flags & IVM_FLAG_WIDE)) {
+        return 0;
+    }
+
+    image->wide_code = malloc(size > 0 ? size : 1);
+    if (image->wide_code == NULL) {
+        return errno;
+    }
+    memcpy(image->wide_code, parent->wide_code, size);
+
+    struct ivm_segment* segment = NULL;
+    int err = ivm_image_add_segment(&segment, image, IVM_SEG_DATA, image->page_size, (uint64_t) parent->data->wcode, size, image->page_size);
+    if (err != 0) {
+        return err;
+    }
+
+    return ivm_image_add_section(NULL, segment, IVM_SECT_CONST, sizeof(uint64_t), image->wide_code, size);
+}
+
+
+
+/*
+ * Find the position of a frame in the parent image file.
+ */
+static bool parent_file_offset(const struct ivm_image* parent, const struct ivm_frame* frame, size_t* offset)
+{
+    size_t fsize = parent->data->fsize;
+
+    ivm_list_foreach(const struct ivm_segment, seg, &parent->segments) {
+        if (frame->addr < seg->vm_start || frame->addr >= seg->vm_start + seg->vm_size) {
+            continue;
+        }
+
+        uint64_t pos = frame->addr - seg->vm_start;
+        if (pos + fsize > seg->file_size) {
+            return false;
+        }
+
+        pos += ivm_image_header_size(parent) + ivm_image_segment_offset(parent, seg);
+        if (pos + fsize > UINT32_MAX) {
+            return false;
+        }
+
+        *offset = pos;
+        return true;
+    }
+
+    return false;
+}
+
+
+
+/*
+ * Decide if a frame must be saved in the snapshot, or if it can be
+ * referenced from the parent image.
+ */
+static bool must_save(const struct ivm_image* parent,
+                      const struct ivm_context* context,
+                      enum ivm_snapshot_type type,
+                      size_t idx)
+{
+    const struct ivm_frame* frame = &context->data->ftable[idx];
+    const struct ivm_frame* orig = &((const struct ivm_frame*) (((const unsigned char*) parent->data) + parent->data_offset_to_ft))[idx];
+    size_t offset;
+
+    if (frame->addr == 0) {
+        return false;
+    }
+
+    if (frame->addr < (uint64_t) context->memory || frame->addr >= (uint64_t) context->memory + context->pool->memory_size) {
+        return true;
+    }
+
+    if (type == IVM_SNAPSHOT_FULL) {
+        return !!(frame->attr & IVM_FRAME_ATTR_ALLOC);
+    }
+
+    if (frame->attr & IVM_FRAME_ATTR_STALE) {
+        return true;
+    }
+
+    if (orig->attr & IVM_FRAME_ATTR_ALLOC) {
+        return !parent_file_offset(parent, orig, &offset);
+    }
+
+    return !((orig->attr & IVM_FRAME_ATTR_ALLOC_ON_FAULT) && orig->file >= 0);
+}
+
+
+
+static void rewrite_frames(struct ivm_image* image,
+                           const struct ivm_image* parent,
+                           const struct ivm_context* context,
+                           enum ivm_snapshot_type type,
+                           int parent_fd,
+                           uint64_t saved_start)
+{
+    const struct ivm_frame* orig = (const struct ivm_frame*) (((const unsigned char*) parent->data) + parent->data_offset_to_ft);
+    const struct ivm_frame* frames = context->data->ftable;
+    struct ivm_frame* snap = (struct ivm_frame*) (((unsigned char*) image->data) + image->data_offset_to_ft);
+
+    size_t fsize = context->data->fsize;
+    size_t saved = 0;
+
+    for (size_t i = 0; i < context->data->fnum; ++i) {
+        uint16_t attr = frames[i].attr & ~(IVM_FRAME_ATTR_STALE | IVM_FRAME_ATTR_SHARED);
+
+        if (frames[i].addr == 0) {
+            continue;
+        }
+
+        if (must_save(parent, context, type, i)) {
+            memcpy(((unsigned char*) image->frame_data) + saved * fsize, (const void*) frames[i].addr, fsize);
+            snap[i].addr = saved_start + saved * fsize;
+            snap[i].attr = attr | IVM_FRAME_ATTR_ALLOC;
+            snap[i].file = -1;
+            snap[i].offs = 0;
+            ++saved;
+            continue;
+        }
+
+        snap[i].addr = context->pool->memory_start + (frames[i].addr - (uint64_t) context->memory);
+        snap[i].attr = attr;
+
+        if (type == IVM_SNAPSHOT_FULL) {
+            continue;
+        }
+
+        size_t offset;
+        snap[i].attr = (attr & ~IVM_FRAME_ATTR_ALLOC) | IVM_FRAME_ATTR_ALLOC_ON_FAULT;
+
+        if ((orig[i].attr & IVM_FRAME_ATTR_ALLOC) && parent_file_offset(parent, &orig[i], &offset)) {
+            snap[i].file = parent_fd;
+            snap[i].offs = offset;
+        }
+        else {
+            snap[i].file = orig[i].file;
+            snap[i].offs = orig[i].offs;
+        }
+    }
+}
+
+
+
+static int create_snapshot(struct ivm_image* image,
+                           const struct ivm_image* parent,
+                           struct ivm_context* context,
+                           enum ivm_snapshot_type type,
+                           int parent_fd)
+{
+    int err;
+    const struct ivm_pool* pool = context->pool;
+    size_t fsize = context->data->fsize;
+
+    err = copy_code(image, parent);
+    if (err != 0) {
+        return err;
+    }
+
+    // Capture VM data, registers, state stack and frame table
+    memcpy(image->data, context->data, image->data_size);
+    ivm_flush_tlb(image->data);
+
+    // The snapshot may run on a different host, or in a different process
+    image->data->cpu = 0;
+    memset(((unsigned char*) image->data) + image->data_offset_to_ct, 0, sizeof(uint64_t) * IVM_CTABLE_SIZE);
+
+    // The profile table belongs to the context
+    image->data->ptable = NULL;
+    image->data->psize = 0;
+    image->data->plost = 0;
+
+    size_t num_saved = 0;
+    for (size_t i = 0; i < context->data->fnum; ++i) {
+        if (must_save(parent, context, type, i)) {
+            ++num_saved;
+        }
+    }
+
+    if (num_saved > 0) {
+        image->frame_data = malloc(num_saved * fsize);
+        if (image->frame_data == NULL) {
+            return errno;
+        }
+    }
+
+    // Create data segment at the same address as in the parent
+    uint64_t data_addr = (uint64_t) parent->data->registers - parent->data_offset_to_regs;
+
+    struct ivm_segment* data_segment = NULL;
+    err = ivm_image_add_segment(&data_segment, image, IVM_SEG_DATA, image->page_size, data_addr, image->data_size, image->page_size);
+    if (err != 0) {
+        return err;
+    }
+
+    image->data->registers = (void*) (data_addr + image->data_offset_to_regs);
+    image->data->states = (void*) (data_addr + image->data_offset_to_states);
+    image->data->ftable = (void*) (data_addr + image->data_offset_to_ft);
+    image->data->ctable = (void*) (data_addr + image->data_offset_to_ct);
+
+    err = ivm_image_add_section(NULL, data_segment, IVM_SECT_DATA, image->page_size, image->data, image->data_offset_to_ct);
+    if (err != 0) {
+        return err;
+    }
+
+    // Reserve guest memory without file contents
+    err = ivm_image_add_segment(NULL, image, IVM_SEG_DATA, image->page_size, pool->memory_start, pool->memory_size, image->page_size);
+    if (err != 0) {
+        return err;
+    }
+
+    err = copy_wide_code(image, parent);
+    if (err != 0) {
+        return err;
+    }
+
+    // Store saved frames after guest memory, and after the fixed-width code if it follows
+    uint64_t saved_start = IVM_ALIGN_ADDR(pool->memory_start + pool->memory_size, image->page_size);
+    uint64_t wide_end = (uint64_t) image->data->wcode + sizeof(uint64_t) * image->data->wsize;
+    if ((image->data->flags & IVM_FLAG_WIDE) && (uint64_t) image->data->wcode >= pool->memory_start && wide_end > saved_start) {
+        saved_start = IVM_ALIGN_ADDR(wide_end, image->page_size);
+    }
+
+    if (num_saved > 0) {
+        struct ivm_segment* saved_segment = NULL;
+        err = ivm_image_add_segment(&saved_segment, image, IVM_SEG_DATA, image->page_size, saved_start, num_saved * fsize, image->page_size);
+        if (err != 0) {
+            return err;
+        }
+
+        err = ivm_image_add_section(NULL, saved_segment, IVM_SECT_DATA, image->page_size, image->frame_data, num_saved * fsize);
+        if (err != 0) {
+            return err;
+        }
+    }
+
+    rewrite_frames(image, parent, context, type, parent_fd, saved_start);
+    return 0;
+}
+
+
+
+int ivm_image_snapshot(struct ivm_image** handle,
+                       const struct ivm_image* parent,
+                       struct ivm_context* context,
+                       enum ivm_snapshot_type type,
+                       int parent_fd)
+{
+    if (handle == NULL || parent == NULL || context == NULL) {
+        return EINVAL;
+    }
+
+    const struct ivm_data* data = context->data;
+
+    if (parent->data->fnum != data->fnum || parent->data->fsize != data->fsize || parent->data->state_size != data->state_size) {
+        return EINVAL;
+    }
+
+    if (type == IVM_SNAPSHOT_INCREMENTAL && parent_fd < 0) {
+        return EBADF;
+    }
+
+    struct ivm_image* image = NULL;
+    int err = ivm_image_create(&image, data->state_size, data->fsize, data->fnum);
+    if (err != 0) {
+        return err;
+    }
+
+    err = create_snapshot(image, parent, context, type, parent_fd);
+    if (err != 0) {
+        ivm_image_remove(image);
+        return err;
+    }
+
+    // Frames written up to now are stored in the snapshot
+    struct ivm_frame* frames = context->data->ftable;
+    ivm_flush_tlb(context->data);
+    for (size_t i = 0; i < data->fnum; ++i) {
+        if (frames[i].attr & IVM_FRAME_ATTR_STALE) {
+            context->saved[i / 64] |= 1ULL << (i % 64);
+            frames[i].attr &= ~IVM_FRAME_ATTR_STALE;
+        }
+    }
+
+    *handle = image;
+    return 0;
+}
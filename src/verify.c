@@ -0,0 +1,652 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <ivm_list.h>
+#include <ivm_vm.h>
+#include <ivm_image.h>
+#include <ivm_bytecode.h>
+#include <ivm_verify.h>
+
+
+
+/*
+ * Defined opcodes.
+ */
+static const bool valid_opcodes[256] = {
+    [JUMP] = true, [JUMPEQ] = true, [JUMPLT] = true, [JUMPGT] = true, [JUMPNE] = true,
+    [CALL] = true, [RETURN] = true, [CALLW] = true, [RETW] = true, [SETWS] = true, [NCALL] = true,
+    [LOAD] = true, [LOADWORD] = true, [STORE] = true, [STOREWORD] = true,
+    [LOADACQ] = true, [STOREREL] = true, [ATOMCAS] = true, [ATOMADD] = true,
+    [POP] = true, [PUSH] = true, [MOVE] = true, [SET] = true, [ZERO] = true,
+    [INVERT] = true, [XOR] = true, [AND] = true, [OR] = true, [SHIFTUP] = true, [SHIFTDOWN] = true,
+    [SUB] = true, [ADD] = true, [MUL] = true, [DIVMOD] = true,
+    [VADD] = true, [VXOR] = true, [VCMPEQ] = true, [VMIN] = true, [VMAX] = true, [VSUM] = true,
+    [MADD] = true, [MXOR] = true, [MCMPEQ] = true, [MMIN] = true, [MMAX] = true, [MSUM] = true,
+    [MCOPY] = true, [MFILL] = true, [MCMP] = true, [MFIND] = true,
+    [SETBP] = true, [SETSB] = true, [SETSP] = true, [MOVEBP] = true, [MOVESB] = true, [MOVESP] = true, [MOVEIP] = true,
+    [ENTER] = true, [LEAVE] = true, [POPALL] = true, [PUSHALL] = true,
+    [HALT] = true, [NOOP] = true, [DISABLE] = true, [ENABLE] = true, [VECTOR] = true, [TRAP] = true, [RESTORE] = true,
+};
+
+
+
+/*
+ * Registers with values known at link time.
+ */
+struct reg_state
+{
+    uint64_t    known[4];
+    uint32_t    value[256];
+};
+
+
+
+/*
+ * Kind of each bytecode offset.
+ */
+enum
+{
+    OFFSET_UNVISITED        = 0x0,
+    OFFSET_START            = 0x1,
+    OFFSET_INSIDE           = 0x2,
+    OFFSET_KIND             = 0x3,
+    OFFSET_DYNAMIC          = 0x4,  // Instruction has been counted as a computed jump
+};
+
+
+
+struct verifier
+{
+    const unsigned char*    code;
+    size_t                  size;
+    unsigned char*          kind;       // Kind of each offset
+    uint32_t*               owner;      // Jump target each instruction was last decoded from
+    struct reg_state**      leaders;    // Register state on entry of each jump target
+    uint32_t*               work;       // Jump targets to decode from
+    size_t                  num_work;
+    size_t                  max_work;
+    bool                    vectored;   // A VECTOR instruction has been decoded
+    bool                    untracked;  // Register values are not tracked
+    struct ivm_verify_result* result;
+};
+
+
+
+static inline bool is_known(const struct reg_state* s, uint8_t reg)
+{
+    return !!(s->known[reg / 64] & (1ULL << (reg % 64)));
+}
+
+
+
+static inline void set_known(struct reg_state* s, uint8_t reg, uint32_t value)
+{
+    s->known[reg / 64] |= 1ULL << (reg % 64);
+    s->value[reg] = value;
+}
+
+
+
+static inline void set_unknown(struct reg_state* s, uint8_t reg)
+{
+    s->known[reg / 64] &= ~(1ULL << (reg % 64));
+}
+
+
+
+static inline void clear_state(struct reg_state* s)
+{
+    memset(s->known, 0, sizeof(s->known));
+}
+
+
+
+/*
+ * Keep the registers that have the same known value in both states.
+ * Returns true if the destination changed.
+ */
+static bool merge_state(struct reg_state* dst, const struct reg_state* src)
+{
+    bool changed = false;
+
+    for (int i = 0; i < 4; ++i) {
+        uint64_t known = dst->known[i] & src->known[i];
+
+        for (uint64_t bits = known; bits != 0; bits &= bits - 1) {
+            int reg = i * 64 + __builtin_ctzll(bits);
+            if (dst->value[reg] != src->value[reg]) {
+                known &= ~(1ULL << (reg % 64));
+            }
+        }
+
+        changed = changed || known != dst->known[i];
+        dst->known[i] = known;
+    }
+
+    return changed;
+}
+
+
+
+static int reject(struct verifier* v, enum ivm_verify_error error, uint32_t offset)
+{
+    v->result->error = error;
+    v->result->offset = offset;
+    return EINVAL;
+}
+
+
+
+/*
+ * Count a jump or call with a computed target once, even if its path is
+ * decoded again.
+ */
+static void count_dynamic(struct verifier* v, uint32_t pos)
+{
+    if (!(v->kind[pos] & OFFSET_DYNAMIC)) {
+        v->kind[pos] |= OFFSET_DYNAMIC;
+        v->result->num_dynamic++;
+    }
+}
+
+
+
+static int push_work(struct verifier* v, uint32_t offset)
+{
+    if (v->num_work == v->max_work) {
+        size_t max = v->max_work > 0 ? v->max_work * 2 : 64;
+        uint32_t* work = realloc(v->work, sizeof(uint32_t) * max);
+        if (work == NULL) {
+            return errno;
+        }
+        v->work = work;
+        v->max_work = max;
+    }
+
+    v->work[v->num_work++] = offset;
+    return 0;
+}
+
+
+
+/*
+ * Record a jump target of the instruction at the given offset.
+ * The state is NULL if no register values are known at the target.
+ */
+static int add_target(struct verifier* v, uint32_t from, uint32_t target, const struct reg_state* state)
+{
+    if (target >= v->size) {
+        return reject(v, IVM_VERIFY_INVALID_TARGET, from);
+    }
+
+    if ((v->kind[target] & OFFSET_KIND) == OFFSET_INSIDE) {
+        return reject(v, IVM_VERIFY_OVERLAP, from);
+    }
+
+    struct reg_state* entry = v->leaders[target];
+
+    if (entry == NULL) {
+        entry = malloc(sizeof(struct reg_state));
+        if (entry == NULL) {
+            return errno;
+        }
+        v->leaders[target] = entry;
+
+        if (state == NULL) {
+            clear_state(entry);
+        }
+        else {
+            memcpy(entry, state, sizeof(struct reg_state));
+        }
+
+        int err = push_work(v, target);
+        if (err != 0 || (v->kind[target] & OFFSET_KIND) == OFFSET_UNVISITED) {
+            return err;
+        }
+
+        // A path already fell through the target, typically the body of a
+        // loop. Decode that path again, which merges its state into the
+        // target before the target is decoded.
+        return push_work(v, v->owner[target]);
+    }
+
+    struct reg_state empty;
+    if (state == NULL) {
+        clear_state(&empty);
+        state = &empty;
+    }
+
+    if (merge_state(entry, state)) {
+        return push_work(v, target);
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Decode a basic block and the blocks it falls through to, until the path
+ * ends or reaches another jump target.
+ */
+static int verify_path(struct verifier* v, uint32_t start)
+{
+    int err;
+    struct reg_state s;
+    uint32_t pos = start;
+
+    memcpy(&s, v->leaders[start], sizeof(struct reg_state));
+
+    while (1) {
+        if (pos >= v->size) {
+            return reject(v, IVM_VERIFY_TRUNCATED, pos);
+        }
+
+        if ((v->kind[pos] & OFFSET_KIND) == OFFSET_INSIDE) {
+            return reject(v, IVM_VERIFY_OVERLAP, pos);
+        }
+
+        if (pos != start && v->leaders[pos] != NULL) {
+            if (merge_state(v->leaders[pos], &s)) {
+                return push_work(v, pos);
+            }
+            return 0;
+        }
+
+        uint8_t opcode = v->code[pos];
+        if (!valid_opcodes[opcode]) {
+            return reject(v, IVM_VERIFY_INVALID_OPCODE, pos);
+        }
+
+        uint32_t len = IVM_INSTR_LEN(opcode);
+        if (pos + len > v->size) {
+            return reject(v, IVM_VERIFY_TRUNCATED, pos);
+        }
+
+        for (uint32_t i = 1; i < len; ++i) {
+            if ((v->kind[pos + i] & OFFSET_KIND) == OFFSET_START) {
+                return reject(v, IVM_VERIFY_OVERLAP, pos);
+            }
+            v->kind[pos + i] = OFFSET_INSIDE;
+        }
+
+        if ((v->kind[pos] & OFFSET_KIND) == OFFSET_UNVISITED) {
+            v->kind[pos] = OFFSET_START;
+            v->result->num_instructions++;
+        }
+        v->owner[pos] = start;
+
+        const unsigned char* code = &v->code[pos];
+        uint8_t a = len > 1 ? code[1] : 0;
+        uint8_t b = len > 2 ? code[2] : 0;
+        uint8_t c = len > 3 ? code[3] : 0;
+        uint32_t word = 0;
+        if (IVM_HAS_WORD(opcode)) {
+            const unsigned char* w = &code[1 + IVM_NUM_REGS(opcode)];
+            word = w[0] | (w[1] << 8) | (w[2] << 16) | ((uint32_t) w[3] << 24);
+        }
+
+        uint32_t next = pos + len;
+        uint8_t base = 0;
+        bool ends = false;
+        bool jumps = false;
+
+        switch (opcode) {
+            case JUMP:
+                base = a;
+                jumps = true;
+                ends = true;
+                break;
+
+            case JUMPEQ:
+                base = c;
+                jumps = true;
+                break;
+
+            case JUMPLT:
+            case JUMPGT:
+            case JUMPNE:
+                // A register compared with itself never takes the branch,
+                // which is how padding skips over code
+                base = c;
+                jumps = a != b;
+                break;
+
+            case CALL:
+                if (is_known(&s, a)) {
+                    err = add_target(v, pos, s.value[a], &s);
+                    if (err != 0) {
+                        return err;
+                    }
+                }
+                else {
+                    count_dynamic(v, pos);
+                }
+                clear_state(&s);
+                break;
+
+            case CALLW:
+                // The callee sees a different register window
+                if (is_known(&s, a)) {
+                    err = add_target(v, pos, s.value[a] + word, NULL);
+                    if (err != 0) {
+                        return err;
+                    }
+                }
+                else {
+                    count_dynamic(v, pos);
+                }
+                clear_state(&s);
+                break;
+
+            case VECTOR:
+                v->vectored = true;
+                if (is_known(&s, b)) {
+                    err = add_target(v, pos, s.value[b] + word, NULL);
+                    if (err != 0) {
+                        return err;
+                    }
+                }
+                else {
+                    count_dynamic(v, pos);
+                }
+                break;
+
+            case RETURN:
+            case RETW:
+            case RESTORE:
+            case HALT:
+                ends = true;
+                break;
+
+            case NCALL:
+                if (is_known(&s, a) && s.value[a] + word >= IVM_CTABLE_SIZE) {
+                    return reject(v, IVM_VERIFY_INVALID_OPERAND, pos);
+                }
+                clear_state(&s);
+                break;
+
+            case TRAP:
+            case POPALL:
+                clear_state(&s);
+                break;
+
+            case SET:
+                set_known(&s, a, word);
+                break;
+
+            case ZERO:
+                set_known(&s, a, 0);
+                break;
+
+            case MOVEIP:
+                set_known(&s, a, next);
+                break;
+
+            case MOVE:
+                if (is_known(&s, b)) {
+                    set_known(&s, a, s.value[b]);
+                }
+                else {
+                    set_unknown(&s, a);
+                }
+                break;
+
+            case ADD:
+            case SUB:
+                if (is_known(&s, b) && is_known(&s, c)) {
+                    set_known(&s, a, opcode == ADD ? s.value[b] + s.value[c] : s.value[b] - s.value[c]);
+                }
+                else {
+                    set_unknown(&s, a);
+                }
+                break;
+
+            case VADD:
+            case VXOR:
+            case VCMPEQ:
+            case VMIN:
+            case VMAX:
+                if (word > 256U - a || word > 256U - b || word > 256U - c) {
+                    return reject(v, IVM_VERIFY_INVALID_OPERAND, pos);
+                }
+                for (uint32_t i = 0; i < word; ++i) {
+                    set_unknown(&s, a + i);
+                }
+                break;
+
+            case VSUM:
+                if (word > 256U - b) {
+                    return reject(v, IVM_VERIFY_INVALID_OPERAND, pos);
+                }
+                set_unknown(&s, a);
+                break;
+
+            default:
+                // Assume that every register operand may be written
+                for (int i = 0; i < IVM_NUM_REGS(opcode); ++i) {
+                    set_unknown(&s, code[1 + i]);
+                }
+                break;
+        }
+
+        // Interrupt handlers may change any register if they can run
+        // between any two instructions
+        if (v->untracked) {
+            clear_state(&s);
+        }
+
+        if (jumps) {
+            if (is_known(&s, base)) {
+                err = add_target(v, pos, s.value[base] + word, &s);
+                if (err != 0) {
+                    return err;
+                }
+            }
+            else {
+                count_dynamic(v, pos);
+            }
+        }
+
+        if (ends) {
+            return 0;
+        }
+
+        pos = next;
+    }
+}
+
+
+
+/*
+ * Forget everything a pass has found.
+ */
+static void reset(struct verifier* v)
+{
+    memset(v->kind, 0, v->size);
+    memset(v->owner, 0, sizeof(uint32_t) * v->size);
+
+    for (size_t i = 0; i < v->size; ++i) {
+        free(v->leaders[i]);
+        v->leaders[i] = NULL;
+    }
+
+    v->num_work = 0;
+    v->result->error = IVM_VERIFY_OK;
+    v->result->offset = 0;
+    v->result->num_instructions = 0;
+    v->result->num_dynamic = 0;
+}
+
+
+
+static int decode(struct verifier* v)
+{
+    int err;
+
+    err = add_target(v, 0, 0, NULL);
+    if (err != 0) {
+        return err;
+    }
+
+    while (v->num_work > 0) {
+        uint32_t start = v->work[--v->num_work];
+
+        err = verify_path(v, start);
+        if (err != 0) {
+            return err;
+        }
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Decode the bytecode, tracking register values until a VECTOR instruction
+ * is found. Once the guest installs a handler, asynchronous interrupts can
+ * run it between any two instructions, so the bytecode is decoded again
+ * without tracking any values.
+ */
+static int verify(struct verifier* v)
+{
+    int err = decode(v);
+
+    if (v->vectored && !v->untracked) {
+        reset(v);
+        v->untracked = true;
+        err = decode(v);
+    }
+
+    return err;
+}
+
+
+
+int ivm_bytecode_map(struct ivm_verify_result* result, const void* bytecode, size_t size, unsigned char* map)
+{
+    if (result == NULL || (bytecode == NULL && size > 0) || size > UINT32_MAX) {
+        return EINVAL;
+    }
+
+    result->error = IVM_VERIFY_OK;
+    result->offset = 0;
+    result->num_instructions = 0;
+    result->num_dynamic = 0;
+
+    if (size == 0) {
+        result->error = IVM_VERIFY_TRUNCATED;
+        return EINVAL;
+    }
+
+    struct verifier v = {
+        .code = bytecode,
+        .size = size,
+        .kind = calloc(size, 1),
+        .owner = calloc(size, sizeof(uint32_t)),
+        .leaders = calloc(size, sizeof(struct reg_state*)),
+        .work = NULL,
+        .num_work = 0,
+        .max_work = 0,
+        .vectored = false,
+        .untracked = false,
+        .result = result,
+    };
+
+    int err = ENOMEM;
+    if (v.kind != NULL && v.owner != NULL && v.leaders != NULL) {
+        err = verify(&v);
+    }
+
+    if (err == 0 && map != NULL) {
+        for (size_t i = 0; i < size; ++i) {
+            map[i] = 0;
+            if ((v.kind[i] & OFFSET_KIND) == OFFSET_START) {
+                map[i] |= IVM_MAP_START;
+            }
+            if (v.leaders[i] != NULL) {
+                map[i] |= IVM_MAP_TARGET;
+            }
+        }
+    }
+
+    if (v.leaders != NULL) {
+        for (size_t i = 0; i < size; ++i) {
+            free(v.leaders[i]);
+        }
+    }
+    free(v.leaders);
+    free(v.owner);
+    free(v.kind);
+    free(v.work);
+
+    return err;
+}
+
+
+
+int ivm_bytecode_verify(struct ivm_verify_result* result, const void* bytecode, size_t size)
+{
+    return ivm_bytecode_map(result, bytecode, size, NULL);
+}
+
+
+
+int ivm_image_verify(struct ivm_image* image, const void* bytecode, struct ivm_verify_result* result)
+{
+    struct ivm_verify_result local;
+    const struct ivm_section* bytecode_section = NULL;
+
+    if (image == NULL || bytecode == NULL) {
+        return EINVAL;
+    }
+
+    if (result == NULL) {
+        result = &local;
+    }
+
+    ivm_list_foreach(const struct ivm_segment, seg, &image->segments) {
+        ivm_list_foreach(const struct ivm_section, sect, &seg->sections) {
+            if (sect->type == IVM_SECT_BYTECODE) {
+                bytecode_section = sect;
+            }
+        }
+    }
+
+    if (bytecode_section == NULL) {
+        return EINVAL;
+    }
+
+    return ivm_bytecode_verify(result, bytecode, bytecode_section->size);
+}
+
+
+
+const char* ivm_verify_strerror(enum ivm_verify_error error)
+{
+    switch (error) {
+        case IVM_VERIFY_OK:
+            return "Bytecode is well-formed";
+
+        case IVM_VERIFY_INVALID_OPCODE:
+            return "Undefined opcode";
+
+        case IVM_VERIFY_TRUNCATED:
+            return "Execution runs past the end of the bytecode";
+
+        case IVM_VERIFY_INVALID_OPERAND:
+            return "Register range or native function slot out of bounds";
+
+        case IVM_VERIFY_INVALID_TARGET:
+            return "Jump target outside the bytecode";
+
+        case IVM_VERIFY_OVERLAP:
+            return "Instructions overlap";
+    }
+
+    return "Unknown error";
+}
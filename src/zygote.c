@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <ivm_zygote.h>
+
+
+
+int ivm_zygote_start(pid_t* handle, int* control, const char* filename)
+{
+    int sv[2];
+
+    if (handle == NULL || control == NULL || filename == NULL) {
+        return EINVAL;
+    }
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) != 0) {
+        return errno;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        int err = errno;
+        close(sv[0]);
+        close(sv[1]);
+        return err;
+    }
+
+    if (pid == 0) {
+        // dup2 clears the close-on-exec flag
+        if (dup2(sv[1], IVM_ZYGOTE_FD) < 0) {
+            _exit(127);
+        }
+
+        char* const argv[] = { (char*) filename, NULL };
+        execv(filename, argv);
+        _exit(127);
+    }
+
+    close(sv[1]);
+
+    *handle = pid;
+    *control = sv[0];
+    return 0;
+}
+
+
+
+int ivm_zygote_spawn(pid_t* child, int control, const int fds[3], const uint32_t* args, size_t num_args)
+{
+    if (fds == NULL || num_args > IVM_ZYGOTE_MAX_ARGS || (args == NULL && num_args > 0)) {
+        return EINVAL;
+    }
+
+    struct ivm_zygote_request request;
+    memset(&request, 0, sizeof(request));
+    request.num_args = num_args;
+    if (num_args > 0) {
+        memcpy(request.args, args, sizeof(uint32_t) * num_args);
+    }
+
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int) * 3)];
+    } buffer;
+    memset(&buffer, 0, sizeof(buffer));
+
+    struct iovec iov;
+    iov.iov_base = &request;
+    iov.iov_len = sizeof(request);
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = buffer.buf;
+    msg.msg_controllen = sizeof(buffer.buf);
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * 3);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * 3);
+
+    if (sendmsg(control, &msg, 0) != sizeof(request)) {
+        return errno != 0 ? errno : EIO;
+    }
+
+    struct ivm_zygote_reply reply;
+    ssize_t n = read(control, &reply, sizeof(reply));
+    if (n < 0) {
+        return errno;
+    }
+    else if (n != sizeof(reply)) {
+        return EPIPE;
+    }
+
+    if (reply.pid < 0) {
+        return -reply.pid;
+    }
+
+    if (child != NULL) {
+        *child = reply.pid;
+    }
+    return 0;
+}
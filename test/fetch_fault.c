@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ivm_vm.h>
+#include <ivm_image.h>
+#include <ivm_instance.h>
+#include <ivm_interrupt.h>
+#include <ivm_bytecode.h>
+
+
+/*
+ * Frame geometry of the guest. Only the first frame holds code.
+ */
+#define FRAME_SIZE      0x400
+#define NUM_FRAMES      64
+
+
+
+/*
+ * Instruction budget of each run, far more than the guest executes.
+ */
+#define BUDGET          1000000
+
+
+
+/*
+ * Guest address of two frames that are unmapped before the guest runs.
+ */
+#define UNMAPPED        0x8000
+
+
+
+static size_t emit(unsigned char* code, size_t pos, uint8_t opcode, uint8_t a, uint8_t b, uint8_t c, uint32_t word)
+{
+    const uint8_t regs[3] = { a, b, c };
+
+    code[pos++] = opcode;
+    for (int i = 0; i < IVM_NUM_REGS(opcode); ++i) {
+        code[pos++] = regs[i];
+    }
+
+    if (IVM_HAS_WORD(opcode)) {
+        memcpy(&code[pos], &word, sizeof(word));
+        pos += sizeof(word);
+    }
+
+    return pos;
+}
+
+
+
+/*
+ * Jump to an unmapped address and check that the VM aborts with the
+ * expected interrupt raised instead of fetching again forever.
+ */
+static int check(const char* name, const unsigned char* code, size_t size, int intr)
+{
+    struct ivm_image* image;
+    struct ivm_instance* instance;
+    struct ivm_registers regs;
+    int64_t status;
+
+    if (ivm_image_create(&image, 32, FRAME_SIZE, NUM_FRAMES) != 0
+            || ivm_image_load_vm_from_object(image, IVM_VM_OBJECT, 0x400000) != 0
+            || ivm_image_reserve_vm_data(image, IVM_ENTRY, size) != 0
+            || ivm_instance_create(&instance, image, code) != 0) {
+        fprintf(stderr, "Failed to create VM\n");
+        return 1;
+    }
+
+    for (int i = 0; i < 2; ++i) {
+        instance->data->ftable[UNMAPPED / FRAME_SIZE + i].attr = 0;
+    }
+
+    ivm_instance_step(instance, BUDGET);
+    ivm_instance_wait(instance, &status, &regs);
+
+    ivm_instance_remove(instance);
+    ivm_image_remove(image);
+
+    if (status != IVM_EXIT_ABORT || !IVM_INTR_IS_SET(&regs, intr)) {
+        fprintf(stderr, "%s: status %lld, interrupts 0x%x\n", name, (long long) status, regs.intr);
+        return 1;
+    }
+
+    return 0;
+}
+
+
+
+int main()
+{
+    unsigned char code[FRAME_SIZE];
+    size_t pos;
+    int failed = 0;
+
+    // No handler for the frame fault
+    memset(code, 0, sizeof(code));
+    pos = 0;
+    pos = emit(code, pos, SET, 1, 0, 0, 0);
+    pos = emit(code, pos, JUMP, 1, 0, 0, UNMAPPED);
+    failed |= check("unhandled", code, sizeof(code), IVM_INTR_FRAME_FAULT);
+
+    // Frame faults disabled, so the fault stays pending
+    memset(code, 0, sizeof(code));
+    pos = 0;
+    pos = emit(code, pos, SET, 1, 0, 0, IVM_INTR_FRAME_FAULT);
+    pos = emit(code, pos, DISABLE, 1, 0, 0, 0);
+    pos = emit(code, pos, SET, 1, 0, 0, 0);
+    pos = emit(code, pos, JUMP, 1, 0, 0, UNMAPPED);
+    failed |= check("disabled", code, sizeof(code), IVM_INTR_FRAME_FAULT);
+
+    // Handler that is not mapped either
+    memset(code, 0, sizeof(code));
+    pos = 0;
+    pos = emit(code, pos, SET, 1, 0, 0, IVM_INTR_FRAME_FAULT);
+    pos = emit(code, pos, SET, 2, 0, 0, 0);
+    pos = emit(code, pos, VECTOR, 1, 2, 0, UNMAPPED + FRAME_SIZE);
+    pos = emit(code, pos, JUMP, 2, 0, 0, UNMAPPED);
+    failed |= check("unmapped handler", code, sizeof(code), IVM_INTR_FRAME_FAULT);
+
+    // Beyond the frame table
+    memset(code, 0, sizeof(code));
+    pos = 0;
+    pos = emit(code, pos, SET, 1, 0, 0, 0);
+    pos = emit(code, pos, JUMP, 1, 0, 0, FRAME_SIZE * NUM_FRAMES);
+    failed |= check("out of range", code, sizeof(code), IVM_INTR_PROTECTION_FAULT);
+
+    return failed;
+}
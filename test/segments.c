@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <elf.h>
+#include <ivm_image.h>
+
+
+/*
+ * Number of segments added in bulk.
+ */
+#define NUM_SEGMENTS    64
+
+
+
+/*
+ * Check that the contents of a segment can be found in the file at the
+ * offset of the program header for its address.
+ */
+static int check_segment(FILE* fp, const Elf64_Phdr* phdrs, size_t num_phdrs, uint64_t addr, const unsigned char* data, size_t size)
+{
+    unsigned char buf[256];
+
+    for (size_t i = 0; i < num_phdrs; ++i) {
+        if (phdrs[i].p_type != PT_LOAD || phdrs[i].p_vaddr != addr) {
+            continue;
+        }
+
+        if (phdrs[i].p_filesz < size || fseek(fp, phdrs[i].p_offset, SEEK_SET) != 0 || fread(buf, size, 1, fp) != 1) {
+            return 1;
+        }
+
+        return memcmp(buf, data, size) != 0;
+    }
+
+    return 1;
+}
+
+
+
+int main()
+{
+    struct ivm_image* image;
+    struct ivm_segment_info info[NUM_SEGMENTS];
+    struct ivm_segment* segments[NUM_SEGMENTS];
+    unsigned char data[NUM_SEGMENTS][256];
+
+    if (ivm_image_create(&image, 32, 0x1000, 16) != 0 || ivm_image_load_vm_from_object(image, IVM_VM_OBJECT, 0x400000) != 0) {
+        fprintf(stderr, "Failed to create image\n");
+        return 1;
+    }
+
+    // Add segments in descending address order, so that file order and
+    // address order differ
+    for (size_t i = 0; i < NUM_SEGMENTS; ++i) {
+        info[i].type = IVM_SEG_DATA;
+        info[i].vm_align = 0x1000;
+        info[i].vm_start = 0x100000000ULL - 0x10000 * i;
+        info[i].vm_size = 0x1000;
+        info[i].file_align = 8;
+        memset(data[i], (int) i + 1, sizeof(data[i]));
+    }
+
+    if (ivm_image_add_segments(segments, image, info, NUM_SEGMENTS) != 0) {
+        fprintf(stderr, "Failed to add segments\n");
+        return 1;
+    }
+
+    // Sections are added after all segments exist
+    for (size_t i = 0; i < NUM_SEGMENTS; ++i) {
+        if (ivm_image_add_section(NULL, segments[i], IVM_SECT_DATA, 8, data[i], sizeof(data[i])) != 0) {
+            fprintf(stderr, "Failed to add section %zu\n", i);
+            return 1;
+        }
+    }
+
+    // A segment that overlaps one of them is refused
+    info[0].vm_start = 0x100000000ULL - 0x10000 * 3 - 0x1000;
+    info[0].vm_size = 0x3000;
+    if (ivm_image_add_segments(NULL, image, info, 1) != EFAULT) {
+        fprintf(stderr, "Overlapping segment was added\n");
+        return 1;
+    }
+
+    FILE* fp = tmpfile();
+    if (fp == NULL || ivm_image_write(fp, image, NULL) != 0) {
+        fprintf(stderr, "Failed to write image\n");
+        return 1;
+    }
+
+    Elf64_Ehdr ehdr;
+    Elf64_Phdr phdrs[NUM_SEGMENTS + 2];
+    rewind(fp);
+    if (fread(&ehdr, sizeof(ehdr), 1, fp) != 1 || ehdr.e_phnum > NUM_SEGMENTS + 2 || fread(phdrs, sizeof(Elf64_Phdr), ehdr.e_phnum, fp) != ehdr.e_phnum) {
+        fprintf(stderr, "Failed to read program headers\n");
+        return 1;
+    }
+
+    int failed = 0;
+    for (size_t i = 0; i < NUM_SEGMENTS; ++i) {
+        if (check_segment(fp, phdrs, ehdr.e_phnum, segments[i]->vm_start, data[i], sizeof(data[i])) != 0) {
+            fprintf(stderr, "Segment %zu at 0x%llx does not match the file\n", i, (unsigned long long) segments[i]->vm_start);
+            failed = 1;
+        }
+    }
+
+    fclose(fp);
+    ivm_image_remove(image);
+    return failed;
+}
@@ -0,0 +1,262 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ivm_vm.h>
+#include <ivm_image.h>
+#include <ivm_instance.h>
+#include <ivm_bytecode.h>
+
+
+/*
+ * Frame geometry of the guest, small enough for spans to cross frames.
+ */
+#define FRAME_SIZE      0x400
+#define NUM_FRAMES      256
+
+
+
+/*
+ * Longest register range and memory span that are checked.
+ */
+#define MAX_LANES       64
+#define MAX_SPAN        0x3000
+
+
+
+/*
+ * Registers and guest addresses of the operands.
+ */
+#define REG_DST         0x80
+#define REG_SRC1        0x00
+#define REG_SRC2        0x40
+#define REG_SUM         0xf0
+#define MEM_DST         0x8000
+#define MEM_SRC         0x2000
+
+
+
+static struct ivm_instance* instance;
+
+
+
+static uint32_t lane_op(int op, uint32_t x, uint32_t y, uint32_t mask)
+{
+    switch (op) {
+        case 0: return x + y;
+        case 1: return x ^ y;
+        case 2: return x == y ? mask : 0;
+        case 3: return x < y ? x : y;
+        default: return x > y ? x : y;
+    }
+}
+
+
+
+static unsigned char* guest(uint32_t addr)
+{
+    const struct ivm_data* data = instance->data;
+    return (unsigned char*) data->ftable[addr / FRAME_SIZE].addr + addr % FRAME_SIZE;
+}
+
+
+
+/*
+ * Replace the guest code with a vector instruction, a sum and HALT.
+ */
+static void load_code(uint8_t op, uint8_t a, uint8_t b, uint8_t c, uint32_t word, uint8_t sum_op, uint8_t sa, uint8_t sb, uint8_t sc, uint32_t sum_word)
+{
+    unsigned char code[2 * IVM_MAX_INSTR_LEN + 1];
+    size_t pos = 0;
+    const uint8_t ops[2] = { op, sum_op };
+    const uint8_t regs[2][3] = { { a, b, c }, { sa, sb, sc } };
+    const uint32_t words[2] = { word, sum_word };
+
+    for (int i = 0; i < 2; ++i) {
+        code[pos++] = ops[i];
+        for (int j = 0; j < IVM_NUM_REGS(ops[i]); ++j) {
+            code[pos++] = regs[i][j];
+        }
+        if (IVM_HAS_WORD(ops[i])) {
+            memcpy(&code[pos], &words[i], sizeof(words[i]));
+            pos += sizeof(words[i]);
+        }
+    }
+    code[pos++] = HALT;
+
+    memcpy(guest(0), code, pos);
+}
+
+
+
+/*
+ * Run the guest code from the start with the given CPU features.
+ * IVM_CPU_DETECTED alone restricts the VM to its 128-bit kernels.
+ */
+static int run(uint64_t cpu, struct ivm_registers* regs)
+{
+    int64_t status;
+
+    instance->data->cpu = cpu;
+    instance->data->registers->ip = 0;
+
+    ivm_instance_run(instance);
+    ivm_instance_wait(instance, &status, regs);
+    return status != IVM_EXIT_HALT;
+}
+
+
+
+static int check_registers(uint64_t cpu)
+{
+    struct ivm_registers* regs = instance->data->registers;
+    struct ivm_registers out;
+    uint32_t src[2][MAX_LANES];
+
+    for (int op = 0; op < 5; ++op) {
+        for (uint32_t n = 0; n <= MAX_LANES; ++n) {
+            load_code(VADD + op, REG_DST, REG_SRC1, REG_SRC2, n, VSUM, REG_SUM, REG_DST, 0, n);
+
+            // Make some lanes equal, so that comparisons see both outcomes
+            for (uint32_t i = 0; i < MAX_LANES; ++i) {
+                src[0][i] = regs->r[REG_SRC1 + i] = (uint32_t) rand() * 2654435761U;
+                src[1][i] = regs->r[REG_SRC2 + i] = rand() % 3 == 0 ? src[0][i] : (uint32_t) rand();
+            }
+
+            if (run(cpu, &out) != 0) {
+                fprintf(stderr, "Register op %d with %u lanes failed\n", op, n);
+                return 1;
+            }
+
+            uint32_t sum = 0;
+            for (uint32_t i = 0; i < n; ++i) {
+                uint32_t expected = lane_op(op, src[0][i], src[1][i], ~0U);
+                if (out.r[REG_DST + i] != expected) {
+                    fprintf(stderr, "Register op %d with %u lanes differs in lane %u\n", op, n, i);
+                    return 1;
+                }
+                sum += expected;
+            }
+
+            if (out.r[REG_SUM] != sum) {
+                fprintf(stderr, "Sum of %u lanes is %u, expected %u\n", n, out.r[REG_SUM], sum);
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+
+
+static int check_span(uint64_t cpu, int op, uint32_t dst, uint32_t src, uint32_t len)
+{
+    struct ivm_registers* regs = instance->data->registers;
+    struct ivm_registers out;
+    static unsigned char expected[MAX_SPAN];
+
+    load_code(MADD + op, 1, 2, 3, 0, MSUM, 4, 1, 3, 0);
+    regs->r[1] = dst;
+    regs->r[2] = src;
+    regs->r[3] = len;
+
+    for (uint32_t i = 0; i < len; ++i) {
+        unsigned char x = rand();
+        unsigned char y = rand() % 3 == 0 ? x : rand();
+
+        *guest(dst + i) = x;
+        *guest(src + i) = y;
+        expected[i] = lane_op(op, x, y, 0xff);
+    }
+
+    // Bytes around the span must be left alone
+    *guest(dst - 1) = 0x5a;
+    *guest(dst + len) = 0xa5;
+
+    if (run(cpu, &out) != 0) {
+        fprintf(stderr, "Memory op %d of %u bytes failed\n", op, len);
+        return 1;
+    }
+
+    uint32_t sum = 0;
+    for (uint32_t i = 0; i < len; ++i) {
+        if (*guest(dst + i) != expected[i]) {
+            fprintf(stderr, "Memory op %d of %u bytes at 0x%x differs at byte %u\n", op, len, dst, i);
+            return 1;
+        }
+        sum += expected[i];
+    }
+
+    if (*guest(dst - 1) != 0x5a || *guest(dst + len) != 0xa5) {
+        fprintf(stderr, "Memory op %d of %u bytes at 0x%x wrote outside the span\n", op, len, dst);
+        return 1;
+    }
+
+    if (out.r[4] != sum) {
+        fprintf(stderr, "Sum of %u bytes is %u, expected %u\n", len, out.r[4], sum);
+        return 1;
+    }
+
+    return 0;
+}
+
+
+
+static int check_memory(uint64_t cpu)
+{
+    for (int op = 0; op < 5; ++op) {
+        for (uint32_t len = 0; len < MAX_SPAN; len = len < 80 ? len + 1 : len * 2 + 13) {
+            // Random offsets within a frame, so spans start and end anywhere
+            uint32_t dst = MEM_DST + rand() % FRAME_SIZE;
+            uint32_t src = MEM_SRC + rand() % FRAME_SIZE;
+
+            if (check_span(cpu, op, dst, src, len) != 0) {
+                return 1;
+            }
+        }
+
+        // Spans that end just before, at and after a frame boundary
+        for (uint32_t end = FRAME_SIZE - 33; end <= FRAME_SIZE + 33; ++end) {
+            if (check_span(cpu, op, MEM_DST + FRAME_SIZE - 40, MEM_SRC + 7, end - (FRAME_SIZE - 40)) != 0) {
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Compare the vector instructions with a scalar reference, with the
+ * kernels the VM picks for this CPU and with its 128-bit kernels.
+ */
+int main()
+{
+    struct ivm_image* image;
+    unsigned char code[FRAME_SIZE];
+
+    memset(code, 0, sizeof(code));
+    if (ivm_image_create(&image, 32, FRAME_SIZE, NUM_FRAMES) != 0
+            || ivm_image_load_vm_from_object(image, IVM_VM_OBJECT, 0x400000) != 0
+            || ivm_image_reserve_vm_data(image, IVM_ENTRY, sizeof(code)) != 0
+            || ivm_instance_create(&instance, image, code) != 0) {
+        fprintf(stderr, "Failed to create VM\n");
+        return 1;
+    }
+
+    srand(1);
+
+    const uint64_t features[2] = { 0, IVM_CPU_DETECTED };
+    int failed = 0;
+    for (int i = 0; i < 2 && !failed; ++i) {
+        failed = check_registers(features[i]) || check_memory(features[i]);
+    }
+
+    ivm_instance_remove(instance);
+    ivm_image_remove(image);
+    return failed;
+}
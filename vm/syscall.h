@@ -6,11 +6,29 @@
 
 
 
+static inline __attribute__((always_inline))
+long ibsen_syscall0(long nr)
+{
+    long ret;
+    __asm__ volatile ("syscall" : "=a" (ret) : "a" (nr) : "rcx", "r11", "memory");
+    return ret;
+}
+
+
 static inline __attribute__((always_inline))
 long ibsen_syscall1(long nr, long long arg1)
 {
     long ret;
-    __asm__ volatile ("syscall" : "=a" (ret) : "a" (nr), "D" (arg1) : "memory");
+    __asm__ volatile ("syscall" : "=a" (ret) : "a" (nr), "D" (arg1) : "rcx", "r11", "memory");
+    return ret;
+}
+
+
+static inline __attribute__((always_inline))
+long ibsen_syscall2(long nr, long long arg1, long long arg2)
+{
+    long ret;
+    __asm__ volatile ("syscall" : "=a" (ret) : "a" (nr), "D" (arg1), "S" (arg2) : "rcx", "r11", "memory");
     return ret;
 }
 
@@ -19,7 +37,17 @@ static inline __attribute__((always_inline))
 long ibsen_syscall3(long nr, long long arg1, long long arg2, long long arg3)
 {
     long ret;
-    __asm__ volatile ("syscall" : "=a" (ret) : "a" (nr), "D" (arg1), "S" (arg2), "d" (arg3) : "memory");
+    __asm__ volatile ("syscall" : "=a" (ret) : "a" (nr), "D" (arg1), "S" (arg2), "d" (arg3) : "rcx", "r11", "memory");
+    return ret;
+}
+
+
+static inline __attribute__((always_inline))
+long ibsen_syscall4(long nr, long long arg1, long long arg2, long long arg3, long long arg4)
+{
+    long ret;
+    register long long r10 __asm__ ("r10") = arg4;
+    __asm__ volatile ("syscall" : "=a" (ret) : "a" (nr), "D" (arg1), "S" (arg2), "d" (arg3), "r" (r10) : "rcx", "r11", "memory");
     return ret;
 }
 
@@ -40,4 +68,60 @@ size_t ibsen_write(int fd, const char* ptr, size_t len)
 }
 
 
+
+static inline __attribute__((always_inline))
+long ibsen_read(int fd, void* ptr, size_t len)
+{
+    return ibsen_syscall3(0, fd, (long long) ptr, (long long) len);
+}
+
+
+
+static inline __attribute__((always_inline))
+long ibsen_pread(int fd, void* ptr, size_t len, long long offset)
+{
+    return ibsen_syscall4(17, fd, (long long) ptr, (long long) len, offset);
+}
+
+
+
+static inline __attribute__((always_inline))
+long ibsen_close(int fd)
+{
+    return ibsen_syscall1(3, fd);
+}
+
+
+
+static inline __attribute__((always_inline))
+long ibsen_dup2(int oldfd, int newfd)
+{
+    return ibsen_syscall2(33, oldfd, newfd);
+}
+
+
+
+static inline __attribute__((always_inline))
+long ibsen_recvmsg(int fd, void* msg, int flags)
+{
+    return ibsen_syscall3(47, fd, (long long) msg, flags);
+}
+
+
+
+static inline __attribute__((always_inline))
+long ibsen_fork(void)
+{
+    return ibsen_syscall0(57);
+}
+
+
+
+static inline __attribute__((always_inline))
+long ibsen_rt_sigaction(int sig, const void* act, void* oldact, size_t size)
+{
+    return ibsen_syscall4(13, sig, (long long) act, (long long) oldact, size);
+}
+
+
 #endif /* __IBSEN_VM_SYSCALL_H__ */
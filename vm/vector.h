@@ -0,0 +1,245 @@
+#ifndef __IBSEN_VM_VECTOR_H__
+#define __IBSEN_VM_VECTOR_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <ivm_vm.h>
+#ifdef __x86_64__
+#include <cpuid.h>
+#endif
+
+
+/*
+ * Kernels for the vector opcodes.
+ *
+ * The kernels are written with GCC vector extensions and instantiated once
+ * for each lane width by including vector_ops.h. The 128-bit kernels are
+ * inlined into the VM and use SSE2 on x86-64, or plain scalar code where the
+ * target has no vector unit. The 256-bit kernels are compiled for AVX2 and
+ * selected at run time.
+ *
+ * The AVX2 kernels can not be inlined into the VM, so they are only built
+ * when the VM is extracted by symbol. A VM copied by address range must
+ * consist of its three entry functions only.
+ */
+#if defined(__x86_64__) && defined(IVM_VM_EXTRACTED)
+#define IVM_VECTOR_AVX2
+#endif
+
+
+
+/*
+ * Lane operations.
+ */
+enum
+{
+    VOP_ADD,
+    VOP_XOR,
+    VOP_CMPEQ,
+    VOP_MIN,
+    VOP_MAX,
+};
+
+
+
+#define VEC_WIDTH   16
+#define VEC_NAME(name) name##_128
+#define VEC_ATTR    static inline __attribute__((always_inline))
+#include "vector_ops.h"
+#undef VEC_WIDTH
+#undef VEC_NAME
+#undef VEC_ATTR
+
+
+#ifdef IVM_VECTOR_AVX2
+#define VEC_WIDTH   32
+#define VEC_NAME(name) name##_256
+#define VEC_ATTR    static __attribute__((noinline, target("avx2")))
+#include "vector_ops.h"
+#undef VEC_WIDTH
+#undef VEC_NAME
+#undef VEC_ATTR
+#endif
+
+
+
+/*
+ * Detect the vector instructions of the host CPU.
+ * AVX2 can only be used if the kernel saves the upper halves of the YMM
+ * registers, which is indicated by XCR0.
+ */
+static inline __attribute__((always_inline))
+uint32_t detect_cpu(void)
+{
+    uint32_t features = IVM_CPU_DETECTED;
+#ifdef IVM_VECTOR_AVX2
+    uint32_t eax, ebx, ecx, edx;
+
+    __cpuid(0, eax, ebx, ecx, edx);
+    if (eax < 7) {
+        return features;
+    }
+
+    __cpuid(1, eax, ebx, ecx, edx);
+    if (!(ecx & bit_OSXSAVE) || !(ecx & bit_AVX)) {
+        return features;
+    }
+
+    uint32_t xcr0, xcr0_hi;
+    __asm__ volatile ("xgetbv" : "=a" (xcr0), "=d" (xcr0_hi) : "c" (0));
+    if ((xcr0 & 0x6) != 0x6) {
+        return features;
+    }
+
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    if (ebx & bit_AVX2) {
+        features |= IVM_CPU_AVX2;
+    }
+#endif
+    return features;
+}
+
+
+
+/*
+ * Apply an operation to 32-bit lanes, dst[i] = x[i] op y[i].
+ */
+static inline __attribute__((always_inline))
+void vector_op32(uint32_t cpu, int op, uint32_t* dst, const uint32_t* x, const uint32_t* y, uint32_t n)
+{
+#ifdef IVM_VECTOR_AVX2
+    if ((cpu & IVM_CPU_AVX2) && n >= 8) {
+        vector_op32_256(op, dst, x, y, n);
+        return;
+    }
+#endif
+    (void) cpu;
+    vector_op32_128(op, dst, x, y, n);
+}
+
+
+
+/*
+ * Apply an operation to 8-bit lanes, dst[i] = dst[i] op src[i].
+ */
+static inline __attribute__((always_inline))
+void vector_op8(uint32_t cpu, int op, unsigned char* dst, const unsigned char* src, uint32_t n)
+{
+#ifdef IVM_VECTOR_AVX2
+    if ((cpu & IVM_CPU_AVX2) && n >= 32) {
+        vector_op8_256(op, dst, src, n);
+        return;
+    }
+#endif
+    (void) cpu;
+    vector_op8_128(op, dst, src, n);
+}
+
+
+
+/*
+ * Sum 32-bit lanes, wrapping on overflow.
+ */
+static inline __attribute__((always_inline))
+uint32_t vector_sum32(uint32_t cpu, const uint32_t* x, uint32_t n)
+{
+#ifdef IVM_VECTOR_AVX2
+    if ((cpu & IVM_CPU_AVX2) && n >= 8) {
+        return vector_sum32_256(x, n);
+    }
+#endif
+    (void) cpu;
+    return vector_sum32_128(x, n);
+}
+
+
+
+/*
+ * Sum bytes into a 32-bit value, wrapping on overflow.
+ */
+static inline __attribute__((always_inline))
+uint32_t vector_sum8(uint32_t cpu, const unsigned char* x, uint32_t n)
+{
+#ifdef IVM_VECTOR_AVX2
+    if ((cpu & IVM_CPU_AVX2) && n >= 32) {
+        return vector_sum8_256(x, n);
+    }
+#endif
+    (void) cpu;
+    return vector_sum8_128(x, n);
+}
+
+
+
+/*
+ * Copy bytes, in descending order if the destination is above the source.
+ */
+static inline __attribute__((always_inline))
+void vector_move(uint32_t cpu, unsigned char* dst, const unsigned char* src, uint32_t n)
+{
+#ifdef IVM_VECTOR_AVX2
+    if ((cpu & IVM_CPU_AVX2) && n >= 64) {
+        if (dst > src) {
+            vector_copy_back_256(dst, src, n);
+        }
+        else {
+            vector_copy_256(dst, src, n);
+        }
+        return;
+    }
+#endif
+    (void) cpu;
+    if (dst > src) {
+        vector_copy_back_128(dst, src, n);
+    }
+    else {
+        vector_copy_128(dst, src, n);
+    }
+}
+
+
+
+static inline __attribute__((always_inline))
+void vector_set(uint32_t cpu, unsigned char* dst, unsigned char value, uint32_t n)
+{
+#ifdef IVM_VECTOR_AVX2
+    if ((cpu & IVM_CPU_AVX2) && n >= 64) {
+        vector_fill_256(dst, value, n);
+        return;
+    }
+#endif
+    (void) cpu;
+    vector_fill_128(dst, value, n);
+}
+
+
+
+static inline __attribute__((always_inline))
+uint32_t vector_compare(uint32_t cpu, const unsigned char* x, const unsigned char* y, uint32_t n)
+{
+#ifdef IVM_VECTOR_AVX2
+    if ((cpu & IVM_CPU_AVX2) && n >= 64) {
+        return vector_diff_256(x, y, n);
+    }
+#endif
+    (void) cpu;
+    return vector_diff_128(x, y, n);
+}
+
+
+
+static inline __attribute__((always_inline))
+uint32_t vector_search(uint32_t cpu, const unsigned char* x, unsigned char value, uint32_t n)
+{
+#ifdef IVM_VECTOR_AVX2
+    if ((cpu & IVM_CPU_AVX2) && n >= 64) {
+        return vector_find_256(x, value, n);
+    }
+#endif
+    (void) cpu;
+    return vector_find_128(x, value, n);
+}
+
+
+#endif /* __IBSEN_VM_VECTOR_H__ */
@@ -0,0 +1,322 @@
+/*
+ * Vector kernels for one lane width, included by vector.h.
+ * VEC_WIDTH is the vector size in bytes, VEC_NAME decorates function and
+ * type names and VEC_ATTR holds the function attributes.
+ */
+
+typedef uint32_t VEC_NAME(u32v) __attribute__((vector_size(VEC_WIDTH), aligned(1), may_alias));
+typedef uint16_t VEC_NAME(u16v) __attribute__((vector_size(VEC_WIDTH), aligned(1), may_alias));
+typedef uint8_t VEC_NAME(u8v) __attribute__((vector_size(VEC_WIDTH), aligned(1), may_alias));
+typedef uint64_t VEC_NAME(u64v) __attribute__((vector_size(VEC_WIDTH), aligned(1), may_alias));
+
+#define VEC_LANES32 (VEC_WIDTH / 4)
+#define VEC_LANES8  VEC_WIDTH
+
+#define VEC_LOOP(type, lanes, d, x, y, expr) \
+    for (; i + (lanes) <= n; i += (lanes)) { \
+        type a = *(const type*) ((x) + i); \
+        type b = *(const type*) ((y) + i); \
+        *(type*) ((d) + i) = (expr); \
+    }
+
+#define VEC_SCALAR(d, x, y, mask) \
+    for (; i < n; ++i) { \
+        switch (op) { \
+            case VOP_ADD: d[i] = x[i] + y[i]; break; \
+            case VOP_XOR: d[i] = x[i] ^ y[i]; break; \
+            case VOP_CMPEQ: d[i] = x[i] == y[i] ? (mask) : 0; break; \
+            case VOP_MIN: d[i] = x[i] < y[i] ? x[i] : y[i]; break; \
+            case VOP_MAX: d[i] = x[i] > y[i] ? x[i] : y[i]; break; \
+        } \
+    }
+
+
+
+VEC_ATTR
+void VEC_NAME(vector_op32)(int op, uint32_t* dst, const uint32_t* x, const uint32_t* y, uint32_t n)
+{
+    typedef VEC_NAME(u32v) v;
+    uint32_t i = 0;
+
+    switch (op) {
+        case VOP_ADD:
+            VEC_LOOP(v, VEC_LANES32, dst, x, y, a + b);
+            break;
+
+        case VOP_XOR:
+            VEC_LOOP(v, VEC_LANES32, dst, x, y, a ^ b);
+            break;
+
+        case VOP_CMPEQ:
+            VEC_LOOP(v, VEC_LANES32, dst, x, y, (v) (a == b));
+            break;
+
+        case VOP_MIN:
+            VEC_LOOP(v, VEC_LANES32, dst, x, y, (a & (v) (a < b)) | (b & ~(v) (a < b)));
+            break;
+
+        case VOP_MAX:
+            VEC_LOOP(v, VEC_LANES32, dst, x, y, (a & (v) (a > b)) | (b & ~(v) (a > b)));
+            break;
+    }
+
+    VEC_SCALAR(dst, x, y, 0xffffffff);
+}
+
+
+
+VEC_ATTR
+void VEC_NAME(vector_op8)(int op, unsigned char* dst, const unsigned char* src, uint32_t n)
+{
+    typedef VEC_NAME(u8v) v;
+    uint32_t i = 0;
+
+    switch (op) {
+        case VOP_ADD:
+            VEC_LOOP(v, VEC_LANES8, dst, dst, src, a + b);
+            break;
+
+        case VOP_XOR:
+            VEC_LOOP(v, VEC_LANES8, dst, dst, src, a ^ b);
+            break;
+
+        case VOP_CMPEQ:
+            VEC_LOOP(v, VEC_LANES8, dst, dst, src, (v) (a == b));
+            break;
+
+        case VOP_MIN:
+            VEC_LOOP(v, VEC_LANES8, dst, dst, src, (a & (v) (a < b)) | (b & ~(v) (a < b)));
+            break;
+
+        case VOP_MAX:
+            VEC_LOOP(v, VEC_LANES8, dst, dst, src, (a & (v) (a > b)) | (b & ~(v) (a > b)));
+            break;
+    }
+
+    VEC_SCALAR(dst, dst, src, 0xff);
+}
+
+
+
+VEC_ATTR
+uint32_t VEC_NAME(vector_sum32)(const uint32_t* x, uint32_t n)
+{
+    typedef VEC_NAME(u32v) v;
+    v acc = { 0 };
+    uint32_t sum = 0;
+    uint32_t i = 0;
+
+    for (; i + VEC_LANES32 <= n; i += VEC_LANES32) {
+        acc += *(const v*) (x + i);
+    }
+
+    for (int j = 0; j < VEC_LANES32; ++j) {
+        sum += acc[j];
+    }
+
+    for (; i < n; ++i) {
+        sum += x[i];
+    }
+
+    return sum;
+}
+
+
+
+/*
+ * Bytes are added pairwise into 16-bit lanes, which are widened to 32-bit
+ * lanes before they can overflow.
+ */
+VEC_ATTR
+uint32_t VEC_NAME(vector_sum8)(const unsigned char* x, uint32_t n)
+{
+    typedef VEC_NAME(u32v) v32;
+    typedef VEC_NAME(u16v) v16;
+    typedef VEC_NAME(u8v) v8;
+    v32 acc = { 0 };
+    uint32_t sum = 0;
+    uint32_t i = 0;
+
+    while (i + VEC_LANES8 <= n) {
+        v16 partial = { 0 };
+
+        for (int k = 0; k < 128 && i + VEC_LANES8 <= n; ++k, i += VEC_LANES8) {
+            v16 w = (v16) *(const v8*) (x + i);
+            partial += (w & 0xff) + (w >> 8);
+        }
+
+        v32 d = (v32) partial;
+        acc += (d & 0xffff) + (d >> 16);
+    }
+
+    for (int j = 0; j < VEC_LANES32; ++j) {
+        sum += acc[j];
+    }
+
+    for (; i < n; ++i) {
+        sum += x[i];
+    }
+
+    return sum;
+}
+
+
+
+/*
+ * Copy bytes in ascending order. The spans may overlap if dst < src.
+ */
+VEC_ATTR
+void VEC_NAME(vector_copy)(unsigned char* dst, const unsigned char* src, uint32_t n)
+{
+    typedef VEC_NAME(u8v) v;
+    uint32_t i = 0;
+
+    for (; i + 4 * VEC_WIDTH <= n; i += 4 * VEC_WIDTH) {
+        v a = *(const v*) (src + i);
+        v b = *(const v*) (src + i + VEC_WIDTH);
+        v c = *(const v*) (src + i + 2 * VEC_WIDTH);
+        v d = *(const v*) (src + i + 3 * VEC_WIDTH);
+        *(v*) (dst + i) = a;
+        *(v*) (dst + i + VEC_WIDTH) = b;
+        *(v*) (dst + i + 2 * VEC_WIDTH) = c;
+        *(v*) (dst + i + 3 * VEC_WIDTH) = d;
+    }
+
+    for (; i + VEC_WIDTH <= n; i += VEC_WIDTH) {
+        *(v*) (dst + i) = *(const v*) (src + i);
+    }
+
+    for (; i < n; ++i) {
+        dst[i] = src[i];
+    }
+}
+
+
+
+/*
+ * Copy bytes in descending order. The spans may overlap if dst > src.
+ */
+VEC_ATTR
+void VEC_NAME(vector_copy_back)(unsigned char* dst, const unsigned char* src, uint32_t n)
+{
+    typedef VEC_NAME(u8v) v;
+    uint32_t i = n;
+
+    for (; i >= 4 * VEC_WIDTH; i -= 4 * VEC_WIDTH) {
+        v a = *(const v*) (src + i - VEC_WIDTH);
+        v b = *(const v*) (src + i - 2 * VEC_WIDTH);
+        v c = *(const v*) (src + i - 3 * VEC_WIDTH);
+        v d = *(const v*) (src + i - 4 * VEC_WIDTH);
+        *(v*) (dst + i - VEC_WIDTH) = a;
+        *(v*) (dst + i - 2 * VEC_WIDTH) = b;
+        *(v*) (dst + i - 3 * VEC_WIDTH) = c;
+        *(v*) (dst + i - 4 * VEC_WIDTH) = d;
+    }
+
+    for (; i >= VEC_WIDTH; i -= VEC_WIDTH) {
+        *(v*) (dst + i - VEC_WIDTH) = *(const v*) (src + i - VEC_WIDTH);
+    }
+
+    while (i > 0) {
+        --i;
+        dst[i] = src[i];
+    }
+}
+
+
+
+VEC_ATTR
+void VEC_NAME(vector_fill)(unsigned char* dst, unsigned char value, uint32_t n)
+{
+    typedef VEC_NAME(u8v) v;
+    v fill = (v) { 0 } + value;
+    uint32_t i = 0;
+
+    for (; i + 4 * VEC_WIDTH <= n; i += 4 * VEC_WIDTH) {
+        *(v*) (dst + i) = fill;
+        *(v*) (dst + i + VEC_WIDTH) = fill;
+        *(v*) (dst + i + 2 * VEC_WIDTH) = fill;
+        *(v*) (dst + i + 3 * VEC_WIDTH) = fill;
+    }
+
+    for (; i + VEC_WIDTH <= n; i += VEC_WIDTH) {
+        *(v*) (dst + i) = fill;
+    }
+
+    for (; i < n; ++i) {
+        dst[i] = value;
+    }
+}
+
+
+
+/*
+ * Find the offset of the first byte that differs, or n if the spans are
+ * equal.
+ */
+VEC_ATTR
+uint32_t VEC_NAME(vector_diff)(const unsigned char* x, const unsigned char* y, uint32_t n)
+{
+    typedef VEC_NAME(u8v) v;
+    typedef VEC_NAME(u64v) v64;
+    uint32_t i = 0;
+
+    for (; i + VEC_WIDTH <= n; i += VEC_WIDTH) {
+        v64 d = (v64) (*(const v*) (x + i) ^ *(const v*) (y + i));
+
+        for (int k = 0; k < VEC_WIDTH / 8; ++k) {
+            if (d[k] != 0) {
+                return i + 8 * k + __builtin_ctzll(d[k]) / 8;
+            }
+        }
+    }
+
+    for (; i < n; ++i) {
+        if (x[i] != y[i]) {
+            return i;
+        }
+    }
+
+    return n;
+}
+
+
+
+/*
+ * Find the offset of the first byte with the given value, or n if there is
+ * none. Bytes equal to the value are turned into zero, and the lowest zero
+ * byte of each 64-bit lane is found with the usual bit trick.
+ */
+VEC_ATTR
+uint32_t VEC_NAME(vector_find)(const unsigned char* x, unsigned char value, uint32_t n)
+{
+    typedef VEC_NAME(u8v) v;
+    typedef VEC_NAME(u64v) v64;
+    v pattern = (v) { 0 } + value;
+    uint32_t i = 0;
+
+    for (; i + VEC_WIDTH <= n; i += VEC_WIDTH) {
+        v64 d = (v64) (*(const v*) (x + i) ^ pattern);
+        v64 z = (d - 0x0101010101010101ULL) & ~d & 0x8080808080808080ULL;
+
+        for (int k = 0; k < VEC_WIDTH / 8; ++k) {
+            if (z[k] != 0) {
+                return i + 8 * k + __builtin_ctzll(z[k]) / 8;
+            }
+        }
+    }
+
+    for (; i < n; ++i) {
+        if (x[i] == value) {
+            return i;
+        }
+    }
+
+    return n;
+}
+
+
+#undef VEC_SCALAR
+#undef VEC_LOOP
+#undef VEC_LANES8
+#undef VEC_LANES32
@@ -4,10 +4,71 @@
 #include <string.h>
 #include <ivm_vm.h>
 #include <ivm_interrupt.h>
+#include <ivm_memory.h>
+#include <ivm_bytecode.h>
 #include <ivm_list.h>
 #include <ivm_syscall.h>
 #include <ivm_entry.h>
+#include <ivm_zygote.h>
+#include <ivm_native.h>
+#include <signal.h>
+#include <sys/socket.h>
 #include "syscall.h"
+#include "vector.h"
+
+
+
+/*
+ * Frame geometry.
+ * Specialized builds define IVM_FRAME_SIZE, IVM_FRAME_COUNT and
+ * IVM_STATE_DEPTH, so that address translation uses immediate shifts and
+ * masks instead of reading the geometry from the VM data.
+ */
+#ifdef IVM_FRAME_SIZE
+#if IVM_FRAME_SIZE < 16 || (IVM_FRAME_SIZE & (IVM_FRAME_SIZE - 1)) != 0
+#error "IVM_FRAME_SIZE must be a power of two and at least 16"
+#endif
+#define FSIZE(vm)   ((size_t) IVM_FRAME_SIZE)
+#define FSHIFT(vm)  ((size_t) __builtin_ctz(IVM_FRAME_SIZE))
+#else
+#define IVM_FRAME_SIZE 0
+#define FSIZE(vm)   ((vm)->fsize)
+#define FSHIFT(vm)  ((vm)->fshift)
+#endif
+
+#ifdef IVM_FRAME_COUNT
+#define FNUM(vm)    ((size_t) IVM_FRAME_COUNT)
+#else
+#define IVM_FRAME_COUNT 0
+#define FNUM(vm)    ((vm)->fnum)
+#endif
+
+#ifdef IVM_STATE_DEPTH
+#define SDEPTH(vm)  ((size_t) IVM_STATE_DEPTH)
+#else
+#define IVM_STATE_DEPTH 0
+#define SDEPTH(vm)  ((vm)->state_size)
+#endif
+
+
+
+/*
+ * Identifier string, found by symbol when the VM code is extracted from an
+ * object file.
+ */
+const char ivm_vm_id[] = IVM_ID_STRING;
+
+
+
+/*
+ * Geometry this build is specialized for, found by symbol when the VM code
+ * is extracted from an object file.
+ */
+const struct ivm_vm_geometry ivm_vm_geometry = {
+    .frame_size = IVM_FRAME_SIZE,
+    .num_frames = IVM_FRAME_COUNT,
+    .num_states = IVM_STATE_DEPTH,
+};
 
 
 static inline __attribute__((always_inline))
@@ -54,28 +115,1489 @@ size_t print_uint(int fd, size_t pad, uint64_t value)
 
 
 
+/*
+ * Kernel signal action structure used by rt_sigaction.
+ */
+struct ibsen_sigaction
+{
+    void*           handler;
+    unsigned long   flags;
+    void*           restorer;
+    unsigned long   mask;
+};
+
+
+
+static inline __attribute__((always_inline))
+void set_sigchld(void* handler)
+{
+    struct ibsen_sigaction action;
+    action.handler = handler;
+    action.flags = 0;
+    action.restorer = NULL;
+    action.mask = 0;
+
+    ibsen_rt_sigaction(SIGCHLD, &action, NULL, sizeof(action.mask));
+}
+
+
+
+/*
+ * Wait for launch requests on the control socket and fork a child for each
+ * request. Returns only in the child.
+ */
+static inline __attribute__((always_inline))
+void zygote(struct ivm_data* vm)
+{
+    // Children are reaped automatically
+    set_sigchld(SIG_IGN);
+
+    while (1) {
+        struct ivm_zygote_request request;
+        union {
+            struct cmsghdr hdr;
+            char buf[CMSG_SPACE(sizeof(int) * 3)];
+        } control;
+
+        struct iovec iov;
+        iov.iov_base = &request;
+        iov.iov_len = sizeof(request);
+
+        struct msghdr msg;
+        msg.msg_name = NULL;
+        msg.msg_namelen = 0;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        msg.msg_flags = 0;
+
+        long n = ibsen_recvmsg(IVM_ZYGOTE_FD, &msg, 0);
+        if (n == -4) { // EINTR
+            continue;
+        }
+        else if (n <= 0) {
+            ibsen_exit(0);
+        }
+
+        int fds[3];
+        fds[0] = fds[1] = fds[2] = -1;
+
+        // The buffer only has room for one message with three descriptors,
+        // anything else is a malformed request and every descriptor that
+        // was received is closed
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS
+                && cmsg->cmsg_len >= CMSG_LEN(0) && cmsg->cmsg_len <= msg.msg_controllen) {
+            const int* data = (const int*) CMSG_DATA(cmsg);
+            size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+            if (count == 3 && !(msg.msg_flags & MSG_CTRUNC)) {
+                fds[0] = data[0];
+                fds[1] = data[1];
+                fds[2] = data[2];
+            }
+            else {
+                for (size_t i = 0; i < count; ++i) {
+                    ibsen_close(data[i]);
+                }
+            }
+        }
+
+        long pid = -22; // EINVAL
+        if (n == sizeof(request) && fds[0] >= 0 && request.num_args <= IVM_ZYGOTE_MAX_ARGS) {
+            pid = ibsen_fork();
+        }
+
+        if (pid == 0) {
+            for (int i = 0; i < 3; ++i) {
+                ibsen_dup2(fds[i], i);
+            }
+
+            for (int i = 0; i < 3; ++i) {
+                if (fds[i] > 2) {
+                    ibsen_close(fds[i]);
+                }
+            }
+
+            ibsen_close(IVM_ZYGOTE_FD);
+            set_sigchld(SIG_DFL);
+
+            for (uint32_t i = 0; i < request.num_args; ++i) {
+                vm->regs.r[vm->regs.wb + i] = request.args[i];
+            }
+
+            return;
+        }
+
+        for (int i = 0; i < 3; ++i) {
+            if (fds[i] >= 0) {
+                ibsen_close(fds[i]);
+            }
+        }
+
+        struct ivm_zygote_reply reply;
+        reply.pid = pid;
+        ibsen_write(IVM_ZYGOTE_FD, (const char*) &reply, sizeof(reply));
+    }
+}
+
+
+
+/*
+ * Set an interrupt bit.
+ * The host may raise interrupts while the VM is running, so the interrupt
+ * bits are only modified atomically.
+ */
+static inline __attribute__((always_inline))
+void raise_intr(struct ivm_registers* regs, int intr)
+{
+    __atomic_fetch_or(&regs->intr, (uint16_t) (1 << intr), __ATOMIC_SEQ_CST);
+}
+
+
+
+static inline __attribute__((always_inline))
+void clear_intr(struct ivm_registers* regs, int intr)
+{
+    __atomic_fetch_and(&regs->intr, (uint16_t) ~(1 << intr), __ATOMIC_SEQ_CST);
+}
+
+
+
+/*
+ * Translate a guest address to a host pointer and check access rights.
+ * Frames that should be loaded on fault are loaded by the interrupt routine.
+ * Raises an interrupt and returns NULL if the address can not be accessed.
+ */
+static inline __attribute__((always_inline))
+unsigned char* translate(struct ivm_data* vm, uint32_t addr, uint16_t access)
+{
+    uint32_t idx = IVM_FNUM(addr, FSHIFT(vm));
+    struct ivm_tlb_entry* entry = &vm->tlb[(access & IVM_FRAME_ATTR_EXEC) ? 0 : 1];
+
+    if (entry->tag == idx + 1 && (entry->attr & access) == access) {
+        return ((unsigned char*) entry->addr) + IVM_FOFF(addr, FSHIFT(vm));
+    }
+
+    if (idx >= FNUM(vm)) {
+        raise_intr(&vm->regs, IVM_INTR_PROTECTION_FAULT);
+        return NULL;
+    }
+
+    struct ivm_frame* frame = &vm->ftable[idx];
+
+    if (!(frame->attr & IVM_FRAME_ATTR_ALLOC)) {
+        if (!(frame->attr & IVM_FRAME_ATTR_ALLOC_ON_FAULT) || frame->addr == 0) {
+            raise_intr(&vm->regs, IVM_INTR_FRAME_FAULT);
+            return NULL;
+        }
+
+        raise_intr(&vm->regs, IVM_INTR_FRAME_FAULT);
+        vm->interrupt(vm, frame->file, addr);
+
+        if (!(frame->attr & IVM_FRAME_ATTR_ALLOC)) {
+            return NULL;
+        }
+    }
+
+    if ((frame->attr & access) != access) {
+        raise_intr(&vm->regs, IVM_INTR_PROTECTION_FAULT);
+        return NULL;
+    }
+
+    if (access & IVM_FRAME_ATTR_WRITE) {
+        frame->attr |= IVM_FRAME_ATTR_STALE;
+    }
+
+    // Writes must miss until the frame is marked stale
+    entry->tag = idx + 1;
+    entry->attr = frame->attr & ((frame->attr & IVM_FRAME_ATTR_STALE) ? 0xffff : ~IVM_FRAME_ATTR_WRITE);
+    entry->addr = frame->addr;
+
+    return ((unsigned char*) frame->addr) + IVM_FOFF(addr, FSHIFT(vm));
+}
+
+
+
+/*
+ * Copy bytes from guest memory, possibly crossing frame boundaries.
+ */
+static inline __attribute__((always_inline))
+bool read_bytes(struct ivm_data* vm, uint32_t addr, unsigned char* buf, uint32_t len, uint16_t access)
+{
+    uint32_t offset = IVM_FOFF(addr, FSHIFT(vm));
+
+    if (offset + len <= (1U << FSHIFT(vm))) {
+        const unsigned char* ptr = translate(vm, addr, access);
+        if (ptr == NULL) {
+            return false;
+        }
+
+        for (uint32_t i = 0; i < len; ++i) {
+            buf[i] = ptr[i];
+        }
+        return true;
+    }
+
+    for (uint32_t i = 0; i < len; ++i) {
+        const unsigned char* ptr = translate(vm, addr + i, access);
+        if (ptr == NULL) {
+            return false;
+        }
+        buf[i] = *ptr;
+    }
+
+    return true;
+}
+
+
+
+static inline __attribute__((always_inline))
+bool write_bytes(struct ivm_data* vm, uint32_t addr, const unsigned char* buf, uint32_t len)
+{
+    for (uint32_t i = 0; i < len; ++i) {
+        unsigned char* ptr = translate(vm, addr + i, IVM_FRAME_ATTR_WRITE);
+        if (ptr == NULL) {
+            return false;
+        }
+        *ptr = buf[i];
+    }
+
+    return true;
+}
+
+
+
+static inline __attribute__((always_inline))
+bool load_word(struct ivm_data* vm, uint32_t addr, uint32_t* value)
+{
+    unsigned char buf[4];
+
+    if (!read_bytes(vm, addr, buf, 4, IVM_FRAME_ATTR_READ)) {
+        return false;
+    }
+
+    *value = buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t) buf[3] << 24);
+    return true;
+}
+
+
+
+static inline __attribute__((always_inline))
+bool store_word(struct ivm_data* vm, uint32_t addr, uint32_t value)
+{
+    unsigned char buf[4];
+    buf[0] = value;
+    buf[1] = value >> 8;
+    buf[2] = value >> 16;
+    buf[3] = value >> 24;
+
+    return write_bytes(vm, addr, buf, 4);
+}
+
+
+
+static inline __attribute__((always_inline))
+bool push(struct ivm_data* vm, uint32_t value)
+{
+    if (!store_word(vm, vm->regs.sp, value)) {
+        return false;
+    }
+
+    vm->regs.sp += 4;
+    return true;
+}
+
+
+
+static inline __attribute__((always_inline))
+bool pop(struct ivm_data* vm, uint32_t* value)
+{
+    if (!load_word(vm, vm->regs.sp - 4, value)) {
+        return false;
+    }
+
+    vm->regs.sp -= 4;
+    return true;
+}
+
+
+
+/*
+ * Spill the oldest register window to guest memory to make room for another.
+ */
+static inline __attribute__((always_inline))
+bool spill_window(struct ivm_data* vm)
+{
+    struct ivm_registers* regs = &vm->regs;
+
+    if (regs->ws == 0) {
+        raise_intr(regs, IVM_INTR_STACK_OVERFLOW);
+        return false;
+    }
+
+    for (int i = 0; i < IVM_WINDOW_SHIFT; ++i) {
+        if (!store_word(vm, regs->ws + 4 * i, regs->r[i])) {
+            return false;
+        }
+    }
+
+    if (!store_word(vm, regs->ws + 4 * IVM_WINDOW_SHIFT, regs->wret[0])) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < regs->wb + 256 - IVM_WINDOW_SHIFT; ++i) {
+        regs->r[i] = regs->r[i + IVM_WINDOW_SHIFT];
+    }
+
+    for (int i = 0; i < IVM_WINDOW_NUM - 1; ++i) {
+        regs->wret[i] = regs->wret[i + 1];
+    }
+
+    regs->ws += IVM_WINDOW_SPILL_SIZE;
+    regs->wb -= IVM_WINDOW_SHIFT;
+    regs->wn++;
+    return true;
+}
+
+
+
+/*
+ * Fill the most recently spilled register window from guest memory.
+ */
+static inline __attribute__((always_inline))
+bool fill_window(struct ivm_data* vm)
+{
+    struct ivm_registers* regs = &vm->regs;
+    uint32_t window[IVM_WINDOW_SHIFT + 1];
+
+    if (regs->wn == 0) {
+        raise_intr(regs, IVM_INTR_STACK_OVERFLOW);
+        return false;
+    }
+
+    uint32_t addr = regs->ws - IVM_WINDOW_SPILL_SIZE;
+    for (int i = 0; i < IVM_WINDOW_SHIFT + 1; ++i) {
+        if (!load_word(vm, addr + 4 * i, &window[i])) {
+            return false;
+        }
+    }
+
+    for (uint32_t i = regs->wb + 256 + IVM_WINDOW_SHIFT; i-- > IVM_WINDOW_SHIFT; ) {
+        regs->r[i] = regs->r[i - IVM_WINDOW_SHIFT];
+    }
+
+    for (int i = IVM_WINDOW_NUM - 1; i > 0; --i) {
+        regs->wret[i] = regs->wret[i - 1];
+    }
+
+    for (int i = 0; i < IVM_WINDOW_SHIFT; ++i) {
+        regs->r[i] = window[i];
+    }
+
+    regs->wret[0] = window[IVM_WINDOW_SHIFT];
+    regs->ws = addr;
+    regs->wb += IVM_WINDOW_SHIFT;
+    regs->wn--;
+    return true;
+}
+
+
+
+/*
+ * Slide the register window up and save the return address.
+ */
+static inline __attribute__((always_inline))
+bool call_window(struct ivm_data* vm)
+{
+    struct ivm_registers* regs = &vm->regs;
+
+    if (regs->wb + IVM_WINDOW_SHIFT > IVM_WINDOW_REGS && !spill_window(vm)) {
+        return false;
+    }
+
+    regs->wret[regs->wb / IVM_WINDOW_SHIFT] = regs->ip;
+    regs->wb += IVM_WINDOW_SHIFT;
+    return true;
+}
+
+
+
+/*
+ * Slide the register window down and restore the return address.
+ */
+static inline __attribute__((always_inline))
+bool return_window(struct ivm_data* vm)
+{
+    struct ivm_registers* regs = &vm->regs;
+
+    if (regs->wb == 0 && !fill_window(vm)) {
+        return false;
+    }
+
+    regs->wb -= IVM_WINDOW_SHIFT;
+    regs->ip = regs->wret[regs->wb / IVM_WINDOW_SHIFT];
+    return true;
+}
+
+
+
+/*
+ * Translate the address of an aligned word for an atomic instruction.
+ */
+static inline __attribute__((always_inline))
+uint32_t* atomic_word(struct ivm_data* vm, uint32_t addr, uint16_t access)
+{
+    if (addr & 3) {
+        raise_intr(&vm->regs, IVM_INTR_PROTECTION_FAULT);
+        return NULL;
+    }
+
+    return (uint32_t*) translate(vm, addr, access);
+}
+
+
+
+/*
+ * Check that a range of registers fits in the current window.
+ */
+static inline __attribute__((always_inline))
+bool check_range(struct ivm_registers* regs, uint32_t first, uint32_t count)
+{
+    if (count > 256 - first) {
+        raise_intr(regs, IVM_INTR_INVALID_OPCODE);
+        return false;
+    }
+
+    return true;
+}
+
+
+
+/*
+ * Translate the start of a span of guest memory, and extend it over the
+ * following frames as long as they are contiguous in host memory and allow
+ * the same access. Access rights are checked once per frame.
+ * Returns NULL if the first frame can not be accessed.
+ */
+static inline __attribute__((always_inline))
+unsigned char* translate_run(struct ivm_data* vm, uint32_t addr, uint32_t len, uint16_t access, uint32_t* run)
+{
+    unsigned char* ptr = translate(vm, addr, access);
+    if (ptr == NULL) {
+        return NULL;
+    }
+
+    uint64_t size = FSIZE(vm) - IVM_FOFF(addr, FSHIFT(vm));
+    uint64_t next = (uint64_t) ptr + size;
+    uint32_t idx = IVM_FNUM(addr, FSHIFT(vm)) + 1;
+
+    while (size < len && idx < FNUM(vm)) {
+        struct ivm_frame* frame = &vm->ftable[idx];
+
+        if (frame->addr != next || !(frame->attr & IVM_FRAME_ATTR_ALLOC) || (frame->attr & access) != access) {
+            break;
+        }
+
+        if (access & IVM_FRAME_ATTR_WRITE) {
+            frame->attr |= IVM_FRAME_ATTR_STALE;
+        }
+
+        size += FSIZE(vm);
+        next += FSIZE(vm);
+        ++idx;
+    }
+
+    *run = size < len ? size : len;
+    return ptr;
+}
+
+
+
+/*
+ * Apply a lane operation to two spans of guest memory.
+ */
+static inline __attribute__((always_inline))
+void vector_span(struct ivm_data* vm, uint32_t cpu, int op, uint32_t dst, uint32_t src, uint32_t len)
+{
+    while (len > 0) {
+        uint32_t src_run, dst_run;
+
+        const unsigned char* s = translate_run(vm, src, len, IVM_FRAME_ATTR_READ, &src_run);
+        if (s == NULL) {
+            return;
+        }
+
+        unsigned char* d = translate_run(vm, dst, src_run, IVM_FRAME_ATTR_WRITE, &dst_run);
+        if (d == NULL) {
+            return;
+        }
+
+        vector_op8(cpu, op, d, s, dst_run);
+        dst += dst_run;
+        src += dst_run;
+        len -= dst_run;
+    }
+}
+
+
+
+/*
+ * Sum the bytes of a span of guest memory.
+ */
+static inline __attribute__((always_inline))
+bool sum_span(struct ivm_data* vm, uint32_t cpu, uint32_t addr, uint32_t len, uint32_t* sum)
+{
+    uint32_t total = 0;
+
+    while (len > 0) {
+        uint32_t run;
+
+        const unsigned char* ptr = translate_run(vm, addr, len, IVM_FRAME_ATTR_READ, &run);
+        if (ptr == NULL) {
+            return false;
+        }
+
+        total += vector_sum8(cpu, ptr, run);
+        addr += run;
+        len -= run;
+    }
+
+    *sum = total;
+    return true;
+}
+
+
+
+/*
+ * Copy a span of guest memory. Overlapping spans are copied as if through
+ * an intermediate buffer, so a destination above the source is copied
+ * backwards one frame at a time.
+ */
+static inline __attribute__((always_inline))
+void copy_span(struct ivm_data* vm, uint32_t cpu, uint32_t dst, uint32_t src, uint32_t len)
+{
+    if (dst > src && dst - src < len) {
+        while (len > 0) {
+            uint32_t n = len;
+            uint32_t dst_left = IVM_FOFF(dst + len - 1, FSHIFT(vm)) + 1;
+            uint32_t src_left = IVM_FOFF(src + len - 1, FSHIFT(vm)) + 1;
+            n = n < dst_left ? n : dst_left;
+            n = n < src_left ? n : src_left;
+
+            const unsigned char* s = translate(vm, src + len - n, IVM_FRAME_ATTR_READ);
+            if (s == NULL) {
+                return;
+            }
+
+            unsigned char* d = translate(vm, dst + len - n, IVM_FRAME_ATTR_WRITE);
+            if (d == NULL) {
+                return;
+            }
+
+            vector_move(cpu, d, s, n);
+            len -= n;
+        }
+        return;
+    }
+
+    while (len > 0) {
+        uint32_t src_run, dst_run;
+
+        const unsigned char* s = translate_run(vm, src, len, IVM_FRAME_ATTR_READ, &src_run);
+        if (s == NULL) {
+            return;
+        }
+
+        unsigned char* d = translate_run(vm, dst, src_run, IVM_FRAME_ATTR_WRITE, &dst_run);
+        if (d == NULL) {
+            return;
+        }
+
+        vector_move(cpu, d, s, dst_run);
+        dst += dst_run;
+        src += dst_run;
+        len -= dst_run;
+    }
+}
+
+
+
+static inline __attribute__((always_inline))
+void fill_span(struct ivm_data* vm, uint32_t cpu, uint32_t dst, unsigned char value, uint32_t len)
+{
+    while (len > 0) {
+        uint32_t run;
+
+        unsigned char* d = translate_run(vm, dst, len, IVM_FRAME_ATTR_WRITE, &run);
+        if (d == NULL) {
+            return;
+        }
+
+        vector_set(cpu, d, value, run);
+        dst += run;
+        len -= run;
+    }
+}
+
+
+
+/*
+ * Find the offset of the first byte that differs between two spans of
+ * guest memory.
+ */
+static inline __attribute__((always_inline))
+bool compare_span(struct ivm_data* vm, uint32_t cpu, uint32_t x, uint32_t y, uint32_t len, uint32_t* offset)
+{
+    uint32_t pos = 0;
+
+    while (pos < len) {
+        uint32_t x_run, y_run;
+
+        const unsigned char* px = translate_run(vm, x + pos, len - pos, IVM_FRAME_ATTR_READ, &x_run);
+        if (px == NULL) {
+            return false;
+        }
+
+        const unsigned char* py = translate_run(vm, y + pos, x_run, IVM_FRAME_ATTR_READ, &y_run);
+        if (py == NULL) {
+            return false;
+        }
+
+        uint32_t diff = vector_compare(cpu, px, py, y_run);
+        pos += diff;
+        if (diff < y_run) {
+            break;
+        }
+    }
+
+    *offset = pos;
+    return true;
+}
+
+
+
+/*
+ * Find the offset of the first byte with the given value in a span of guest
+ * memory.
+ */
+static inline __attribute__((always_inline))
+bool find_span(struct ivm_data* vm, uint32_t cpu, uint32_t addr, unsigned char value, uint32_t len, uint32_t* offset)
+{
+    uint32_t pos = 0;
+
+    while (pos < len) {
+        uint32_t run;
+
+        const unsigned char* ptr = translate_run(vm, addr + pos, len - pos, IVM_FRAME_ATTR_READ, &run);
+        if (ptr == NULL) {
+            return false;
+        }
+
+        uint32_t found = vector_search(cpu, ptr, value, run);
+        pos += found;
+        if (found < run) {
+            break;
+        }
+    }
+
+    *offset = pos;
+    return true;
+}
+
+
+
+/*
+ * Load a frame that is marked to be loaded on fault.
+ */
+static inline __attribute__((always_inline))
+void load_frame(struct ivm_data* vm, int fd, uint64_t addr)
+{
+    uint32_t idx = IVM_FNUM(addr, FSHIFT(vm));
+    if (idx >= FNUM(vm)) {
+        return;
+    }
+
+    struct ivm_frame* frame = &vm->ftable[idx];
+    unsigned char* ptr = (unsigned char*) frame->addr;
+
+    if (fd >= 0) {
+        size_t n = 0;
+
+        while (n < FSIZE(vm)) {
+            long ret = ibsen_pread(fd, ptr + n, FSIZE(vm) - n, frame->offs + n);
+            if (ret == -4) { // EINTR
+                continue;
+            }
+            else if (ret <= 0) {
+                raise_intr(&vm->regs, IVM_INTR_IO_ERROR);
+                return;
+            }
+            n += ret;
+        }
+    }
+    else if (frame->attr & IVM_FRAME_ATTR_ZERO_ON_ALLOC) {
+        for (size_t i = 0; i < FSIZE(vm); ++i) {
+            ptr[i] = 0;
+        }
+    }
+    else {
+        return;
+    }
+
+    frame->attr |= IVM_FRAME_ATTR_ALLOC;
+    clear_intr(&vm->regs, IVM_INTR_FRAME_FAULT);
+}
+
+
+
+/*
+ * Execute a system call on behalf of the guest.
+ * The syscall number is in R01 and arguments in R02 to R04. The result is
+ * returned in R01.
+ */
+static inline __attribute__((always_inline))
+void do_syscall(struct ivm_data* vm)
+{
+    struct ivm_registers* regs = &vm->regs;
+    uint32_t* r = regs->r + regs->wb;
+    uint32_t addr = r[3];
+    uint32_t remaining = r[4];
+    uint32_t total = 0;
+    long ret = 0;
+
+    switch (r[1]) {
+        case IVM_SYSCALL_WRITE:
+        case IVM_SYSCALL_READ:
+            while (remaining > 0) {
+                uint32_t offset = IVM_FOFF(addr, FSHIFT(vm));
+                uint32_t len = (1U << FSHIFT(vm)) - offset;
+                if (len > remaining) {
+                    len = remaining;
+                }
+
+                unsigned char* ptr = translate(vm, addr, r[1] == IVM_SYSCALL_WRITE ? IVM_FRAME_ATTR_READ : IVM_FRAME_ATTR_WRITE);
+                if (ptr == NULL) {
+                    ret = -14; // EFAULT
+                    break;
+                }
+
+                if (r[1] == IVM_SYSCALL_WRITE) {
+                    ret = ibsen_write(r[2], (const char*) ptr, len);
+                }
+                else {
+                    ret = ibsen_read(r[2], ptr, len);
+                }
+
+                if (ret <= 0) {
+                    break;
+                }
+
+                total += ret;
+                addr += ret;
+                remaining -= ret;
+
+                if ((uint32_t) ret < len) {
+                    break;
+                }
+            }
+
+            if (ret < 0 && total == 0) {
+                raise_intr(regs, IVM_INTR_IO_ERROR);
+                r[1] = ret;
+            }
+            else {
+                r[1] = total;
+            }
+            break;
+
+        default:
+            r[1] = -38; // ENOSYS
+            break;
+    }
+}
+
+
+
+/*
+ * Deliver the first pending interrupt that is enabled.
+ * The IP and R00 of the interrupted code are pushed on the state stack and
+ * popped by RESTORE. The interrupt is disabled until its handler returns,
+ * so that an interrupt raised again from another thread, such as a
+ * doorbell, waits for the handler instead of nesting in it. Disabled
+ * interrupts are left pending until they are enabled again.
+ * Returns a reason to return to the caller, or -1 to continue execution.
+ */
+static inline __attribute__((always_inline))
+int64_t handle_interrupts(struct ivm_data* vm)
+{
+    struct ivm_registers* regs = &vm->regs;
+
+    if (regs->intr & (1 << IVM_INTR_EXTERNAL_EVENT)) {
+        clear_intr(regs, IVM_INTR_EXTERNAL_EVENT);
+        return IVM_EXIT_PAUSE;
+    }
+
+    for (int i = 0; i < 16; ++i) {
+        if (!(regs->intr & (1 << i))) {
+            continue;
+        }
+
+        if (!IVM_INTR_IS_MASKABLE(i)) {
+            return IVM_EXIT_ABORT;
+        }
+
+        if (!(regs->imask & (1 << i))) {
+            continue;
+        }
+
+        if (regs->iv[i] == 0) {
+            return IVM_EXIT_ABORT;
+        }
+
+        if (vm->state_pos >= SDEPTH(vm)) {
+            raise_intr(regs, IVM_INTR_EXCEPTION_OVERFLOW);
+            return IVM_EXIT_ABORT;
+        }
+
+        struct ivm_state* state = &vm->states[vm->state_pos++];
+        state->state = IVM_STATE_EXECUTE;
+        state->intr = i;
+        state->ip = regs->ip;
+        state->ret = regs->r[regs->wb];
+
+        clear_intr(regs, i);
+        regs->imask &= ~(1 << i);
+        regs->r[regs->wb] = regs->ip;
+        regs->ip = regs->iv[i];
+        break;
+    }
+
+    return -1;
+}
+
+
+
+/*
+ * Handle an instruction that could not be fetched.
+ * Fetching it again would fail the same way, so the VM aborts unless the
+ * fault will be delivered to a handler. The failed fetch counts against
+ * the instruction budget.
+ * Returns a reason to return to the caller, or -1 to continue execution.
+ */
+static inline __attribute__((always_inline))
+int64_t fetch_fault(struct ivm_data* vm)
+{
+    struct ivm_registers* regs = &vm->regs;
+    uint16_t pending = regs->intr;
+    bool delivered = false;
+
+    // Non-maskable interrupts pause or abort the VM when they are handled
+    if (pending & IVM_INTR_NONMASKABLE) {
+        delivered = true;
+    }
+
+    for (int i = 0; i < 16 && !delivered; ++i) {
+        delivered = (pending & regs->imask & (1 << i)) && regs->iv[i] != 0;
+    }
+
+    if (!delivered) {
+        return IVM_EXIT_ABORT;
+    }
+
+    if (vm->steps != 0 && --vm->steps == 0) {
+        return IVM_EXIT_BUDGET;
+    }
+
+    return -1;
+}
+
+
+
+/*
+ * Interrupt routine.
+ * Loads frames on frame faults and executes system calls.
+ */
 void __interrupt(struct ivm_data* vm, int fd, uint64_t addr)
 {
-    //char data[16] = "Hello\n";
-    //write(1, data, 6);
+    struct ivm_registers* regs = &vm->regs;
+
+    if (regs->intr & (1 << IVM_INTR_FRAME_FAULT)) {
+        load_frame(vm, fd, addr);
+    }
+    else if (regs->intr & (1 << IVM_INTR_SYSCALL)) {
+        do_syscall(vm);
+        clear_intr(regs, IVM_INTR_SYSCALL);
+    }
 }
 
 
+
+/*
+ * Count a control transfer in the profile table.
+ * Transfers that do not fit in the table are only counted as lost.
+ */
+static inline __attribute__((always_inline))
+void record_transfer(struct ivm_data* vm, uint32_t from, uint32_t to)
+{
+    struct ivm_profile_entry* table = vm->ptable;
+    uint64_t mask = vm->psize - 1;
+    uint64_t key = ((uint64_t) to << 32) | from;
+    uint64_t idx = (key * 0x9e3779b97f4a7c15ULL) >> 32;
+
+    for (uint64_t i = 0; i <= mask; ++i) {
+        struct ivm_profile_entry* entry = &table[(idx + i) & mask];
+
+        if (entry->count == 0) {
+            entry->key = key;
+            entry->count = 1;
+            return;
+        }
+        else if (entry->key == key) {
+            entry->count++;
+            return;
+        }
+    }
+
+    vm->plost++;
+}
+
+
+
+/*
+ * Run the virtual machine from the current instruction pointer until the
+ * guest halts, an unhandled interrupt occurs, the host pauses the VM or the
+ * instruction budget is exhausted.
+ */
 int64_t __vm(struct ivm_data* vm)
 {
-    return 2;
+    struct ivm_registers* regs = &vm->regs;
+    uint32_t* r = regs->r + regs->wb;
+
+    if (vm->cpu == 0) {
+        vm->cpu = detect_cpu();
+    }
+    uint32_t cpu = vm->cpu;
+
+    // Fixed-width code is indexed by the IP and needs no translation
+    const uint64_t* wcode = vm->wcode;
+    uint64_t wsize = (vm->flags & IVM_FLAG_WIDE) ? vm->wsize : 0;
+
+    // Address of the last instruction and the IP that follows it, so that
+    // control transfers can be recorded and looked up in the branch target
+    // cache. Entering the VM counts as a transfer from the host.
+    uint32_t last = IVM_PROFILE_HOST;
+    uint32_t expected = regs->ip + 1;
+
+    while (1) {
+        if (regs->intr != 0) {
+            int64_t status = handle_interrupts(vm);
+            if (status >= 0) {
+                return status;
+            }
+        }
+
+        // Decode instruction
+        unsigned char buf[IVM_MAX_INSTR_LEN];
+        const unsigned char* code = buf;
+        uint32_t ip = regs->ip;
+        uint8_t opcode;
+        uint32_t len;
+        uint8_t a;
+        uint8_t b;
+        uint8_t c;
+        uint32_t word = 0;
+
+        // Address plus one of the instruction that transferred control here
+        uint32_t site = 0;
+        if (ip != expected) {
+            site = last + 1;
+            expected = ip;
+            if (vm->ptable != NULL) {
+                record_transfer(vm, last, ip);
+            }
+        }
+
+        if (ip < wsize) {
+            uint64_t insn = wcode[ip];
+
+            opcode = IVM_WIDE_OPCODE(insn);
+            len = IVM_INSTR_LEN(opcode);
+            a = IVM_WIDE_REG(insn, 0);
+            b = IVM_WIDE_REG(insn, 1);
+            c = IVM_WIDE_REG(insn, 2);
+            word = IVM_WIDE_WORD(insn);
+            code = NULL;
+        }
+        else if (site != 0 && vm->btc[site & (IVM_BTC_SIZE - 1)].key == (((uint64_t) ip << 32) | site)) {
+            // Same branch and target as last time
+            struct ivm_btc_entry* entry = &vm->btc[site & (IVM_BTC_SIZE - 1)];
+
+            vm->tlb[0] = entry->tlb;
+            code = (const unsigned char*) entry->addr;
+            opcode = code[0];
+            len = IVM_INSTR_LEN(opcode);
+        }
+        else if (IVM_FOFF(ip, FSHIFT(vm)) <= FSIZE(vm) - IVM_MAX_INSTR_LEN) {
+            // The longest instruction fits in the rest of the frame, so it
+            // can be read in place with a single translation
+            code = translate(vm, ip, IVM_FRAME_ATTR_EXEC);
+            if (code == NULL) {
+                int64_t status = fetch_fault(vm);
+                if (status >= 0) {
+                    return status;
+                }
+                continue;
+            }
+
+            if (site != 0) {
+                struct ivm_btc_entry* entry = &vm->btc[site & (IVM_BTC_SIZE - 1)];
+
+                entry->key = ((uint64_t) ip << 32) | site;
+                entry->addr = (uint64_t) code;
+                entry->tlb = vm->tlb[0];
+            }
+
+            opcode = code[0];
+            len = IVM_INSTR_LEN(opcode);
+        }
+        else {
+            if (!read_bytes(vm, ip, buf, 1, IVM_FRAME_ATTR_EXEC)) {
+                int64_t status = fetch_fault(vm);
+                if (status >= 0) {
+                    return status;
+                }
+                continue;
+            }
+
+            opcode = buf[0];
+            len = IVM_INSTR_LEN(opcode);
+
+            if (!read_bytes(vm, ip + 1, buf + 1, len - 1, IVM_FRAME_ATTR_EXEC)) {
+                int64_t status = fetch_fault(vm);
+                if (status >= 0) {
+                    return status;
+                }
+                continue;
+            }
+        }
+
+        if (code != NULL) {
+            a = code[1];
+            b = code[2];
+            c = code[3];
+            if (IVM_HAS_WORD(opcode)) {
+                const unsigned char* w = &code[1 + IVM_NUM_REGS(opcode)];
+                word = w[0] | (w[1] << 8) | (w[2] << 16) | ((uint32_t) w[3] << 24);
+            }
+        }
+
+        regs->ip = ip + len;
+
+        // Execute instruction
+        uint32_t value;
+        uint32_t* ptr;
+        unsigned char byte;
+
+        switch (opcode) {
+            case JUMP:
+                regs->ip = r[a] + word;
+                break;
+
+            case JUMPEQ:
+                if (r[a] == r[b]) {
+                    regs->ip = r[c] + word;
+                }
+                break;
+
+            case JUMPLT:
+                if (r[a] < r[b]) {
+                    regs->ip = r[c] + word;
+                }
+                break;
+
+            case JUMPGT:
+                if (r[a] > r[b]) {
+                    regs->ip = r[c] + word;
+                }
+                break;
+
+            case JUMPNE:
+                if (r[a] != r[b]) {
+                    regs->ip = r[c] + word;
+                }
+                break;
+
+            case CALL:
+                value = r[a];
+                if (push(vm, regs->ip)) {
+                    regs->ip = value;
+                }
+                break;
+
+            case RETURN:
+                if (pop(vm, &value)) {
+                    regs->ip = value;
+                }
+                break;
+
+            case CALLW:
+                value = r[a] + word;
+                if (call_window(vm)) {
+                    regs->ip = value;
+                    r = regs->r + regs->wb;
+                }
+                break;
+
+            case RETW:
+                if (return_window(vm)) {
+                    r = regs->r + regs->wb;
+                }
+                break;
+
+            case SETWS:
+                regs->ws = r[a] + word;
+                break;
+
+            case NCALL:
+                value = r[a] + word;
+                if (value >= IVM_CTABLE_SIZE || vm->ctable[value] == 0) {
+                    raise_intr(regs, IVM_INTR_INVALID_OPCODE);
+                }
+                else {
+                    ((ivm_native_t) vm->ctable[value])(r, vm->ftable, vm);
+                }
+                break;
+
+            case LOAD:
+                if (read_bytes(vm, regs->bp + r[b] + word, &byte, 1, IVM_FRAME_ATTR_READ)) {
+                    r[a] = byte;
+                }
+                break;
+
+            case LOADWORD:
+                if (load_word(vm, regs->bp + r[b] + word, &value)) {
+                    r[a] = value;
+                }
+                break;
+
+            case STORE:
+                byte = r[a];
+                write_bytes(vm, regs->bp + r[b] + word, &byte, 1);
+                break;
+
+            case STOREWORD:
+                store_word(vm, regs->bp + r[b] + word, r[a]);
+                break;
+
+            case LOADACQ:
+                ptr = atomic_word(vm, regs->bp + r[b] + word, IVM_FRAME_ATTR_READ);
+                if (ptr != NULL) {
+                    r[a] = __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+                }
+                break;
+
+            case STOREREL:
+                ptr = atomic_word(vm, regs->bp + r[b] + word, IVM_FRAME_ATTR_WRITE);
+                if (ptr != NULL) {
+                    __atomic_store_n(ptr, r[a], __ATOMIC_RELEASE);
+                }
+                break;
+
+            case ATOMCAS:
+                ptr = atomic_word(vm, regs->bp + r[b], IVM_FRAME_ATTR_READ | IVM_FRAME_ATTR_WRITE);
+                if (ptr != NULL) {
+                    value = r[a];
+                    __atomic_compare_exchange_n(ptr, &value, r[c], false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+                    r[a] = value;
+                }
+                break;
+
+            case ATOMADD:
+                ptr = atomic_word(vm, regs->bp + r[b], IVM_FRAME_ATTR_READ | IVM_FRAME_ATTR_WRITE);
+                if (ptr != NULL) {
+                    r[a] = __atomic_fetch_add(ptr, r[c], __ATOMIC_SEQ_CST);
+                }
+                break;
+
+            case PUSH:
+                push(vm, r[a]);
+                break;
+
+            case POP:
+                if (pop(vm, &value)) {
+                    r[a] = value;
+                }
+                break;
+
+            case MOVE:
+                r[a] = r[b];
+                break;
+
+            case SET:
+                r[a] = word;
+                break;
+
+            case ZERO:
+                r[a] = 0;
+                break;
+
+            case INVERT:
+                r[a] = ~r[a];
+                break;
+
+            case XOR:
+                r[a] ^= r[b];
+                break;
+
+            case AND:
+                r[a] &= r[b];
+                break;
+
+            case OR:
+                r[a] |= r[b];
+                break;
+
+            case SHIFTUP:
+                r[a] <<= (r[b] & 31);
+                break;
+
+            case SHIFTDOWN:
+                r[a] >>= (r[b] & 31);
+                break;
+
+            case SUB:
+                r[a] = r[b] - r[c];
+                break;
+
+            case ADD:
+                r[a] = r[b] + r[c];
+                break;
+
+            case MUL:
+                r[a] = r[b] * r[c];
+                break;
+
+            case DIVMOD:
+                if (r[b] == 0) {
+                    raise_intr(regs, IVM_INTR_ARITHMETIC_ERROR);
+                }
+                else {
+                    uint32_t quot = r[a] / r[b];
+                    uint32_t rem = r[a] % r[b];
+                    r[c] = rem;
+                    r[a] = quot;
+                }
+                break;
+
+            case VADD:
+            case VXOR:
+            case VCMPEQ:
+            case VMIN:
+            case VMAX:
+                if (check_range(regs, a, word) && check_range(regs, b, word) && check_range(regs, c, word)) {
+                    vector_op32(cpu, opcode - VADD + VOP_ADD, &r[a], &r[b], &r[c], word);
+                }
+                break;
+
+            case VSUM:
+                if (check_range(regs, b, word)) {
+                    r[a] = vector_sum32(cpu, &r[b], word);
+                }
+                break;
+
+            case MADD:
+            case MXOR:
+            case MCMPEQ:
+            case MMIN:
+            case MMAX:
+                vector_span(vm, cpu, opcode - MADD + VOP_ADD, regs->bp + r[a], regs->bp + r[b], r[c]);
+                break;
+
+            case MSUM:
+                if (sum_span(vm, cpu, regs->bp + r[b], r[c], &value)) {
+                    r[a] = value;
+                }
+                break;
+
+            case MCOPY:
+                copy_span(vm, cpu, regs->bp + r[a], regs->bp + r[b], r[c]);
+                break;
+
+            case MFILL:
+                fill_span(vm, cpu, regs->bp + r[a], r[b], r[c]);
+                break;
+
+            case MCMP:
+                if (compare_span(vm, cpu, regs->bp + r[a], regs->bp + r[b], r[c], &value)) {
+                    r[a] = value;
+                }
+                break;
+
+            case MFIND:
+                if (find_span(vm, cpu, regs->bp + r[a], r[b], r[c], &value)) {
+                    r[a] = value;
+                }
+                break;
+
+            case SETBP:
+                regs->bp = r[a] + word;
+                break;
+
+            case SETSB:
+                regs->sb = r[a] + word;
+                break;
+
+            case SETSP:
+                regs->sp = r[a] + word;
+                break;
+
+            case MOVEBP:
+                r[a] = regs->bp;
+                break;
+
+            case MOVESB:
+                r[a] = regs->sb;
+                break;
+
+            case MOVESP:
+                r[a] = regs->sp;
+                break;
+
+            case MOVEIP:
+                r[a] = regs->ip;
+                break;
+
+            case ENTER:
+                regs->sp = regs->sb;
+                if (pop(vm, &value)) {
+                    regs->sb = value;
+                }
+                break;
+
+            case LEAVE:
+                if (push(vm, regs->sb)) {
+                    regs->sb = regs->sp;
+                }
+                break;
+
+            case PUSHALL:
+                for (int i = 0; i < 256; ++i) {
+                    if (!store_word(vm, regs->sp + 4 * i, r[i])) {
+                        break;
+                    }
+                }
+                if (store_word(vm, regs->sp + 4 * 256, regs->sb)) {
+                    regs->sp += 4 * 257;
+                    regs->sb = regs->sp;
+                }
+                break;
+
+            case POPALL:
+                regs->sp = regs->sb - 4 * 257;
+                if (load_word(vm, regs->sp + 4 * 256, &value)) {
+                    regs->sb = value;
+                    for (int i = 0; i < 256; ++i) {
+                        if (!load_word(vm, regs->sp + 4 * i, &r[i])) {
+                            break;
+                        }
+                    }
+                }
+                break;
+
+            case HALT:
+                return IVM_EXIT_HALT;
+
+            case NOOP:
+                break;
+
+            case DISABLE:
+                regs->imask &= ~(1 << ((r[a] + word) & 0xf));
+                break;
+
+            case ENABLE:
+                regs->imask |= 1 << (r[a] & 0xf);
+                break;
+
+            case VECTOR:
+                regs->iv[r[a] & 0xf] = r[b] + word;
+                break;
+
+            case TRAP:
+                value = (r[a] + word) & 0xf;
+                if (value != IVM_INTR_SYSCALL) {
+                    raise_intr(regs, value);
+                }
+                else if (r[1] == IVM_SYSCALL_SNAPSHOT) {
+                    return IVM_EXIT_SNAPSHOT;
+                }
+                else {
+                    raise_intr(regs, IVM_INTR_SYSCALL);
+                    vm->interrupt(vm, r[2], r[3]);
+                }
+                break;
+
+            case RESTORE:
+                if (vm->state_pos == 0) {
+                    raise_intr(regs, IVM_INTR_ILLEGAL_STATE);
+                    break;
+                }
+                --vm->state_pos;
+                regs->ip = vm->states[vm->state_pos].ip;
+                r[0] = vm->states[vm->state_pos].ret;
+                regs->imask |= 1 << vm->states[vm->state_pos].intr;
+                break;
+
+            default:
+                raise_intr(regs, IVM_INTR_INVALID_OPCODE);
+                break;
+        }
+
+        last = ip;
+        expected = ip + len;
+
+        if (vm->steps != 0 && --vm->steps == 0) {
+            return IVM_EXIT_BUDGET;
+        }
+    }
 }
 
 
+
+/*
+ * Entry point of the image.
+ */
+__attribute__((force_align_arg_pointer))
 void __loader(void)
 {
-   ibsen_exit(15);
+    struct ivm_data* vm = (struct ivm_data*) IVM_ENTRY;
+    int64_t (*run)(struct ivm_data*) = (int64_t (*)(struct ivm_data*)) vm->vm_addr;
+    int64_t status;
+
+    if (vm->flags & IVM_FLAG_ZYGOTE) {
+        zygote(vm);
+    }
+
+    // There is no host to pause the VM or take snapshots, so just resume
+    do {
+        status = run(vm);
+    } while (status != IVM_EXIT_HALT && status != IVM_EXIT_ABORT);
+
+    ibsen_exit(status == IVM_EXIT_HALT ? (int) vm->regs.r[vm->regs.wb] : 255);
 }
 
 
+#ifndef IVM_VM_EXTRACTED
+/*
+ * Function sizes are computed from the addresses of the next function, which
+ * only holds when the compiler keeps the functions in source order.
+ * Optimized builds are extracted by symbol instead, see ivm_vm_code_extract.
+ */
 void ivm_get_vm_functions(struct ivm_vm_functions* funcs)
 {
     strcpy(funcs->id, IVM_ID_STRING);
+    funcs->geometry = ivm_vm_geometry;
 
     strcpy(funcs->interrupt.name, "__interrupt");
     funcs->interrupt.addr = (uint64_t) __interrupt;
@@ -89,3 +1611,4 @@ void ivm_get_vm_functions(struct ivm_vm_functions* funcs)
     funcs->loader.addr = (uint64_t) __loader;
     funcs->loader.size = (uint64_t) ivm_get_vm_functions - (uint64_t) __loader;
 }
+#endif